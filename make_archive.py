@@ -6,30 +6,280 @@ import hashlib
 import struct
 import zlib
 from io import BytesIO
+import web_assets
 
 
 def bin_padding(bin, size):
     size = ((len(bin) -1) // size + 1) * size
     return struct.pack(f"<{size}s", bin)
 
-def do_make_archive():
+def image_hash(content, sector_size = 4096):
+    """SHA-256 over the chain of per sector SHA-256 digests, as the device
+    computes it (image_hash_add() in src/mz_update.cpp)"""
+    h = bytes(32)
+    for i in range(0, len(content), sector_size):
+        h = hashlib.sha256(h + hashlib.sha256(content[i:i + sector_size]).digest()).digest()
+    return h
+
+def make_section(label, content, orig_len, sector_size, sector_hashes = False):
+    """make a section: the header, the optional per sector SHA-256 list and
+    the content, each padded to sector_size"""
+    content = bin_padding(content, sector_size)
+    hash_list = b"".join(hashlib.sha256(content[i:i + sector_size]).digest()
+        for i in range(0, len(content), sector_size)) if sector_hashes else b""
+    header = (b"-file boundary--" +
+        struct.pack("<8sLL", label.encode('utf-8'), orig_len, len(content)) +
+        hashlib.md5(content).digest() + image_hash(content, sector_size) +
+        struct.pack("<L", len(hash_list)))
+    out = bin_padding(header, sector_size)
+    if hash_list:
+        out += bin_padding(hash_list, sector_size)
+    return out + content
+
+def read_fs_manifest(filename):
+    """read a manifest taken from /update/fs_manifest of the running device;
+    returns {path: (size, md5 hex)}"""
+    base = {}
+    with open(filename, "r") as f:
+        for line in f:
+            parts = line.rstrip("\n").split(" ", 2)
+            if len(parts) == 3:
+                base[parts[2]] = (int(parts[1]), parts[0])
+    return base
+
+def make_fs_delta(data_dir, base):
+    """make "fsfiles" section content from the data directory. Files whose
+    size and md5 match the base manifest are not included; the device copies
+    them from its running filesystem. See src/fs_delta.h for the layout."""
+    entries = []
+    for root, dirs, names in os.walk(data_dir):
+        dirs.sort()
+        for name in sorted(names):
+            full = os.path.join(root, name)
+            path = "/" + os.path.relpath(full, data_dir).replace(os.sep, "/")
+            content = open(full, "rb").read()
+            md5 = hashlib.md5(content)
+            changed = base.get(path) != (len(content), md5.hexdigest())
+            entries.append((path.encode('utf-8'), content, md5.digest(), changed))
+
+    out = BytesIO()
+    out.write(b"MZ5FSD1\n" + struct.pack("<L", len(entries)))
+    for path, content, md5, changed in entries:
+        out.write(struct.pack("<BBL", 1 if changed else 0, len(path), len(content)) + md5 + path)
+    for path, content, md5, changed in entries:
+        if changed: out.write(content)
+
+    n_changed = sum(1 for e in entries if e[3])
+    print(f"Filesystem: {len(entries)} files, {n_changed} included in the archive\n")
+    return out.getvalue()
+
+def read_sector_manifest(filename):
+    """read sector hashes taken from /update/sector_manifest of the running
+    device; returns {(target, "running" or "inactive"): [sha256 hex, ...]}"""
+    base = {}
+    hashes = None
+    with open(filename, "r") as f:
+        for line in f:
+            parts = line.split()
+            if len(parts) == 3:
+                hashes = base[(parts[0], parts[1])] = []
+            elif len(parts) == 1 and hashes is not None:
+                hashes.append(parts[0])
+    return base
+
+SECTOR_DELTA_KEEP = 0
+SECTOR_DELTA_COPY = 1
+SECTOR_DELTA_DATA = 2
+
+def make_sector_delta(label, content, base, sector_size):
+    """make "sdelta" section content of a padded partition image. Sectors
+    already on the inactive partition, or on the running partition at the same
+    offset, are not included. See src/sector_delta.h for the layout."""
+    inactive = base.get((label, "inactive"), [])
+    running = base.get((label, "running"), [])
+    entries = []
+    data = BytesIO()
+    counts = [0, 0, 0]
+    for i in range(0, len(content), sector_size):
+        sector = content[i:i + sector_size]
+        digest = hashlib.sha256(sector)
+        n = i // sector_size
+        if n < len(inactive) and inactive[n] == digest.hexdigest():
+            op = SECTOR_DELTA_KEEP
+        elif n < len(running) and running[n] == digest.hexdigest():
+            op = SECTOR_DELTA_COPY
+        else:
+            op = SECTOR_DELTA_DATA
+            data.write(sector)
+        counts[op] += 1
+        entries.append(struct.pack("<B", op) + digest.digest())
+
+    out = BytesIO()
+    out.write(b"MZ5SD2\n\0" + struct.pack("<8sL", label.encode('utf-8'), len(content)) +
+        image_hash(content, sector_size))
+    out.write(b"".join(entries))
+    out.write(data.getvalue())
+    print(f"Sector delta of {label}: {counts[0]} kept, {counts[1]} copied, {counts[2]} included in the archive\n")
+    return out.getvalue()
+
+LZ4_BLOCK_SIZE = 32768 # must match lz4_decoder_t::BLOCK_SIZE in src/mz_update.cpp
+
+def compress_lz4(data):
+    """compress into "MZ5 lz4 blocks archive": uncompressed size, then
+    independent LZ4 blocks of LZ4_BLOCK_SIZE, each preceded by its size
+    (bit 31 set if stored uncompressed)"""
+    try:
+        import lz4.block
+    except ImportError:
+        print("--lz4 needs the lz4 module (pip install lz4).\n")
+        exit(3)
+    out = BytesIO()
+    out.write(b"MZ5 lz4 blocks archive\r\n\n\x1a")
+    out.write(struct.pack("<L", len(data)))
+    for i in range(0, len(data), LZ4_BLOCK_SIZE):
+        block = data[i:i + LZ4_BLOCK_SIZE]
+        compressed = lz4.block.compress(block, mode='high_compression', compression=12, store_size=False)
+        if len(compressed) >= len(block):
+            out.write(struct.pack("<L", 0x80000000 | len(block)) + block)
+        else:
+            out.write(struct.pack("<L", len(compressed)) + compressed)
+    return out.getvalue()
+
+def compress_archive(data, lz4):
+    """compress an uncompressed archive into the format the device reads"""
+    if lz4:
+        return compress_lz4(data)
+    compressed = zlib.compress(data, 9)
+    return b"MZ5 compressed archive\r\n\n\x1a" + struct.pack("<L", len(compressed)) + compressed
+
+def decompress_archive(data):
+    """inverse of compress_archive()"""
+    if data.startswith(b"MZ5 compressed archive\r\n\n\x1a"):
+        return zlib.decompress(data[30:]) # after the magic and the size
+    if not data.startswith(b"MZ5 lz4 blocks archive\r\n\n\x1a"):
+        return data # uncompressed
+    import lz4.block
+    size, = struct.unpack_from("<L", data, 26)
+    pos = 30
+    out = BytesIO()
+    while out.tell() < size:
+        n, = struct.unpack_from("<L", data, pos)
+        block = data[pos + 4:pos + 4 + (n & 0x7fffffff)]
+        pos += 4 + len(block)
+        out.write(block if n & 0x80000000 else
+            lz4.block.decompress(block, uncompressed_size = min(LZ4_BLOCK_SIZE, size - out.tell())))
+    return out.getvalue()
+
+def verify_archive(filename, sector_size = 4096):
+    """check an archive the way the device does: the section sizes, the image
+    hashes and the per sector SHA-256 lists; returns whether it is valid"""
+    data = decompress_archive(open(filename, "rb").read())
+    if not data.startswith(b"MZ5 firmware archive 1.0\r\n\n\x1a    "):
+        print("Invalid archive header.\n")
+        return False
+    pos = sector_size
+    ok = True
+    while pos < len(data):
+        if data[pos:pos + 16] != b"-file boundary--":
+            print(f"Invalid section header at {pos}.\n")
+            return False
+        label, orig_len, arc_len = struct.unpack_from("<8sLL", data, pos + 16)
+        md5 = data[pos + 32:pos + 48]
+        hash_bin = data[pos + 48:pos + 80]
+        hash_list_len, = struct.unpack_from("<L", data, pos + 80)
+        label = label.rstrip(b"\0").decode('utf-8')
+        pos += sector_size
+        hash_list = data[pos:pos + hash_list_len]
+        if hash_list_len:
+            pos += len(bin_padding(hash_list, sector_size))
+        content = data[pos:pos + arc_len]
+        pos += arc_len
+
+        errors = []
+        if orig_len > arc_len or arc_len % sector_size or len(content) != arc_len:
+            errors.append("invalid size")
+        if hashlib.md5(content).digest() != md5:
+            errors.append("MD5 mismatch")
+        if hash_bin != image_hash(content, sector_size):
+            errors.append("image hash mismatch")
+        if hash_list_len and hash_list_len != arc_len // sector_size * 32:
+            errors.append("invalid sector hash list")
+        for i in range(0, min(hash_list_len // 32 * sector_size, len(content)), sector_size):
+            if hashlib.sha256(content[i:i + sector_size]).digest() != hash_list[i // sector_size * 32:][:32]:
+                errors.append(f"sector {i // sector_size} corrupted")
+                break
+        print(f"{label}: {arc_len} bytes, {'sector hashes, ' if hash_list_len else ''}" +
+            (", ".join(errors) if errors else "OK"))
+        ok = ok and not errors
+    return ok
+
+def do_make_pull(version = None):
+    """make per-partition archives and mz5_manifest.txt for the pull updater
+    (src/ota_pull.h); serve the build directory with ota_server.py. Archives
+    are LZ4 compressed with per sector hashes so that broken downloads can be
+    resumed."""
     pio_env_name = "esp32dev"
     pio_build_dir = f".pio/build/{pio_env_name}"
-
     files = [
         ["src/fonts/TakaoPGothicC.ttf", "font"],
         [f"{pio_build_dir}/littlefs.bin", "fs"],
         [f"{pio_build_dir}/firmware.bin", "app"] # the firmware must be the last
     ]
-
     sector_size = 4096
 
-    # execute filesystem binary generation (TODO: proper scons execution)
     res = subprocess.call(f"pio run --target buildfs --environment {pio_env_name}", shell=True)
     if(res != 0):
         print("Could not run pio command. Check the pio installation.\n")
         exit(3)
 
+    if version is None:
+        version = subprocess.run("git describe --always --dirty", shell=True,
+            capture_output=True, text=True).stdout.strip() or "unknown"
+
+    manifest = [f"version {version}\n"]
+    for filename, label in files:
+        raw = open(filename, "rb").read()
+        content = bin_padding(raw, sector_size)
+        archive = compress_archive(
+            bin_padding(b"MZ5 firmware archive 1.0\r\n\n\x1a    ", sector_size) +
+            make_section(label, content, len(raw), sector_size, sector_hashes = True), True)
+
+        arcname = f"mz5_{label}.bin"
+        open(f"{pio_build_dir}/{arcname}", "wb").write(archive)
+        manifest.append(f"part {label} {len(content)} {image_hash(content, sector_size).hex()} "
+            f"{arcname} {len(archive)} {hashlib.md5(archive).hexdigest()}\n")
+
+    outfn = f"{pio_build_dir}/mz5_manifest.txt"
+    open(outfn, "w").write("".join(manifest))
+    print(F"Made pull update manifest at {outfn}\n")
+
+def do_make_archive(fs_base = None, fs_files = False, sector_base = None, lz4 = False, sector_hashes = False):
+    """fs_files: carry the filesystem as files instead of a LittleFS image.
+    fs_base: manifest of the running device; unchanged files are left out.
+    sector_base: sector hashes of the running device; partition images are
+    carried as sector deltas.
+    lz4: compress with LZ4 blocks instead of zlib; faster to decode on the device.
+    sector_hashes: add the per sector SHA-256 list to each section, which lets
+    the device stop at the first corrupted sector."""
+    pio_env_name = "esp32dev"
+    pio_build_dir = f".pio/build/{pio_env_name}"
+
+    fs_files = fs_files or fs_base is not None
+    files = [
+        ["src/fonts/TakaoPGothicC.ttf", "font"],
+        [None, "fsfiles"] if fs_files else [f"{pio_build_dir}/littlefs.bin", "fs"],
+        [f"{pio_build_dir}/firmware.bin", "app"] # the firmware must be the last
+    ]
+
+    sector_size = 4096
+
+    if not fs_files:
+        # execute filesystem binary generation (TODO: proper scons execution)
+        res = subprocess.call(f"pio run --target buildfs --environment {pio_env_name}", shell=True)
+        if(res != 0):
+            print("Could not run pio command. Check the pio installation.\n")
+            exit(3)
+
     # open the binary memory stream
     stream = BytesIO()
 
@@ -41,34 +291,25 @@ def do_make_archive():
         filename = file[0]
         label = file[1]
 
-        # open the input file
-        f = open(filename, "rb")
-
-        # read all content
-        content = f.read()
-        content_org_len = len(content)
-        content = bin_padding(content, sector_size)
-        content_arc_len = len(content)
-
-        # get hash
-        hash_bin = hashlib.md5(content).digest()
-
-        # write archive file header
-        header = (b"-file boundary--" +
-            struct.pack("<8sLL", label.encode('utf-8'), content_org_len, content_arc_len) +
-            hash_bin)
-        stream.write(bin_padding(header, sector_size))
-
-        # write content
-        stream.write(bin_padding(content, sector_size))
+        if filename is None:
+            # file level filesystem section
+            content = make_fs_delta(web_assets.build_web_assets("data", f"{pio_build_dir}/data"),
+                read_fs_manifest(fs_base) if fs_base else {})
+        else:
+            # read all content of the input file
+            content = open(filename, "rb").read()
+        if sector_base is not None and filename is not None:
+            # sector level delta of the partition image
+            content = make_sector_delta(label, bin_padding(content, sector_size),
+                read_sector_manifest(sector_base), sector_size)
+            label = "sdelta"
+        # write archive file header and content
+        stream.write(make_section(label, content, len(content), sector_size, sector_hashes))
 
     # compress and write the output file
     outfn = f".pio/build/{pio_env_name}/mz5_firm.bin"
     out = open(outfn, "wb")
-    out.write(b"MZ5 compressed archive\r\n\n\x1a")
-    compressed = zlib.compress(stream.getvalue(), 9)
-    out.write(struct.pack("<L", len(compressed)))
-    out.write(compressed)
+    out.write(compress_archive(stream.getvalue(), lz4))
     out.close()
 
     # done
@@ -84,4 +325,28 @@ def do_make_archive():
     print(F"Made OTA uncompressed (for old firmwares) archive at {outfn}\n")
 
 if __name__ == '__main__':
-    do_make_archive()
+    import argparse
+    parser = argparse.ArgumentParser(description="make firmware OTA archive")
+    parser.add_argument("--fs-files", action="store_true",
+        help="carry the filesystem as files instead of a LittleFS image")
+    parser.add_argument("--fs-base", metavar="MANIFEST",
+        help="manifest from http://<device>/update/fs_manifest; only changed files are included")
+    parser.add_argument("--sector-base", metavar="MANIFEST",
+        help="sector hashes from http://<device>/update/sector_manifest; only changed sectors are included")
+    parser.add_argument("--lz4", action="store_true",
+        help="compress with LZ4 instead of zlib; needs the lz4 module and a firmware which knows the format")
+    parser.add_argument("--sector-hashes", action="store_true",
+        help="add per sector SHA-256 lists; the device stops at a corrupted sector and the upload can be resumed")
+    parser.add_argument("--verify", metavar="ARCHIVE",
+        help="check an archive as the device does instead")
+    parser.add_argument("--pull", action="store_true",
+        help="make per-partition LZ4 archives and mz5_manifest.txt for the pull updater instead")
+    parser.add_argument("--version", help="version string of the --pull manifest; git describe by default")
+    args = parser.parse_args()
+    if args.verify:
+        exit(0 if verify_archive(args.verify) else 1)
+    if args.pull:
+        do_make_pull(version = args.version)
+        exit(0)
+    do_make_archive(fs_base = args.fs_base, fs_files = args.fs_files, sector_base = args.sector_base,
+        lz4 = args.lz4, sector_hashes = args.sector_hashes)
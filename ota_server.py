@@ -0,0 +1,58 @@
+#!/usr/bin/env python3
+
+# Minimal HTTP server for the pull updater (src/ota_pull.h); serves the
+# directory holding mz5_manifest.txt and the archives made by
+# make_archive.py --pull. Unlike python's http.server, it answers
+# "Range: bytes=N-" requests, which the device uses to resume downloads.
+# --drop-after cuts connections to test the resume.
+
+import http.server
+import os
+import re
+import shutil
+
+
+class RangeRequestHandler(http.server.SimpleHTTPRequestHandler):
+    drop_after = None
+
+    def send_head(self):
+        m = re.fullmatch(r"bytes=(\d+)-", self.headers.get("Range", ""))
+        path = self.translate_path(self.path)
+        if not m or not os.path.isfile(path):
+            return super().send_head()
+
+        f = open(path, "rb")
+        size = os.fstat(f.fileno()).st_size
+        start = int(m.group(1))
+        if start >= size:
+            f.close()
+            self.send_error(416, "Requested Range Not Satisfiable")
+            return None
+        f.seek(start)
+        self.send_response(206)
+        self.send_header("Content-Type", self.guess_type(path))
+        self.send_header("Content-Range", f"bytes {start}-{size - 1}/{size}")
+        self.send_header("Content-Length", str(size - start))
+        self.send_header("Accept-Ranges", "bytes")
+        self.end_headers()
+        return f
+
+    def copyfile(self, source, outputfile):
+        if self.drop_after is None:
+            return shutil.copyfileobj(source, outputfile)
+        outputfile.write(source.read(self.drop_after))
+        self.close_connection = True
+
+if __name__ == '__main__':
+    import argparse
+    import functools
+    parser = argparse.ArgumentParser(description="serve pull OTA archives with range request support")
+    parser.add_argument("directory", nargs="?", default=".pio/build/esp32dev")
+    parser.add_argument("--port", type=int, default=8000)
+    parser.add_argument("--drop-after", type=int, metavar="BYTES",
+        help="close each connection after sending this many bytes")
+    args = parser.parse_args()
+    RangeRequestHandler.drop_after = args.drop_after
+    handler = functools.partial(RangeRequestHandler, directory=args.directory)
+    print(f"Manifest: http://<this host>:{args.port}/mz5_manifest.txt")
+    http.server.ThreadingHTTPServer(("", args.port), handler).serve_forever()
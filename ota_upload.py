@@ -0,0 +1,61 @@
+#!/usr/bin/env python3
+
+# Resumable OTA upload; sends an archive made by make_archive.py to
+# /update/resume of the device, continuing from the last checkpoint of the
+# device when the connection drops. Only LZ4 archives (make_archive.py --lz4)
+# have restart points; others restart from the beginning.
+
+import base64
+import hashlib
+import http.client
+import json
+import time
+import urllib.parse
+
+
+def request(host, method, path, auth, body = None, headers = {}):
+    conn = http.client.HTTPConnection(host, timeout = 60)
+    h = dict(headers)
+    h["Authorization"] = "Basic " + base64.b64encode(auth.encode('utf-8')).decode('ascii')
+    conn.request(method, path, body = body, headers = h)
+    res = conn.getresponse()
+    data = res.read()
+    conn.close()
+    return res.status, data
+
+def upload(host, filename, auth, retries):
+    content = open(filename, "rb").read()
+    archive_id = hashlib.md5(content).hexdigest()
+    query = "id=" + archive_id
+
+    for attempt in range(retries + 1):
+        try:
+            status, data = request(host, "GET", "/update/resume?" + query, auth)
+            if status == 409:
+                # a pulled update has the updater
+                print("The device is busy with another update; retrying ...")
+                time.sleep(30)
+                continue
+            offset = json.loads(data)["offset"] if status == 200 else 0
+            print(f"Uploading {len(content) - offset} bytes from offset {offset} ...")
+            status, data = request(host, "POST",
+                "/update/resume?" + query + "&" + urllib.parse.urlencode({"offset": offset}), auth,
+                body = content[offset:], headers = {"Content-Type": "application/octet-stream"})
+            print(data.decode('utf-8', 'replace'))
+            # RETRY: a sector was corrupted on the way; resume from the checkpoint
+            if data != b"RETRY":
+                return data == b"OK"
+        except (OSError, http.client.HTTPException) as e:
+            print(f"Connection failed: {e}; retrying ...")
+            time.sleep(5)
+    return False
+
+if __name__ == '__main__':
+    import argparse
+    parser = argparse.ArgumentParser(description="upload firmware OTA archive, resuming after disconnection")
+    parser.add_argument("host", help="device host name or address")
+    parser.add_argument("archive", nargs="?", default=".pio/build/esp32dev/mz5_firm.bin")
+    parser.add_argument("--password", default="admin", help="web UI password of user 'admin'")
+    parser.add_argument("--retries", type=int, default=20)
+    args = parser.parse_args()
+    exit(0 if upload(args.host, args.archive, "admin:" + args.password, args.retries) else 1)
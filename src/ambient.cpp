@@ -1,4 +1,5 @@
 #include <Arduino.h>
+#include <array>
 #include "ambient.h"
 #include "interval.h"
 #include <rom/crc.h>
@@ -65,14 +66,26 @@ static constexpr int MAX_SETPOINTS = 16;
 
 static setpoint_t setpoints[MAX_SETPOINTS];
 
-// initialize the setpoints to the default
-static void init_setpoints()
+typedef std::array<setpoint_t, MAX_SETPOINTS> setpoint_array_t;
+
+// the default setpoints; also the default of the setting, so this must not
+// depend on any other static object
+static setpoint_array_t default_setpoints()
 {
     // make at least two setpoints, that is minimum and maximum
-    for(auto && n : setpoints) { n.ambient = INVALID_AMBIENT; n.brightness = 0; }
+    setpoint_array_t ar;
+    for(auto && n : ar) { n.ambient = INVALID_AMBIENT; n.brightness = 0; }
 
-    setpoints[0] = { .ambient  = 0, .brightness = DEFAULT_BRIGHTNESS }; 
-    setpoints[MAX_SETPOINTS - 1] = { .ambient = AMBIENT_MAX, .brightness = DEFAULT_BRIGHTNESS };
+    ar[0] = { .ambient  = 0, .brightness = DEFAULT_BRIGHTNESS };
+    ar[MAX_SETPOINTS - 1] = { .ambient = AMBIENT_MAX, .brightness = DEFAULT_BRIGHTNESS };
+    return ar;
+}
+
+// initialize the setpoints to the default
+static void init_setpoints()
+{
+    setpoint_array_t ar = default_setpoints();
+    memcpy(setpoints, ar.data(), sizeof(setpoints));
 }
 
 
@@ -186,34 +199,39 @@ void ambient_dump()
     }
 }
 
+// check setpoints read from the settings store
+static bool validate_setpoints(const setpoint_array_t & ar)
+{
+	for(auto && sp : ar)
+	{
+		if(sp.ambient < INVALID_AMBIENT || sp.ambient > AMBIENT_MAX ||
+			sp.brightness < 0 || sp.brightness > BRIGHTNESS_MAX)
+			return false;
+	}
+	return true;
+}
+
+static const setting_t<setpoint_array_t> ambient_setting("ambient_sp", 1, default_setpoints(), validate_setpoints);
+
 // write settings to the settings store
 static void write_ambient_settings()
 {
-	// make string vector representing the array
-	string_vector vec;
-	for(int i = 0; i < MAX_SETPOINTS; ++i)
-		vec.push_back(String((int)setpoints[i].ambient) + "," + String((int)setpoints[i].brightness));
-
-	// write
-	settings_write_vector("ambient", vec, SETTINGS_OVERWRITE);
+	setpoint_array_t ar;
+	memcpy(ar.data(), setpoints, sizeof(setpoints));
+	ambient_setting.set(ar);
 }
 
-// load settings from the settings store
-static void read_ambient_settings()
+// read settings stored as a string vector by older firmware
+static bool read_legacy_ambient_settings(setpoint_array_t & ar)
 {
 	string_vector vec;
-	if(!settings_read_vector("ambient", vec))
-	{
-		printf("ambient: ambient settings not found\n");
-		return; // not yet stored
-	}
+	if(!settings_read_vector("ambient", vec)) return false; // not stored
 	if(vec.size() != MAX_SETPOINTS)
 	{
 		// invalid data
 		printf("ambient: corrupted data: data number mismatch\n");
-		return;
+		return false;
 	}
-	setpoint_t ar[MAX_SETPOINTS];
 	for(int i = 0; i < MAX_SETPOINTS; ++i)
 	{
 		String s = vec[i];
@@ -221,19 +239,27 @@ static void read_ambient_settings()
 		if(2 != sscanf(s.c_str(), "%d,%d", &amb, &bri))
 		{
 			printf("ambient: corrupted data: %s is not parsable\n", s.c_str());
-			return;
-		}
-		if(amb < INVALID_AMBIENT || amb > AMBIENT_MAX ||
-			bri < 0 || bri > BRIGHTNESS_MAX)
-		{
-			printf("ambient: corrupted data: %s: value out of range\n", s.c_str());
-			return; // data out of range
+			return false;
 		}
 		ar[i] = {(int16_t)amb, (int16_t)bri};
 	}
+	return validate_setpoints(ar);
+}
+
+// load settings from the settings store
+static void read_ambient_settings()
+{
+	setpoint_array_t ar;
+	if(!ambient_setting.read(ar) && read_legacy_ambient_settings(ar))
+	{
+		// migrate to the binary form
+		printf("ambient: converting legacy settings\n");
+		ambient_setting.set(ar);
+		settings_remove("ambient");
+	}
 
-	// all read.
-	memcpy(setpoints, ar, sizeof(ar));
+	ar = ambient_setting.get(); // the default if not stored or invalid
+	memcpy(setpoints, ar.data(), sizeof(setpoints));
 }
 
 
@@ -292,6 +318,7 @@ int16_t ambient_to_brightness(int16_t ambient)
 static int16_t last_read_ambient;
 static uint32_t freeze_ambient_until;
 static bool ambient_freezing;
+static int16_t ambient_override = INVALID_AMBIENT; // replaces ADC reading while a session log is replayed
 static bool ambient_ledtest_fix_brightness; // always full brightness for led test
 static int ambient_ledtest_fixed_brightness; // the fixed brightness value index
 static int ambient_brightness_by_current_ambient; // brightness value index from current ambient; not affected by ambient_ledtest_fix_brightness
@@ -344,6 +371,7 @@ static int16_t read_ambient()
 		int lv = (int)(20000000.0 * il) + 50; // reformat to easy-to-handle range
 		if(lv < 0) lv = 0;
 		if(lv > AMBIENT_MAX) lv = AMBIENT_MAX;
+		if(ambient_override != INVALID_AMBIENT) lv = ambient_override;
 		last_read_ambient = lv;
 	}
 	else
@@ -465,6 +493,12 @@ int16_t get_ambient()
 	return last_read_ambient;
 }
 
+void ambient_set_override(int16_t ambient)
+{
+	ambient_override = ambient;
+	if(ambient != INVALID_AMBIENT) last_read_ambient = ambient;
+}
+
 
 #define AMBIENT_FREEZE_TIME 5000 // ambient brightness reading freezing time in ms
 // freezing ambient for certain time period. to 
@@ -3,6 +3,7 @@
 void init_ambient();
 void poll_ambient();
 int16_t get_ambient();
+void ambient_set_override(int16_t ambient); // -1 to use the sensor again
 
 void sensors_set_brightness_always_max(bool b);
 void sensors_set_brightness_fix(int brightness);
@@ -2,8 +2,53 @@
 #include "buttons.h"
 #include "matrix_drive.h"
 #include "interval.h"
+#include "esp_timer.h"
 
-uint8_t buttons[MAX_BUTTONS] = {0};
+/**
+ * Input event ring buffer.
+ * Events are pushed from the main thread and other tasks (web server,
+ * console), so the ring is protected by a spinlock.
+ * When the ring is full, new events are dropped.
+ */
+static constexpr int INPUT_EVENT_RING_SIZE = 32; // must be a power of two
+static input_event_t input_events[INPUT_EVENT_RING_SIZE];
+static uint32_t input_event_head = 0; // read position
+static uint32_t input_event_tail = 0; // write position
+static uint32_t input_event_dropped = 0; // count of dropped events
+static portMUX_TYPE input_event_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static void push_event(uint32_t timestamp_us, int button, input_event_type_t type, input_source_t source)
+{
+	portENTER_CRITICAL(&input_event_lock);
+	if(input_event_tail - input_event_head < INPUT_EVENT_RING_SIZE)
+	{
+		input_event_t & ev = input_events[input_event_tail & (INPUT_EVENT_RING_SIZE - 1)];
+		ev.timestamp_us = timestamp_us;
+		ev.button = (uint8_t)button;
+		ev.type = type;
+		ev.source = source;
+		++ input_event_tail;
+	}
+	else
+	{
+		++ input_event_dropped;
+	}
+	portEXIT_CRITICAL(&input_event_lock);
+}
+
+bool button_get_event(input_event_t & ev)
+{
+	bool ret = false;
+	portENTER_CRITICAL(&input_event_lock);
+	if(input_event_head != input_event_tail)
+	{
+		ev = input_events[input_event_head & (INPUT_EVENT_RING_SIZE - 1)];
+		++ input_event_head;
+		ret = true;
+	}
+	portEXIT_CRITICAL(&input_event_lock);
+	return ret;
+}
 
 /**
  * Button repeat / debounce counter.
@@ -20,6 +65,7 @@ uint8_t buttons[MAX_BUTTONS] = {0};
  * thus recognized again and again as pushed (repeating).
  */
 static uint8_t button_debounce_counter[MAX_BUTTONS] = {0};
+static bool button_long_pressed[MAX_BUTTONS] = {0}; // whether long press event has been sent for current press
 
 static bool phys_button_disabled = false; // whether the physical button input is disabled or not
 
@@ -34,6 +80,7 @@ static bool phys_button_disabled = false; // whether the physical button input i
 static void button_update_handler()
 {
 	auto br = matrix_button_scan_bits; // button_read is updated in matrix_drive.cpp
+	uint32_t now = (uint32_t)esp_timer_get_time();
 	for(int i = 0; i < MAX_BUTTONS; i++)
 	{
 		if(br & (1U << i))
@@ -43,7 +90,8 @@ static void button_update_handler()
 			count ++;
 			if(count == BUTTON_DEBOUNCE_COUNT)
 			{
-				if(buttons[i] < 255) buttons[i] ++;
+				// stamp with the time of the raw edge caught by the scan interrupt
+				push_event(matrix_button_edge_us[i], i, ie_press, is_physical);
 			}
 			else if(count == BUTTON_REPEAT_LIMIT)
 			{
@@ -52,14 +100,22 @@ static void button_update_handler()
 
 			if(count == BUTTON_INITIAL_REPEAT_DELAY)
 			{
-				if(buttons[i] < 255) buttons[i] ++;
+				if(!button_long_pressed[i])
+				{
+					button_long_pressed[i] = true;
+					push_event(now, i, ie_long_press, is_physical);
+				}
+				push_event(now, i, ie_repeat, is_physical);
 			}
 			button_debounce_counter[i] = count;
 		}
 		else
 		{
 			// physical button released
+			if(button_debounce_counter[i] >= BUTTON_DEBOUNCE_COUNT)
+				push_event(matrix_button_edge_us[i], i, ie_release, is_physical);
 			button_debounce_counter[i] = 0;
+			button_long_pressed[i] = false;
 		}
 	}
 }
@@ -104,19 +160,25 @@ void button_update()
 uint32_t button_get()
 {
 	uint32_t ret = 0;
-	for(int i = 0; i < MAX_BUTTONS; i++)
+	input_event_t ev;
+	while(button_get_event(ev))
 	{
-		if(buttons[i]) ret |= (1<<i), buttons[i] = 0;
+		if(ev.is_push()) ret |= ev.button_bit();
 	}
 	return ret;
 }
 
 
-void button_push(uint32_t button)
+void button_push(uint32_t button, input_source_t source)
 {
+	uint32_t now = (uint32_t)esp_timer_get_time();
 	for(int i = 0; i < MAX_BUTTONS; i++)
 	{
-		if(((1<<i) & button) && buttons[i] != 255) ++buttons[i];
+		if((1<<i) & button)
+		{
+			push_event(now, i, ie_press, source);
+			push_event(now, i, ie_release, source);
+		}
 	}
 }
 
@@ -4,21 +4,57 @@
 #include <Arduino.h>
 
 #define MAX_BUTTONS 6
+
+/**
+ * Input event type
+ */
+enum input_event_type_t : uint8_t
+{
+	ie_press, //!< button pressed (after debounce)
+	ie_release, //!< button released
+	ie_repeat, //!< auto repeat while the button is kept pressed
+	ie_long_press, //!< the button has been kept pressed long (once per press)
+};
+
+/**
+ * Input event source
+ */
+enum input_source_t : uint8_t
+{
+	is_physical, //!< physical buttons
+	is_web, //!< web interface
+	is_console, //!< serial console
+};
+
 /**
- * Button pushed count.
- * Put zero to reset count.
+ * An input event.
  */
-extern uint8_t buttons[MAX_BUTTONS];
+struct input_event_t
+{
+	uint32_t timestamp_us; //!< when the event happened, in us (esp_timer_get_time() based; wraps around)
+	uint8_t button; //!< button ordinal; ORD_BUTTON_XXX
+	input_event_type_t type;
+	input_source_t source;
+
+	//! returns button bitmap
+	uint32_t button_bit() const { return 1U << button; }
+	//! returns whether this event should be treated as a button push
+	bool is_push() const { return type == ie_press || type == ie_repeat; }
+};
 
 /**
  * Call this in main loop.
  */
 void button_update();
 
+/**
+ * Pop the oldest input event. Returns false if no event is queued.
+ */
+bool button_get_event(input_event_t & ev);
 
 /**
- * Get button state in bitmap format.
- * button buffer is to be cleared.
+ * Get pushed buttons in bitmap format, from queued events.
+ * All queued events are consumed.
  */
 uint32_t button_get();
 
@@ -37,9 +73,10 @@ uint32_t button_get();
 #define BUTTON_CANCEL    (1<<ORD_BUTTON_CANCEL)
 
 /**
- * Emulate button pushing
+ * Emulate button pushing.
+ * Press and release events are queued for each button in the bitmap.
  */
-void button_push(uint32_t button);
+void button_push(uint32_t button, input_source_t source);
 
 /**
  * return a bitmap of *physical* button pressing state
@@ -9,6 +9,10 @@ static string_vector time_servers;
 static String time_zone;
 static struct timeval last_time_correct_timestamp;
 
+static const char * const default_time_servers[] = {"0.pool.ntp.org", "1.pool.ntp.org", "2.pool.ntp.org"};
+static const setting_string_vector_t time_servers_setting("time_servers", default_time_servers);
+static const setting_string_t time_zone_setting("time_zone", "JST-9");
+
 static void sntp_sync_time_cb(struct timeval *tv)
 {
     memcpy(&last_time_correct_timestamp, tv, sizeof(timeval));
@@ -38,44 +42,48 @@ void calendar_reconfigure()
 }
 
 
+/**
+ * read time servers and time zone from settings; defaults are not written
+ * until changed
+ * */
+static void read_settings(string_vector & _time_servers, String & _time_zone)
+{
+    _time_servers = time_servers_setting.get();
+    if(_time_servers.size() > 3) _time_servers.resize(3); // only three servers are supported
+    _time_zone = time_zone_setting.get();
+}
+
+
 /**
  * initialize the calendar
  * */
 void init_calendar()
 {
-    // read from settings
-    settings_write_vector(F("time_servers"),
-        {"0.pool.ntp.org", "1.pool.ntp.org", "2.pool.ntp.org"}, SETTINGS_NO_OVERWRITE);
-	settings_write(F("time_zone"), F("JST-9"), SETTINGS_NO_OVERWRITE);
-
-	settings_read_vector(F("time_servers"), time_servers);
-    if(time_servers.size() > 3) time_servers.resize(3); // only three servers are supported
-	settings_read(F("time_zone"), time_zone);
+    read_settings(time_servers, time_zone);
     sntp_set_time_sync_notification_cb(sntp_sync_time_cb);
 
     calendar_reconfigure();
-}
 
-/**
- * write current settings to settings store
- * */
-static void write_settings()
-{
-	settings_write_vector(F("time_servers"), time_servers);
-	settings_write(F("time_zone"), time_zone);
+    // follow changes; both keys start with "time_"
+    settings_subscribe(F("time_"), []() {
+        read_settings(time_servers, time_zone);
+        calendar_reconfigure();
+    });
 }
 
-
 /**
- * configure time server and time zone
+ * configure time server and time zone. The calendar is reconfigured
+ * through the settings subscription.
  * */
 void set_tz(const string_vector & _time_servers, const String & _time_zone)
 {
-    time_servers = _time_servers;
-    if(time_servers.size() > 3) time_servers.resize(3); // only three servers are supported
-    time_zone = _time_zone;
-    write_settings();
-    calendar_reconfigure();
+    string_vector servers = _time_servers;
+    if(servers.size() > 3) servers.resize(3); // only three servers are supported
+
+    settings_transaction_t tr;
+    tr.put_vector(time_servers_setting.get_key(), servers);
+    tr.put(time_zone_setting.get_key(), _time_zone);
+    tr.commit();
 }
 
 /**
@@ -83,6 +91,5 @@ void set_tz(const string_vector & _time_servers, const String & _time_zone)
  * */
 void get_tz(string_vector & _time_servers, String & _time_zone)
 {
-    _time_servers = time_servers;
-    _time_zone = time_zone;
+    read_settings(_time_servers, _time_zone); // may be newer than the running configuration
 }
@@ -12,6 +12,9 @@
 #include "buttons.h"
 #include "mz_update.h"
 #include "mz_version.h"
+#include "session_log.h"
+#include "flash_stats.h"
+#include "ota_pull.h"
 
 
 
@@ -806,8 +809,9 @@ namespace cmd_keys
                 default:
                     break;
                 }
-                run_in_main_thread([buttons] () -> int {
-                    button_push(buttons);
+                // no need to wait for the key to be processed
+                run_in_main_thread_async([buttons] () -> int {
+                    button_push(buttons, is_console);
                     return 0;
                 });
 
@@ -818,6 +822,118 @@ namespace cmd_keys
 }
 
 
+namespace cmd_session
+{
+    struct arg_lit *help, *stop, *frames;
+    struct arg_str *record, *play;
+    struct arg_end *end;
+    void * arg_table[] = {
+            help =    arg_litn(NULL, "help", 0, 1, "Display help and exit"),
+            record =  arg_strn("r",  "record", "<file>", 0, 1, "Record UI session into the file"),
+            play =    arg_strn("p",  "play",   "<file>", 0, 1, "Replay UI session from the file"),
+            frames =  arg_litn(nullptr, "frames", 0, 1, "Also write frame contents while replaying"),
+            stop =    arg_litn("s",  "stop",   0, 1, "Stop recording or replaying"),
+            end =     arg_end(5)
+            };
+
+    class _cmd : public cmd_base_t
+    {
+
+    public:
+        _cmd() : cmd_base_t("session", "Record or replay UI session", arg_table) {}
+
+    private:
+
+        int func(int argc, char **argv)
+        {
+            return run_in_main_thread([] () -> int {
+                if(record->count + play->count + stop->count != 1)
+                {
+                    printf("Exactly one of --record, --play or --stop must be given.\n");
+                    return 1;
+                }
+
+                if(stop->count)
+                {
+                    session_stop();
+                    return 0;
+                }
+
+                if(record->count)
+                    return session_record_start(record->sval[0]) ? 0 : 2;
+
+                return session_replay_start(play->sval[0], frames->count > 0) ? 0 : 2;
+            }) ;
+        }
+    };
+}
+
+namespace cmd_flashstat
+{
+    struct arg_lit *help, *reset;
+    struct arg_end *end;
+    void * arg_table[] = {
+            help =    arg_litn(NULL, "help", 0, 1, "Display help and exit"),
+            reset =   arg_litn("r",  "reset", 0, 1, "Clear the counters"),
+            end =     arg_end(5)
+            };
+
+    class _cmd : public cmd_base_t
+    {
+
+    public:
+        _cmd() : cmd_base_t("flashstat", "Show flash write and erase counters since boot", arg_table) {}
+
+    private:
+        int func(int argc, char **argv)
+        {
+            return run_in_main_thread([] () -> int {
+                if(reset->count)
+                {
+                    flash_stats_reset();
+                    printf("Counters cleared.\n");
+                    return 0;
+                }
+                flash_stats_dump();
+                return 0;
+            }) ;
+        }
+    };
+}
+
+namespace cmd_otapull
+{
+    struct arg_lit *help = arg_litn(NULL, "help", 0, 1, "Display help and exit");
+    struct arg_str *url = arg_strn(NULL, NULL, "<manifest-url>", 0, 1, "URL of mz5_manifest.txt");
+    struct arg_end *end = arg_end(5);
+    void * arg_table[] = { help, url, end };
+
+    class _cmd : public cmd_base_t
+    {
+
+    public:
+        _cmd() : cmd_base_t("otapull", "Update firmware from a HTTP server", arg_table) {}
+
+    private:
+        int func(int argc, char **argv)
+        {
+            return run_in_main_thread([] () -> int {
+                if(!url->count)
+                {
+                    printf("OTA pull is %s.\n", ota_pull_is_running() ? "running" : "not running");
+                    return 0;
+                }
+                if(!ota_pull_start(url->sval[0]))
+                {
+                    printf("OTA pull or an uploaded update is already running.\n");
+                    return 1;
+                }
+                return 0;
+            }) ;
+        }
+    };
+}
+
 namespace cmd_ver
 {
     struct arg_lit *help = arg_litn(NULL, "help", 0, 1, "Display help and exit");
@@ -880,6 +996,9 @@ void init_console_commands()
     static cmd_rmt::_cmd rmt_cmd;
     static cmd_reboot::_cmd reboot_cmd;
     static cmd_keys::_cmd keys_cmd;
+    static cmd_session::_cmd session_cmd;
+    static cmd_flashstat::_cmd flashstat_cmd;
+    static cmd_otapull::_cmd otapull_cmd;
     static cmd_ver::_cmd ver_cmd;
     static cmd_t::_cmd t_cmd;
 }
\ No newline at end of file
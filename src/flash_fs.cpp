@@ -35,10 +35,14 @@ namespace
 
     class LittleFSImpl : public VFSImpl
     {
+        size_t file_buffer_size = 0;
+
     public:
         LittleFSImpl();
         virtual ~LittleFSImpl() { }
         virtual bool exists(const char* path);
+        virtual FileImplPtr open(const char* path, const char* mode, const bool create);
+        void set_file_buffer_size(size_t size) { file_buffer_size = size; }
     };
 
     LittleFSImpl::LittleFSImpl()
@@ -47,10 +51,19 @@ namespace
 
     bool LittleFSImpl::exists(const char* path)
     {
-        File f = open(path, "r", false);
+        File f(VFSImpl::open(path, "r", false)); // no buffer for a mere check
         return (f == true) && !f.isDirectory();
     }
 
+    // every open goes here, whether through ANY_LittleFSFS or a plain fs::FS
+    FileImplPtr LittleFSImpl::open(const char* path, const char* mode, const bool create)
+    {
+        FileImplPtr file = VFSImpl::open(path, mode, create);
+        if(file && *file && file_buffer_size && !file->isDirectory())
+            file->setBufferSize(file_buffer_size);
+        return file;
+    }
+
 
 }
 
@@ -59,9 +72,24 @@ ANY_LittleFSFS::ANY_LittleFSFS() : FS(FSImplPtr(new LittleFSImpl()))
 
 }
 
+// maxOpenFiles is ignored; esp_littlefs has no limit of open files
 bool ANY_LittleFSFS::begin(bool formatOnFail, const char *label, const char * basePath, uint8_t maxOpenFiles)
 {
+    flash_fs_config_t config;
+    config.label = label;
+    config.base_path = basePath;
+    config.format_on_fail = formatOnFail;
+    return begin(config);
+}
+
+bool ANY_LittleFSFS::begin(const flash_fs_config_t & config)
+{
+    const char *label = config.label;
+    const char *basePath = config.base_path;
+    bool formatOnFail = config.format_on_fail;
     const char *p_label = label ? label : "(default)"; // for print only
+
+    static_cast<LittleFSImpl *>(_impl.get())->set_file_buffer_size(config.file_buffer_size);
     printf("Mounting LittleFS ... Label:%s\r\n", p_label);
 
     if(esp_littlefs_mounted(label)){
@@ -99,6 +127,17 @@ bool ANY_LittleFSFS::begin(bool formatOnFail, const char *label, const char * ba
     return true;
 }
 
+void ANY_LittleFSFS::end(const char *label)
+{
+    if(!esp_littlefs_mounted(label)) return;
+    esp_err_t err = esp_vfs_littlefs_unregister(label);
+    if(err){
+        log_e("Unmounting LittleFS failed! Error: %d", err);
+        return;
+    }
+    _impl->mountpoint(NULL);
+}
+
 bool ANY_LittleFSFS::format(const char *label)
 {
     disableCore0WDT();
@@ -130,9 +169,12 @@ const char * get_main_flash_fs_partition_name(int generation)
 void init_fs()
 {
    	puts("Main LittleFS initializing ...");
-    if(!(
-        ::FS.begin(true, get_main_flash_fs_partition_name(get_current_active_partition_number())) 
-    ))
+    // web assets are read sequentially in large pieces; let stdio read ahead
+    flash_fs_config_t config;
+    config.label = get_main_flash_fs_partition_name(get_current_active_partition_number());
+    config.format_on_fail = true;
+    config.file_buffer_size = 4096;
+    if(!::FS.begin(config))
     {
         // main LittleFS mount failed! go in recovery mode
         printf("Main LittleFS mount failed. Going to system recovery mode ...\n");
@@ -20,6 +20,15 @@
 
 #include "FS.h"
 
+//! Mount configuration of a LittleFS partition.
+struct flash_fs_config_t
+{
+    const char *label = nullptr;    //!< partition label; nullptr for the default
+    const char *base_path = "/fs";  //!< mount point
+    bool format_on_fail = false;    //!< format if the partition is not mountable
+    size_t file_buffer_size = 0;    //!< stdio buffer size of every file opened on this filesystem; 0 for the default
+};
+
 namespace fs
 {
 
@@ -27,8 +36,10 @@ class ANY_LittleFSFS : public FS
 {
 public:
     ANY_LittleFSFS();
+    bool begin(const flash_fs_config_t & config);
     bool begin(bool formatOnFail=false, const char *label = nullptr, const char * basePath="/fs", uint8_t maxOpenFiles=10);
     bool format(const char * label = nullptr);
+    void end(const char * label = nullptr);
 };
 
 }
@@ -0,0 +1,223 @@
+#include <Arduino.h>
+#include <vector>
+#include "esp_partition.h"
+#include "esp_timer.h"
+#include "flash_stats.h"
+#include "settings.h"
+
+//! Per partition counters
+struct partition_stats_t
+{
+	const esp_partition_t *partition;
+	uint64_t bytes_written;
+	uint32_t write_calls;
+	uint32_t sectors_erased;
+	latency_histogram_t write_latency;
+	latency_histogram_t erase_latency;
+};
+
+static constexpr int MAX_PARTITIONS = 12;
+static partition_stats_t partition_stats[MAX_PARTITIONS];
+static int num_partitions;
+// partition writes come from any task; the lock is held only while counting
+static portMUX_TYPE stats_mux = portMUX_INITIALIZER_UNLOCKED;
+
+
+void latency_histogram_t::add(uint32_t us)
+{
+	int i = 0;
+	while(i < NUM_BUCKETS - 1 && (us >> (i + 1))) ++i;
+	++ counts[i];
+	if(max_us < us) max_us = us;
+}
+
+uint32_t latency_histogram_t::total() const
+{
+	uint32_t n = 0;
+	for(auto c : counts) n += c;
+	return n;
+}
+
+uint32_t latency_histogram_t::percentile(int p) const
+{
+	uint32_t n = total();
+	if(n == 0) return 0;
+	uint32_t rank = ((uint64_t)n * p + 99) / 100; // 1-based rank of the sample
+	if(rank == 0) rank = 1;
+	uint32_t acc = 0;
+	for(int i = 0; i < NUM_BUCKETS; ++i)
+	{
+		acc += counts[i];
+		if(acc >= rank)
+		{
+			uint32_t upper = (i == NUM_BUCKETS - 1) ? max_us : ((2u << i) - 1);
+			return upper < max_us ? upper : max_us;
+		}
+	}
+	return max_us;
+}
+
+void latency_histogram_json(const latency_histogram_t & h, Print & st)
+{
+	st.printf("\"count\":%u,\"p50_us\":%u,\"p90_us\":%u,\"p99_us\":%u,\"max_us\":%u",
+		(unsigned)h.total(), (unsigned)h.percentile(50), (unsigned)h.percentile(90),
+		(unsigned)h.percentile(99), (unsigned)h.max_us);
+}
+
+static void print_histogram(const char *title, const latency_histogram_t & h)
+{
+	printf("  %-8s n=%-7u p50<=%-7u p90<=%-7u p99<=%-7u max=%u us\n", title,
+		(unsigned)h.total(), (unsigned)h.percentile(50), (unsigned)h.percentile(90),
+		(unsigned)h.percentile(99), (unsigned)h.max_us);
+}
+
+
+// find or add the counters of the partition; called with stats_mux held
+static partition_stats_t *find_partition_stats(const esp_partition_t *partition)
+{
+	for(int i = 0; i < num_partitions; ++i)
+		if(partition_stats[i].partition == partition) return partition_stats + i;
+	if(num_partitions == MAX_PARTITIONS) return nullptr;
+	partition_stats_t *s = partition_stats + num_partitions++;
+	s->partition = partition;
+	return s;
+}
+
+
+// Linker wrappers; -Wl,--wrap=<func> routes calls to <func> here and makes
+// the original available as __real_<func>.
+extern "C" {
+
+esp_err_t __real_esp_partition_write(const esp_partition_t *partition,
+	size_t dst_offset, const void *src, size_t size);
+esp_err_t __real_esp_partition_erase_range(const esp_partition_t *partition,
+	size_t offset, size_t size);
+
+esp_err_t __wrap_esp_partition_write(const esp_partition_t *partition,
+	size_t dst_offset, const void *src, size_t size)
+{
+	int64_t start = esp_timer_get_time();
+	esp_err_t err = __real_esp_partition_write(partition, dst_offset, src, size);
+	uint32_t us = (uint32_t)(esp_timer_get_time() - start);
+
+	portENTER_CRITICAL(&stats_mux);
+	partition_stats_t *s = find_partition_stats(partition);
+	if(s)
+	{
+		s->bytes_written += size;
+		++ s->write_calls;
+		s->write_latency.add(us);
+	}
+	portEXIT_CRITICAL(&stats_mux);
+	return err;
+}
+
+esp_err_t __wrap_esp_partition_erase_range(const esp_partition_t *partition,
+	size_t offset, size_t size)
+{
+	int64_t start = esp_timer_get_time();
+	esp_err_t err = __real_esp_partition_erase_range(partition, offset, size);
+	uint32_t us = (uint32_t)(esp_timer_get_time() - start);
+
+	portENTER_CRITICAL(&stats_mux);
+	partition_stats_t *s = find_partition_stats(partition);
+	if(s)
+	{
+		s->sectors_erased += size / SPI_FLASH_SEC_SIZE;
+		s->erase_latency.add(us);
+	}
+	portEXIT_CRITICAL(&stats_mux);
+	return err;
+}
+
+}
+
+
+// take a consistent copy of the partition counters
+static int snapshot(partition_stats_t *out)
+{
+	portENTER_CRITICAL(&stats_mux);
+	int n = num_partitions;
+	memcpy(out, partition_stats, sizeof(partition_stats[0]) * n);
+	portEXIT_CRITICAL(&stats_mux);
+	return n;
+}
+
+void flash_stats_dump()
+{
+	partition_stats_t *ps = new partition_stats_t[MAX_PARTITIONS];
+	if(!ps) return;
+	int n = snapshot(ps);
+
+	printf("Partition   Written(bytes)  Writes  Erased(sectors)\n");
+	for(int i = 0; i < n; ++i)
+	{
+		printf("%-10s %15llu %7u %16u\n", ps[i].partition->label,
+			(unsigned long long)ps[i].bytes_written, (unsigned)ps[i].write_calls,
+			(unsigned)ps[i].sectors_erased);
+		print_histogram("write", ps[i].write_latency);
+		print_histogram("erase", ps[i].erase_latency);
+	}
+	delete [] ps;
+
+	std::vector<settings_write_stat_t> ss;
+	latency_histogram_t flush_latency;
+	settings_get_write_stats(ss, flush_latency);
+	printf("\nSettings key prefix  Writes  Bytes\n");
+	for(auto && s : ss)
+		printf("%-20s %6u %6u\n", s.prefix.c_str(), (unsigned)s.writes, (unsigned)s.bytes);
+	print_histogram("flush", flush_latency);
+}
+
+void flash_stats_json(Print & st)
+{
+	partition_stats_t *ps = new partition_stats_t[MAX_PARTITIONS];
+	if(!ps) { st.print(F("{}")); return; }
+	int n = snapshot(ps);
+
+	st.print(F("{\"partitions\":{"));
+	for(int i = 0; i < n; ++i)
+	{
+		if(i) st.print((char)',');
+		st.printf("\n\"%s\":{\"bytes_written\":%llu,\"writes\":%u,\"sectors_erased\":%u,",
+			ps[i].partition->label, (unsigned long long)ps[i].bytes_written,
+			(unsigned)ps[i].write_calls, (unsigned)ps[i].sectors_erased);
+		st.print(F("\"write_latency\":{"));
+		latency_histogram_json(ps[i].write_latency, st);
+		st.print(F("},\"erase_latency\":{"));
+		latency_histogram_json(ps[i].erase_latency, st);
+		st.print(F("}}"));
+	}
+	delete [] ps;
+
+	std::vector<settings_write_stat_t> ss;
+	latency_histogram_t flush_latency;
+	settings_get_write_stats(ss, flush_latency);
+	st.print(F("},\n\"settings\":{\"prefixes\":{"));
+	bool first = true;
+	for(auto && s : ss)
+	{
+		if(!first) st.print((char)',');
+		first = false;
+		st.print(F("\n\""));
+		for(const char *p = s.prefix.c_str(); *p; ++p)
+			if(*p >= 0x20 && *p != '"' && *p != '\\') st.print(*p); // imported keys may be anything
+		st.printf("\":{\"writes\":%u,\"bytes\":%u}", (unsigned)s.writes, (unsigned)s.bytes);
+	}
+	st.print(F("},\n\"flush_latency\":{"));
+	latency_histogram_json(flush_latency, st);
+	st.print(F("}}}\n"));
+}
+
+void flash_stats_reset()
+{
+	portENTER_CRITICAL(&stats_mux);
+	for(int i = 0; i < num_partitions; ++i)
+	{
+		const esp_partition_t *p = partition_stats[i].partition;
+		partition_stats[i] = partition_stats_t();
+		partition_stats[i].partition = p;
+	}
+	portEXIT_CRITICAL(&stats_mux);
+	settings_reset_write_stats();
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Flash wear accounting.
+//
+// Every esp_partition_write() and esp_partition_erase_range() call, made by
+// LittleFS, NVS or the updater, is counted per partition through linker
+// wrapping (see build_flags in platformio.ini). Settings writes are also
+// counted per key prefix by the settings store, to find chatty writers.
+// Counters live in RAM and start from zero at every boot.
+
+//! Histogram of latencies in power-of-two micro second buckets
+struct latency_histogram_t
+{
+	static constexpr int NUM_BUCKETS = 24; //!< bucket i holds [2^i, 2^(i+1)) us; the last one holds the rest
+
+	uint32_t counts[NUM_BUCKETS] = {0};
+	uint32_t max_us = 0;
+
+	void add(uint32_t us);
+	void clear() { *this = latency_histogram_t(); }
+	uint32_t total() const;
+
+	//! upper bound in us of the given percentile (0-100), 0 if empty
+	uint32_t percentile(int p) const;
+};
+
+//! Write a histogram summary as JSON object members: "count", "p50_us", ...
+void latency_histogram_json(const latency_histogram_t & h, Print & st);
+
+//! Print all counters to the console
+void flash_stats_dump();
+
+//! Write all counters as a JSON object
+void flash_stats_json(Print & st);
+
+//! Clear all counters
+void flash_stats_reset();
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdint.h>
+
+// Stackless cooperative flow (protothread) helpers.
+//
+// A flow is a function which returns true while it is running, and which is
+// called (resumed) repeatedly by its owner. FLOW_WAIT_UNTIL() returns from
+// the function and continues at the same place on the next call, so
+// multi-step workflows can be written straight instead of as a hand-made
+// state machine, without spending a task and its stack.
+//
+// Local variables are NOT preserved across waits; keep them in members.
+// Do not use switch statements across waits, and do not put two waits on
+// a line.
+
+struct flow_t
+{
+	int line = 0; //!< resume point; 0 = not started, -1 = finished
+	uint32_t timer = 0; //!< start tick of FLOW_SLEEP()
+
+	//! restart the flow from its beginning on the next call
+	void reset() { line = 0; }
+};
+
+#define FLOW_BEGIN(f) \
+	if((f).line < 0) return false; \
+	switch((f).line) { case 0:
+
+#define FLOW_WAIT_UNTIL(f, cond) \
+	do { (f).line = __LINE__; /* FALLTHRU */ case __LINE__: \
+		if(!(cond)) return true; } while(0)
+
+#define FLOW_YIELD(f) \
+	do { (f).line = __LINE__; return true; case __LINE__: ; } while(0)
+
+#define FLOW_SLEEP(f, ms) \
+	do { (f).timer = millis(); \
+		FLOW_WAIT_UNTIL(f, (int32_t)(millis() - (f).timer) >= (int32_t)(ms)); } while(0)
+
+// Required to close FLOW_BEGIN(), even where the flow never reaches it, such
+// as a screen's flow which deletes its screen and returns false.
+#define FLOW_END(f) \
+	} (f).line = -1; return false
@@ -95,18 +95,32 @@ static bool utf8tow(const uint8_t * & in, uint32_t *out)
 
 bool frame_buffer_t::clip(int &fx, int &fy, int &x, int &y, int &w, int &h) const
 {
-	if(x < 0)
-		fx += -x, w -= -x, x = 0;
-	if(y < 0)
-		fy += -y, h -= -h, y = 0;
-	if(x + w >= get_width())
-		w -= (x + w) - get_width();
-	if(y + h >= get_height())
-		h -= (y + h) - get_height();
+	if(x < clip_left)
+		fx += clip_left - x, w -= clip_left - x, x = clip_left;
+	if(y < clip_top)
+		fy += clip_top - y, h -= clip_top - y, y = clip_top;
+	if(x + w >= clip_right)
+		w -= (x + w) - clip_right;
+	if(y + h >= clip_bottom)
+		h -= (y + h) - clip_bottom;
 
 	return w > 0 && h > 0;
 }
 
+void frame_buffer_t::set_clip(int x, int y, int w, int h)
+{
+	if(x < 0) w += x, x = 0;
+	if(y < 0) h += y, y = 0;
+	if(x + w > LED_MAX_LOGICAL_COL) w = LED_MAX_LOGICAL_COL - x;
+	if(y + h > LED_MAX_LOGICAL_ROW) h = LED_MAX_LOGICAL_ROW - y;
+	if(w < 0) w = 0;
+	if(h < 0) h = 0;
+	clip_left = x;
+	clip_top = y;
+	clip_right = x + w;
+	clip_bottom = y + h;
+}
+
 
 void frame_buffer_t::draw_char(int x, int y, int level, int ch, const font_base_t & font)
 {
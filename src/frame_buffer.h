@@ -13,6 +13,10 @@ public:
 
 protected:
 	array_t buffer;
+	int clip_left = 0; //!< clipping rectangle used by clip()
+	int clip_top = 0;
+	int clip_right = LED_MAX_LOGICAL_COL;
+	int clip_bottom = LED_MAX_LOGICAL_ROW;
 
 public:
 	//! returns width
@@ -24,6 +28,16 @@ public:
 	//! returns whether the box is remaining
 	bool clip(int &fx, int &fy, int &x, int &y, int &w, int &h) const;
 
+	//! Restrict text drawing to the specified rectangle.
+	//! Note that fill() and set_point() are not affected.
+	void set_clip(int x, int y, int w, int h);
+
+	//! Reset clipping rectangle to the whole buffer
+	void reset_clip() { set_clip(0, 0, LED_MAX_LOGICAL_COL, LED_MAX_LOGICAL_ROW); }
+
+	//! Copy whole content from another buffer
+	void copy_from(const frame_buffer_t & src) { memcpy(buffer, src.buffer, sizeof(buffer)); }
+
 	//! Returns array
 	array_t & IRAM_ATTR array() { return buffer; }
 
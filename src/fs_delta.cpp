@@ -0,0 +1,366 @@
+#include <Arduino.h>
+#include <algorithm>
+#include "esp_spi_flash.h"
+#include "fs_delta.h"
+#include "mz_update.h"
+
+static const char FS_DELTA_MAGIC[8] = { 'M', 'Z', '5', 'F', 'S', 'D', '1', '\n' };
+static const char NEXT_FS_MOUNT_POINT[] = "/fsnext";
+static constexpr size_t ENTRY_HEAD_SIZE = 1 + 1 + 4 + 16;
+static constexpr size_t COPY_BUF_SIZE = 4096;
+static constexpr uint32_t MAX_ENTRIES = 2048; // far more than the filesystem holds
+
+static uint32_t get_u32(const uint8_t *p) { return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24); }
+
+bool fs_delta_updater_t::fail(const char *msg)
+{
+    printf("\nOTA: Error: %s\n", msg);
+    state = stError;
+    if (out) out.close();
+    return false;
+}
+
+/**
+ * Format and mount the inactive generation of the main filesystem
+ * */
+bool fs_delta_updater_t::begin(uint32_t size)
+{
+    _size = size;
+    _progress = 0;
+    _md5.begin();
+    entries.clear();
+    current = 0;
+    files_copied = files_written = bytes_copied = bytes_written = 0;
+
+    int active = get_current_active_partition_number();
+    next_label = get_main_flash_fs_partition_name((active == 1) ? 0 : 1);
+    if (!next_label)
+        return fail("Next generation filesystem partition not found.");
+
+    printf("OTA: Formatting %s ...\n", next_label);
+    if (!next_fs.format(next_label))
+        return fail("Could not format the next generation filesystem.");
+
+    flash_fs_config_t config;
+    config.label = next_label;
+    config.base_path = NEXT_FS_MOUNT_POINT;
+    if (!next_fs.begin(config))
+        return fail("Could not mount the next generation filesystem.");
+    mounted = true;
+
+    state = stHeader;
+    expect(sizeof(FS_DELTA_MAGIC) + 4);
+    return true;
+}
+
+void fs_delta_updater_t::end()
+{
+    if (out) out.close();
+    if (mounted) next_fs.end(next_label);
+    mounted = false;
+    entries.clear();
+    entries.shrink_to_fit();
+}
+
+bool fs_delta_updater_t::write_sector(const uint8_t *buf)
+{
+    if (state == stError)
+        return false;
+    if (_progress >= _size)
+        return fail("Too much data for the filesystem section.");
+
+    _md5.add(const_cast<uint8_t *>(buf), (uint16_t)SPI_FLASH_SEC_SIZE);
+    _progress += SPI_FLASH_SEC_SIZE;
+
+    if (!feed(buf, SPI_FLASH_SEC_SIZE))
+        return false;
+    printf("!");
+
+    if (_progress >= _size)
+    {
+        _md5.calculate();
+        if (state != stDone)
+            return fail("Premature end of the filesystem section.");
+        printf("\nOTA: Filesystem: %u files (%u bytes) copied, %u files (%u bytes) received.\n",
+               (unsigned)files_copied, (unsigned)bytes_copied,
+               (unsigned)files_written, (unsigned)bytes_written);
+    }
+    return true;
+}
+
+bool fs_delta_updater_t::match_md5(const uint8_t *md5)
+{
+    if (state != stDone || _progress != _size)
+        return false;
+    uint8_t buf[16];
+    _md5.getBytes(buf);
+    return !memcmp(md5, buf, sizeof(buf));
+}
+
+// parse a completed fixed size part in head[]
+bool fs_delta_updater_t::parse_head()
+{
+    switch (state)
+    {
+    case stHeader:
+        if (memcmp(head, FS_DELTA_MAGIC, sizeof(FS_DELTA_MAGIC)))
+            return fail("Invalid filesystem section header.");
+        entry_count = get_u32(head + sizeof(FS_DELTA_MAGIC));
+        printf("OTA: Filesystem manifest: %u files\n", (unsigned)entry_count);
+        // every entry takes ENTRY_HEAD_SIZE + 1 bytes at least; a broken
+        // count must not exhaust the memory by reserve()
+        if (entry_count > MAX_ENTRIES || entry_count > _size / (ENTRY_HEAD_SIZE + 1))
+            return fail("Too many files in the filesystem manifest.");
+        if (entry_count == 0)
+        {
+            state = stDone;
+            return true;
+        }
+        entries.reserve(entry_count);
+        state = stEntryHead;
+        expect(ENTRY_HEAD_SIZE);
+        return true;
+
+    case stEntryHead:
+      {
+        entry_t e;
+        e.flags = head[0];
+        e.size = get_u32(head + 2);
+        memcpy(e.md5, head + 6, sizeof(e.md5));
+        size_t path_len = head[1];
+        if (path_len == 0)
+            return fail("Empty path in the filesystem manifest.");
+        entries.push_back(e);
+        state = stEntryPath;
+        expect(path_len);
+        return true;
+      }
+
+    case stEntryPath:
+      {
+        entry_t &e = entries.back();
+        if (memchr(head, 0, head_fill))
+            return fail("Invalid path in the filesystem manifest.");
+        e.path.reserve(head_fill);
+        for (size_t i = 0; i < head_fill; ++i)
+            e.path += (char)head[i];
+        if (e.path[0] != '/')
+            return fail("Relative path in the filesystem manifest.");
+        if (e.path.indexOf("/../") >= 0 || e.path.endsWith("/.."))
+            return fail("Parent directory in the filesystem manifest.");
+        if (entries.size() < entry_count)
+        {
+            state = stEntryHead;
+            expect(ENTRY_HEAD_SIZE);
+            return true;
+        }
+
+        // manifest completed
+        if (!copy_unchanged())
+            return false;
+        current = 0;
+        return open_next_content();
+      }
+
+    default:
+        return fail("Internal error.");
+    }
+}
+
+// feed section bytes to the parser
+bool fs_delta_updater_t::feed(const uint8_t *p, size_t n)
+{
+    while (n > 0)
+    {
+        switch (state)
+        {
+        case stHeader:
+        case stEntryHead:
+        case stEntryPath:
+          {
+            size_t len = std::min(head_need - head_fill, n);
+            memcpy(head + head_fill, p, len);
+            head_fill += len;
+            p += len;
+            n -= len;
+            if (head_fill == head_need && !parse_head())
+                return false;
+            break;
+          }
+
+        case stContent:
+          {
+            size_t len = std::min((size_t)content_remaining, n);
+            if (out.write(p, len) != len)
+                return fail("Could not write a file.");
+            file_md5.add(const_cast<uint8_t *>(p), (uint16_t)len);
+            p += len;
+            n -= len;
+            content_remaining -= len;
+            bytes_written += len;
+            if (content_remaining == 0)
+            {
+                ++current;
+                if (!open_next_content())
+                    return false;
+            }
+            break;
+          }
+
+        case stDone:
+            return true; // padding
+
+        default:
+            return false;
+        }
+    }
+    return true;
+}
+
+// verify the previous content, then open the next entry having its content
+// in the section
+bool fs_delta_updater_t::open_next_content()
+{
+    if (out)
+    {
+        out.close();
+        file_md5.calculate();
+        uint8_t md5[16];
+        file_md5.getBytes(md5);
+        if (memcmp(md5, entries[current - 1].md5, sizeof(md5)))
+            return fail("File MD5 mismatch in the filesystem section.");
+        ++files_written;
+    }
+
+    while (current < entries.size() && !(entries[current].flags & FS_DELTA_CONTENT))
+        ++current;
+    if (current == entries.size())
+    {
+        state = stDone;
+        return true;
+    }
+
+    const entry_t &e = entries[current];
+    if (!make_parent_dirs(e.path))
+        return fail("Could not make a directory.");
+    out = next_fs.open(e.path, FILE_WRITE);
+    if (!out)
+        return fail("Could not create a file.");
+    file_md5.begin();
+    content_remaining = e.size;
+    state = stContent;
+    if (content_remaining == 0)
+    {
+        ++current;
+        return open_next_content();
+    }
+    return true;
+}
+
+// make directories on the path; existing ones are fine.
+// (exists() of the wrapper is false for directories, so just try mkdir;
+// a missing directory makes the following open fail anyway)
+bool fs_delta_updater_t::make_parent_dirs(const String &path)
+{
+    int pos = 0;
+    while ((pos = path.indexOf('/', pos + 1)) > 0)
+        next_fs.mkdir(path.substring(0, pos));
+    return true;
+}
+
+// copy files without content in the section from the active generation
+bool fs_delta_updater_t::copy_unchanged()
+{
+    uint8_t *buf = (uint8_t *)malloc(COPY_BUF_SIZE);
+    if (!buf)
+        return fail("Memory exhausted.");
+
+    bool ok = true;
+    for (auto &&e : entries)
+    {
+        if (e.flags & FS_DELTA_CONTENT)
+            continue;
+
+        File in = FS.open(e.path, FILE_READ);
+        if (!in || in.isDirectory() || in.size() != e.size)
+        {
+            printf("\nOTA: %s differs from the manifest base.\n", e.path.c_str());
+            ok = fail("The archive does not match the running filesystem; use a full archive.");
+            break;
+        }
+        if (!make_parent_dirs(e.path))
+        {
+            ok = fail("Could not make a directory.");
+            break;
+        }
+        File o = next_fs.open(e.path, FILE_WRITE);
+        if (!o)
+        {
+            ok = fail("Could not create a file.");
+            break;
+        }
+
+        MD5Builder md5;
+        md5.begin();
+        size_t n;
+        while ((n = in.read(buf, COPY_BUF_SIZE)) > 0)
+        {
+            md5.add(buf, (uint16_t)n);
+            if (o.write(buf, n) != n)
+            {
+                ok = false;
+                break;
+            }
+        }
+        in.close();
+        o.close();
+        md5.calculate();
+        uint8_t digest[16];
+        md5.getBytes(digest);
+        if (!ok || memcmp(digest, e.md5, sizeof(digest)))
+        {
+            printf("\nOTA: %s differs from the manifest base.\n", e.path.c_str());
+            ok = fail("The archive does not match the running filesystem; use a full archive.");
+            break;
+        }
+        printf("=");
+        ++files_copied;
+        bytes_copied += e.size;
+    }
+
+    free(buf);
+    return ok;
+}
+
+
+// list files under the directory recursively
+static void write_manifest_dir(File &dir, Print &out, uint8_t *buf)
+{
+    File f;
+    while ((f = dir.openNextFile()))
+    {
+        if (f.isDirectory())
+        {
+            write_manifest_dir(f, out, buf);
+            continue;
+        }
+        MD5Builder md5;
+        md5.begin();
+        size_t n;
+        while ((n = f.read(buf, COPY_BUF_SIZE)) > 0)
+            md5.add(buf, (uint16_t)n);
+        md5.calculate();
+        out.printf("%s %u %s\n", md5.toString().c_str(), (unsigned)f.size(), f.path());
+    }
+}
+
+void fs_delta_write_manifest(Print &out)
+{
+    uint8_t *buf = (uint8_t *)malloc(COPY_BUF_SIZE);
+    if (!buf)
+        return;
+    File root = FS.open("/");
+    if (root)
+        write_manifest_dir(root, out, buf);
+    free(buf);
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <Arduino.h>
+#include <vector>
+#include <MD5Builder.h>
+#include "flash_fs.h"
+
+// File level update of the main filesystem.
+//
+// Instead of a whole LittleFS image ("fs"), an archive may carry an
+// "fsfiles" section: a manifest of every file of the new filesystem with
+// its size and MD5, followed by the contents of the changed files only.
+// The inactive generation (fs0/fs1, paired with app0/app1) is formatted;
+// unchanged files are copied from the active generation after their MD5
+// is verified, and changed files are written from the archive. The new
+// generation becomes active together with the new app at the next boot.
+//
+// Section layout (little endian):
+//   "MZ5FSD1\n", uint32 entry count
+//   entries: uint8 flags, uint8 path length, uint32 size, uint8 md5[16], path
+//   contents of the entries with FS_DELTA_CONTENT flag, in entry order
+// make_archive.py builds the section against a manifest taken from
+// /update/fs_manifest of the running device.
+
+static constexpr uint8_t FS_DELTA_CONTENT = 1; //!< entry flag: the content follows in the section
+
+class fs_delta_updater_t
+{
+    struct entry_t
+    {
+        String path;
+        uint8_t flags;
+        uint32_t size;
+        uint8_t md5[16];
+    };
+
+    enum state_t
+    {
+        stHeader,     // receiving magic and entry count
+        stEntryHead,  // receiving fixed part of an entry
+        stEntryPath,  // receiving path of an entry
+        stContent,    // receiving content of an entry
+        stDone,       // all contents received; the rest is padding
+        stError,
+    };
+
+    fs::ANY_LittleFSFS next_fs;
+    const char *next_label = nullptr;
+    bool mounted = false;
+
+    uint32_t _size = 0;      //!< section size, including the padding
+    uint32_t _progress = 0;
+    MD5Builder _md5;         //!< of whole section
+
+    state_t state = stError;
+    uint8_t head[256];       //!< accumulates fixed size parts
+    size_t head_fill = 0;
+    size_t head_need = 0;
+    uint32_t entry_count = 0;
+    std::vector<entry_t> entries;
+    size_t current = 0;      //!< index of the entry being received
+    uint32_t content_remaining = 0;
+    File out;
+    MD5Builder file_md5;
+
+    uint32_t files_copied = 0, files_written = 0;
+    uint32_t bytes_copied = 0, bytes_written = 0;
+
+public:
+    fs_delta_updater_t() : next_fs() {}
+
+    bool begin(uint32_t size);
+    bool write_sector(const uint8_t *buf);
+    bool match_md5(const uint8_t *md5);
+    void end();
+
+private:
+    bool feed(const uint8_t *p, size_t n);
+    void expect(size_t n) { head_fill = 0; head_need = n; }
+    bool parse_head();
+    bool copy_unchanged();
+    bool open_next_content();
+    bool make_parent_dirs(const String & path);
+    bool fail(const char *msg);
+};
+
+//! Write "<md5 hex> <size> <path>" lines for every file on the active
+//! main filesystem
+void fs_delta_write_manifest(Print & out);
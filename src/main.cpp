@@ -3,6 +3,7 @@
 #include "flash_fs.h"
 #include "settings.h"
 #include "mz_update.h"
+#include "ota_pull.h"
 #include "mz_wifi.h"
 #include "buttons.h"
 #include "mz_console.h"
@@ -18,6 +19,7 @@
 #include "pendulum.h"
 #include "fonts/font_ft.h"
 #include "panic.h"
+#include "session_log.h"
 
 #define MY_CONFIG_ARDUINO_LOOP_STACK_SIZE 16384U
 extern TaskHandle_t loopTaskHandle; // defined in main.cpp of Arduino core
@@ -140,11 +142,14 @@ void loop() {
   matrix_drive_loop();
   button_update();
   poll_main_thread_queue();
+  poll_session();
+  poll_settings();
   status_led_loop();
   poll_ambient();
   poll_bme280();
-  web_server_handle_client();
+  poll_web_server();
   poll_pendulum();
+  poll_ota_pull();
   ui_process();
   panic_notify_loop_is_running();
 }
\ No newline at end of file
@@ -13,6 +13,7 @@
 #include "soc/rtc.h"
 #include "driver/rtc_io.h"
 #include "driver/uart.h"
+#include "esp_timer.h"
 
 #include "matrix_drive.h"
 #include "frame_buffer.h"
@@ -642,6 +643,7 @@ static inline int IRAM_ATTR iram__digitalRead(uint8_t pin)
 
 
 uint8_t matrix_button_scan_bits; //!< holds currently pushed button bit-map ('1':pushed)
+uint32_t matrix_button_edge_us[MAX_BUTTONS]; //!< time of the last raw press/release edge of each button, in us
 static void IRAM_ATTR scan_button()
 {
 	int btn_num = r-2; // 'r' represents currently buffering row + 1, so subtract 2 from it
@@ -649,10 +651,13 @@ static void IRAM_ATTR scan_button()
 	{
 		typeof(matrix_button_scan_bits) mask = 1 << btn_num;
 		typeof(matrix_button_scan_bits) tmp = matrix_button_scan_bits;
+		typeof(matrix_button_scan_bits) prev = tmp;
 		tmp &= ~mask;
 		if(!iram__digitalRead(IO_BUTTONSENSE))
 			tmp |= mask;
 		matrix_button_scan_bits = tmp;
+		if((prev ^ tmp) & mask)
+			matrix_button_edge_us[btn_num] = (uint32_t)esp_timer_get_time(); // stamp the edge for the input event
 	}
 }
 
@@ -3,6 +3,7 @@
 
 
 extern uint8_t matrix_button_scan_bits; //!< holds currently pushed button bit-map ('1':pushed)
+extern uint32_t matrix_button_edge_us[]; //!< time of the last raw press/release edge of each button, in us
 void matrix_drive_early_setup(); // first initialization to blank all LEDs
 void matrix_drive_setup();
 void matrix_drive_loop();
@@ -71,21 +71,70 @@ static int tread(mtar_t *tar, void *data, unsigned size) {
 }
 
 
+/* Write out buffered bytes */
+static int flush_block(mtar_t *tar) {
+  int err;
+  if (tar->wfill == 0) {
+    return MTAR_ESUCCESS;
+  }
+  err = tar->write(tar, tar->wbuf, tar->wfill);
+  tar->wfill = 0;
+  return err;
+}
+
+
+/* Buffered write; the underlying write is called with whole blocks only,
+ * except for the last flush */
 static int twrite(mtar_t *tar, const void *data, unsigned size) {
-  int err = tar->write(tar, data, size);
+  const char *p = (const char *) data;
+  unsigned len;
+  int err;
   tar->pos += size;
-  return err;
+  /* Complete the partially filled block first */
+  if (tar->wfill) {
+    len = sizeof(tar->wbuf) - tar->wfill;
+    if (len > size) {
+      len = size;
+    }
+    memcpy(tar->wbuf + tar->wfill, p, len);
+    tar->wfill += len;
+    p += len;
+    size -= len;
+    if (tar->wfill < sizeof(tar->wbuf)) {
+      return MTAR_ESUCCESS;
+    }
+    err = flush_block(tar);
+    if (err) {
+      return err;
+    }
+  }
+  /* Pass whole blocks through without copying */
+  len = size - size % sizeof(tar->wbuf);
+  if (len) {
+    err = tar->write(tar, p, len);
+    if (err) {
+      return err;
+    }
+    p += len;
+    size -= len;
+  }
+  /* Keep the rest */
+  memcpy(tar->wbuf, p, size);
+  tar->wfill = size;
+  return MTAR_ESUCCESS;
 }
 
 
 static int write_null_bytes(mtar_t *tar, int n) {
-  int i, err;
-  char nul = '\0';
-  for (i = 0; i < n; i++) {
-    err = twrite(tar, &nul, 1);
+  static const char nul[512] = { 0 };
+  int err;
+  while (n > 0) {
+    int len = n < (int)sizeof(nul) ? n : (int)sizeof(nul);
+    err = twrite(tar, nul, len);
     if (err) {
       return err;
     }
+    n -= len;
   }
   return MTAR_ESUCCESS;
 }
@@ -216,12 +265,18 @@ int mtar_open(mtar_t *tar, const char *filename, const char *mode) {
 
 
 int mtar_close(mtar_t *tar) {
-  return tar->close(tar);
+  int err = flush_block(tar);
+  int err2 = tar->close(tar);
+  return err ? err : err2;
 }
 
 
 int mtar_seek(mtar_t *tar, unsigned pos) {
-  int err = tar->seek(tar, pos);
+  int err = flush_block(tar);
+  if (err) {
+    return err;
+  }
+  err = tar->seek(tar, pos);
   tar->pos = pos;
   return err;
 }
@@ -379,5 +434,148 @@ int mtar_write_data(mtar_t *tar, const void *data, unsigned size) {
 
 int mtar_finalize(mtar_t *tar) {
   /* Write two NULL records */
-  return write_null_bytes(tar, sizeof(mtar_raw_header_t) * 2);
+  int err = write_null_bytes(tar, sizeof(mtar_raw_header_t) * 2);
+  if (err) {
+    return err;
+  }
+  return flush_block(tar);
+}
+
+
+static int null_close(mtar_t *tar) {
+  return MTAR_ESUCCESS;
+}
+
+static int null_seek(mtar_t *tar, unsigned pos) {
+  return MTAR_ESEEKFAIL;
+}
+
+static int null_read(mtar_t *tar, void *data, unsigned size) {
+  return MTAR_EREADFAIL;
+}
+
+
+/* Open a write-only archive which emits its bytes to `write`, e.g. into a
+ * network stream, instead of a file */
+int mtar_open_writer(mtar_t *tar, int (*write)(mtar_t *tar, const void *data, unsigned size), void *udata) {
+  tar->write = write;
+  tar->read = null_read;
+  tar->seek = null_seek;
+  tar->close = null_close;
+  tar->udata = udata;
+  tar->pos = 0;
+  tar->remaining_data = 0;
+  tar->last_header = 0;
+  tar->wfill = 0;
+  return MTAR_ESUCCESS;
+}
+
+
+enum {
+  MTAR_PS_HEADER,
+  MTAR_PS_DATA,
+  MTAR_PS_PADDING,
+  MTAR_PS_DONE
+};
+
+
+void mtar_parser_init(mtar_parser_t *p) {
+  p->state = MTAR_PS_HEADER;
+  p->fill = 0;
+  p->remaining_data = 0;
+  p->remaining_padding = 0;
+}
+
+
+/* Returns whether the terminating null record has been seen */
+int mtar_parser_done(const mtar_parser_t *p) {
+  return p->state == MTAR_PS_DONE;
+}
+
+
+static int parser_end_record(mtar_parser_t *p) {
+  int err = p->on_end ? p->on_end(p) : MTAR_ESUCCESS;
+  p->state = p->remaining_padding ? MTAR_PS_PADDING : MTAR_PS_HEADER;
+  return err;
+}
+
+
+int mtar_parser_feed(mtar_parser_t *p, const void *data, unsigned size) {
+  const char *ptr = (const char *) data;
+  int err;
+
+  while (size > 0) {
+    switch (p->state) {
+      case MTAR_PS_HEADER: {
+        unsigned len = sizeof(p->block) - p->fill;
+        if (len > size) {
+          len = size;
+        }
+        memcpy(p->block + p->fill, ptr, len);
+        p->fill += len;
+        ptr += len;
+        size -= len;
+        if (p->fill < sizeof(p->block)) {
+          break;
+        }
+        p->fill = 0;
+
+        err = raw_to_header(&p->header, (const mtar_raw_header_t *) p->block);
+        if (err == MTAR_ENULLRECORD) {
+          p->state = MTAR_PS_DONE;
+          return MTAR_ESUCCESS; /* trailing bytes are ignored */
+        }
+        if (err) {
+          return err;
+        }
+        err = p->on_header ? p->on_header(p, &p->header) : MTAR_ESUCCESS;
+        if (err) {
+          return err;
+        }
+        p->remaining_data = p->header.size;
+        p->remaining_padding = round_up(p->header.size, 512) - p->header.size;
+        p->state = MTAR_PS_DATA;
+        if (p->remaining_data == 0) {
+          err = parser_end_record(p);
+          if (err) {
+            return err;
+          }
+        }
+        break;
+      }
+
+      case MTAR_PS_DATA: {
+        unsigned len = p->remaining_data < size ? p->remaining_data : size;
+        err = p->on_data ? p->on_data(p, ptr, len) : MTAR_ESUCCESS;
+        if (err) {
+          return err;
+        }
+        ptr += len;
+        size -= len;
+        p->remaining_data -= len;
+        if (p->remaining_data == 0) {
+          err = parser_end_record(p);
+          if (err) {
+            return err;
+          }
+        }
+        break;
+      }
+
+      case MTAR_PS_PADDING: {
+        unsigned len = p->remaining_padding < size ? p->remaining_padding : size;
+        ptr += len;
+        size -= len;
+        p->remaining_padding -= len;
+        if (p->remaining_padding == 0) {
+          p->state = MTAR_PS_HEADER;
+        }
+        break;
+      }
+
+      default:
+        return MTAR_ESUCCESS; /* after the end of the archive */
+    }
+  }
+  return MTAR_ESUCCESS;
 }
@@ -55,9 +55,32 @@ struct mtar_t {
   int (*seek)(mtar_t *tar, unsigned pos);
   int (*close)(mtar_t *tar);
   File stream;
+  void *udata;
   unsigned pos;
   unsigned remaining_data;
   unsigned last_header;
+  unsigned wfill;
+  char wbuf[512]; /* write buffer; the archive is written in whole blocks */
+};
+
+
+/* Push parser; feed the archive in arbitrary sized pieces as it arrives.
+ * on_header is called for each record, on_data with the pieces of its
+ * content, and on_end after the last piece (also for empty records).
+ * A non-zero return from a callback aborts the parse with that value. */
+typedef struct mtar_parser_t mtar_parser_t;
+
+struct mtar_parser_t {
+  int (*on_header)(mtar_parser_t *p, const mtar_header_t *h);
+  int (*on_data)(mtar_parser_t *p, const void *data, unsigned size);
+  int (*on_end)(mtar_parser_t *p);
+  void *udata;
+  int state;
+  unsigned fill;
+  unsigned remaining_data;
+  unsigned remaining_padding;
+  mtar_header_t header;
+  char block[512];
 };
 
 
@@ -79,5 +102,11 @@ int mtar_write_dir_header(mtar_t *tar, const char *name);
 int mtar_write_data(mtar_t *tar, const void *data, unsigned size);
 int mtar_finalize(mtar_t *tar);
 
+int mtar_open_writer(mtar_t *tar, int (*write)(mtar_t *tar, const void *data, unsigned size), void *udata);
+
+void mtar_parser_init(mtar_parser_t *p);
+int mtar_parser_feed(mtar_parser_t *p, const void *data, unsigned size);
+int mtar_parser_done(const mtar_parser_t *p);
+
 
 #endif
@@ -22,12 +22,18 @@ static void poll()
 }
 
 bme280_result_t bme280_result;
+static bool hold;
+
+void bme280_hold(bool b)
+{
+    hold = b;
+}
 
 void poll_bme280()
 {
     EVERY_MS(500)
     {
-        poll();
+        if(!hold) poll();
     }
     END_EVERY_MS
 }
\ No newline at end of file
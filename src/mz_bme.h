@@ -2,6 +2,7 @@
 
 void init_bme280();
 void poll_bme280();
+void bme280_hold(bool b); // stop updating bme280_result while true
 
 struct bme280_result_t
 {
@@ -4,13 +4,31 @@
 #include <rom/miniz.h>
 #include <functional>
 #include "flash_fs.h"
+#include "fs_delta.h"
+#include "sector_delta.h"
+#include "nvs.h"
+#include "mbedtls/sha256.h"
 
-// streamed ZLIB decompressor
-class mz_inflator_t
+// streamed decompressor interface
+class stream_decoder_t
 {
 public:
     typedef std::function<int(const uint8_t *buf, size_t size)> write_fn_t;
 
+    virtual ~stream_decoder_t() {}
+
+    // feed compressed data. write_fn is called when uncompressed data is ready.
+    // returns TINFL_STATUS_NEEDS_MORE_INPUT, TINFL_STATUS_DONE or a negative error.
+    virtual int eat(const uint8_t *buf, size_t size) = 0;
+
+    // called from write_fn; returns true if a new decoder can start from
+    // in_offset of the input, to produce the output after the data being written.
+    virtual bool get_restart_point(uint32_t &in_offset) const { return false; }
+};
+
+// streamed ZLIB decompressor
+class mz_inflator_t : public stream_decoder_t
+{
 private:
     size_t infile_remaining;
     const void *next_in;
@@ -30,8 +48,7 @@ public:
         infile_remaining = input_size;
     }
 
-    // feed compressed data. write_fn is called when uncompressed data is ready.
-    int eat(const uint8_t *buf, size_t size)
+    int eat(const uint8_t *buf, size_t size) override
     {
         next_in = buf;
         for (;;)
@@ -104,11 +121,261 @@ public:
     }
 };
 
+static uint32_t get_u32(const uint8_t *p) { return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24); }
+
+// streamed LZ4 block decompressor.
+// The stream is a sequence of blocks, each of which decodes to BLOCK_SIZE
+// bytes (the last one may be shorter): a uint32 header holding the size of
+// the block data, with bit 31 set if the data is stored uncompressed,
+// followed by the data in LZ4 block format. Blocks are independent, so the
+// window is the block itself and the decoded block is passed to write_fn
+// as a whole, which keeps the output sector aligned.
+class lz4_decoder_t : public stream_decoder_t
+{
+public:
+    static constexpr size_t BLOCK_SIZE = 32768; //!< multiple of SPI_FLASH_SEC_SIZE
+
+private:
+    enum state_t
+    {
+        sBlockHeader,   // receiving the block header
+        sStored,        // receiving uncompressed block data
+        sToken,         // waiting for a sequence token
+        sLiteralLength, // receiving extra literal length bytes
+        sLiterals,      // receiving literals
+        sOffset,        // receiving the match offset
+        sMatchLength,   // receiving extra match length bytes
+        sDone,
+        sError,
+    };
+
+    write_fn_t write_fn;
+    uint32_t out_remaining; // uncompressed bytes not yet passed to write_fn
+    state_t state = sBlockHeader;
+    uint8_t header[4];
+    size_t header_fill = 0;
+    uint32_t in_remaining = 0; // data bytes remaining in the current block
+    size_t out_size = 0; // uncompressed size of the current block
+    size_t out_pos = 0;
+    uint8_t token = 0;
+    size_t length = 0; // literal or match length
+    size_t offset = 0;
+    int offset_fill = 0;
+    int write_status = 0;
+    uint32_t total_in = 0; // input bytes consumed
+    bool at_block_end = false; // write_fn is being called with a whole block
+    uint8_t out[BLOCK_SIZE];
+
+public:
+    lz4_decoder_t(write_fn_t fn, uint32_t output_size)
+    {
+        write_fn = fn;
+        out_remaining = output_size;
+    }
+
+    int eat(const uint8_t *buf, size_t size) override
+    {
+        while (size > 0 && state != sDone && state != sError)
+        {
+            if (state == sBlockHeader)
+            {
+                header[header_fill++] = *buf++;
+                --size;
+                ++total_in;
+                if (header_fill == sizeof(header))
+                    begin_block();
+                continue;
+            }
+
+            if (state == sStored || state == sLiterals)
+            {
+                // bulk copy
+                size_t n = std::min(std::min(size, (size_t)in_remaining),
+                                    state == sStored ? out_size - out_pos : length);
+                memcpy(out + out_pos, buf, n);
+                buf += n;
+                size -= n;
+                total_in += n;
+                in_remaining -= n;
+                out_pos += n;
+                if (state == sStored)
+                {
+                    if (in_remaining == 0)
+                        end_block();
+                }
+                else
+                {
+                    length -= n;
+                    if (length == 0)
+                        end_literals();
+                    else if (in_remaining == 0)
+                        state = sError; // block ends within literals
+                }
+                continue;
+            }
+
+            // sequence bytes
+            uint8_t b = *buf++;
+            --size;
+            ++total_in;
+            --in_remaining;
+            switch (state)
+            {
+            case sToken:
+                token = b;
+                length = token >> 4;
+                if (length == 15)
+                    state = sLiteralLength;
+                else
+                    start_literals();
+                break;
+
+            case sLiteralLength:
+                length += b;
+                if (b != 255)
+                    start_literals();
+                break;
+
+            case sOffset:
+                offset |= (size_t)b << (8 * offset_fill);
+                if (++offset_fill == 2)
+                {
+                    length = token & 15;
+                    if (length == 15)
+                        state = sMatchLength;
+                    else
+                        copy_match();
+                }
+                break;
+
+            case sMatchLength:
+                length += b;
+                if (b != 255)
+                    copy_match();
+                break;
+
+            default:
+                state = sError;
+                break;
+            }
+            if (in_remaining == 0 && state != sBlockHeader && state != sDone)
+                state = sError; // the block ends within a sequence
+        }
+
+        if (write_status < 0)
+            return write_status;
+        if (state == sError)
+        {
+            printf("LZ4 block decoding failed.\n");
+            return TINFL_STATUS_FAILED;
+        }
+        return state == sDone ? TINFL_STATUS_DONE : TINFL_STATUS_NEEDS_MORE_INPUT;
+    }
+
+    bool get_restart_point(uint32_t &in_offset) const override
+    {
+        // blocks are independent; the next block header is a restart point
+        if (!at_block_end)
+            return false;
+        in_offset = total_in;
+        return true;
+    }
+
+private:
+    void begin_block()
+    {
+        header_fill = 0;
+        uint32_t h = get_u32(header);
+        in_remaining = h & 0x7fffffff;
+        out_size = std::min((uint32_t)BLOCK_SIZE, out_remaining);
+        out_pos = 0;
+        if (in_remaining == 0 || out_size == 0)
+            state = sError;
+        else if (h & 0x80000000)
+            state = (in_remaining == out_size) ? sStored : sError;
+        else
+            state = sToken;
+    }
+
+    void start_literals()
+    {
+        if (out_pos + length > out_size)
+            state = sError;
+        else if (length == 0)
+            end_literals();
+        else
+            state = sLiterals;
+    }
+
+    void end_literals()
+    {
+        if (in_remaining == 0)
+        {
+            end_block(); // the last sequence has literals only
+            return;
+        }
+        offset = 0;
+        offset_fill = 0;
+        state = sOffset;
+    }
+
+    void copy_match()
+    {
+        length += 4; // minimum match length
+        if (offset == 0 || offset > out_pos || out_pos + length > out_size)
+        {
+            state = sError;
+            return;
+        }
+        // byte by byte; the source may overlap the destination
+        const uint8_t *src = out + out_pos - offset;
+        for (size_t i = 0; i < length; ++i)
+            out[out_pos + i] = src[i];
+        out_pos += length;
+        state = sToken;
+    }
+
+    void end_block()
+    {
+        if (out_pos != out_size)
+        {
+            state = sError;
+            return;
+        }
+        at_block_end = true;
+        write_status = write_fn(out, out_size);
+        at_block_end = false;
+        if (write_status < 0)
+        {
+            state = sError;
+            return;
+        }
+        out_remaining -= out_size;
+        state = out_remaining ? sBlockHeader : sDone;
+    }
+};
+
+void sector_sha256(const void *sector, uint8_t *digest)
+{
+    mbedtls_sha256_ret((const unsigned char *)sector, SPI_FLASH_SEC_SIZE, digest, 0); // the hardware engine if free
+}
+
+void image_hash_add(uint8_t *hash, const uint8_t *sector_digest)
+{
+    uint8_t buf[IMAGE_HASH_SIZE * 2];
+    memcpy(buf, hash, IMAGE_HASH_SIZE);
+    memcpy(buf + IMAGE_HASH_SIZE, sector_digest, IMAGE_HASH_SIZE);
+    mbedtls_sha256_ret(buf, sizeof(buf), hash, 0);
+}
+
 bool partition_updater_t::begin(update_type_t type, uint32_t size)
 {
     _type = type;
     _size = size;
     _progress = 0;
+    _first_word = 0xffffffff;
+    _written = _skipped = 0;
+    _latency.clear();
     if (_size & (SPI_FLASH_SEC_SIZE - 1))
         return false; // the size is not a multiple of SPI_FLASH_SEC_SIZE
     _partition = next_partition_from_type(_type);
@@ -116,12 +383,59 @@ bool partition_updater_t::begin(update_type_t type, uint32_t size)
         return false; // partition not found
     if (_partition->size < _size)
         return false; // too large
-    _md5.begin();
+    if (!_rbuf)
+        _rbuf = (uint32_t *)malloc(SPI_FLASH_SEC_SIZE); // malloc() returns 4-byte aligned memory
+    if (!_rbuf)
+    {
+        printf("OTA: Error: Memory exhausted.\n");
+        return false;
+    }
+    memset(_hash, 0, sizeof(_hash));
     return true;
 }
 
-bool partition_updater_t::write_sector(const uint8_t *buf)
+bool partition_updater_t::resume(update_type_t type, uint32_t size, uint32_t progress, uint32_t first_word)
 {
+    if (!begin(type, size))
+        return false;
+    if (progress >= size || (progress & (SPI_FLASH_SEC_SIZE - 1)))
+        return false;
+
+    // take the hash of the sectors already written
+    for (uint32_t pos = 0; pos < progress; pos += SPI_FLASH_SEC_SIZE)
+    {
+        if (!ESP.flashRead(_partition->address + pos, _rbuf, SPI_FLASH_SEC_SIZE))
+        {
+            printf("OTA: Error: Failed to read a sector at %08lx.\n", (long)(_partition->address + pos));
+            _type = utUnknown;
+            return false;
+        }
+        if (pos == 0)
+            _rbuf[0] = first_word; // still erased on the flash
+        uint8_t digest[IMAGE_HASH_SIZE];
+        sector_sha256(_rbuf, digest);
+        image_hash_add(_hash, digest);
+    }
+    _progress = progress;
+    _first_word = first_word;
+    return true;
+}
+
+void partition_updater_t::end()
+{
+    if (_rbuf)
+        free(_rbuf), _rbuf = nullptr;
+    _type = utUnknown;
+}
+
+bool partition_updater_t::write_sector(const uint8_t *buf, const uint8_t *digest)
+{
+    uint32_t start = micros();
+    uint32_t address;
+    size_t offset;
+    bool skip;
+    uint8_t own_digest[IMAGE_HASH_SIZE];
+
     if (_type == utUnknown)
     {
         printf("not begin\n");
@@ -132,123 +446,96 @@ bool partition_updater_t::write_sector(const uint8_t *buf)
         printf("already done %d %d\n", _progress, _size);
         return false;
     } // already done
-    uint8_t *bbuf = (uint8_t *)malloc(SPI_FLASH_SEC_SIZE);
-    uint8_t *rbuf = nullptr;
-    if (!bbuf)
+    if ((uintptr_t)buf & 3)
     {
-        printf("OTA: Error: Memory exhausted.\n");
-        return false; // memory exhausted
+        printf("OTA: Error: Unaligned sector buffer.\n");
+        goto fail;
     }
 
-    memcpy(bbuf, buf, SPI_FLASH_SEC_SIZE);
-
-    bool skip = true;
-
+    address = _partition->address + _progress;
+    offset = 0;
     if (_progress == 0)
     {
         // the first sector
-        // save first byte (this byte will be overwritten at the completion)
-        _first_byte = bbuf[0];
-        bbuf[0] = 0xff; // we use 0xff here because flash device can clear bit easily
-        // but set bit with difficulty (only erase operation can set the bits)
+        // leave the first word erased (0xff) until the completion, so that
+        // an interrupted update never leaves a valid looking image
+        memcpy(&_first_word, buf, sizeof(_first_word));
+        offset = sizeof(_first_word);
         skip = false;
     }
-
-    if(skip)
+    else
     {
         // check the content is already the same as the data to be written, to save time
-        rbuf = (uint8_t*)malloc(SPI_FLASH_SEC_SIZE);
-        if(!rbuf)
-        {
-            printf("OTA: Error: Memory exhausted.\n");
-            goto fail;
-            return false; // memory exhausted
-        }
-        if(!ESP.flashRead(_partition->address + _progress, (uint32_t*)rbuf, SPI_FLASH_SEC_SIZE))
+        if (!ESP.flashRead(address, _rbuf, SPI_FLASH_SEC_SIZE))
         {
-            printf("OTA: Error: Failed to read a sector at %08lx.\n", (long)(_partition->address + _progress));
+            printf("OTA: Error: Failed to read a sector at %08lx.\n", (long)address);
             goto fail;
         }
-        skip = !memcmp(rbuf, bbuf, SPI_FLASH_SEC_SIZE); // skip erase and write if the content is the same
+        skip = !memcmp(_rbuf, buf, SPI_FLASH_SEC_SIZE); // skip erase and write if the content is the same
     }
 
-    if(!skip)
+    if (!skip)
     {
-        if (!ESP.flashEraseSector((_partition->address + _progress) / SPI_FLASH_SEC_SIZE))
+        // through esp_partition_*(), so that flash_stats counts the update
+        if (esp_partition_erase_range(_partition, _progress, SPI_FLASH_SEC_SIZE) != ESP_OK)
         {
-            printf("OTA: Error: Failed to erase a sector at %08lx.\n", (long)(_partition->address + _progress));
+            printf("OTA: Error: Failed to erase a sector at %08lx.\n", (long)address);
             goto fail;
         }
-        if (!ESP.flashWrite(_partition->address + _progress, (uint32_t *)bbuf, SPI_FLASH_SEC_SIZE))
+        if (esp_partition_write(_partition, _progress + offset, buf + offset, SPI_FLASH_SEC_SIZE - offset) != ESP_OK)
         {
-            printf("OTA: Error: Failed to write a sector at %08lx.\n", (long)(_partition->address + _progress));
+            printf("OTA: Error: Failed to write a sector at %08lx.\n", (long)address);
             goto fail;
         }
         printf("!"); // wrote
+        ++_written;
     }
     else
     {
         printf("="); // skipped
+        ++_skipped;
     }
+    _latency.add(micros() - start);
 
-    if (_progress == 0)
-    {
-        // the first sector
-        // write back the first byte to calculate md5
-        bbuf[0] = _first_byte;
-    }
-
-    _md5.add(bbuf, (uint16_t)SPI_FLASH_SEC_SIZE); //  !?!?!? why the first argument is not const
+    if (!digest)
+        sector_sha256(buf, own_digest), digest = own_digest;
+    image_hash_add(_hash, digest); // the data as is; nothing is patched
 
     _progress += SPI_FLASH_SEC_SIZE;
     if (_progress >= _size)
     {
         // finished
 
-        _md5.calculate();
-        // write back the first sector's first byte to the correct value
-        uint8_t buf[4];
-
-        if (!ESP.flashRead(_partition->address, (uint32_t *)buf, 4))
-        {
-            printf("OTA: Error: Failed to read a sector from %08lx.\n", (long)(_partition->address));
-            goto fail;
-        }
-        buf[0] = _first_byte;
-
-        if (!ESP.flashWrite(_partition->address, (uint32_t *)buf, 4))
+        // write the first word over the erased one
+        if (esp_partition_write(_partition, 0, &_first_word, sizeof(_first_word)) != ESP_OK)
         {
             printf("OTA: Error: Failed to write a sector at %08lx.\n", (long)(_partition->address));
             goto fail;
         }
+        printf("\nOTA: %u sectors written, %u skipped; sector latency p50<=%u p90<=%u p99<=%u max=%u us\n",
+               (unsigned)_written, (unsigned)_skipped, (unsigned)_latency.percentile(50),
+               (unsigned)_latency.percentile(90), (unsigned)_latency.percentile(99), (unsigned)_latency.max_us);
     }
 
-    if(bbuf) free(bbuf);
-    if(rbuf) free(rbuf);
     return true;
 
 fail:
-    if(bbuf) free(bbuf);
-    if(rbuf) free(rbuf);
     _type = utUnknown;
     return false;
 }
 
-bool partition_updater_t::match_md5(const uint8_t *md5)
+bool partition_updater_t::match_hash(const uint8_t *hash)
 {
     if (_type == utUnknown)
         return false; // not begun
     if (_progress != _size)
         return false; // incomplete
 
-    // _md5.calculate() was done in write_sector()
-    uint8_t buf[16];
-    _md5.getBytes(buf);
-    printf("OTA: Received MD5: ");
-    for (int i = 0; i < sizeof(buf); ++i)
-        printf("%02x", buf[i]);
+    printf("OTA: Received image hash: ");
+    for (size_t i = 0; i < sizeof(_hash); ++i)
+        printf("%02x", _hash[i]);
     printf("\n");
-    return !memcmp(md5, buf, sizeof(buf));
+    return !memcmp(hash, _hash, sizeof(_hash));
 }
 
 bool partition_updater_t::activate_new_code()
@@ -265,20 +552,31 @@ bool partition_updater_t::activate_new_code()
 const esp_partition_t *partition_updater_t::next_partition_from_type(update_type_t _type)
 {
     int active = get_current_active_partition_number();
+    return partition_from_type(_type, (active == 1) ? 0 : 1);
+}
+
+const esp_partition_t *partition_updater_t::current_partition_from_type(update_type_t _type)
+{
+    int active = get_current_active_partition_number();
+    return partition_from_type(_type, (active == 1) ? 1 : 0);
+}
+
+const esp_partition_t *partition_updater_t::partition_from_type(update_type_t _type, int number)
+{
     switch (_type)
     {
     case utCode:
         return esp_partition_find_first(ESP_PARTITION_TYPE_APP,
-                                        (active == 1) ? ESP_PARTITION_SUBTYPE_APP_OTA_0 : ESP_PARTITION_SUBTYPE_APP_OTA_1, nullptr);
+                                        (number == 0) ? ESP_PARTITION_SUBTYPE_APP_OTA_0 : ESP_PARTITION_SUBTYPE_APP_OTA_1, nullptr);
     case utFS:
       {
-        const char * part_name = get_main_flash_fs_partition_name((active == 1) ? 0 : 1);
+        const char * part_name = get_main_flash_fs_partition_name(number);
         const esp_partition_t * par =  esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, part_name); // old partition naming scheme
         return par;
       }
     case utFont:
         return esp_partition_find_first((esp_partition_type_t)0x40,
-                                        (esp_partition_subtype_t)((active == 1) ? 0 : 1), nullptr); // see custom.csv for partition table
+                                        (esp_partition_subtype_t)number, nullptr); // see custom.csv for partition table
     case utUnknown:
         return nullptr;
     }
@@ -297,34 +595,330 @@ int get_current_active_partition_number()
     return -1; // TODO: PANIC
 }
 
-void updater_t::begin()
+// print heap usage; the minimum is the high-water mark since boot
+// also shows the stack left on the caller's task (web server or OTA pull)
+static void print_heap(const char *when)
+{
+    printf("OTA: Heap %s: free %u, minimum free %u, largest block %u; stack of '%s' never below %u bytes free\n", when,
+           (unsigned)ESP.getFreeHeap(), (unsigned)ESP.getMinFreeHeap(), (unsigned)ESP.getMaxAllocHeap(),
+           pcTaskGetName(nullptr), (unsigned)uxTaskGetStackHighWaterMark(nullptr));
+}
+
+// throughput in KiB/s
+static unsigned kib_per_sec(uint32_t bytes, uint32_t us)
+{
+    if (us == 0)
+        return 0;
+    return (unsigned)((uint64_t)bytes * 1000000 / 1024 / us);
+}
+
+int get_next_partition_number()
 {
-    if (!buffer)
-        buffer = (uint8_t *)malloc(SPI_FLASH_SEC_SIZE);
-    if (!buffer)
-    { /* TODO: PANIC */
+    return (get_current_active_partition_number() == 1) ? 0 : 1;
+}
+
+static const char OTA_NVS_NAMESPACE[] = "mz5_ota";
+
+// NVS key of the image hash record
+static bool image_hash_key(partition_updater_t::update_type_t type, int number, char *key)
+{
+    const char *name;
+    switch (type)
+    {
+    case partition_updater_t::utCode: name = "app"; break;
+    case partition_updater_t::utFS:   name = "fs"; break;
+    case partition_updater_t::utFont: name = "font"; break;
+    default: return false;
     }
+    sprintf(key, "hash_%s%d", name, number);
+    return true;
+}
+
+bool get_image_hash(partition_updater_t::update_type_t type, int number, uint8_t *hash)
+{
+    char key[16];
+    if (!image_hash_key(type, number, key))
+        return false;
+    nvs_handle h;
+    if (nvs_open(OTA_NVS_NAMESPACE, NVS_READONLY, &h) != ESP_OK)
+        return false;
+    size_t size = IMAGE_HASH_SIZE;
+    bool ok = nvs_get_blob(h, key, hash, &size) == ESP_OK && size == IMAGE_HASH_SIZE;
+    nvs_close(h);
+    return ok;
+}
+
+void set_image_hash(partition_updater_t::update_type_t type, int number, const uint8_t *hash)
+{
+    char key[16];
+    if (!image_hash_key(type, number, key))
+        return;
+    nvs_handle h;
+    if (nvs_open(OTA_NVS_NAMESPACE, NVS_READWRITE, &h) != ESP_OK)
+        return;
+    esp_err_t err = hash ? nvs_set_blob(h, key, hash, IMAGE_HASH_SIZE) : nvs_erase_key(h, key);
+    if (err == ESP_OK)
+        nvs_commit(h);
+    nvs_close(h);
+}
+
+void updater_t::begin()
+{
+    stop_flash_task(); // a previous upload may have been aborted
+    end_fs_delta();
+    end_sector_delta();
 
     remaining_count = 0;
     buffer_pos = 0;
     phase = phBegin;
     status = stNoError;
+    start_ms = millis();
+    flash_bytes = flash_busy_us = sector_wait_us = 0;
+    processed_offset = checkpoint_offset = 0;
+    sector_index = sector_hashes_received = 0;
+    sector_corrupted = false;
+    end_sector_hashes();
+    memset(&checkpoint, 0, sizeof(checkpoint)); // not resumable unless the caller sets the id
+    print_heap("at begin");
+
+    for (auto &&b : sector_buffers)
+        b = (uint8_t *)malloc(SECTOR_BUFFER_SIZE);
+    free_sectors = xQueueCreate(NUM_SECTOR_BUFFERS, sizeof(uint8_t *));
+    full_sectors = xQueueCreate(NUM_SECTOR_BUFFERS + 1, sizeof(uint8_t *)); // +1 for the quit request
+    flash_done = xSemaphoreCreateBinary();
+    restart_points = xQueueCreate(8, sizeof(restart_point_t));
+    bool ok = free_sectors && full_sectors && flash_done && restart_points;
+    for (auto &&b : sector_buffers)
+        ok = ok && b;
+    if (!ok)
+    {
+        printf("OTA: Error: Memory exhausted.\n");
+        stop_flash_task();
+        status = stCorrupted;
+        return;
+    }
+    for (auto &&b : sector_buffers)
+        xQueueSend(free_sectors, &b, 0);
+
+    if (xTaskCreate(flash_task_entry, "OTA flash", 8192, this, 1, &flash_task) != pdPASS)
+    {
+        printf("OTA: Error: Could not start the flash task.\n");
+        flash_task = nullptr;
+        stop_flash_task();
+        status = stCorrupted;
+    }
 }
 
 void updater_t::end()
 {
-    if (buffer)
-        free(buffer), buffer = nullptr;
+    stop_flash_task();
+    partition_updater.end();
+    end_fs_delta();
+    end_sector_delta();
+    end_sector_hashes();
+}
+
+void updater_t::flash_task_entry(void *arg)
+{
+    static_cast<updater_t *>(arg)->flash_task_loop();
+    vTaskDelete(nullptr);
+}
+
+void updater_t::flash_task_loop()
+{
+    for (;;)
+    {
+        uint8_t *block;
+        xQueueReceive(full_sectors, &block, portMAX_DELAY);
+        if (!block)
+            break; // quit request
+        if (status == stNoError)
+        {
+            // after an error the rest is just drained
+            uint32_t start = micros();
+            process_block(block);
+            flash_busy_us += micros() - start;
+            flash_bytes += SPI_FLASH_SEC_SIZE;
+            processed_offset += SPI_FLASH_SEC_SIZE;
+
+            // checkpoint when a restart point has been reached
+            restart_point_t rp;
+            while (xQueuePeek(restart_points, &rp, 0) == pdTRUE && rp.out_offset <= processed_offset)
+            {
+                xQueueReceive(restart_points, &rp, 0);
+                if (rp.out_offset == processed_offset && status == stNoError &&
+                    processed_offset - checkpoint_offset >= CHECKPOINT_INTERVAL)
+                    save_checkpoint(rp);
+            }
+        }
+        xQueueSend(free_sectors, &block, portMAX_DELAY);
+    }
+    xSemaphoreGive(flash_done);
+}
+
+void updater_t::stop_flash_task()
+{
+    if (flash_task)
+    {
+        uint8_t *quit = nullptr;
+        xQueueSend(full_sectors, &quit, portMAX_DELAY);
+        xSemaphoreTake(flash_done, portMAX_DELAY);
+        flash_task = nullptr;
+    }
+    buffer = nullptr; // one of sector_buffers
+    for (auto &&b : sector_buffers)
+        if (b)
+            free(b), b = nullptr;
+    if (free_sectors)
+        vQueueDelete(free_sectors), free_sectors = nullptr;
+    if (full_sectors)
+        vQueueDelete(full_sectors), full_sectors = nullptr;
+    if (flash_done)
+        vSemaphoreDelete(flash_done), flash_done = nullptr;
+    if (restart_points)
+        vQueueDelete(restart_points), restart_points = nullptr;
+}
+
+void updater_t::end_fs_delta()
+{
+    if (!fs_delta)
+        return;
+    fs_delta->end(); // unmount the next generation filesystem
+    delete fs_delta;
+    fs_delta = nullptr;
 }
 
-void updater_t::process_block()
+void updater_t::end_sector_delta()
+{
+    if (!sector_delta)
+        return;
+    sector_delta->end();
+    delete sector_delta;
+    sector_delta = nullptr;
+}
+
+void updater_t::end_sector_hashes()
+{
+    if (sector_hashes)
+        free(sector_hashes), sector_hashes = nullptr;
+}
+
+bool updater_t::check_sector(const uint8_t *block)
+{
+    uint32_t index = sector_index++;
+    if (!sector_hashes)
+        return true; // no list, or resumed without it; the image hash still checks the whole
+    if (!memcmp(block + SPI_FLASH_SEC_SIZE, sector_hashes + index * IMAGE_HASH_SIZE, IMAGE_HASH_SIZE))
+        return true;
+    printf("\nOTA: Error: Sector %u of '%s' is corrupted.\n", (unsigned)index, header.label);
+    sector_corrupted = true;
+    status = stCorrupted;
+    return false;
+}
+
+static const char OTA_CHECKPOINT_KEY[] = "checkpoint";
+static constexpr uint32_t OTA_CHECKPOINT_VERSION = 2;
+
+void updater_t::add_restart_point(uint32_t in_offset, uint32_t out_offset)
 {
-    // process the block according to the buffer content and the phase
+    if (!checkpoint.id[0] || !restart_points)
+        return; // not resumable
+    restart_point_t rp = { in_offset, out_offset };
+    xQueueSend(restart_points, &rp, 0); // just skip this one if full
+}
+
+void updater_t::save_checkpoint(const restart_point_t &rp)
+{
+    // only between sections and inside plain partition images
+    if (phase == phBegin || phase == phSectorHashes || fs_delta || sector_delta)
+        return;
+
+    checkpoint.version = OTA_CHECKPOINT_VERSION;
+    checkpoint.active_partition = (int8_t)get_current_active_partition_number();
+    checkpoint.in_offset = rp.in_offset;
+    checkpoint.out_offset = rp.out_offset;
+    checkpoint.phase = (uint8_t)phase;
+    checkpoint.header = header;
+    checkpoint.remaining_count = remaining_count;
+    checkpoint.type = (uint8_t)partition_updater.get_type();
+    checkpoint.progress = partition_updater.get_progress();
+    checkpoint.first_word = partition_updater.get_first_word();
+
+    nvs_handle h;
+    if (nvs_open(OTA_NVS_NAMESPACE, NVS_READWRITE, &h) != ESP_OK)
+        return;
+    if (nvs_set_blob(h, OTA_CHECKPOINT_KEY, &checkpoint, sizeof(checkpoint)) == ESP_OK &&
+        nvs_commit(h) == ESP_OK)
+        checkpoint_offset = rp.out_offset;
+    nvs_close(h);
+}
+
+bool updater_t::load_checkpoint(checkpoint_t &cp)
+{
+    nvs_handle h;
+    if (nvs_open(OTA_NVS_NAMESPACE, NVS_READONLY, &h) != ESP_OK)
+        return false;
+    size_t size = sizeof(cp);
+    bool ok = nvs_get_blob(h, OTA_CHECKPOINT_KEY, &cp, &size) == ESP_OK && size == sizeof(cp);
+    nvs_close(h);
+    return ok && cp.version == OTA_CHECKPOINT_VERSION &&
+           cp.active_partition == get_current_active_partition_number() &&
+           cp.id[0] && cp.id[sizeof(cp.id) - 1] == 0;
+}
+
+void updater_t::clear_checkpoint()
+{
+    nvs_handle h;
+    if (nvs_open(OTA_NVS_NAMESPACE, NVS_READWRITE, &h) != ESP_OK)
+        return;
+    if (nvs_erase_key(h, OTA_CHECKPOINT_KEY) == ESP_OK)
+        nvs_commit(h);
+    nvs_close(h);
+}
+
+bool updater_t::restore(const checkpoint_t &cp)
+{
+    if (status != stNoError)
+        return false;
+    checkpoint = cp;
+    phase = (phase_t)cp.phase;
+    header = cp.header;
+    remaining_count = cp.remaining_count;
+    processed_offset = checkpoint_offset = cp.out_offset;
+    if (phase == phContent)
+    {
+        sector_index = cp.progress / SPI_FLASH_SEC_SIZE; // the per sector list is not kept; it is not checked
+
+        printf("OTA: Resuming '%s' at %u of %u bytes ...\n", header.label,
+               (unsigned)cp.progress, (unsigned)header.arc_len);
+        if (cp.progress + remaining_count * SPI_FLASH_SEC_SIZE != header.arc_len ||
+            !partition_updater.resume((partition_updater_t::update_type_t)cp.type,
+                                      header.arc_len, cp.progress, cp.first_word))
+        {
+            printf("OTA: Error: Could not resume the partition.\n");
+            status = stCorrupted;
+            return false;
+        }
+    }
+    else if (phase != phHeader)
+    {
+        status = stCorrupted;
+        return false;
+    }
+    return true;
+}
+
+void updater_t::process_block(const uint8_t *block)
+{
+    if (phase == phContent && !check_sector(block))
+        return;
+
+    // process the block according to the block content and the phase
     if (phase == phBegin)
     {
         // received block must be a header
         printf("OTA: Receiving archive header ...\n");
-        if (memcmp("MZ5 firmware archive 1.0\r\n\n\x1a    ", buffer, 32))
+        if (memcmp("MZ5 firmware archive 1.0\r\n\n\x1a    ", block, 32))
         {
             // invalid header
             printf("OTA: Error: invalid archive header.\n");
@@ -338,26 +932,27 @@ void updater_t::process_block()
     {
         // received block must be a partition header
         printf("OTA: Receiving partition header ...\n");
-        if (memcmp(buffer, "-file boundary--", 16))
+        if (memcmp(block, "-file boundary--", 16))
         {
             // partition header mismatch
             printf("OTA: Error: invalid partition header.\n");
             status = stCorrupted;
             return;
         }
-        memcpy(&header, buffer + 16, sizeof(header)); // take a copy of it
+        memcpy(&header, block + 16, sizeof(header)); // take a copy of it
         header.label[sizeof(header.label) - 1] = 0;   // force terminate the label string
+        end_sector_hashes();
 
         // print information
         printf("OTA: Partition label: '%s', Original size: %d, Archived size: %d\n",
                header.label, (int)header.orig_len, (int)header.arc_len);
-        printf("OTA:            MD5 sum: ");
-        for (int i = 0; i < sizeof(header.md5); ++i)
-            printf("%02x", header.md5[i]);
+        printf("OTA:         Image hash: ");
+        for (size_t i = 0; i < sizeof(header.hash); ++i)
+            printf("%02x", header.hash[i]);
         printf("\n");
 
         // some sanity checks
-        if (header.orig_len > header.arc_len ||
+        if (header.orig_len > header.arc_len || header.arc_len == 0 ||
             header.arc_len % SPI_FLASH_SEC_SIZE != 0)
         {
             printf("OTA: Error: Invalid partition size.\n");
@@ -373,6 +968,41 @@ void updater_t::process_block()
             type = partition_updater_t::utFS;
         else if (!strcmp(header.label, "app"))
             type = partition_updater_t::utCode;
+        else if (!strcmp(header.label, "fsfiles"))
+        {
+            // file level update of the filesystem
+            set_image_hash(partition_updater_t::utFS, get_next_partition_number(), nullptr); // not an image
+            end_fs_delta();
+            fs_delta = new fs_delta_updater_t();
+            if (!fs_delta || !fs_delta->begin(header.arc_len))
+            {
+                printf("OTA: Error: Could not prepare the filesystem.\n");
+                end_fs_delta();
+                status = stCorrupted;
+                return;
+            }
+            remaining_count = header.arc_len / SPI_FLASH_SEC_SIZE;
+            printf("OTA: Sector count: %d\n", (int)remaining_count);
+            begin_section_content();
+            return;
+        }
+        else if (!strcmp(header.label, "sdelta"))
+        {
+            // sector level delta of a partition image
+            end_sector_delta();
+            sector_delta = new sector_delta_updater_t();
+            if (!sector_delta || !sector_delta->begin(header.arc_len))
+            {
+                printf("OTA: Error: Could not prepare the sector delta.\n");
+                end_sector_delta();
+                status = stCorrupted;
+                return;
+            }
+            remaining_count = header.arc_len / SPI_FLASH_SEC_SIZE;
+            printf("OTA: Sector count: %d\n", (int)remaining_count);
+            begin_section_content();
+            return;
+        }
         else
         {
             // unknown label
@@ -381,20 +1011,84 @@ void updater_t::process_block()
             return;
         }
 
+        static const uint8_t no_hash[IMAGE_HASH_SIZE] = {0};
+        if (!memcmp(header.hash, no_hash, sizeof(no_hash)))
+        {
+            printf("OTA: Error: The archive has no image hash; make it again with the current make_archive.py.\n");
+            status = stCorrupted;
+            return;
+        }
         if (!partition_updater.begin(type, header.arc_len))
         {
             printf("OTA: Error: Possibly too large image to fit.\n");
             status = stCorrupted;
             return;
         }
+        set_image_hash(type, get_next_partition_number(), nullptr); // until verified
 
         remaining_count = header.arc_len / SPI_FLASH_SEC_SIZE;
         printf("OTA: Sector count: %d\n", (int)remaining_count);
-        phase = phContent;
+        begin_section_content();
+    }
+    else if (phase == phSectorHashes)
+    {
+        size_t len = std::min((size_t)(header.sector_hash_len - sector_hashes_received), (size_t)SPI_FLASH_SEC_SIZE);
+        memcpy(sector_hashes + sector_hashes_received, block, len);
+        sector_hashes_received += len;
+        if (sector_hashes_received == header.sector_hash_len)
+            phase = phContent;
+    }
+    else if (phase == phContent && fs_delta)
+    {
+        if (!fs_delta->write_sector(block))
+        {
+            printf("\nOTA: Error: Failed at fs_delta_updater.write_sector().\n");
+            end_fs_delta();
+            status = stCorrupted;
+            return;
+        }
+        --remaining_count;
+        if (remaining_count == 0)
+        {
+            printf("\nOTA: All files written.\n");
+            bool match = fs_delta->match_md5(header.md5);
+            end_fs_delta();
+            if (!match)
+            {
+                printf("OTA: Error: MD5 mismatch.\n");
+                status = stCorrupted;
+                return;
+            }
+            phase = phHeader;
+        }
+    }
+    else if (phase == phContent && sector_delta)
+    {
+        if (!sector_delta->write_sector(block))
+        {
+            printf("\nOTA: Error: Failed at sector_delta_updater.write_sector().\n");
+            end_sector_delta();
+            status = stCorrupted;
+            return;
+        }
+        --remaining_count;
+        if (remaining_count == 0)
+        {
+            printf("\nOTA: Sector delta applied.\n");
+            bool match = sector_delta->match_md5(header.md5);
+            end_sector_delta();
+            if (!match)
+            {
+                printf("OTA: Error: MD5 mismatch.\n");
+                status = stCorrupted;
+                return;
+            }
+            phase = phHeader;
+        }
     }
     else if (phase == phContent)
     {
-        if (!partition_updater.write_sector(buffer))
+        if (!partition_updater.write_sector(block, block + SPI_FLASH_SEC_SIZE))
         {
             printf("\nOTA: Error: Failed at partition_updater.write_sector().\n");
             status = stCorrupted;
@@ -405,13 +1099,14 @@ void updater_t::process_block()
         {
             // all sector in the partition has been written
             printf("\nOTA: All sectors written.\n");
-            if (!partition_updater.match_md5(header.md5))
+            if (!partition_updater.match_hash(header.hash))
             {
-                // md5 mismatch
-                printf("OTA: Error: MD5 mismatch.\n");
+                // hash mismatch
+                printf("OTA: Error: Image hash mismatch.\n");
                 status = stCorrupted;
                 return;
             }
+            set_image_hash(partition_updater.get_type(), get_next_partition_number(), header.hash);
             // activate new code
             partition_updater.activate_new_code();
 
@@ -421,14 +1116,47 @@ void updater_t::process_block()
     }
 }
 
+bool updater_t::begin_section_content()
+{
+    sector_index = 0;
+    if (!header.sector_hash_len)
+    {
+        phase = phContent;
+        return true;
+    }
+    if (header.sector_hash_len != remaining_count * IMAGE_HASH_SIZE)
+    {
+        printf("OTA: Error: Invalid sector hash list.\n");
+        status = stCorrupted;
+        return false;
+    }
+    sector_hashes = (uint8_t *)malloc(header.sector_hash_len);
+    if (!sector_hashes)
+    {
+        printf("OTA: Error: Memory exhausted.\n");
+        status = stCorrupted;
+        return false;
+    }
+    sector_hashes_received = 0;
+    phase = phSectorHashes;
+    return true;
+}
+
 void updater_t::write_data(const uint8_t *buf, size_t size)
 {
     if (status != stNoError)
         return;
-    if (!buffer)
+    if (!free_sectors)
         return;
     while (size > 0)
     {
+        if (!buffer)
+        {
+            // wait for the flash task to return a buffer; this throttles the sender
+            uint32_t start = micros();
+            xQueueReceive(free_sectors, &buffer, portMAX_DELAY);
+            sector_wait_us += micros() - start;
+        }
         // fill buffer
         size_t buffer_remain = SPI_FLASH_SEC_SIZE - buffer_pos;
         size_t one_size = std::min(buffer_remain, size);
@@ -438,9 +1166,11 @@ void updater_t::write_data(const uint8_t *buf, size_t size)
         buffer_pos += one_size;
         if (buffer_pos == SPI_FLASH_SEC_SIZE)
         {
-            // one block has been filled
+            // one block has been filled; hash it and pass it to the flash task
+            sector_sha256(buffer, buffer + SPI_FLASH_SEC_SIZE);
             buffer_pos = 0;
-            process_block();
+            xQueueSend(full_sectors, &buffer, portMAX_DELAY);
+            buffer = nullptr;
             if (status != stNoError)
                 return;
         }
@@ -450,6 +1180,13 @@ void updater_t::write_data(const uint8_t *buf, size_t size)
 bool updater_t::finish()
 {
     bool success = false;
+    stop_flash_task(); // wait for all queued sectors to be processed
+
+    printf("OTA: Flash: %u bytes in %u ms busy (%u KiB/s); total %u ms\n",
+           (unsigned)flash_bytes, (unsigned)(flash_busy_us / 1000),
+           kib_per_sec(flash_bytes, flash_busy_us), (unsigned)(millis() - start_ms));
+    print_heap("at finish");
+
     if (status != stNoError)
         goto fin;
     if (phase != phHeader)
@@ -462,40 +1199,218 @@ bool updater_t::finish()
 
     success = true; // no error found
 fin:
-    if (buffer)
-        free(buffer), buffer = nullptr;
+    partition_updater.end();
+    end_fs_delta();
+    end_sector_delta();
+    end_sector_hashes();
+    if (checkpoint.id[0] && sector_corrupted)
+        printf("OTA: The upload can be resumed from the last checkpoint.\n");
+    else if (checkpoint.id[0])
+        clear_checkpoint(); // resuming a finished or broken upload makes no sense
     return success;
 }
 
-void compressed_updater_t::begin()
+void compressed_updater_t::begin(const String &resume_id)
 {
+    stop_inflate_task();
+    if (decoder)
+        delete decoder, decoder = nullptr;
     inherited::begin();
     total_received_bytes = 0;
-    compressed_size = 0;
+    stream_size = 0;
+    zlib_mark_ok = lz4_mark_ok = true;
+    receive_blocked_us = inflate_bytes = inflate_busy_us = 0;
+    input_end = false;
+
+    in_base = out_base = 0;
+
+    input = xStreamBufferCreate(INPUT_RING_SIZE, 1);
+    inflate_done = xSemaphoreCreateBinary();
+    if (!input || !inflate_done)
+    {
+        printf("OTA: Error: Memory exhausted.\n");
+        status = stCorrupted;
+    }
+
+    if (resume_id.length())
+    {
+        // checkpoints of the previous upload are no longer valid
+        clear_checkpoint();
+        strncpy(checkpoint.id, resume_id.c_str(), sizeof(checkpoint.id) - 1);
+    }
+}
+
+uint32_t compressed_updater_t::get_resume_offset(const String &resume_id)
+{
+    checkpoint_t cp;
+    if (!load_checkpoint(cp) || resume_id != cp.id)
+        return 0;
+    return cp.in_offset;
+}
+
+bool compressed_updater_t::resume(const String &resume_id, uint32_t offset)
+{
+    checkpoint_t cp;
+    bool ok = load_checkpoint(cp) && resume_id == cp.id && offset == cp.in_offset;
+    begin();
+    if (!ok)
+    {
+        printf("OTA: Error: No checkpoint to resume from at %u.\n", (unsigned)offset);
+        status = stCorrupted;
+        clear_checkpoint(); // the client starts over instead of retrying this offset
+        return false;
+    }
+    if (!restore(cp))
+    {
+        clear_checkpoint(); // the same checkpoint would fail again
+        return false;
+    }
+
+    // restart points exist only in lz4 streams
+    printf("OTA: Resuming from file offset %u, archive offset %u\n", (unsigned)cp.in_offset, (unsigned)cp.out_offset);
+    total_received_bytes = cp.in_offset;
+    stream_size = cp.stream_size;
+    zlib_mark_ok = false;
+    in_base = cp.in_offset;
+    out_base = cp.out_offset;
+    return start_decoder(true, stream_size - out_base);
+}
+
+// create the decoder and start the inflate task
+bool compressed_updater_t::start_decoder(bool lz4, uint32_t out_size)
+{
+    stream_decoder_t::write_fn_t write_fn = [this](const uint8_t *buf, size_t size) -> int {
+        uint32_t in_offset;
+        if (decoder->get_restart_point(in_offset))
+            add_restart_point(in_base + in_offset, out_base + inflate_bytes + size);
+        inflate_bytes += size;
+        inherited::write_data(buf, size);
+        return inherited::status == stNoError ? 0 : -1;
+    };
+    if (lz4)
+        decoder = new lz4_decoder_t(write_fn, out_size);
+    else
+        decoder = new mz_inflator_t(write_fn, stream_size);
+    if (!decoder)
+    {
+        printf("OTA: Error: Memory exhausted.\n");
+        status = stCorrupted;
+        return false;
+    }
+
+    // decompression runs on its own task, so that the receiver is not
+    // blocked while the flash task is erasing
+    if (xTaskCreate(inflate_task_entry, "OTA inflate", 4096, this, 1, &inflate_task) != pdPASS)
+    {
+        printf("OTA: Error: Could not start the inflate task.\n");
+        inflate_task = nullptr;
+        status = stCorrupted;
+        return false;
+    }
+    return true;
+}
+
+static portMUX_TYPE updater_owner_mux = portMUX_INITIALIZER_UNLOCKED;
+
+bool compressed_updater_t::acquire(owner_t who)
+{
+    portENTER_CRITICAL(&updater_owner_mux);
+    bool ok = owner == owNone;
+    if (ok)
+        owner = who;
+    portEXIT_CRITICAL(&updater_owner_mux);
+    return ok;
+}
+
+void compressed_updater_t::release(owner_t who)
+{
+    portENTER_CRITICAL(&updater_owner_mux);
+    if (owner == who)
+        owner = owNone;
+    portEXIT_CRITICAL(&updater_owner_mux);
 }
 
 void compressed_updater_t::end()
 {
+    stop_inflate_task();
+    if (decoder)
+        delete decoder, decoder = nullptr;
     inherited::end();
-    if (inflator)
-        delete inflator, inflator = nullptr;
+}
+
+void compressed_updater_t::inflate_task_entry(void *arg)
+{
+    static_cast<compressed_updater_t *>(arg)->inflate_task_loop();
+    vTaskDelete(nullptr);
+}
+
+void compressed_updater_t::inflate_task_loop()
+{
+    uint8_t chunk[512];
+    for (;;)
+    {
+        bool end = input_end; // read before receiving; once set, all input is in the ring
+        size_t n = xStreamBufferReceive(input, chunk, sizeof(chunk), pdMS_TO_TICKS(100));
+        if (n == 0)
+        {
+            if (end)
+                break;
+            continue;
+        }
+        if (status != stNoError)
+            continue; // drain the rest
+
+        uint32_t waited = sector_wait_us;
+        uint32_t start = micros();
+        int res = decoder->eat(chunk, n);
+        inflate_busy_us += (micros() - start) - (sector_wait_us - waited);
+        if (res <= TINFL_STATUS_DONE && res != TINFL_STATUS_DONE)
+        {
+            // decompression error
+            printf("OTA: Compressed image corrupted. status: %i\n", res);
+            status = stCorrupted;
+        }
+    }
+    xSemaphoreGive(inflate_done);
+}
+
+void compressed_updater_t::stop_inflate_task()
+{
+    if (inflate_task)
+    {
+        input_end = true;
+        xSemaphoreTake(inflate_done, portMAX_DELAY);
+        inflate_task = nullptr;
+    }
+    if (input)
+        vStreamBufferDelete(input), input = nullptr;
+    if (inflate_done)
+        vSemaphoreDelete(inflate_done), inflate_done = nullptr;
 }
 
 void compressed_updater_t::write_data(const uint8_t *buf, size_t size)
 {
-    static const char marks[] = "MZ5 compressed archive\r\n\n\x1a"; // magic header mark
+    static const char marks[] = "MZ5 compressed archive\r\n\n\x1a"; // magic header mark of zlib stream
+    static const char lz4_marks[] = "MZ5 lz4 blocks archive\r\n\n\x1a"; // magic header mark of lz4 blocks
+    static_assert(sizeof(marks) == sizeof(lz4_marks), "magic header marks must be of the same length");
     static constexpr size_t mark_size = sizeof(marks) - 1;
 
-    // compressed image consists of magic header, compressed image size,
-    // and the compressed data.
+    // compressed image consists of magic header, image size (compressed size
+    // for zlib, uncompressed size for lz4), and the compressed data.
     if (status != stNoError)
         return; // error found
+    if (!input)
+        return;
 
     // check the magic header
     while (total_received_bytes >= 0 && total_received_bytes < mark_size && size)
     {
         // check magic header
         if (*buf != marks[total_received_bytes])
+            zlib_mark_ok = false;
+        if (*buf != lz4_marks[total_received_bytes])
+            lz4_mark_ok = false;
+        if (!zlib_mark_ok && !lz4_mark_ok)
         {
             // magic mismatch
             status = stCorrupted; // data is corrupted;
@@ -516,41 +1431,55 @@ void compressed_updater_t::write_data(const uint8_t *buf, size_t size)
         --size;
     }
 
-    if (total_received_bytes == mark_size + 4)
+    if (total_received_bytes == mark_size + 4 && !decoder)
     {
         // done receiving sz_buf
         // prepare for the receiving of the compressed data
-        uint32_t compressed_size =
+        stream_size =
             ((uint32_t)sz_buf[0] << 0) +
             ((uint32_t)sz_buf[1] << 8) +
             ((uint32_t)sz_buf[2] << 16) +
             ((uint32_t)sz_buf[3] << 24);
-        printf("OTA: Compressed image detected. compressed size: %u\n", (unsigned int)compressed_size);
-        if (inflator)
-            delete inflator, inflator = nullptr;
-        using namespace std::placeholders;
-        mz_inflator_t::write_fn_t write_fn = [this](const uint8_t *buf, size_t size) -> int {
-            inherited::write_data(buf, size);
-            return inherited::status == stNoError ? 0 : -1;
-        };
-        inflator = new mz_inflator_t(write_fn, compressed_size);
+        in_base = total_received_bytes;
+        out_base = 0;
+        checkpoint.stream_size = stream_size;
+        if (lz4_mark_ok)
+            printf("OTA: LZ4 compressed image detected. uncompressed size: %u\n", (unsigned int)stream_size);
+        else
+            printf("OTA: Compressed image detected. compressed size: %u\n", (unsigned int)stream_size);
+        if (!start_decoder(lz4_mark_ok, stream_size))
+            return;
     }
 
     if (total_received_bytes >= mark_size + 4 && size)
     {
-        // compressed data
-        int status = inflator->eat(buf, size);
-        if(status <= TINFL_STATUS_DONE && status != TINFL_STATUS_DONE)
+        // compressed data; blocks while the ring is full
+        total_received_bytes += size;
+        uint32_t start = micros();
+        while (size && status == stNoError)
         {
-            // decompression error
-            printf("OTA: Compressed image corrupted. status: %i\n", status);
-            status = stCorrupted;
-            return;
+            size_t n = xStreamBufferSend(input, buf, size, pdMS_TO_TICKS(100));
+            buf += n;
+            size -= n;
         }
-        total_received_bytes += size;
+        receive_blocked_us += micros() - start;
     }
 }
 
+bool compressed_updater_t::finish()
+{
+    stop_inflate_task(); // let the rest in the ring be inflated
+    if (decoder)
+        delete decoder, decoder = nullptr;
+
+    printf("OTA: Receive: %u bytes, %u ms waiting for the ring\n",
+           (unsigned)total_received_bytes, (unsigned)(receive_blocked_us / 1000));
+    printf("OTA: Inflate: %u bytes in %u ms busy (%u KiB/s), %u ms waiting for the flash task\n",
+           (unsigned)inflate_bytes, (unsigned)(inflate_busy_us / 1000),
+           kib_per_sec(inflate_bytes, inflate_busy_us), (unsigned)(sector_wait_us / 1000));
+    return inherited::finish();
+}
+
 compressed_updater_t Updater;
 
 void show_ota_boot_status()
@@ -572,6 +1501,9 @@ void reboot(bool clear_settings)
     }
 
 
+    // write pending settings
+    settings_flush();
+
     // TODO: check if the filesystem shutdown is needed
     printf("Rebooting ...\n");
     delay(1000);
@@ -1,10 +1,28 @@
 #pragma once
 
 #include <Arduino.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <freertos/stream_buffer.h>
 #include "esp_spi_flash.h"
 #include "esp_ota_ops.h"
 #include "esp_image_format.h"
-#include <MD5Builder.h>
+#include "flash_stats.h"
+
+// Image hash: SHA-256 over the chain of per sector SHA-256 digests,
+//   h = 32 zero bytes; for each sector: h = SHA-256(h || SHA-256(sector))
+// Every step is a short one-shot hash, so that the hardware SHA engine is
+// never held across sectors and the digest of a sector can be taken by
+// another task, ahead of its erase and write. make_archive.py has the same
+// computation in image_hash().
+static constexpr size_t IMAGE_HASH_SIZE = 32;
+
+//! SHA-256 of one sector
+void sector_sha256(const void *sector, uint8_t *digest);
+
+//! Chain the digest of the next sector into the image hash
+void image_hash_add(uint8_t *hash, const uint8_t *sector_digest);
 
 class partition_updater_t
 {
@@ -16,32 +34,81 @@ public:
         utFS,
         utFont,
     };
-    partition_updater_t() : _type(utUnknown), _size(0), _first_byte(0xff), _progress(0), _partition(nullptr) {}
-    ~partition_updater_t() {}
+    partition_updater_t() : _type(utUnknown), _size(0), _first_word(0xffffffff), _progress(0), _partition(nullptr) {}
+    ~partition_updater_t() { end(); }
 
     bool begin(update_type_t type, uint32_t size);
-    bool write_sector(const uint8_t *buf); //!< write a sector to current position
-    bool match_md5(const uint8_t *md5);
+    //! continue an interrupted update; sectors up to progress are already on the flash
+    bool resume(update_type_t type, uint32_t size, uint32_t progress, uint32_t first_word);
+    //! write a sector to current position; buf must be 4-byte aligned;
+    //! digest: sector_sha256() of buf if already taken
+    bool write_sector(const uint8_t *buf, const uint8_t *digest = nullptr);
+    bool match_hash(const uint8_t *hash); //!< compare the image hash of the whole image
     bool activate_new_code(); //!< activate newly written code (only for type == utCode)
+    void end(); //!< free the read back buffer
 
-    static const esp_partition_t* next_partition_from_type(update_type_t _type);
+    const esp_partition_t* get_partition() const { return _partition; }
+    update_type_t get_type() const { return _type; }
+    uint32_t get_progress() const { return _progress; }
+    uint32_t get_first_word() const { return _first_word; }
+
+    static const esp_partition_t* next_partition_from_type(update_type_t _type); //!< partition to be updated
+    static const esp_partition_t* current_partition_from_type(update_type_t _type); //!< partition in use
+    static const esp_partition_t* partition_from_type(update_type_t _type, int number);
 
 private:
     update_type_t _type;
     uint32_t _size;
-    uint8_t _first_byte; //!< first byte of the partition (usually a magic number)
+    uint32_t _first_word; //!< first word of the partition (usually a magic number), written at the completion
     uint32_t _progress;
     const esp_partition_t* _partition;
-    MD5Builder _md5;
+    uint8_t _hash[IMAGE_HASH_SIZE]; //!< image hash so far
+    uint32_t *_rbuf = nullptr; //!< read back buffer of a sector, kept over partitions of an archive
+    uint32_t _written = 0, _skipped = 0; //!< sector counts
+    latency_histogram_t _latency; //!< per sector read/erase/write latency
 };
 
 int get_current_active_partition_number();
+int get_next_partition_number(); //!< partition number (0 or 1) to be updated
+
+/**
+ * Image hash of the image (padded to the sector size) last written to the
+ * partition of the type and number, recorded when the write was verified;
+ * returns false if unknown
+ * */
+bool get_image_hash(partition_updater_t::update_type_t type, int number, uint8_t *hash);
+
+/**
+ * Record the image hash of the image written to the partition; nullptr forgets it
+ * */
+void set_image_hash(partition_updater_t::update_type_t type, int number, const uint8_t *hash);
+
+class fs_delta_updater_t;
+class sector_delta_updater_t;
 
 // update management class
+//
+// Received data is assembled into sectors, which are handed to a flash task
+// through a small pool of sector buffers; the flash task parses headers and
+// erases/writes the sectors while the caller keeps receiving. When all
+// buffers are in flight write_data() blocks, which throttles the sender.
+// The caller also takes the SHA-256 of each sector before handing it over,
+// so hashing overlaps with the erase/write of the previous sector.
 class updater_t
 {
-    uint8_t *buffer;
+    static constexpr int NUM_SECTOR_BUFFERS = 3;
+    static constexpr size_t SECTOR_BUFFER_SIZE = SPI_FLASH_SEC_SIZE + IMAGE_HASH_SIZE; // the sector, then its SHA-256
+
+    uint8_t *sector_buffers[NUM_SECTOR_BUFFERS] = {nullptr};
+    uint8_t *buffer = nullptr; //!< sector buffer being filled, taken from free_sectors
+    QueueHandle_t free_sectors = nullptr; //!< empty sector buffers
+    QueueHandle_t full_sectors = nullptr; //!< filled sector buffers for the flash task; nullptr tells it to quit
+    SemaphoreHandle_t flash_done = nullptr; //!< given when the flash task quits
+    TaskHandle_t flash_task = nullptr;
+
     partition_updater_t partition_updater;
+    fs_delta_updater_t *fs_delta = nullptr; //!< non-null while receiving "fsfiles" section
+    sector_delta_updater_t *sector_delta = nullptr; //!< non-null while receiving "sdelta" section
 
 #pragma pack(push, 4)
     struct partition_header_t
@@ -49,7 +116,9 @@ class updater_t
         char label[8];
         uint32_t orig_len;
         uint32_t arc_len;
-        uint8_t md5[16];
+        uint8_t md5[16]; // for older firmwares
+        uint8_t hash[IMAGE_HASH_SIZE]; // image hash of the content; all zero in older archives
+        uint32_t sector_hash_len; // bytes of the per sector SHA-256 list preceding the content; 0 if none
     };
 #pragma pack(pop)
 
@@ -57,12 +126,28 @@ class updater_t
     {
         phBegin, // the begining, waiting for the first header
         phHeader, // waiting for the partition header
+        phSectorHashes, // waiting for the per sector SHA-256 list
         phContent, // waiting for the content
     };
 
     size_t remaining_count; // remaining block count
     size_t buffer_pos; // buffer writing position
     partition_header_t header; // current partition header
+    uint8_t *sector_hashes = nullptr; //!< per sector SHA-256 list of the current section, if the archive has one
+    uint32_t sector_index = 0; //!< index of the next content sector of the current section
+    uint32_t sector_hashes_received = 0; //!< bytes of the list received so far
+    bool sector_corrupted = false; //!< a sector did not match the list; the checkpoint is kept for a retry
+
+    // restart point of the input, where a new decoder can start
+    struct restart_point_t
+    {
+        uint32_t in_offset; // offset in the uploaded file
+        uint32_t out_offset; // offset in the archive
+    };
+    static constexpr uint32_t CHECKPOINT_INTERVAL = 256 * 1024; // in archive bytes
+    QueueHandle_t restart_points = nullptr; //!< restart points ahead of the flash task
+    uint32_t processed_offset = 0; //!< archive offset of the next sector for the flash task
+    uint32_t checkpoint_offset = 0; //!< archive offset of the last checkpoint
 
 public:
     enum status_t
@@ -71,8 +156,37 @@ public:
         stCorrupted, // data corrupted
     };
 protected:
-    status_t status;
-    phase_t phase;
+    volatile status_t status; // written by the flash task
+    phase_t phase; // owned by the flash task while it runs
+
+    // progress of a resumable update, saved to NVS at restart points
+    struct checkpoint_t
+    {
+        uint32_t version;
+        char id[33]; // archive identifier given by the client; empty if not resumable
+        int8_t active_partition;
+        uint32_t in_offset;
+        uint32_t out_offset;
+        uint32_t stream_size;
+        uint8_t phase;
+        partition_header_t header;
+        uint32_t remaining_count;
+        uint8_t type;
+        uint32_t progress;
+        uint32_t first_word;
+    };
+    checkpoint_t checkpoint; // id and stream_size are set by the caller
+
+    void add_restart_point(uint32_t in_offset, uint32_t out_offset); // called when the input so far has been written
+    bool restore(const checkpoint_t &cp); // restore the state saved in a checkpoint, right after begin()
+    static bool load_checkpoint(checkpoint_t &cp);
+    static void clear_checkpoint();
+
+    // per stage statistics
+    uint32_t start_ms = 0;
+    uint32_t flash_bytes = 0; // bytes processed by the flash task
+    uint32_t flash_busy_us = 0; // time spent by the flash task
+    uint32_t sector_wait_us = 0; // time write_data() waited for a free sector buffer
 
 public:
     updater_t() {;}
@@ -82,18 +196,28 @@ public:
 
 
 private:
-    void process_block(); // process one block
+    void process_block(const uint8_t *block); // process one block
+    void end_fs_delta();
+    void end_sector_delta();
+    void end_sector_hashes();
+    bool check_sector(const uint8_t *block); // check a content sector against the per sector list
+    bool begin_section_content(); // after a partition header: expect the per sector list or the content
+    static void flash_task_entry(void *arg);
+    void flash_task_loop();
+    void stop_flash_task(); // drain the pipeline and free the buffers
+    void save_checkpoint(const restart_point_t &rp);
 
 public:
     void write_data(const uint8_t * buf, size_t size); // write a block
     bool finish(); // call this when all data is sent via write_data(); returns whether the update is succeeded or not
 
     status_t get_last_status() const { return status; } // returns last status
+    bool is_resumable_error() const { return sector_corrupted; } // failed by a corrupted sector; resuming from the checkpoint may succeed
 };
 
 
-// inflator forward decl
-class mz_inflator_t;
+// decompressor forward decl
+class stream_decoder_t;
 
 /**
  * updater management class which consumes compressed firmware stream
@@ -102,15 +226,61 @@ class compressed_updater_t : public updater_t
 {
     typedef updater_t inherited;
 
+    static constexpr size_t INPUT_RING_SIZE = 8192;
+
     size_t total_received_bytes = 0; // total received bytes of compressed stream
-    uint32_t compressed_size = 0;
-    mz_inflator_t * inflator = nullptr;
+    uint32_t stream_size = 0; // compressed size for zlib, uncompressed size for lz4
+    bool zlib_mark_ok = true, lz4_mark_ok = true; // whether the magic header received so far matches
+    stream_decoder_t * decoder = nullptr;
     uint8_t sz_buf[4]; // buffer for the size
+
+    StreamBufferHandle_t input = nullptr; //!< compressed data from the receiver to the inflate task
+    TaskHandle_t inflate_task = nullptr;
+    SemaphoreHandle_t inflate_done = nullptr; //!< given when the inflate task quits
+    volatile bool input_end = false; //!< no more data will be put into the input
+
+    // per stage statistics
+    uint32_t receive_blocked_us = 0; // time the receiver waited for the ring
+    uint32_t inflate_bytes = 0; // uncompressed bytes produced
+    uint32_t inflate_busy_us = 0; // time spent inflating, excluding waits for sector buffers
+
+    uint32_t in_base = 0; // file offset where the decoder starts
+    uint32_t out_base = 0; // archive offset where the decoder starts
+
 public:
-    /*override*/ void begin();
-    /*override*/ void end();
+    enum owner_t
+    {
+        owNone,
+        owPush, // an upload to the web server
+        owPull, // the pull updater task
+    };
+private:
+    volatile owner_t owner = owNone;
+
+    static void inflate_task_entry(void *arg);
+    void inflate_task_loop();
+    void stop_inflate_task(); // let the inflate task consume the rest of input and quit
+    bool start_decoder(bool lz4, uint32_t out_size);
+
+public:
+    //! take the updater for an update; returns false if another one has it.
+    //! Pushed and pulled updates run on different tasks, and only the owner
+    //! may call begin(), resume(), write_data(), finish() and end().
+    bool acquire(owner_t who);
+    //! give the updater back; does nothing unless who is the owner
+    void release(owner_t who);
+    owner_t get_owner() const { return owner; }
+
+    /*override*/ void begin(const String &resume_id = String()); // resume_id: make the update resumable
+    /*override*/ void end(); // a checkpoint is kept for resume()
+
+    //! file offset to resume the upload of the archive from; 0 if unknown
+    uint32_t get_resume_offset(const String &resume_id);
+    //! continue an interrupted upload; the data from offset follows
+    bool resume(const String &resume_id, uint32_t offset);
 
     /*override*/ void write_data(const uint8_t * buf, size_t size); // write a block
+    /*override*/ bool finish();
 
 };
 
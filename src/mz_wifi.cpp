@@ -7,6 +7,8 @@
 #include "esp_wps.h"
 #include "calendar.h"
 #include "ESPmDNS.h"
+#include "threadsync.h"
+#include "session_log.h"
 
 static bool clear_wifi_setting = false;
 
@@ -95,7 +97,29 @@ static String wpspin2string(uint8_t a[]){
 static WiFiEvent_t wps_last_state = ARDUINO_EVENT_WIFI_READY;
 static bool reconfigure_ntp = false;
 
+// update the WiFi state shown by the UI; from the events, or from a
+// replayed session (see session_log.h)
+static void wifi_ui_event(WiFiEvent_t event)
+{
+	switch(event)
+	{
+	case SYSTEM_EVENT_STA_WPS_ER_SUCCESS:
+	case SYSTEM_EVENT_STA_WPS_ER_FAILED:
+	case SYSTEM_EVENT_STA_WPS_ER_TIMEOUT:
+		wps_last_state = event;
+		break;
+	default:
+		break;
+	}
+}
+
 static void WiFiEventHandler(WiFiEvent_t event, arduino_event_info_t info){
+  if(session_recording())
+  {
+	// this runs on the WiFi event task; the session log belongs to the main thread
+	run_in_main_thread_async([event]() -> int { session_on_network_event((int)event); return 0; });
+  }
+  wifi_ui_event(event);
   switch(event){
     case SYSTEM_EVENT_STA_START:
 //      puts("Station mode started");
@@ -116,7 +140,6 @@ static void WiFiEventHandler(WiFiEvent_t event, arduino_event_info_t info){
     case SYSTEM_EVENT_STA_WPS_ER_SUCCESS:
 //      printf("WPS successful, stopping WPS and connecting to: %s\r\n", String(WiFi.SSID()).c_str() );
 
-	  wps_last_state = event;
       esp_wifi_wps_disable();
 
 		delay(10);
@@ -132,12 +155,10 @@ static void WiFiEventHandler(WiFiEvent_t event, arduino_event_info_t info){
       break;
     case SYSTEM_EVENT_STA_WPS_ER_FAILED:
 //      puts("WPS failed.");
-	  wps_last_state = event;
       esp_wifi_wps_disable();
       break;
     case SYSTEM_EVENT_STA_WPS_ER_TIMEOUT:
 //      puts("WPS timed out.");
-	  wps_last_state = event;
       esp_wifi_wps_disable();
       break;
     case SYSTEM_EVENT_STA_WPS_ER_PIN:
@@ -206,6 +227,7 @@ void wifi_wps()
 {
 	wpsInitConfig();
 	wps_last_state = ARDUINO_EVENT_WIFI_READY;
+	if(session_replaying()) return; // the result comes from the session log
 	esp_wifi_wps_enable(&config);
 	esp_wifi_wps_start(0);
 }
@@ -220,9 +242,85 @@ WiFiEvent_t wifi_get_wps_status() { return wps_last_state; }
  * */
 void wifi_stop_wps()
 {
+	if(session_replaying()) return;
 	esp_wifi_wps_disable();
 }
 
+static std::vector<wifi_scan_item_t> replayed_scan_list; // scan result of a replayed session
+static int16_t replayed_scan_result = WIFI_SCAN_RUNNING;
+static bool scan_recorded = false; // whether the result of the last scan is in the session log
+
+/**
+ * Start scanning networks in the background.
+ * */
+void wifi_scan_start()
+{
+	scan_recorded = false;
+	if(session_replaying())
+	{
+		// the result comes from the session log
+		replayed_scan_list.clear();
+		replayed_scan_result = WIFI_SCAN_RUNNING;
+		return;
+	}
+	WiFi.scanNetworks(/*async=*/true, /*show_hidden=*/false);
+}
+
+/**
+ * Returns WIFI_SCAN_RUNNING while scanning, WIFI_SCAN_FAILED, or the number
+ * of networks found. A session being recorded gets the result once.
+ * */
+int16_t wifi_scan_complete()
+{
+	if(session_replaying()) return replayed_scan_result;
+
+	int16_t result = WiFi.scanComplete();
+	if(result != WIFI_SCAN_RUNNING && !scan_recorded && session_recording())
+	{
+		scan_recorded = true;
+		for(auto && item : get_wifi_scan_list())
+			session_on_scan_item(item.SSID, item.RSSI);
+		session_on_scan_result(result);
+	}
+	return result;
+}
+
+/**
+ * Release the scan result.
+ * */
+void wifi_scan_delete()
+{
+	if(session_replaying())
+	{
+		replayed_scan_list.clear();
+		replayed_scan_list.shrink_to_fit();
+		return;
+	}
+	WiFi.scanDelete();
+}
+
+// called from the session replayer
+void wifi_replay_event(int event)
+{
+	wifi_ui_event((WiFiEvent_t)event);
+}
+
+void wifi_replay_scan_item(const String & ssid, int32_t rssi)
+{
+	wifi_scan_item_t item;
+	item.SSID = ssid;
+	item.encryptionType = WIFI_AUTH_OPEN; // not recorded
+	item.RSSI = rssi;
+	memset(item.BSSID, 0, sizeof(item.BSSID));
+	item.channel = 0;
+	replayed_scan_list.push_back(item);
+}
+
+void wifi_replay_scan_result(int16_t result)
+{
+	replayed_scan_result = result;
+}
+
 
 /**
  * Start WiFi connection using configured parameters
@@ -257,33 +355,40 @@ void wifi_start()
 	WiFi.config(i_ip_addr, i_ip_gateway, i_ip_mask, i_dns1, i_dns2);
 }
 
+// WiFi settings schema; empty AP name and 0.0.0.0 mean not configured
+// and automatic IP configuration respectively
+static const setting_string_t ap_name_setting("ap_name", "");
+static const setting_string_t ap_pass_setting("ap_pass", "");
+static const setting_string_t ip_addr_setting("ip_addr", "0.0.0.0");
+static const setting_string_t ip_gateway_setting("ip_gateway", "0.0.0.0");
+static const setting_string_t ip_mask_setting("ip_mask", "0.0.0.0");
+static const setting_string_t dns_1_setting("dns_1", "0.0.0.0");
+static const setting_string_t dns_2_setting("dns_2", "0.0.0.0");
+
 /**
  * Read settings. Initialize settings to factory state, if the settings key is invalid
  */
 static void wifi_init_settings()
 {
-	settings_overwrite_t overwrite = SETTINGS_NO_OVERWRITE;
 	if(clear_wifi_setting)
 	{
 		puts("Clearing WiFi settings due to repeated boot failure.");
-		overwrite = SETTINGS_OVERWRITE;
+		ap_name_setting.reset();
+		ap_pass_setting.reset();
+		ip_addr_setting.reset();
+		ip_gateway_setting.reset();
+		ip_mask_setting.reset();
+		dns_1_setting.reset();
+		dns_2_setting.reset();
 	}
 
-	settings_write(F("ap_name"), F(""), overwrite);
-	settings_write(F("ap_pass"), F(""), overwrite);
-	settings_write(F("ip_addr"), F("0.0.0.0"), overwrite); // automatic ip configuration
-	settings_write(F("ip_gateway"), F("0.0.0.0"), overwrite);
-	settings_write(F("ip_mask"), F("0.0.0.0"), overwrite);
-	settings_write(F("dns_1"), F("0.0.0.0"), overwrite);
-	settings_write(F("dns_2"), F("0.0.0.0"), overwrite);
-
-	settings_read(F("ap_name"), ap_name);
-	settings_read(F("ap_pass"), ap_pass);
-	settings_read(F("ip_addr"),    ip_addr_settings.ip_addr);
-	settings_read(F("ip_gateway"), ip_addr_settings.ip_gateway);
-	settings_read(F("ip_mask"),    ip_addr_settings.ip_mask);
-	settings_read(F("dns_1"),      ip_addr_settings.dns1);
-	settings_read(F("dns_2"),      ip_addr_settings.dns2);
+	ap_name = ap_name_setting.get();
+	ap_pass = ap_pass_setting.get();
+	ip_addr_settings.ip_addr    = ip_addr_setting.get();
+	ip_addr_settings.ip_gateway = ip_gateway_setting.get();
+	ip_addr_settings.ip_mask    = ip_mask_setting.get();
+	ip_addr_settings.dns1       = dns_1_setting.get();
+	ip_addr_settings.dns2       = dns_2_setting.get();
 }
 
 /**
@@ -291,13 +396,16 @@ static void wifi_init_settings()
  */
 void wifi_write_settings()
 {
-	settings_write(F("ap_name"), ap_name);
-	settings_write(F("ap_pass"), ap_pass);
-	settings_write(F("ip_addr"),    ip_addr_settings.ip_addr);
-	settings_write(F("ip_gateway"), ip_addr_settings.ip_gateway);
-	settings_write(F("ip_mask"),    ip_addr_settings.ip_mask);
-	settings_write(F("dns_1"),      ip_addr_settings.dns1);
-	settings_write(F("dns_2"),      ip_addr_settings.dns2);
+	// AP and IP settings must be consistent; write them at once
+	settings_transaction_t tr;
+	tr.put(ap_name_setting.get_key(), ap_name);
+	tr.put(ap_pass_setting.get_key(), ap_pass);
+	tr.put(ip_addr_setting.get_key(),    ip_addr_settings.ip_addr);
+	tr.put(ip_gateway_setting.get_key(), ip_addr_settings.ip_gateway);
+	tr.put(ip_mask_setting.get_key(),    ip_addr_settings.ip_mask);
+	tr.put(dns_1_setting.get_key(),      ip_addr_settings.dns1);
+	tr.put(dns_2_setting.get_key(),      ip_addr_settings.dns2);
+	tr.commit();
 }
 
 const String & wifi_get_ap_name()
@@ -442,6 +550,12 @@ std::vector<wifi_scan_item_t> get_wifi_scan_list(size_t max)
 	// here we use naive method to sort the list.
 	// assumes list is not so big.
 	std::vector<wifi_scan_item_t> items;
+	if(session_replaying())
+	{
+		items.assign(replayed_scan_list.begin(),
+			replayed_scan_list.begin() + std::min(replayed_scan_list.size(), max));
+		return items;
+	}
 	int16_t result = WiFi.scanComplete();
 	if(result != WIFI_SCAN_FAILED && result > 0)
 	{
@@ -12,6 +12,15 @@ void wifi_wps();
 WiFiEvent_t wifi_get_wps_status();
 void wifi_stop_wps();
 
+void wifi_scan_start();
+int16_t wifi_scan_complete();
+void wifi_scan_delete();
+
+// WiFi state seen by the UI, fed by the session replayer; see session_log.h
+void wifi_replay_event(int event);
+void wifi_replay_scan_item(const String & ssid, int32_t rssi);
+void wifi_replay_scan_result(int16_t result);
+
 void wifi_start();
 void wifi_write_settings();
 
@@ -0,0 +1,346 @@
+#include <Arduino.h>
+#include <HTTPClient.h>
+#include <WiFi.h>
+#include <algorithm>
+#include <vector>
+#include "esp_ota_ops.h"
+#include "ota_pull.h"
+#include "mz_update.h"
+#include "settings.h"
+#include "threadsync.h"
+#include "web_server.h"
+
+static const setting_string_t pull_url_setting("ota_pull_url", "");
+static constexpr uint32_t PULL_FIRST_CHECK_MS = 5 * 60 * 1000; // after boot
+static constexpr uint32_t PULL_INTERVAL_MS = 6 * 60 * 60 * 1000;
+static constexpr int PULL_RETRIES = 10; // per archive, on connection drops
+static constexpr uint32_t PULL_STALL_MS = 15000; // give up a connection without data for this long
+
+struct pull_part_t
+{
+    String label;
+    partition_updater_t::update_type_t type;
+    uint32_t image_size;
+    uint8_t image_hash[IMAGE_HASH_SIZE];
+    String file;
+    uint32_t file_size;
+    String file_md5; // hex; also the resume id
+};
+
+static volatile bool running = false;
+static String pull_url; // handed to the task
+static uint32_t next_check_ms = PULL_FIRST_CHECK_MS;
+
+static bool parse_hex(const String &hex, uint8_t *bin, size_t size)
+{
+    if (hex.length() != size * 2)
+        return false;
+    for (size_t i = 0; i < size; ++i)
+    {
+        char b[3] = { hex[i * 2], hex[i * 2 + 1], 0 };
+        char *end;
+        bin[i] = (uint8_t)strtoul(b, &end, 16);
+        if (*end)
+            return false;
+    }
+    return true;
+}
+
+// split a line by spaces
+static std::vector<String> split_words(const String &line)
+{
+    std::vector<String> words;
+    int pos = 0;
+    while (pos < (int)line.length())
+    {
+        int sp = line.indexOf(' ', pos);
+        if (sp < 0)
+            sp = line.length();
+        if (sp > pos)
+            words.push_back(line.substring(pos, sp));
+        pos = sp + 1;
+    }
+    return words;
+}
+
+static bool parse_manifest(const String &text, std::vector<pull_part_t> &parts)
+{
+    int pos = 0;
+    while (pos < (int)text.length())
+    {
+        int nl = text.indexOf('\n', pos);
+        if (nl < 0)
+            nl = text.length();
+        String line = text.substring(pos, nl);
+        line.trim();
+        pos = nl + 1;
+
+        if (line.startsWith("version "))
+        {
+            printf("OTA pull: Manifest version: %s\n", line.c_str() + 8);
+            continue;
+        }
+        std::vector<String> w = split_words(line);
+        if (w.size() == 0 || w[0] != "part")
+            continue;
+        if (w.size() != 7)
+            return false;
+
+        pull_part_t p;
+        p.label = w[1];
+        if (p.label == "app")
+            p.type = partition_updater_t::utCode;
+        else if (p.label == "fs")
+            p.type = partition_updater_t::utFS;
+        else if (p.label == "font")
+            p.type = partition_updater_t::utFont;
+        else
+            return false;
+        p.image_size = strtoul(w[2].c_str(), nullptr, 10);
+        if (!parse_hex(w[3], p.image_hash, sizeof(p.image_hash)))
+            return false;
+        p.file = w[4];
+        p.file_size = strtoul(w[5].c_str(), nullptr, 10);
+        p.file_md5 = w[6];
+        parts.push_back(p);
+    }
+    return parts.size() > 0 && parts.back().type == partition_updater_t::utCode;
+}
+
+// resolve a file name relative to the manifest URL
+static String resolve_url(const String &manifest_url, const String &file)
+{
+    if (file.startsWith("http://") || file.startsWith("https://"))
+        return file;
+    return manifest_url.substring(0, manifest_url.lastIndexOf('/') + 1) + file;
+}
+
+static bool fetch_manifest(const String &url, String &text)
+{
+    HTTPClient http;
+    http.setTimeout(10000);
+    if (!http.begin(url))
+        return false;
+    int code = http.GET();
+    if (code == HTTP_CODE_OK)
+        text = http.getString();
+    else
+        printf("OTA pull: Could not get the manifest: %d\n", code);
+    http.end();
+    return code == HTTP_CODE_OK;
+}
+
+// copy the running image to the inactive partition
+static bool copy_running_image(const pull_part_t &p)
+{
+    const esp_partition_t *from = partition_updater_t::current_partition_from_type(p.type);
+    uint32_t *buf = (uint32_t *)malloc(SPI_FLASH_SEC_SIZE);
+    partition_updater_t to;
+    bool ok = from && buf && from->size >= p.image_size && to.begin(p.type, p.image_size);
+    for (uint32_t pos = 0; ok && pos < p.image_size; pos += SPI_FLASH_SEC_SIZE)
+        ok = ESP.flashRead(from->address + pos, buf, SPI_FLASH_SEC_SIZE) &&
+             to.write_sector((const uint8_t *)buf);
+    ok = ok && to.match_hash(p.image_hash);
+    if (ok)
+        set_image_hash(p.type, get_next_partition_number(), p.image_hash);
+    to.end();
+    free(buf);
+    return ok;
+}
+
+// download one archive into Updater; returns 1 on success, 0 if the
+// connection dropped, -1 on failure
+static int download_archive(const String &url, const pull_part_t &p)
+{
+    uint32_t offset = Updater.get_resume_offset(p.file_md5);
+    if (offset && !Updater.resume(p.file_md5, offset))
+    {
+        // resume() has dropped the checkpoint; start over
+        printf("OTA pull: Could not resume %s; downloading it again\n", url.c_str());
+        Updater.end();
+        offset = 0;
+    }
+    if (!offset)
+        Updater.begin(p.file_md5);
+    if (Updater.get_last_status() != updater_t::stNoError)
+    {
+        Updater.end();
+        return -1;
+    }
+
+    HTTPClient http;
+    http.setTimeout(10000);
+    if (!http.begin(url))
+    {
+        Updater.end();
+        return 0;
+    }
+    if (offset)
+        http.addHeader("Range", String("bytes=") + String(offset) + "-");
+    int code = http.GET();
+    if (code != (offset ? HTTP_CODE_PARTIAL_CONTENT : HTTP_CODE_OK))
+    {
+        printf("OTA pull: Could not get %s: %d\n", url.c_str(), code);
+        http.end();
+        Updater.end();
+        return code > 0 ? -1 : 0;
+    }
+
+    printf("OTA pull: Downloading %s from %u\n", url.c_str(), (unsigned)offset);
+    WiFiClient *stream = http.getStreamPtr();
+    uint8_t buf[1024];
+    uint32_t received = offset;
+    uint32_t last_data_ms = millis();
+    while (received < p.file_size && Updater.get_last_status() == updater_t::stNoError)
+    {
+        size_t avail = stream->available();
+        if (!avail)
+        {
+            if (!http.connected() || millis() - last_data_ms > PULL_STALL_MS)
+                break;
+            delay(2);
+            continue;
+        }
+        int n = stream->readBytes(buf, std::min(avail, std::min(sizeof(buf), (size_t)(p.file_size - received))));
+        if (n <= 0)
+            continue;
+        Updater.write_data(buf, n); // blocks while the pipeline is busy
+        received += n;
+        last_data_ms = millis();
+    }
+    http.end();
+
+    if (received < p.file_size && Updater.get_last_status() == updater_t::stNoError)
+    {
+        printf("OTA pull: Connection dropped at %u of %u\n", (unsigned)received, (unsigned)p.file_size);
+        Updater.end(); // keep the checkpoint
+        return 0;
+    }
+    if (Updater.finish())
+        return 1;
+    return Updater.is_resumable_error() ? 0 : -1; // a corrupted sector is fetched again
+}
+
+// update the inactive partitions as the manifest says; returns true if a
+// reboot into them is needed
+static bool pull_update(const String &manifest_url)
+{
+    String text;
+    std::vector<pull_part_t> parts;
+    if (!fetch_manifest(manifest_url, text))
+        return false;
+    if (!parse_manifest(text, parts))
+    {
+        printf("OTA pull: Invalid manifest.\n");
+        return false;
+    }
+
+    int current = get_current_active_partition_number();
+    int next = get_next_partition_number();
+
+    // anything new ?
+    bool up_to_date = true;
+    for (auto &&p : parts)
+    {
+        uint8_t hash[IMAGE_HASH_SIZE];
+        if (!get_image_hash(p.type, current, hash) || memcmp(hash, p.image_hash, sizeof(hash)))
+            up_to_date = false;
+    }
+    if (up_to_date)
+    {
+        printf("OTA pull: Up to date.\n");
+        return false;
+    }
+
+    bool app_written = false;
+    for (auto &&p : parts)
+    {
+        uint8_t hash[IMAGE_HASH_SIZE];
+        if (get_image_hash(p.type, next, hash) && !memcmp(hash, p.image_hash, sizeof(hash)))
+        {
+            printf("OTA pull: '%s' is already on the inactive partition.\n", p.label.c_str());
+            continue;
+        }
+        if (get_image_hash(p.type, current, hash) && !memcmp(hash, p.image_hash, sizeof(hash)))
+        {
+            printf("OTA pull: Copying '%s' from the running partition ...\n", p.label.c_str());
+            if (!copy_running_image(p))
+            {
+                printf("OTA pull: Error: Could not copy '%s'.\n", p.label.c_str());
+                return false;
+            }
+            continue;
+        }
+
+        int res = 0;
+        for (int i = 0; i <= PULL_RETRIES && res == 0; ++i)
+        {
+            if (i)
+                delay(5000);
+            res = download_archive(resolve_url(manifest_url, p.file), p);
+        }
+        if (res != 1)
+        {
+            printf("OTA pull: Error: Could not update '%s'.\n", p.label.c_str());
+            return false;
+        }
+        if (p.type == partition_updater_t::utCode)
+            app_written = true; // activated by the updater
+    }
+
+    if (!app_written)
+    {
+        // the app was kept or copied; boot from it with the other partitions
+        if (esp_ota_set_boot_partition(partition_updater_t::next_partition_from_type(partition_updater_t::utCode)) != ESP_OK)
+            return false;
+    }
+    return true;
+}
+
+static void pull_task(void *arg)
+{
+    String url = pull_url;
+    if (pull_update(url))
+    {
+        printf("OTA pull: Success.\n");
+        run_in_main_thread([]() -> int { schedule_reboot(); return 0; });
+    }
+    Updater.release(compressed_updater_t::owPull);
+    running = false;
+    vTaskDelete(nullptr);
+}
+
+bool ota_pull_is_running()
+{
+    return running;
+}
+
+bool ota_pull_start(const String &manifest_url)
+{
+    if (running)
+        return false;
+    if (!Updater.acquire(compressed_updater_t::owPull))
+    {
+        printf("OTA pull: An uploaded update is running.\n");
+        return false;
+    }
+    running = true;
+    pull_url = manifest_url;
+    if (xTaskCreate(pull_task, "OTA pull", 8192, nullptr, 1, nullptr) != pdPASS)
+    {
+        Updater.release(compressed_updater_t::owPull);
+        running = false;
+        return false;
+    }
+    return true;
+}
+
+void poll_ota_pull()
+{
+    if ((int32_t)(millis() - next_check_ms) < 0)
+        return;
+    next_check_ms = millis() + PULL_INTERVAL_MS;
+    String url = pull_url_setting.get();
+    if (url.length() && WiFi.status() == WL_CONNECTED)
+        ota_pull_start(url);
+}
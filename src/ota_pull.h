@@ -0,0 +1,33 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Pull mode OTA.
+//
+// The device fetches a manifest from a HTTP server, made by
+// make_archive.py --pull, and updates itself in a background task:
+//
+//   version <free text>
+//   part <label> <image size> <image hash> <archive file> <archive size> <archive md5>
+//   ...
+//
+// One "part" line per partition image (font, fs, app; app must be the
+// last). Archive files are relative to the manifest URL; each is a complete
+// OTA archive holding that image only. Because all partitions switch
+// together at the next boot, every image must end up on the inactive
+// partitions: an image already there is kept, an image equal to the running
+// one is copied locally, and only the others are downloaded. Downloads are
+// fed to the pipelined Updater and resumed with range requests when the
+// connection drops or a sector fails its hash (LZ4 archives only; see
+// compressed_updater_t::resume()).
+// ota_server.py serves a directory with range support for testing.
+
+//! Start checking the manifest at the URL and updating in the background;
+//! returns false if already running, or if an uploaded update is running
+bool ota_pull_start(const String & manifest_url);
+
+//! Whether the background update is running
+bool ota_pull_is_running();
+
+//! Periodic check of the URL in "ota_pull_url" setting; call from the main loop
+void poll_ota_pull();
@@ -0,0 +1,297 @@
+#include <Arduino.h>
+#include <algorithm>
+#include "esp_spi_flash.h"
+#include "sector_delta.h"
+
+static const char SECTOR_DELTA_MAGIC[8] = { 'M', 'Z', '5', 'S', 'D', '2', '\n', '\0' };
+static constexpr size_t HEADER_SIZE = sizeof(SECTOR_DELTA_MAGIC) + 8 + 4 + IMAGE_HASH_SIZE;
+static constexpr size_t ENTRY_SIZE = 1 + IMAGE_HASH_SIZE;
+
+static uint32_t get_u32(const uint8_t *p) { return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24); }
+
+bool sector_delta_updater_t::fail(const char *msg)
+{
+    printf("\nOTA: Error: %s\n", msg);
+    state = stError;
+    return false;
+}
+
+bool sector_delta_updater_t::begin(uint32_t size)
+{
+    _size = size;
+    _progress = 0;
+    _md5.begin();
+    entries.clear();
+    current = 0;
+    sector_fill = 0;
+    kept = copied = received = 0;
+
+    if (!sector)
+        sector = (uint32_t *)malloc(SPI_FLASH_SEC_SIZE);
+    if (!sector)
+        return fail("Memory exhausted.");
+
+    state = stHeader;
+    expect(HEADER_SIZE);
+    return true;
+}
+
+void sector_delta_updater_t::end()
+{
+    target.end();
+    if (sector)
+        free(sector), sector = nullptr;
+    entries.clear();
+    entries.shrink_to_fit();
+}
+
+bool sector_delta_updater_t::write_sector(const uint8_t *buf)
+{
+    if (state == stError)
+        return false;
+    if (_progress >= _size)
+        return fail("Too much data for the sector delta section.");
+
+    _md5.add(const_cast<uint8_t *>(buf), (uint16_t)SPI_FLASH_SEC_SIZE);
+    _progress += SPI_FLASH_SEC_SIZE;
+
+    if (!feed(buf, SPI_FLASH_SEC_SIZE))
+        return false;
+
+    if (_progress >= _size)
+    {
+        _md5.calculate();
+        if (state != stDone)
+            return fail("Premature end of the sector delta section.");
+        printf("\nOTA: Sector delta: %u sectors kept, %u copied, %u received.\n",
+               (unsigned)kept, (unsigned)copied, (unsigned)received);
+    }
+    return true;
+}
+
+bool sector_delta_updater_t::match_md5(const uint8_t *md5)
+{
+    if (state != stDone || _progress != _size)
+        return false;
+    uint8_t buf[16];
+    _md5.getBytes(buf);
+    return !memcmp(md5, buf, sizeof(buf));
+}
+
+// parse a completed fixed size part in head[]
+bool sector_delta_updater_t::parse_head()
+{
+    switch (state)
+    {
+    case stHeader:
+      {
+        if (memcmp(head, SECTOR_DELTA_MAGIC, sizeof(SECTOR_DELTA_MAGIC)))
+            return fail("Invalid sector delta header.");
+        char label[9];
+        memcpy(label, head + 8, 8);
+        label[8] = 0;
+        uint32_t image_size = get_u32(head + 16);
+        memcpy(image_hash, head + 20, sizeof(image_hash));
+
+        partition_updater_t::update_type_t type = partition_updater_t::utUnknown;
+        if (!strcmp(label, "font"))
+            type = partition_updater_t::utFont;
+        else if (!strcmp(label, "fs"))
+            type = partition_updater_t::utFS;
+        else if (!strcmp(label, "app"))
+            type = partition_updater_t::utCode;
+        else
+            return fail("Unknown sector delta target.");
+        is_code = type == partition_updater_t::utCode;
+
+        printf("OTA: Sector delta of '%s', image size: %u\n", label, (unsigned)image_size);
+        if (image_size == 0 || !target.begin(type, image_size))
+            return fail("Possibly too large image to fit.");
+        set_image_hash(type, get_next_partition_number(), nullptr); // until verified
+        running = partition_updater_t::current_partition_from_type(type);
+        if (!running || running->size < image_size)
+            return fail("Running partition not found.");
+
+        entry_count = image_size / SPI_FLASH_SEC_SIZE;
+        entries.reserve(entry_count);
+        state = stEntries;
+        expect(ENTRY_SIZE);
+        return true;
+      }
+
+    case stEntries:
+      {
+        entry_t e;
+        e.op = head[0];
+        memcpy(e.sha256, head + 1, sizeof(e.sha256));
+        if (e.op > SECTOR_DELTA_DATA)
+            return fail("Unknown sector delta operation.");
+        entries.push_back(e);
+        if (entries.size() < entry_count)
+        {
+            expect(ENTRY_SIZE);
+            return true;
+        }
+
+        // all entries received; sectors taken from the flash can be written now
+        state = stSectors;
+        current = 0;
+        return write_ready_sectors();
+      }
+
+    default:
+        return fail("Internal error.");
+    }
+}
+
+// feed section bytes to the parser
+bool sector_delta_updater_t::feed(const uint8_t *p, size_t n)
+{
+    while (n > 0)
+    {
+        switch (state)
+        {
+        case stHeader:
+        case stEntries:
+          {
+            size_t len = std::min(head_need - head_fill, n);
+            memcpy(head + head_fill, p, len);
+            head_fill += len;
+            p += len;
+            n -= len;
+            if (head_fill == head_need && !parse_head())
+                return false;
+            break;
+          }
+
+        case stSectors:
+          {
+            size_t len = std::min(SPI_FLASH_SEC_SIZE - sector_fill, n);
+            memcpy((uint8_t *)sector + sector_fill, p, len);
+            sector_fill += len;
+            p += len;
+            n -= len;
+            if (sector_fill == SPI_FLASH_SEC_SIZE)
+            {
+                sector_fill = 0;
+                if (!write_current(nullptr))
+                    return false;
+                ++received;
+                if (!write_ready_sectors())
+                    return false;
+            }
+            break;
+          }
+
+        case stDone:
+            return true; // padding
+
+        default:
+            return false;
+        }
+    }
+    return true;
+}
+
+// write sectors which need no data from the section, up to the next one
+// which does
+bool sector_delta_updater_t::write_ready_sectors()
+{
+    while (current < entries.size() && entries[current].op != SECTOR_DELTA_DATA)
+    {
+        if (entries[current].op == SECTOR_DELTA_KEEP)
+        {
+            if (!write_current(target.get_partition()))
+                return false;
+            ++kept;
+        }
+        else
+        {
+            if (!write_current(running))
+                return false;
+            ++copied;
+        }
+    }
+
+    if (current < entries.size())
+        return true; // wait for the data
+
+    printf("\nOTA: All sectors written.\n");
+    if (!target.match_hash(image_hash))
+        return fail("Image hash mismatch.");
+    set_image_hash(target.get_type(), get_next_partition_number(), image_hash);
+    if (is_code)
+        target.activate_new_code();
+    target.end();
+    state = stDone;
+    return true;
+}
+
+// verify and write the current sector, read from the partition if given,
+// otherwise already in sector[]
+bool sector_delta_updater_t::write_current(const esp_partition_t *from)
+{
+    if (from && !ESP.flashRead(from->address + current * SPI_FLASH_SEC_SIZE, sector, SPI_FLASH_SEC_SIZE))
+        return fail("Failed to read a sector.");
+
+    uint8_t digest[IMAGE_HASH_SIZE];
+    sector_sha256(sector, digest);
+    if (memcmp(digest, entries[current].sha256, sizeof(digest)))
+    {
+        printf("\nOTA: Sector %u differs from the delta base.\n", (unsigned)current);
+        return fail("The archive does not match the running partitions; use a full archive.");
+    }
+
+    if (!target.write_sector((const uint8_t *)sector, digest))
+        return fail("Failed at partition_updater.write_sector().");
+    ++current;
+    return true;
+}
+
+
+// list SHA-256 of every sector of a partition
+static void write_manifest_partition(const char *target, const char *side,
+    const esp_partition_t *par, Print &out, uint32_t *buf)
+{
+    if (!par)
+        return;
+    uint32_t count = par->size / SPI_FLASH_SEC_SIZE;
+    out.printf("%s %s %u\n", target, side, (unsigned)count);
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        uint8_t digest[IMAGE_HASH_SIZE];
+        if (!ESP.flashRead(par->address + i * SPI_FLASH_SEC_SIZE, buf, SPI_FLASH_SEC_SIZE))
+            memset(digest, 0, sizeof(digest)); // matches nothing
+        else
+            sector_sha256(buf, digest);
+        char hex[IMAGE_HASH_SIZE * 2 + 1];
+        for (size_t j = 0; j < IMAGE_HASH_SIZE; ++j)
+            sprintf(hex + j * 2, "%02x", digest[j]);
+        out.printf("%s\n", hex);
+    }
+}
+
+void sector_delta_write_manifest(Print &out)
+{
+    static const struct
+    {
+        const char *name;
+        partition_updater_t::update_type_t type;
+    } targets[] = {
+        { "app", partition_updater_t::utCode },
+        { "fs", partition_updater_t::utFS },
+        { "font", partition_updater_t::utFont },
+    };
+
+    uint32_t *buf = (uint32_t *)malloc(SPI_FLASH_SEC_SIZE);
+    if (!buf)
+        return;
+    for (auto &&t : targets)
+    {
+        write_manifest_partition(t.name, "running",
+            partition_updater_t::current_partition_from_type(t.type), out, buf);
+        write_manifest_partition(t.name, "inactive",
+            partition_updater_t::next_partition_from_type(t.type), out, buf);
+    }
+    free(buf);
+}
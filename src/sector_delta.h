@@ -0,0 +1,90 @@
+#pragma once
+
+#include <Arduino.h>
+#include <vector>
+#include <MD5Builder.h>
+#include "mz_update.h"
+
+// Sector level delta update of a partition image.
+//
+// An "sdelta" section replaces a whole "app", "fs" or "font" section. It
+// lists the SHA-256 of every sector of the new image with where to take the
+// sector from: the partition being updated may already hold it (typical
+// for the font, which rarely changes), the running partition may hold it
+// at the same offset, or its content follows in the section. Every sector
+// is verified against its SHA-256 before it is written, and the whole image
+// against the image hash (see mz_update.h), so a delta made against a
+// different device only fails the update.
+//
+// Section layout (little endian):
+//   "MZ5SD2\n\0", char target[8] ("app", "fs" or "font"), uint32 image size,
+//   uint8 image hash[32]
+//   entries, one per sector of the image: uint8 op, uint8 sha256[32]
+//   contents of the sectors with SECTOR_DELTA_DATA op, in sector order
+// make_archive.py builds the section against sector hashes taken from
+// /update/sector_manifest of the running device.
+
+static constexpr uint8_t SECTOR_DELTA_KEEP = 0; //!< the sector of the partition being updated is already the same
+static constexpr uint8_t SECTOR_DELTA_COPY = 1; //!< copy the sector at the same offset of the running partition
+static constexpr uint8_t SECTOR_DELTA_DATA = 2; //!< the content follows in the section
+
+class sector_delta_updater_t
+{
+    struct entry_t
+    {
+        uint8_t op;
+        uint8_t sha256[IMAGE_HASH_SIZE];
+    };
+
+    enum state_t
+    {
+        stHeader,   // receiving magic, target and image size
+        stEntries,  // receiving the sector entries
+        stSectors,  // receiving the sector contents
+        stDone,     // the image has been written; the rest is padding
+        stError,
+    };
+
+    partition_updater_t target;
+    const esp_partition_t *running = nullptr; //!< source of SECTOR_DELTA_COPY
+    bool is_code = false;
+
+    uint32_t _size = 0;      //!< section size, including the padding
+    uint32_t _progress = 0;
+    MD5Builder _md5;         //!< of whole section
+
+    state_t state = stError;
+    uint8_t head[52];        //!< accumulates fixed size parts
+    size_t head_fill = 0;
+    size_t head_need = 0;
+    uint8_t image_hash[IMAGE_HASH_SIZE];
+    uint32_t entry_count = 0;
+    std::vector<entry_t> entries;
+    size_t current = 0;      //!< index of the sector to be written next
+    uint32_t *sector = nullptr; //!< sector being assembled or copied; 4-byte aligned
+    size_t sector_fill = 0;
+
+    uint32_t kept = 0, copied = 0, received = 0;
+
+public:
+    sector_delta_updater_t() {}
+    ~sector_delta_updater_t() { end(); }
+
+    bool begin(uint32_t size);
+    bool write_sector(const uint8_t *buf);
+    bool match_md5(const uint8_t *md5);
+    void end();
+
+private:
+    bool feed(const uint8_t *p, size_t n);
+    void expect(size_t n) { head_fill = 0; head_need = n; }
+    bool parse_head();
+    bool write_ready_sectors();
+    bool write_current(const esp_partition_t *from);
+    bool fail(const char *msg);
+};
+
+//! Write the SHA-256 of every sector of the running and the inactive partitions:
+//! "<target> <running|inactive> <sector count>" line followed by one
+//! "<sha256 hex>" line per sector, for each of app, fs and font
+void sector_delta_write_manifest(Print & out);
@@ -0,0 +1,419 @@
+#include <Arduino.h>
+#include <sys/time.h>
+#include <rom/crc.h>
+#include "esp_timer.h"
+#include "session_log.h"
+#include "flash_fs.h"
+#include "frame_buffer.h"
+#include "mz_bme.h"
+#include "ambient.h"
+#include "ui.h"
+#include "mz_wifi.h"
+#include "interval.h"
+
+// Log format:
+//   header : "MZ5SESS1", wall clock time at start (uint32 LE, seconds)
+//   records: type (uint8), delta time from the previous record in ms
+//            (unsigned LEB128), then type specific payload.
+// Output format ("<log name>.out"), one entry per shown frame:
+//   time from replay start in ms (uint32 LE), draw time in us (uint32 LE),
+//   crc32 of the frame (uint32 LE), then the raw frame if requested.
+
+static const uint8_t SESSION_MAGIC[8] = { 'M', 'Z', '5', 'S', 'E', 'S', 'S', '1' };
+
+enum record_type_t : uint8_t
+{
+	rec_end = 0,     // no payload
+	rec_input = 1,   // button, type, source
+	rec_bme280 = 2,  // temp_10 (int16), pressure (uint16), humidity (uint8)
+	rec_ambient = 3, // ambient (int16)
+	rec_network = 4, // WiFi event (uint8)
+	rec_time = 5,    // wall clock time in seconds (uint32)
+	rec_scan_item = 6,   // a scanned network: SSID (32 bytes, NUL padded), RSSI (int8)
+	rec_scan_result = 7, // end of a scan result: wifi_scan_complete() value (int16)
+	rec_max
+};
+
+static const uint8_t record_payload_size[rec_max] = { 0, 3, 5, 2, 1, 4, 33, 2 };
+static constexpr size_t MAX_PAYLOAD_SIZE = 33;
+
+enum session_mode_t
+{
+	sm_none,
+	sm_record,
+	sm_replay,
+};
+
+static session_mode_t mode = sm_none;
+static File log_file;
+static File out_file;
+static uint32_t start_ms; // millis() at start
+static uint32_t last_record_ms; // recording: time of the last record, replaying: scheduled time of the next record
+
+// recording state
+static uint8_t wbuf[256]; // write buffer, to keep LittleFS write calls low
+static size_t wbuf_len;
+static bme280_result_t last_bme280;
+static int16_t last_ambient;
+
+// replaying state
+static bool dump_frames;
+static bool next_valid;
+static uint8_t next_type;
+static uint8_t next_payload[MAX_PAYLOAD_SIZE];
+static uint32_t frame_count;
+static uint64_t frame_draw_us_sum;
+static uint32_t frame_draw_us_max;
+static struct timeval clock_before_replay; // wall clock time at replay start
+static uint32_t clock_before_replay_ms; // millis() at that time
+
+
+static void put_u16(uint8_t *p, uint16_t v) { p[0] = v; p[1] = v >> 8; }
+static void put_u32(uint8_t *p, uint32_t v) { p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24; }
+static uint16_t get_u16(const uint8_t *p) { return p[0] | (p[1] << 8); }
+static uint32_t get_u32(const uint8_t *p) { return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24); }
+
+static void flush_log()
+{
+	if(wbuf_len)
+	{
+		log_file.write(wbuf, wbuf_len);
+		wbuf_len = 0;
+	}
+}
+
+static void put_record(record_type_t type, const uint8_t *payload)
+{
+	size_t size = record_payload_size[type];
+	if(wbuf_len + 1 + 5 + size > sizeof(wbuf)) flush_log();
+
+	uint32_t now = millis();
+	uint32_t delta = now - last_record_ms;
+	last_record_ms = now;
+
+	wbuf[wbuf_len++] = type;
+	do
+	{
+		uint8_t b = delta & 0x7f;
+		delta >>= 7;
+		if(delta) b |= 0x80;
+		wbuf[wbuf_len++] = b;
+	} while(delta);
+	if(size) memcpy(wbuf + wbuf_len, payload, size);
+	wbuf_len += size;
+}
+
+static void record_time()
+{
+	uint8_t p[4];
+	put_u32(p, (uint32_t)time(nullptr));
+	put_record(rec_time, p);
+}
+
+// record sensor readings which have been changed since the last record
+static void record_sensors(bool force)
+{
+	if(force || memcmp(&last_bme280, &bme280_result, sizeof(last_bme280)))
+	{
+		last_bme280 = bme280_result;
+		uint8_t p[5];
+		put_u16(p + 0, (uint16_t)(int16_t)bme280_result.temp_10);
+		put_u16(p + 2, (uint16_t)bme280_result.pressure);
+		p[4] = (uint8_t)bme280_result.humidity;
+		put_record(rec_bme280, p);
+	}
+
+	int16_t ambient = get_ambient();
+	if(force || ambient != last_ambient)
+	{
+		last_ambient = ambient;
+		uint8_t p[2];
+		put_u16(p, (uint16_t)ambient);
+		put_record(rec_ambient, p);
+	}
+}
+
+// read next record header and payload from the log.
+// next_valid is set to false at the end of the log.
+static void read_next()
+{
+	next_valid = false;
+	int type = log_file.read();
+	if(type < 0 || type == rec_end) return;
+	if(type >= rec_max)
+	{
+		printf("session: Unknown record type %d. Stopping.\n", type);
+		return;
+	}
+
+	uint32_t delta = 0;
+	for(int shift = 0; ; shift += 7)
+	{
+		int b = log_file.read();
+		if(b < 0 || shift > 28) return; // premature end or broken
+		delta |= (uint32_t)(b & 0x7f) << shift;
+		if(!(b & 0x80)) break;
+	}
+
+	size_t size = record_payload_size[type];
+	if(size && log_file.read(next_payload, size) != size) return;
+
+	next_type = type;
+	last_record_ms += delta;
+	next_valid = true;
+}
+
+static void apply_record()
+{
+	switch(next_type)
+	{
+	case rec_input:
+	  {
+		input_event_t ev;
+		ev.timestamp_us = (uint32_t)esp_timer_get_time();
+		ev.button = next_payload[0];
+		ev.type = (input_event_type_t)next_payload[1];
+		ev.source = (input_source_t)next_payload[2];
+		if(ev.button < MAX_BUTTONS) ui_dispatch_input_event(ev);
+		break;
+	  }
+
+	case rec_bme280:
+		bme280_result.temp_10 = (int16_t)get_u16(next_payload + 0);
+		bme280_result.pressure = get_u16(next_payload + 2);
+		bme280_result.humidity = next_payload[4];
+		break;
+
+	case rec_ambient:
+		ambient_set_override((int16_t)get_u16(next_payload));
+		break;
+
+	case rec_network:
+		wifi_replay_event(next_payload[0]);
+		break;
+
+	case rec_scan_item:
+	  {
+		char ssid[33];
+		memcpy(ssid, next_payload, 32);
+		ssid[32] = 0;
+		wifi_replay_scan_item(String(ssid), (int8_t)next_payload[32]);
+		break;
+	  }
+
+	case rec_scan_result:
+		wifi_replay_scan_result((int16_t)get_u16(next_payload));
+		break;
+
+	case rec_time:
+	  {
+		struct timeval tv = { (time_t)get_u32(next_payload), 0 };
+		settimeofday(&tv, nullptr);
+		break;
+	  }
+
+	default:
+		break;
+	}
+}
+
+static String out_name(const String & filename)
+{
+	return filename + F(".out");
+}
+
+static String normalize_name(const String & filename)
+{
+	if(filename.startsWith(F("/"))) return filename;
+	return String(F("/")) + filename;
+}
+
+/**
+ * Start recording to the specified file on the main filesystem.
+ * */
+bool session_record_start(const String & _filename)
+{
+	String filename = normalize_name(_filename);
+	session_stop();
+
+	log_file = FS.open(filename, "w");
+	if(!log_file)
+	{
+		printf("session: Could not open %s.\n", filename.c_str());
+		return false;
+	}
+
+	uint8_t header[12];
+	memcpy(header, SESSION_MAGIC, sizeof(SESSION_MAGIC));
+	put_u32(header + 8, (uint32_t)time(nullptr));
+	log_file.write(header, sizeof(header));
+
+	start_ms = last_record_ms = millis();
+	wbuf_len = 0;
+	mode = sm_record;
+	record_sensors(true);
+	printf("session: Recording to %s.\n", filename.c_str());
+	return true;
+}
+
+/**
+ * Start replaying the specified file on the main filesystem.
+ * */
+bool session_replay_start(const String & _filename, bool _dump_frames)
+{
+	String filename = normalize_name(_filename);
+	session_stop();
+
+	log_file = FS.open(filename, "r");
+	if(!log_file)
+	{
+		printf("session: Could not open %s.\n", filename.c_str());
+		return false;
+	}
+
+	uint8_t header[12];
+	if(log_file.read(header, sizeof(header)) != sizeof(header) ||
+		memcmp(header, SESSION_MAGIC, sizeof(SESSION_MAGIC)))
+	{
+		printf("session: %s is not a session log.\n", filename.c_str());
+		log_file.close();
+		return false;
+	}
+
+	out_file = FS.open(out_name(filename), "w");
+	if(!out_file)
+	{
+		printf("session: Could not open %s.\n", out_name(filename).c_str());
+		log_file.close();
+		return false;
+	}
+
+	gettimeofday(&clock_before_replay, nullptr);
+	clock_before_replay_ms = millis();
+	struct timeval tv = { (time_t)get_u32(header + 8), 0 };
+	settimeofday(&tv, nullptr);
+
+	dump_frames = _dump_frames;
+	frame_count = 0;
+	frame_draw_us_sum = 0;
+	frame_draw_us_max = 0;
+	bme280_hold(true);
+	start_ms = last_record_ms = millis();
+	mode = sm_replay;
+	read_next();
+	printf("session: Replaying %s; frame timings go to %s.\n", filename.c_str(), out_name(filename).c_str());
+	return true;
+}
+
+/**
+ * Stop recording or replaying.
+ * */
+void session_stop()
+{
+	if(mode == sm_record)
+	{
+		put_record(rec_end, nullptr);
+		flush_log();
+		log_file.close();
+		printf("session: Recording stopped. %u ms recorded.\n", (unsigned)(millis() - start_ms));
+	}
+	else if(mode == sm_replay)
+	{
+		log_file.close();
+		out_file.close();
+		bme280_hold(false);
+		ambient_set_override(-1);
+
+		// put the wall clock back where it would be without the replay
+		uint64_t us = (uint64_t)clock_before_replay.tv_usec +
+			(uint64_t)(millis() - clock_before_replay_ms) * 1000;
+		struct timeval tv = { clock_before_replay.tv_sec + (time_t)(us / 1000000), (suseconds_t)(us % 1000000) };
+		settimeofday(&tv, nullptr);
+
+		printf("session: Replay stopped. %u frames, draw time avg %u us, max %u us.\n",
+			(unsigned)frame_count,
+			(unsigned)(frame_count ? frame_draw_us_sum / frame_count : 0),
+			(unsigned)frame_draw_us_max);
+	}
+	mode = sm_none;
+}
+
+bool session_recording() { return mode == sm_record; }
+bool session_replaying() { return mode == sm_replay; }
+
+void poll_session()
+{
+	if(mode == sm_record)
+	{
+		EVERY_MS(100)
+		{
+			record_sensors(false);
+		}
+		END_EVERY_MS
+
+		EVERY_MS(1000)
+		{
+			record_time();
+			flush_log();
+		}
+		END_EVERY_MS
+	}
+	else if(mode == sm_replay)
+	{
+		while(next_valid && (int32_t)(millis() - last_record_ms) >= 0)
+		{
+			apply_record();
+			if(mode != sm_replay) return; // stopped by the replayed input
+			read_next();
+		}
+		if(!next_valid) session_stop();
+	}
+}
+
+void session_on_input_event(const input_event_t & ev)
+{
+	if(mode != sm_record) return;
+	uint8_t p[3] = { ev.button, (uint8_t)ev.type, (uint8_t)ev.source };
+	put_record(rec_input, p);
+}
+
+void session_on_frame_drawn(uint32_t draw_us)
+{
+	if(mode != sm_replay) return;
+
+	++ frame_count;
+	frame_draw_us_sum += draw_us;
+	if(frame_draw_us_max < draw_us) frame_draw_us_max = draw_us;
+
+	frame_buffer_t::array_t & array = get_bg_frame_buffer().array();
+	uint8_t p[12];
+	put_u32(p + 0, millis() - start_ms);
+	put_u32(p + 4, draw_us);
+	put_u32(p + 8, crc32_le(0, &array[0][0], sizeof(array)));
+	out_file.write(p, sizeof(p));
+	if(dump_frames) out_file.write(&array[0][0], sizeof(array));
+}
+
+void session_on_network_event(int event)
+{
+	if(mode != sm_record) return;
+	uint8_t p[1] = { (uint8_t)event };
+	put_record(rec_network, p);
+}
+
+void session_on_scan_item(const String & ssid, int32_t rssi)
+{
+	if(mode != sm_record) return;
+	uint8_t p[33] = {0};
+	memcpy(p, ssid.c_str(), std::min((size_t)ssid.length(), (size_t)32));
+	p[32] = (uint8_t)(int8_t)std::max(rssi, (int32_t)-128);
+	put_record(rec_scan_item, p);
+}
+
+void session_on_scan_result(int result)
+{
+	if(mode != sm_record) return;
+	uint8_t p[2];
+	put_u16(p, (uint16_t)(int16_t)result);
+	put_record(rec_scan_result, p);
+}
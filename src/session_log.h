@@ -0,0 +1,42 @@
+#pragma once
+
+#include <Arduino.h>
+#include "buttons.h"
+
+// UI session recorder / replayer.
+//
+// A recording captures input events, wall clock time, sensor readings,
+// WiFi events and the WiFi scan results seen by the UI into a compact binary
+// log on the main filesystem.
+// Replaying the log feeds the recorded inputs, sensor readings and WiFi state
+// back through the screen manager at the recorded timing, without touching
+// the radio, and writes per-frame draw time and frame checksum (optionally
+// the frame itself) to "<log name>.out", so that runs can be compared across
+// firmware versions. The wall clock is put back when the replay stops.
+
+bool session_record_start(const String & filename);
+bool session_replay_start(const String & filename, bool dump_frames);
+void session_stop();
+
+bool session_recording();
+bool session_replaying();
+
+/**
+ * Call this in main loop.
+ * */
+void poll_session();
+
+// hooks; called from the main thread
+
+//! an input event is dispatched to the screen
+void session_on_input_event(const input_event_t & ev);
+
+//! a frame is drawn into the background frame buffer in draw_us micro seconds
+void session_on_frame_drawn(uint32_t draw_us);
+
+//! a WiFi event occurred
+void session_on_network_event(int event);
+
+//! the UI got a WiFi scan result; items first, then the result
+void session_on_scan_item(const String & ssid, int32_t rssi);
+void session_on_scan_result(int result);
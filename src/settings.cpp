@@ -1,12 +1,12 @@
 #include <Arduino.h>
-#include <EEPROM.h>
-#include "libb64/cdecode.h"
-#include "libb64/cencode.h"
 #include "settings.h"
 #include "microtar.h"
 #include "flash_fs.h"
 #include "panic.h"
 #include <rom/crc.h>
+#include "esp_timer.h"
+#include <map>
+#include <algorithm>
 
 static const String SETTINGS_PART_LABEL(F("conf")); // partition label
 static const String SETTINGS_MOUNT_POINT(F("/settings")); // mount point
@@ -15,12 +15,314 @@ fs::ANY_LittleFSFS SETTINGS_FS;
 
 
 
+static constexpr size_t MAX_KEY_LEN = 30;
+static constexpr int CHECKSUM_SIZE = sizeof(uint32_t); // in bytes
+
+//! initial value for crc.
+//! 0x00000000 or 0xffffffff is not suitable because it is
+//! indistinguishable from all-cleared RAM or all-cleared FLASH ROM.
+static constexpr uint32_t INITIAL_CRC_VALUE = 0x12345678;
+
+//! A cached setting value
+struct settings_entry_t
+{
+	std::vector<uint8_t> value;
+	bool dirty = false; //!< not yet written to the flash
+};
+
+//! All settings are held in RAM; the flash is read only once at
+//! init_settings(), and written behind by poll_settings().
+static std::map<String, settings_entry_t> settings_cache;
+static SemaphoreHandle_t settings_mutex;
+static uint32_t settings_flush_delay = 2000; //!< delay in ms from the first unflushed write to the flush
+static uint32_t settings_dirty_since; //!< millis() at the first unflushed write
+static bool settings_has_dirty; //!< whether any cached entry is not yet written
+
+//! write accounting, guarded by the settings lock
+static std::map<String, settings_write_stat_t> settings_write_stats;
+static latency_histogram_t settings_flush_latency;
+
+//! A subscription to changes of settings
+struct settings_subscription_t
+{
+	settings_subscription_id_t id;
+	String prefix;
+	settings_listener_t listener;
+	bool pending; //!< a matching key has been changed since the last notification
+};
+
+static std::vector<settings_subscription_t> settings_subscriptions;
+static settings_subscription_id_t settings_next_subscription_id;
+static bool settings_notify_pending; //!< whether any subscription is pending
+static uint32_t settings_changed_at; //!< millis() at the last change
+static constexpr uint32_t SETTINGS_NOTIFY_DELAY = 100; //!< quiet time in ms before notification
+
+//! Lock guard of settings cache. Recursive, so that public functions can
+//! call each other.
+class settings_lock_t
+{
+public:
+	settings_lock_t() { xSemaphoreTakeRecursive(settings_mutex, portMAX_DELAY); }
+	~settings_lock_t() { xSemaphoreGiveRecursive(settings_mutex); }
+};
+
+
+// Settings are stored in a single append-only log file.
+// The file starts with STORE_MAGIC, followed by records:
+//   store_record_header_t, key, value
+// A group of put and remove records becomes valid only when a commit record
+// follows, so a group of settings written at once is applied all or nothing.
+// Records after the last valid commit record (a torn write) are ignored,
+// and removed by the next compaction.
+// When the log grows, the whole cache is written into a new file which
+// then atomically replaces the log (compaction).
+static const char STORE_FILE[] = "/.store"; // dot file; never taken as a legacy setting
+static const char STORE_TMP_FILE[] = "/.store.new";
+static const char STORE_MAGIC[8] = { 'M', 'Z', '5', 'S', 'E', 'T', 'S', '1' };
+static constexpr size_t STORE_COMPACT_MIN = 16*1024; //!< compaction does not happen below this log size
+
+enum store_record_type_t : uint8_t
+{
+	srt_put = 1,    //!< key and value
+	srt_commit = 2, //!< no key and value
+	srt_remove = 3, //!< key, no value; the key is removed
+};
+
+struct __attribute__((packed)) store_record_header_t
+{
+	uint8_t type;
+	uint8_t key_len;
+	uint16_t value_len;
+	uint32_t crc; //!< crc of type, key_len, value_len, key and value
+};
+
+static size_t store_size; //!< current log size
+static size_t store_live_size; //!< log size just after the last compaction
+static bool store_needs_compaction; //!< the log has garbage at its end
+static std::vector<String> store_removed; //!< keys removed from the cache but not yet from the log
+
+//! append a record to the buffer
+static void store_put_record(std::vector<uint8_t> & buf, store_record_type_t type,
+	const String & key, const std::vector<uint8_t> & value)
+{
+	store_record_header_t hdr;
+	hdr.type = type;
+	hdr.key_len = key.length();
+	hdr.value_len = value.size();
+	uint32_t crc = crc32_le(INITIAL_CRC_VALUE, reinterpret_cast<const uint8_t *>(&hdr), 4);
+	crc = crc32_le(crc, reinterpret_cast<const uint8_t *>(key.c_str()), hdr.key_len);
+	hdr.crc = crc32_le(crc, value.data(), hdr.value_len);
+
+	const uint8_t *h = reinterpret_cast<const uint8_t *>(&hdr);
+	buf.insert(buf.end(), h, h + sizeof(hdr));
+	buf.insert(buf.end(), key.c_str(), key.c_str() + hdr.key_len);
+	buf.insert(buf.end(), value.begin(), value.end());
+}
+
+//! append a commit record to the buffer
+static void store_put_commit(std::vector<uint8_t> & buf)
+{
+	store_put_record(buf, srt_commit, String(), std::vector<uint8_t>());
+}
+
+//! Load the log into the cache. Returns false if the log does not exist.
+static bool settings_store_load()
+{
+	const char mode[2]  = { 'r',  0  };
+	File file = SETTINGS_FS.open(STORE_FILE, mode);
+	if(!file) return false;
+
+	std::vector<uint8_t> buf(file.size());
+	bool read_ok = buf.size() == file.read(buf.data(), buf.size());
+	file.close();
+
+	if(!read_ok || buf.size() < sizeof(STORE_MAGIC) ||
+		memcmp(buf.data(), STORE_MAGIC, sizeof(STORE_MAGIC)))
+	{
+		printf("Settings: store is broken; starting with empty settings.\n");
+		store_needs_compaction = true;
+		return true;
+	}
+
+	// parse records
+	std::vector<std::pair<String, std::vector<uint8_t>>> group; // uncommitted puts
+	std::vector<String> group_removed; // uncommitted removes
+	size_t pos = sizeof(STORE_MAGIC);
+	size_t committed_pos = pos;
+	while(pos + sizeof(store_record_header_t) <= buf.size())
+	{
+		store_record_header_t hdr;
+		memcpy(&hdr, buf.data() + pos, sizeof(hdr));
+		const uint8_t *key = buf.data() + pos + sizeof(hdr);
+		const uint8_t *value = key + hdr.key_len;
+		size_t next = pos + sizeof(hdr) + hdr.key_len + hdr.value_len;
+		if(next > buf.size()) break; // torn record
+
+		uint32_t crc = crc32_le(INITIAL_CRC_VALUE, reinterpret_cast<const uint8_t *>(&hdr), 4);
+		crc = crc32_le(crc, key, hdr.key_len + hdr.value_len);
+		if(crc != hdr.crc) break; // broken record
+
+		if(hdr.type == srt_put || hdr.type == srt_remove)
+		{
+			String k;
+			k.reserve(hdr.key_len);
+			for(int i = 0; i < hdr.key_len; ++i) k += (char)key[i];
+			if(hdr.type == srt_put)
+				group.emplace_back(k, std::vector<uint8_t>(value, value + hdr.value_len));
+			else
+				group_removed.push_back(k);
+		}
+		else if(hdr.type == srt_commit)
+		{
+			// a group never puts and removes the same key
+			for(auto && kv : group)
+				settings_cache[kv.first].value = std::move(kv.second);
+			for(auto && k : group_removed)
+				settings_cache.erase(k);
+			group.clear();
+			group_removed.clear();
+			committed_pos = next;
+		}
+		else
+		{
+			break; // unknown record
+		}
+		pos = next;
+	}
+
+	store_size = committed_pos;
+	store_live_size = committed_pos;
+	if(committed_pos != buf.size())
+	{
+		printf("Settings: ignoring %d bytes of uncommitted records.\n",
+			(int)(buf.size() - committed_pos));
+		store_needs_compaction = true;
+	}
+	return true;
+}
+
+//! Write whole cache into a new log, then replace the log with it.
+static bool settings_store_compact()
+{
+	std::vector<uint8_t> buf(STORE_MAGIC, STORE_MAGIC + sizeof(STORE_MAGIC));
+	for(auto && kv : settings_cache)
+		store_put_record(buf, srt_put, kv.first, kv.second.value);
+	store_put_commit(buf);
+
+	const char mode[2]  = { 'w',  0  };
+	File file = SETTINGS_FS.open(STORE_TMP_FILE, mode);
+	if(!file) return false;
+	bool success = buf.size() == file.write(buf.data(), buf.size());
+	file.close();
+	if(!success) return false;
+
+	// LittleFS rename replaces the old log atomically
+	if(!SETTINGS_FS.rename(STORE_TMP_FILE, STORE_FILE)) return false;
+
+	for(auto && kv : settings_cache) kv.second.dirty = false;
+	store_removed.clear();
+	store_size = store_live_size = buf.size();
+	store_needs_compaction = false;
+	return true;
+}
+
+//! Append dirty entries and removals to the log as one commit group.
+static bool settings_store_append()
+{
+	std::vector<uint8_t> buf;
+	for(auto && kv : settings_cache)
+		if(kv.second.dirty) store_put_record(buf, srt_put, kv.first, kv.second.value);
+	for(auto && key : store_removed)
+		store_put_record(buf, srt_remove, key, std::vector<uint8_t>());
+	if(buf.size() == 0) return true;
+	store_put_commit(buf);
+
+	const char mode[2]  = { 'a',  0  };
+	File file = SETTINGS_FS.open(STORE_FILE, mode);
+	if(!file) return false;
+	bool success = buf.size() == file.write(buf.data(), buf.size());
+	file.close();
+	if(!success)
+	{
+		// the log may end with a partial group; rewrite it on the next flush
+		store_needs_compaction = true;
+		return false;
+	}
+
+	for(auto && kv : settings_cache) kv.second.dirty = false;
+	store_removed.clear();
+	store_size += buf.size();
+	return true;
+}
+
+//! read a legacy setting file into the value.
+//! returns whether the file is read and its check sum is valid.
+static bool settings_read_legacy_file(File & file, std::vector<uint8_t> & value)
+{
+	size_t file_size = file.size();
+	if(file_size < CHECKSUM_SIZE) return false;
+
+	uint32_t file_crc = 0;
+	if(file.read(reinterpret_cast<uint8_t *>(&file_crc), CHECKSUM_SIZE) != CHECKSUM_SIZE)
+		return false; // read error
+
+	value.resize(file_size - CHECKSUM_SIZE);
+	if(value.size() && file.read(value.data(), value.size()) != value.size())
+		return false; // read error
+
+	uint32_t crc = crc32_le(INITIAL_CRC_VALUE, value.data(), value.size());
+	return crc == file_crc;
+}
+
+//! Scan legacy one-file-per-key settings. If 'load' is true, valid ones
+//! are loaded into the cache. All of them are removed afterwards.
+static int settings_sweep_legacy(bool load)
+{
+	string_vector names;
+	File dir = SETTINGS_FS.open("/");
+	File in;
+	while(!!(in = dir.openNextFile()))
+	{
+		String name = in.name();
+		int last_slash = name.lastIndexOf('/');
+		if(last_slash != -1)
+			name = name.c_str() + last_slash + 1; // extract basename
+
+		// directories and dot files (like console history and the store) are not settings
+		if(in.isDirectory() || name.startsWith(F(".")))
+		{
+			in.close();
+			continue;
+		}
+
+		settings_entry_t entry;
+		if(load && name.length() <= MAX_KEY_LEN && settings_read_legacy_file(in, entry.value))
+			settings_cache[name] = std::move(entry);
+		in.close();
+		names.push_back(name);
+	}
+	dir.close();
+
+	if(!load || settings_store_compact())
+	{
+		for(auto && name : names)
+			SETTINGS_FS.remove(String(F("/")) + name);
+	}
+	return names.size();
+}
+
 void init_settings()
 {
 	puts("Settings store initializing ...");
+	if(!settings_mutex) settings_mutex = xSemaphoreCreateRecursiveMutex();
 	bool second = false;
 retry:
-    if(!SETTINGS_FS.begin(true, SETTINGS_PART_LABEL.c_str(), SETTINGS_MOUNT_POINT.c_str(), 2))
+	// the store is read and written in whole; no file buffer needed
+	flash_fs_config_t config;
+	config.label = SETTINGS_PART_LABEL.c_str();
+	config.base_path = SETTINGS_MOUNT_POINT.c_str();
+	config.format_on_fail = true;
+    if(!SETTINGS_FS.begin(config))
 	{
 		if(second)
 		{
@@ -32,6 +334,24 @@ retry:
 		second = true;
 		goto retry;
 	}
+
+	uint32_t start = millis();
+	SETTINGS_FS.remove(STORE_TMP_FILE); // left by interrupted compaction, if any
+	if(settings_store_load())
+	{
+		// remove legacy files left by interrupted migration, if any
+		settings_sweep_legacy(false);
+		if(store_needs_compaction) settings_store_compact();
+	}
+	else
+	{
+		// migrate from one-file-per-key layout
+		int n = settings_sweep_legacy(true);
+		if(n) printf("Settings: migrated %d legacy setting files.\n", n);
+		else settings_store_compact(); // create empty store
+	}
+	printf("Settings store: %d keys loaded in %d ms.\n",
+		(int)settings_cache.size(), (int)(millis() - start));
 }
 
 // Clear settings store. Instead of calling this function directly,
@@ -39,81 +359,182 @@ retry:
 void _clear_settings()
 {
 	SETTINGS_FS.format(SETTINGS_PART_LABEL.c_str());
+	settings_cache.clear();
+	store_removed.clear();
+	settings_has_dirty = false;
 }
 
-static constexpr size_t MAX_KEY_LEN = 30;
-static constexpr int CHECKSUM_SIZE = sizeof(uint32_t); // in bytes
+//! Write all pending settings to the flash as one commit group.
+//! Returns whether the pending settings are written.
+static bool settings_flush_locked()
+{
+	if(!settings_has_dirty) return true;
 
-//! initial value for crc.
-//! 0x00000000 or 0xffffffff is not suitable because it is
-//! indistinguishable from all-cleared RAM or all-cleared FLASH ROM.
-static constexpr uint32_t INITIAL_CRC_VALUE = 0x12345678;
+	bool success;
+	int64_t start = esp_timer_get_time();
+	if(store_needs_compaction ||
+		(store_size >= STORE_COMPACT_MIN && store_size >= store_live_size * 2))
+		success = settings_store_compact();
+	else
+		success = settings_store_append();
+	settings_flush_latency.add((uint32_t)(esp_timer_get_time() - start));
+
+	settings_has_dirty = !success;
+	if(!success)
+	{
+		printf("Settings: flush failed. Will retry later.\n");
+		settings_dirty_since = millis();
+	}
+	return success;
+}
 
-//! check checksum for a setting.
-//! file pointer is set just after the setting checksum.
-//! returns whether the check sum is valid.
-static bool settings_check_crc(File & file)
+//! Write all pending settings to the flash
+void settings_flush()
 {
-	uint32_t file_crc = 0;
-	if(file.read(reinterpret_cast<uint8_t *>(&file_crc), CHECKSUM_SIZE) != CHECKSUM_SIZE)
-		return false; // read error
+	settings_lock_t lock;
+	settings_flush_locked();
+}
 
-	uint8_t ibuf[64];
-	uint32_t crc = INITIAL_CRC_VALUE;
+//! Set write-behind delay in ms. 0 makes every write go to the flash at once.
+void settings_set_flush_delay(uint32_t ms)
+{
+	settings_flush_delay = ms;
+	if(ms == 0) settings_flush();
+}
 
-	while(true)
+//! call listeners of pending subscriptions, outside of the lock
+static void settings_notify()
+{
+	std::vector<settings_subscription_id_t> ids;
 	{
-		size_t isz = file.read(ibuf, sizeof(ibuf));
-		if(isz == 0) break;
-		crc = crc32_le(crc, ibuf, isz);
+		settings_lock_t lock;
+		for(auto && sub : settings_subscriptions)
+		{
+			if(sub.pending) ids.push_back(sub.id);
+			sub.pending = false;
+		}
+		settings_notify_pending = false;
 	}
 
-	file.seek(CHECKSUM_SIZE); // set file pointer just after the check sum
-
-//	printf("file checksum: %08x   computed checksum: %08x\r\n", file_crc, crc); 
-	return crc == file_crc;
+	for(auto id : ids)
+	{
+		// a listener may have unsubscribed another one
+		settings_listener_t listener;
+		{
+			settings_lock_t lock;
+			for(auto && sub : settings_subscriptions)
+				if(sub.id == id) listener = sub.listener;
+		}
+		if(listener) listener();
+	}
 }
 
+void poll_settings()
+{
+	if(settings_has_dirty &&
+		(int32_t)(millis() - settings_dirty_since) >= (int32_t)settings_flush_delay)
+		settings_flush();
 
-// write checksum 
+	if(settings_notify_pending &&
+		(int32_t)(millis() - settings_changed_at) >= (int32_t)SETTINGS_NOTIFY_DELAY)
+		settings_notify();
+}
 
-//! write a non-string setting to specified settings entry
-bool settings_write(const String & _key, const void * ptr, size_t size, settings_overwrite_t overwrite)
+//! Subscribe to changes of settings whose key starts with the prefix
+settings_subscription_id_t settings_subscribe(const String & prefix, const settings_listener_t & listener)
 {
-	if(_key.length()  > MAX_KEY_LEN) return false;
-	String key = String(F("/")) + _key;
+	settings_lock_t lock;
+	settings_subscription_id_t id = settings_next_subscription_id++;
+	settings_subscriptions.push_back(settings_subscription_t{id, prefix, listener, false});
+	return id;
+}
 
-	if(overwrite.overwrite == false)
+//! Remove the subscription
+void settings_unsubscribe(settings_subscription_id_t id)
+{
+	settings_lock_t lock;
+	settings_subscriptions.erase(std::remove_if(settings_subscriptions.begin(), settings_subscriptions.end(),
+		[id](const settings_subscription_t & sub) { return sub.id == id; }), settings_subscriptions.end());
+}
+
+//! mark subscriptions matching the key to be notified
+static void settings_mark_changed_locked(const String & key)
+{
+	for(auto && sub : settings_subscriptions)
 	{
-		// check key existence
-		const char mode[2]  = { 'r',  0  };
-		File file = SETTINGS_FS.open(key, mode);
-		if(file)
+		if(key.startsWith(sub.prefix))
 		{
-			if(settings_check_crc(file))
-			{
-				// valid key already exists; do not overwrite.
-				file.close();
-				return false;
-			}
+			sub.pending = true;
+			settings_notify_pending = true;
 		}
-		file.close();	
 	}
+	settings_changed_at = millis();
+}
 
-	const char mode[2]  = { 'w',  0  };
-	File file = SETTINGS_FS.open(key, mode);
-	if(!file) return false;
+//! count a changed value by its key prefix
+static void settings_count_write_locked(const String & key, size_t size)
+{
+	int us = key.indexOf('_');
+	String prefix = us == -1 ? key : key.substring(0, us + 1);
+	settings_write_stat_t & stat = settings_write_stats[prefix];
+	stat.prefix = prefix;
+	++ stat.writes;
+	stat.bytes += size;
+}
 
-	uint32_t crc = INITIAL_CRC_VALUE;
-	crc = crc32_le(crc, reinterpret_cast<const uint8_t *>(ptr), size);
-	bool success;
-	success = CHECKSUM_SIZE == file.write(reinterpret_cast<const uint8_t *>(&crc), CHECKSUM_SIZE);
-	if(!success) { file.close(); return false; }
+//! Get write counters since boot
+void settings_get_write_stats(std::vector<settings_write_stat_t> & stats, latency_histogram_t & flush_latency)
+{
+	settings_lock_t lock;
+	stats.clear();
+	for(auto && kv : settings_write_stats) stats.push_back(kv.second);
+	flush_latency = settings_flush_latency;
+}
+
+void settings_reset_write_stats()
+{
+	settings_lock_t lock;
+	settings_write_stats.clear();
+	settings_flush_latency.clear();
+}
 
-	success = size == file.write(reinterpret_cast<const uint8_t *>(ptr), size);
+//! store a value into the cache and mark it to be written
+static void settings_put_locked(const String & key, const uint8_t *p, size_t size)
+{
+	auto it = settings_cache.find(key);
+	if(it != settings_cache.end() && it->second.value.size() == size &&
+		(size == 0 || !memcmp(it->second.value.data(), p, size)))
+		return; // not changed; nothing to write
+
+	settings_entry_t & entry = settings_cache[key];
+	entry.value.assign(p, p + size);
+	entry.dirty = true;
+	auto removed = std::find(store_removed.begin(), store_removed.end(), key);
+	if(removed != store_removed.end()) store_removed.erase(removed); // the put supersedes the removal
+	if(!settings_has_dirty)
+	{
+		settings_has_dirty = true;
+		settings_dirty_since = millis();
+	}
+	settings_mark_changed_locked(key);
+	settings_count_write_locked(key, size);
+}
 
-	file.close();
-	return success;
+//! write a non-string setting to specified settings entry
+bool settings_write(const String & key, const void * ptr, size_t size, settings_overwrite_t overwrite)
+{
+	if(key.length()  > MAX_KEY_LEN || size > 0xffff) return false;
+
+	{
+		settings_lock_t lock;
+		if(overwrite.overwrite == false && settings_cache.count(key))
+			return false; // valid key already exists; do not overwrite.
+
+		settings_put_locked(key, reinterpret_cast<const uint8_t *>(ptr), size);
+	}
+
+	if(settings_flush_delay == 0) settings_flush();
+	return true;
 }
 
 //! write a string setting to specified settings entry
@@ -125,107 +546,72 @@ bool settings_write(const String & key, const String & value, settings_overwrite
 
 
 //! read a non-string setting from specified settings entry
-bool settings_read(const String & _key, void *ptr, size_t size)
+bool settings_read(const String & key, void *ptr, size_t size)
 {
-	if(_key.length()  > MAX_KEY_LEN) return false;
-	String key = String(F("/")) + _key;
-
-	const char mode[2]  = { 'r',  0  };
-	File file = SETTINGS_FS.open(key, mode);
-	if(!file) return false;
+	settings_lock_t lock;
+	auto it = settings_cache.find(key);
+	if(it == settings_cache.end()) return false;
+	if(it->second.value.size() < size) return false;
 
-	if(!settings_check_crc(file)) { file.close(); return false; }
-
-	bool success = size == file.read(reinterpret_cast<uint8_t *>(ptr), size);
-
-	file.close();
-	return success;
+	memcpy(ptr, it->second.value.data(), size);
+	return true;
 }
 
 
 
 //! read a string setting from specified settings entry
-bool settings_read(const String & _key, String & value)
+bool settings_read(const String & key, String & value)
 {
-	if(_key.length()  > MAX_KEY_LEN) return false;
-	String key = String(F("/")) + _key;
-
-	const char mode[2]  = { 'r',  0  };
-	File file = SETTINGS_FS.open(key, mode);
-	if(!file) return false;
-
-	if(!settings_check_crc(file)) { file.close(); return false; }
+	settings_lock_t lock;
+	auto it = settings_cache.find(key);
+	if(it == settings_cache.end()) return false;
 
-	size_t size = file.size() - CHECKSUM_SIZE;
+	size_t size = it->second.value.size();
 	char *buf = new char[size + 1];
-	if(!buf)
-	{
-		file.close();
-		return false; // no memory ?
-	}
+	if(!buf) return false; // no memory ?
 
-	bool success = size == file.read(reinterpret_cast<uint8_t *>(buf), size);
-	if(success)
-	{
-		buf[size] = '\0';
-		value = buf;
-	}
+	memcpy(buf, it->second.value.data(), size);
+	buf[size] = '\0';
+	value = buf;
 
 	delete [] buf;
-	file.close();
-	return success;
+	return true;
 }
 
 
-//! Write string vector settings
-bool settings_write_vector(const String & key, const string_vector & value, settings_overwrite_t overwrite)
+//! serialize string vector; the delimiter is \0
+static void settings_serialize_vector(const string_vector & value, std::vector<uint8_t> & blk)
 {
-	// compute all string length sum
-	size_t sum = 0;
-	for(auto && v : value) sum += v.length() + 1;
-
-	// allocate memory enough to contain all list
-	char *blk = new char[sum];
-	if(!blk) return false;
-
-	// copy string content to the blk. the delimiter is \0
-	char *p = blk;
+	blk.clear();
 	for(auto && v : value)
 	{
-		strcpy(p, v.c_str());
-		p += v.length() + 1;
+		const char *p = v.c_str();
+		blk.insert(blk.end(), p, p + v.length() + 1);
 	}
+}
 
-	// write settings
-	bool res = settings_write(key, blk, sum, overwrite);
-
-	// free blk and return
-	delete [] blk;
-	return res;
+//! Write string vector settings
+bool settings_write_vector(const String & key, const string_vector & value, settings_overwrite_t overwrite)
+{
+	std::vector<uint8_t> blk;
+	settings_serialize_vector(value, blk);
+	return settings_write(key, blk.data(), blk.size(), overwrite);
 }
 
 //! Read string vector settings
-bool settings_read_vector(const String & _key, string_vector & value)
+bool settings_read_vector(const String & key, string_vector & value)
 {
-	if(_key.length()  > MAX_KEY_LEN) return false;
-	String key = String(F("/")) + _key;
-
 	value.clear();
 
-	const char mode[2]  = { 'r',  0  };
-	File file = SETTINGS_FS.open(key, mode);
-	if(!file) return false;
-
-	if(!settings_check_crc(file)) { file.close(); return false; }
-
-	size_t size = file.size() - CHECKSUM_SIZE;
+	settings_lock_t lock;
+	auto it = settings_cache.find(key);
+	if(it == settings_cache.end()) return false;
 
+	size_t size = it->second.value.size();
 	char *ptr = new char[size + 1];
 	if(!ptr) return false; // memory error
 
-	bool success = size == file.read(reinterpret_cast<uint8_t *>(ptr), size);
-	if(!success) { delete [] ptr; file.close(); return false; /* read error*/ }
-
+	memcpy(ptr, it->second.value.data(), size);
 	ptr[size] = 0; // force terminate at last
 
 	char *p = ptr;
@@ -239,63 +625,147 @@ bool settings_read_vector(const String & _key, string_vector & value)
 	}
 
 	delete [] ptr;
-	file.close();
-	return success;
+	return true;
 
 }
 
+//! Remove a setting. The next flush appends a remove record (a tombstone)
+//! for the key; the next compaction drops the key from the log.
+void settings_remove(const String & key)
+{
+	{
+		settings_lock_t lock;
+		if(!settings_cache.erase(key)) return; // not existing
+		store_removed.push_back(key);
+		if(!settings_has_dirty)
+		{
+			settings_has_dirty = true;
+			settings_dirty_since = millis();
+		}
+		settings_mark_changed_locked(key);
+	}
+
+	if(settings_flush_delay == 0) settings_flush();
+}
 
-//! Serialize settings to specified main fs partition filename
-bool settings_export(const String & target_name,
-	const String & exclude_prefix)
+//! read a typed setting; the value must be of the version and exactly the size
+bool settings_read_typed(const String & key, uint8_t version, void *ptr, size_t size)
 {
-	const char w_mode[2]  = { 'w',  0 };
-	String tar_dir_prefix = F("mz5_settings");
-	File dir;
-    File in;
+	settings_lock_t lock;
+	auto it = settings_cache.find(key);
+	if(it == settings_cache.end()) return false;
+	const std::vector<uint8_t> & value = it->second.value;
+	if(value.size() != size + 1 || value[0] != version) return false;
+
+	memcpy(ptr, value.data() + 1, size);
+	return true;
+}
+
+//! write a typed setting with the version byte
+bool settings_write_typed(const String & key, uint8_t version, const void *ptr, size_t size)
+{
+	std::vector<uint8_t> blk(size + 1);
+	blk[0] = version;
+	memcpy(blk.data() + 1, ptr, size);
+	return settings_write(key, blk.data(), blk.size());
+}
+
+
+bool settings_transaction_t::put(const String & key, const void * ptr, size_t size)
+{
+	if(key.length()  > MAX_KEY_LEN || size > 0xffff)
+	{
+		valid = false;
+		return false;
+	}
+	const uint8_t *p = reinterpret_cast<const uint8_t *>(ptr);
+	items.push_back(item_t{key, std::vector<uint8_t>(p, p + size)});
+	return true;
+}
+
+bool settings_transaction_t::put(const String & key, const String & value)
+{
+	return put(key, value.c_str(), value.length());
+}
+
+bool settings_transaction_t::put_vector(const String & key, const string_vector & value)
+{
+	std::vector<uint8_t> blk;
+	settings_serialize_vector(value, blk);
+	return put(key, blk.data(), blk.size());
+}
+
+bool settings_transaction_t::commit()
+{
+	if(!valid)
+	{
+		items.clear();
+		return false;
+	}
+
+	settings_lock_t lock;
+	for(auto && item : items)
+		settings_put_locked(item.key, item.value.data(), item.value.size());
+	items.clear();
+
+	// pending writes outside the transaction go into the same commit group;
+	// that does not break the atomicity of this transaction.
+	return settings_flush_locked();
+}
 
+
+static const char TAR_DIR_PREFIX[] = "mz5_settings/";
+
+// mtar writer callback; forwards the bytes to the sink
+static int settings_export_write(mtar_t *tar, const void *data, unsigned size)
+{
+	const settings_export_sink_t & sink = *reinterpret_cast<const settings_export_sink_t *>(tar->udata);
+	return sink(reinterpret_cast<const uint8_t *>(data), size) ? MTAR_ESUCCESS : MTAR_EWRITEFAIL;
+}
+
+//! Serialize settings as a tar archive into the sink, as it is built
+bool settings_export(const settings_export_sink_t & sink,
+	const String & exclude_prefix)
+{
 	// allocate mtar_t. use heap to reduce stack usage.
 	mtar_t *p_tar = new mtar_t;
 	if(!p_tar) return false;
+	mtar_open_writer(p_tar, settings_export_write, const_cast<settings_export_sink_t *>(&sink));
 
-	// open tar archive for writing
-	if(MTAR_ESUCCESS != mtar_open(p_tar, target_name.c_str(), w_mode))
-		goto error_end; // open error
-
-	// scan settings directory
-	puts("Scanning dir ...");
-	dir = SETTINGS_FS.open("/"); // open settings directory
-	while(!!(in = dir.openNextFile()))
+	// copy the values, so that the lock is not held while the sink sends
+	// them to a possibly slow client
+	std::vector<std::pair<String, std::vector<uint8_t>>> items;
 	{
-		// skip excluded file name
-		String filename = dir.name();
-		printf("Exporting setting %s ... \r\n", filename.c_str());
-		if(exclude_prefix.length() != 0 &&
-			filename.startsWith(exclude_prefix)) continue;
+		settings_lock_t lock;
+		items.reserve(settings_cache.size());
+		for(auto && kv : settings_cache)
+		{
+			// skip excluded key
+			if(exclude_prefix.length() != 0 &&
+				kv.first.startsWith(exclude_prefix)) continue;
+			items.emplace_back(kv.first, kv.second.value);
+		}
+	}
 
-		// write content as base64
-		size_t size = in.size() - CHECKSUM_SIZE;
-		if(!settings_check_crc(in)) { in.close(); continue; }
+	for(auto && item : items)
+	{
+		const String & key = item.first;
+		printf("Exporting setting %s ... \r\n", key.c_str());
 
 		// write header
+		const std::vector<uint8_t> & value = item.second;
 		if(MTAR_ESUCCESS != mtar_write_file_header(p_tar,
-			(tar_dir_prefix + filename).c_str(), size))
+			(String(TAR_DIR_PREFIX) + key).c_str(), value.size()))
 			goto error_end; // write error
 
 		// write content
-		uint8_t buf[128];
-		while(true)
-		{
-			size_t isz = in.read(buf, sizeof(buf));
-			if(isz == 0) break;
-			if(MTAR_ESUCCESS != mtar_write_data(p_tar, buf, isz))
-				goto error_end; // write error
-		}
+		if(value.size() &&
+			MTAR_ESUCCESS != mtar_write_data(p_tar, value.data(), value.size()))
+			goto error_end; // write error
 	}
-	puts("Done scanning dir.");
 
-	mtar_finalize(p_tar);
-	mtar_close(p_tar);
+	if(MTAR_ESUCCESS != mtar_finalize(p_tar))
+		goto error_end;
 
 	delete p_tar;
 	return true;
@@ -305,101 +775,152 @@ error_end:
 	return false;
 }
 
-
-//! import settings from specified main fs partition filename
-bool settings_import(const String & target_name)
+//! Serialize settings to specified main fs partition filename
+bool settings_export(const String & target_name,
+	const String & exclude_prefix)
 {
 	const char w_mode[2]  = { 'w',  0 };
-	const char r_mode[2]  = { 'r',  0 };
-//	const char nullstr[1] = { 0 };
-	int processed_files = 0;
-	int res;
+	File file = FS.open(target_name, w_mode);
+	if(!file) return false;
 
-	// allocate mtar_t and its header. use heap to reduce stack usage.
-	mtar_t *p_tar;
-	mtar_header_t *p_h;
+	bool success = settings_export([&file](const uint8_t *buf, size_t size) {
+			return file.write(buf, size) == size;
+		}, exclude_prefix);
+	file.close();
+	return success;
+}
 
-	p_tar = new mtar_t;
-	p_h = new mtar_header_t;
-	if(!p_tar || !p_h) goto error_end; // memory error
 
-	// open archive for reading
-	res = mtar_open(p_tar, target_name.c_str(), r_mode);
-	if(MTAR_ESUCCESS != res)
-	{
-		printf("mtar_open() failed. code=%d\r\n", res);
-		goto error_end; // open error
-	}
+// Streaming import state. Imported values are collected into a
+// transaction, so that a broken archive changes nothing.
+struct settings_import_state_t
+{
+	mtar_parser_t parser;
+	settings_transaction_t transaction;
+	String key; //!< key of the current record
+	std::vector<uint8_t> value; //!< value of the current record
+	size_t total = 0; //!< bytes fed
+	int processed = 0; //!< number of valid settings
+	bool failed = false;
+};
+
+static settings_import_state_t *import_state;
+
+static int settings_import_on_header(mtar_parser_t *p, const mtar_header_t *h)
+{
+	settings_import_state_t *st = reinterpret_cast<settings_import_state_t *>(p->udata);
+
+	// extract basename of the filename
+	String fn = h->name;
+	printf("Processing %s ...\r\n", fn.c_str());
+	int last_slash = fn.lastIndexOf('/');
+	if(last_slash != -1)
+		fn = fn.c_str() + last_slash + 1; // extract basename
+
+	if(h->size > MAX_SETTINGS_TAR_SIZE) return MTAR_EFAILURE;
+	st->key = fn;
+	st->value.clear();
+	st->value.reserve(h->size);
+	return MTAR_ESUCCESS;
+}
 
-	// read input archive
-	while( (mtar_read_header(p_tar, p_h)) != MTAR_ENULLRECORD)
-	{
-		// extract basename of the filename
-		String fn = p_h->name;
-		printf("Processing %s ...", fn.c_str());
-		int last_slash = fn.lastIndexOf('/');
-		if(last_slash != -1)
-			fn = fn.c_str() + last_slash + 1; // extract basename
-		fn = String(F("/")) + fn; // make it on the root directory
-
-		// open file
-		File out = SETTINGS_FS.open(fn.c_str(), w_mode);
-
-		// reserve checksum space
-		uint32_t crc = 0xffffffff;
-		if(CHECKSUM_SIZE !=
-			out.write(reinterpret_cast<const uint8_t *>(&crc),
-				CHECKSUM_SIZE)) goto file_write_error; // file write error
-		crc = INITIAL_CRC_VALUE;
-
-		// copy value
-		uint8_t ibuf[128];
-		size_t size = p_h->size;
-		while(true)
-		{
-			size_t one_size = sizeof(ibuf) < size ? sizeof(ibuf) : size;
-			if(one_size == 0) break;
-			if(MTAR_ESUCCESS != mtar_read_data(p_tar, ibuf, one_size))
-			{
-				puts("File read error.");
-				goto error_end; // read error
-			}
-			crc = crc32_le(crc, ibuf, one_size);
-			if(one_size != out.write(ibuf, one_size)) goto file_write_error;
-			size -= one_size;
-		}
+static int settings_import_on_data(mtar_parser_t *p, const void *data, unsigned size)
+{
+	settings_import_state_t *st = reinterpret_cast<settings_import_state_t *>(p->udata);
+	const uint8_t *d = reinterpret_cast<const uint8_t *>(data);
+	st->value.insert(st->value.end(), d, d + size);
+	return MTAR_ESUCCESS;
+}
 
-		// write CRC back
-		out.seek(0);
-		if(CHECKSUM_SIZE !=
-			out.write(reinterpret_cast<const uint8_t *>(&crc),
-				CHECKSUM_SIZE)) goto file_write_error; // file write error
-		out.close();
+static int settings_import_on_end(mtar_parser_t *p)
+{
+	settings_import_state_t *st = reinterpret_cast<settings_import_state_t *>(p->udata);
+	if(st->key.length() == 0) return MTAR_ESUCCESS; // a directory entry
 
-		// To the next file
-		++ processed_files;
-		if(mtar_next(p_tar) != MTAR_ESUCCESS) break; 
+	// skip invalid keys instead of failing the whole transaction
+	if(st->key.length() > MAX_KEY_LEN || st->value.size() > 0xffff)
+	{
+		printf("Invalid key %s.\r\n", st->key.c_str());
+		return MTAR_ESUCCESS;
 	}
+	st->transaction.put(st->key, st->value.data(), st->value.size());
+	++ st->processed;
+	return MTAR_ESUCCESS;
+}
 
-	if(p_tar) delete p_tar;
-	if(p_h) delete p_h;
+//! Start streaming import; discards any unfinished import
+void settings_import_begin()
+{
+	delete import_state;
+	import_state = new settings_import_state_t;
+	if(!import_state) return;
+
+	mtar_parser_t & p = import_state->parser;
+	mtar_parser_init(&p);
+	p.on_header = settings_import_on_header;
+	p.on_data = settings_import_on_data;
+	p.on_end = settings_import_on_end;
+	p.udata = import_state;
+}
+
+//! Feed a piece of the archive. Returns false once the import has failed.
+bool settings_import_feed(const void *data, size_t size)
+{
+	settings_import_state_t *st = import_state;
+	if(!st || st->failed) return false;
 
-	if(processed_files == 0)
+	st->total += size;
+	if(st->total > MAX_SETTINGS_TAR_SIZE)
 	{
-		puts("No setting items processed.");
+		puts("Import archive too large.");
+		st->failed = true;
 		return false;
 	}
 
+	int res = mtar_parser_feed(&st->parser, data, size);
+	if(res != MTAR_ESUCCESS)
+	{
+		printf("Import archive broken. code=%d\r\n", res);
+		st->failed = true;
+		return false;
+	}
 	return true;
+}
 
-file_write_error:
-	puts("File write error.");
-
-error_end:
-	if(p_tar) delete p_tar;
-	if(p_h) delete p_h;
-	return false;
+//! Finish streaming import; the imported settings are written to the flash
+//! at once. Returns whether any setting has been imported.
+bool settings_import_end()
+{
+	settings_import_state_t *st = import_state;
+	import_state = nullptr;
+	if(!st) return false;
+
+	bool success = false;
+	if(st->failed)
+		; // already reported
+	else if(!mtar_parser_done(&st->parser))
+		puts("Import archive truncated.");
+	else if(st->processed == 0)
+		puts("No setting items processed.");
+	else
+		success = st->transaction.commit();
 
+	delete st;
+	return success;
 }
 
+//! import settings from specified main fs partition filename
+bool settings_import(const String & target_name)
+{
+	const char r_mode[2]  = { 'r',  0 };
+	File file = FS.open(target_name, r_mode);
+	if(!file) return false;
 
+	settings_import_begin();
+	uint8_t buf[512];
+	size_t len;
+	while((len = file.read(buf, sizeof(buf))) > 0)
+		if(!settings_import_feed(buf, len)) break;
+	file.close();
+	return settings_import_end();
+}
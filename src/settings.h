@@ -2,6 +2,9 @@
 #define SETTINGS_H__
 
 #include <vector>
+#include <type_traits>
+#include <functional>
+#include "flash_stats.h"
 
 typedef std::vector<String> string_vector;
 
@@ -21,6 +24,49 @@ void init_settings();
 
 void _clear_settings();
 
+/**
+ * Settings are cached in RAM and written to the flash behind the writes.
+ * Call this in main loop.
+ * */
+void poll_settings();
+
+//! Write all pending settings to the flash now. Call this before reboot.
+void settings_flush();
+
+//! Set delay in ms from the first pending write to the flash write.
+//! Writes within the delay are coalesced. 0 for write-through.
+void settings_set_flush_delay(uint32_t ms);
+
+//! Write counters of settings sharing a key prefix; the prefix is the key
+//! up to and including its first '_', or the whole key
+struct settings_write_stat_t
+{
+	String prefix;
+	uint32_t writes;
+	uint32_t bytes;
+};
+
+//! Get write counters since boot, and flash write latency of flushes
+void settings_get_write_stats(std::vector<settings_write_stat_t> & stats, latency_histogram_t & flush_latency);
+void settings_reset_write_stats();
+
+typedef std::function<void ()> settings_listener_t;
+typedef int settings_subscription_id_t;
+
+/**
+ * Subscribe to changes of settings whose key starts with the prefix.
+ * The listener is called on the main thread from poll_settings(), once
+ * the settings have been quiet for a while; several changes in a row,
+ * such as a web form posting some fields, result in a single call.
+ * The listener should read the new values from the settings store.
+ * Returns the id to pass to settings_unsubscribe().
+ * */
+settings_subscription_id_t settings_subscribe(const String & prefix, const settings_listener_t & listener);
+
+//! Stop calling the listener. Listeners of objects that can be destroyed
+//! must be unsubscribed in the destructor.
+void settings_unsubscribe(settings_subscription_id_t id);
+
 bool settings_write(const String & key, const void * ptr, size_t size, settings_overwrite_t overwrite = SETTINGS_OVERWRITE);
 bool settings_write(const String & key, const String & value, settings_overwrite_t overwrite = SETTINGS_OVERWRITE);
 bool settings_read(const String & key, void *ptr, size_t size);
@@ -30,9 +76,170 @@ bool settings_read(const String & key, String & value);
 bool settings_write_vector(const String & key, const string_vector & value, settings_overwrite_t overwrite = SETTINGS_OVERWRITE);
 bool settings_read_vector(const String & key, string_vector & value);
 
+//! Remove a setting; it reads as missing (default) afterwards
+void settings_remove(const String & key);
+
+
+// Typed settings.
+// A setting is described at compile time by its key, default value and
+// valid range, and is stored in binary: a version byte followed by the
+// raw value. A value which is missing, of another version or size, or out
+// of range reads as the default. get() never writes to the store, so the
+// default need not be written at boot.
+
+bool settings_read_typed(const String & key, uint8_t version, void *ptr, size_t size);
+bool settings_write_typed(const String & key, uint8_t version, const void *ptr, size_t size);
+
+/**
+ * A setting of trivially copyable type T; an integer, a struct or a
+ * std::array. The optional validator tells whether a value is acceptable.
+ * Bump the version when the layout of T changes; stored values of other
+ * versions are then ignored.
+ * */
+template <typename T>
+class setting_t
+{
+	static_assert(std::is_trivially_copyable<T>::value, "setting_t needs a trivially copyable type");
+
+public:
+	typedef bool (*validator_t)(const T & value);
+
+protected:
+	const char *key;
+	uint8_t version;
+	T def;
+	validator_t validator;
+
+public:
+	constexpr setting_t(const char *_key, uint8_t _version, const T & _def, validator_t _validator = nullptr) :
+		key(_key), version(_version), def(_def), validator(_validator) {}
+
+	const char *get_key() const { return key; }
+	const T & get_default() const { return def; }
+
+	bool is_valid(const T & value) const { return !validator || validator(value); }
+
+	//! returns false if not stored or not valid; value is left unspecified then
+	bool read(T & value) const
+	{
+		return settings_read_typed(key, version, &value, sizeof(value)) && is_valid(value);
+	}
+
+	T get() const
+	{
+		T value;
+		if(read(value)) return value;
+		return def;
+	}
+
+	//! returns false if the value is not valid or could not be stored
+	bool set(const T & value) const
+	{
+		if(!is_valid(value)) return false;
+		return settings_write_typed(key, version, &value, sizeof(value));
+	}
 
+	//! back to the default
+	void reset() const { settings_remove(key); }
+};
+
+//! A string setting. Stored as is, without version byte, so that values
+//! written by settings_write() and exported archives stay compatible.
+class setting_string_t
+{
+	const char *key;
+	const char *def;
+
+public:
+	constexpr setting_string_t(const char *_key, const char *_def) : key(_key), def(_def) {}
+
+	const char *get_key() const { return key; }
+	const char *get_default() const { return def; }
+
+	String get() const
+	{
+		String value;
+		if(!settings_read(key, value)) value = def;
+		return value;
+	}
+
+	bool set(const String & value) const { return settings_write(key, value); }
+
+	void reset() const { settings_remove(key); }
+};
+
+//! A list of strings setting, stored as by settings_write_vector().
+//! The default is a static array of strings.
+class setting_string_vector_t
+{
+	const char *key;
+	const char * const *def;
+	size_t def_count;
+
+public:
+	template <size_t N>
+	constexpr setting_string_vector_t(const char *_key, const char * const (&_def)[N]) :
+		key(_key), def(_def), def_count(N) {}
+
+	const char *get_key() const { return key; }
+
+	string_vector get_default() const { return string_vector(def, def + def_count); }
+
+	string_vector get() const
+	{
+		string_vector value;
+		if(!settings_read_vector(key, value)) value = get_default();
+		return value;
+	}
+
+	bool set(const string_vector & value) const { return settings_write_vector(key, value); }
+
+	void reset() const { settings_remove(key); }
+};
+
+
+/**
+ * A group of settings writes which is applied all or nothing.
+ * put() values, then commit(); the group is written to the flash at once,
+ * with a single commit record, before commit() returns. Destroying the
+ * transaction without commit() discards the values.
+ * */
+class settings_transaction_t
+{
+	struct item_t
+	{
+		String key;
+		std::vector<uint8_t> value;
+	};
+	std::vector<item_t> items;
+	bool valid = true; //!< false if any put() failed
+
+public:
+	bool put(const String & key, const void * ptr, size_t size);
+	bool put(const String & key, const String & value);
+	bool put_vector(const String & key, const string_vector & value);
+
+	//! returns whether all values are written to the flash
+	bool commit();
+};
+
+
+//! receives the exported archive piece by piece; returns false to abort
+typedef std::function<bool (const uint8_t *buf, size_t size)> settings_export_sink_t;
+
+bool settings_export(const settings_export_sink_t & sink,
+	const String & exclude_prefix);
 bool settings_export(const String & target_name,
 	const String & exclude_prefix);
+
+/**
+ * Streaming import. Call settings_import_begin(), then feed the archive
+ * as it arrives, then settings_import_end(). Nothing is changed unless
+ * the whole archive is valid.
+ * */
+void settings_import_begin();
+bool settings_import_feed(const void *data, size_t size);
+bool settings_import_end();
 bool settings_import(const String & target_name);
 
 #endif
@@ -1,92 +1,205 @@
 #include <Arduino.h>
-#include <freertos/semphr.h>
 #include <threadsync.h>
-#include <deque>
+#include <atomic>
 
-// TODO: use FreeRTOS's native queue object
-static portMUX_TYPE queue_lock = portMUX_INITIALIZER_UNLOCKED;
-struct handler_queue_item_t;
-static std::deque<handler_queue_item_t *> queue;
+extern TaskHandle_t loopTaskHandle; // defined in main.cpp of Arduino core
 
-struct handler_queue_item_t
+// Number of handler slots; must be a power of two.
+// Queue producers (console, web, etc.) rarely have more than a few
+// handlers in flight, so this is plenty.
+static constexpr int QUEUE_SLOTS = 16;
+
+/**
+ * A preallocated handler slot.
+ * A slot is referenced by the producer's future and by the queue;
+ * the slot becomes free when both references are dropped.
+ * */
+struct handler_slot_t
 {
     sync_handler_t handler;
     TaskHandle_t waiting_task;
     int retval;
+    std::atomic<bool> done;
+    std::atomic<bool> waiting; // get() blocks and wants a notification
+    std::atomic<uint8_t> refs; // 0 = free
 
-    handler_queue_item_t(sync_handler_t _handler) :
-        handler(_handler), waiting_task(xTaskGetCurrentTaskHandle()), retval(-1)
-    {
-    }
+    handler_slot_t() : waiting_task(nullptr), retval(-1), done(false), waiting(false), refs(0) {}
+};
 
-    ~handler_queue_item_t()
-    {
-    }
+static handler_slot_t slots[QUEUE_SLOTS];
 
-    void execute()
-    {
-        retval = handler();
-    }
+// Bounded MPSC ring of slot indices (D. Vyukov's bounded queue).
+// Every slot is queued at most once at a time, so the ring never overflows.
+struct ring_cell_t
+{
+    std::atomic<uint32_t> sequence;
+    uint8_t slot;
+};
 
-    void wait_execution_done()
+static ring_cell_t ring[QUEUE_SLOTS];
+static std::atomic<uint32_t> enqueue_pos(0);
+static uint32_t dequeue_pos = 0; // only the main thread touches this
+
+// ring must be ready before any task can queue a handler
+static struct ring_initializer_t
+{
+    ring_initializer_t()
     {
-        ulTaskNotifyTake(
-                            pdTRUE,          /* Clear the notification value 
-                                                before exiting. */
-                            portMAX_DELAY ); /* Block indefinitely. */
+        for(int i = 0; i < QUEUE_SLOTS; ++i)
+            ring[i].sequence.store(i, std::memory_order_relaxed);
     }
+} ring_initializer;
 
-    void notify_execution_done()
+static void ring_push(int slot)
+{
+    uint32_t pos = enqueue_pos.load(std::memory_order_relaxed);
+    for(;;)
     {
-        xTaskNotifyGive(waiting_task);
+        ring_cell_t &cell = ring[pos & (QUEUE_SLOTS - 1)];
+        uint32_t seq = cell.sequence.load(std::memory_order_acquire);
+        int32_t dif = (int32_t)(seq - pos);
+        if(dif == 0)
+        {
+            if(enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+            {
+                cell.slot = (uint8_t)slot;
+                cell.sequence.store(pos + 1, std::memory_order_release);
+                return;
+            }
+            // pos was updated by compare_exchange_weak; retry
+        }
+        else
+        {
+            // another producer took this cell; reload
+            pos = enqueue_pos.load(std::memory_order_relaxed);
+        }
     }
-};
+}
 
+// returns popped slot index, or -1 if the ring is empty
+static int ring_pop()
+{
+    ring_cell_t &cell = ring[dequeue_pos & (QUEUE_SLOTS - 1)];
+    uint32_t seq = cell.sequence.load(std::memory_order_acquire);
+    if((int32_t)(seq - (dequeue_pos + 1)) < 0)
+        return -1; // empty (or the producer has not finished yet)
+    int slot = cell.slot;
+    cell.sequence.store(dequeue_pos + QUEUE_SLOTS, std::memory_order_release);
+    ++dequeue_pos;
+    return slot;
+}
+
+static void release_slot(int slot)
+{
+    slots[slot].refs.fetch_sub(1, std::memory_order_acq_rel);
+}
+
+bool _main_thread_is_current()
+{
+    return loopTaskHandle != nullptr && xTaskGetCurrentTaskHandle() == loopTaskHandle;
+}
 
 /**
- * run specified handler in main thread
+ * Find a free slot and own it. Waits for a free slot if all slots are in use.
  * */
-int run_in_main_thread(sync_handler_t handler)
+int _main_thread_acquire_slot()
 {
-    // create queue item on heap
-    handler_queue_item_t * item = new handler_queue_item_t(handler);
-
-    // lock queue and push it back
-	portENTER_CRITICAL(&queue_lock);
-    queue.push_back(item);
-    portEXIT_CRITICAL(&queue_lock);
+    for(;;)
+    {
+        for(int i = 0; i < QUEUE_SLOTS; ++i)
+        {
+            uint8_t expected = 0;
+            if(slots[i].refs.compare_exchange_strong(expected, 2, std::memory_order_acquire))
+            {
+                // one reference for the queue, one for the future
+                slots[i].waiting_task = xTaskGetCurrentTaskHandle();
+                slots[i].retval = -1;
+                slots[i].done.store(false, std::memory_order_relaxed);
+                slots[i].waiting.store(false, std::memory_order_relaxed);
+                return i;
+            }
+        }
+        // all slots are in use
+        if(_main_thread_is_current())
+            poll_main_thread_queue(); // make room by ourselves
+        else
+            vTaskDelay(1);
+    }
+}
 
-    // wait for the handler execution done
-    // queue item is removed from deque in poll_main_thread_queue() function
-    item->wait_execution_done();
+sync_handler_t & _main_thread_slot_handler(int slot)
+{
+    return slots[slot].handler;
+}
 
-    int retval = item->retval;
+void _main_thread_submit(int slot)
+{
+    ring_push(slot);
+}
 
-    // delete handler item
-    delete item;
+bool main_thread_future_t::ready() const
+{
+    if(slot < 0) return false;
+    return slots[slot].done.load(std::memory_order_acquire);
+}
 
+int main_thread_future_t::get()
+{
+    if(slot < 0) return -1;
+    handler_slot_t &s = slots[slot];
+    while(!s.done.load(std::memory_order_acquire))
+    {
+        if(_main_thread_is_current())
+        {
+            poll_main_thread_queue();
+        }
+        else
+        {
+            // publish that we block; the main thread gives exactly one
+            // notification if it claims the flag after setting done.
+            // take only that one, leaving the count of other users intact.
+            s.waiting.store(true);
+            if(!s.done.load() || !s.waiting.exchange(false))
+                ulTaskNotifyTake(pdFALSE, portMAX_DELAY);
+        }
+    }
+    int retval = s.retval;
+    release();
     return retval;
 }
 
+void main_thread_future_t::release()
+{
+    if(slot < 0) return;
+    release_slot(slot);
+    slot = -1;
+}
+
 /**
- * poll queue for the next handler item, if exist, execute it
+ * execute all handlers queued so far.
+ * handlers queued during the execution are left for the next call,
+ * to bound the time spent here.
  * */
 void poll_main_thread_queue()
 {
-    handler_queue_item_t *item = nullptr;
-	portENTER_CRITICAL(&queue_lock);
-    if(queue.size() > 0)
+    for(int n = 0; n < QUEUE_SLOTS; ++n)
     {
-        item = queue.front();
-        queue.pop_front();
+        int slot = ring_pop();
+        if(slot < 0) break;
+
+        handler_slot_t &s = slots[slot];
+
+        // run the handler
+        s.retval = s.handler();
+        s.handler.reset();
+
+        // tell the task blocking in get() that the handler has done.
+        // a future polled by ready() or dropped gets no notification.
+        TaskHandle_t waiting_task = s.waiting_task;
+        s.done.store(true);
+        bool notify = s.waiting.exchange(false);
+        release_slot(slot);
+        if(notify)
+            xTaskNotifyGive(waiting_task);
     }
-    portEXIT_CRITICAL(&queue_lock);
-
-    if(!item) return;
-
-    // run the handler
-    item->execute();
-
-    // tell waiting task that the handler has done
-    item->notify_execution_done();
-}
\ No newline at end of file
+}
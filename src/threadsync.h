@@ -1,10 +1,158 @@
 #pragma once
 
 
-#include <functional>
+#include <stddef.h>
+#include <new>
+#include <utility>
+#include <type_traits>
 
-typedef std::function<int(void)> sync_handler_t;
+/**
+ * Maximum size of a handler which can be stored in a queue slot without
+ * heap allocation. Lambdas capturing a few pointers or integers fit here.
+ * */
+static constexpr size_t SYNC_HANDLER_INLINE_SIZE = 32;
+
+/**
+ * Small-buffer optimized callable which returns int, used as a queue item.
+ * Larger callables fall back to the heap.
+ * */
+class sync_handler_t
+{
+    typedef int (*invoke_fn_t)(void *storage);
+    typedef void (*destroy_fn_t)(void *storage);
+
+    alignas(8) unsigned char storage[SYNC_HANDLER_INLINE_SIZE];
+    invoke_fn_t invoke_fn = nullptr;
+    destroy_fn_t destroy_fn = nullptr;
+
+    template <typename Fn>
+    struct inline_ops
+    {
+        static int invoke(void *s) { return (*reinterpret_cast<Fn *>(s))(); }
+        static void destroy(void *s) { reinterpret_cast<Fn *>(s)->~Fn(); }
+    };
+
+    template <typename Fn>
+    struct heap_ops
+    {
+        static int invoke(void *s) { return (**reinterpret_cast<Fn **>(s))(); }
+        static void destroy(void *s) { delete *reinterpret_cast<Fn **>(s); }
+    };
+
+    template <typename Fn, typename Arg>
+    void _assign(Arg && f, std::true_type /* fits inline */)
+    {
+        new (storage) Fn(std::forward<Arg>(f));
+        invoke_fn = &inline_ops<Fn>::invoke;
+        destroy_fn = &inline_ops<Fn>::destroy;
+    }
+
+    template <typename Fn, typename Arg>
+    void _assign(Arg && f, std::false_type /* too large */)
+    {
+        *reinterpret_cast<Fn **>(storage) = new Fn(std::forward<Arg>(f));
+        invoke_fn = &heap_ops<Fn>::invoke;
+        destroy_fn = &heap_ops<Fn>::destroy;
+    }
+
+public:
+    sync_handler_t() {}
+    ~sync_handler_t() { reset(); }
+
+    sync_handler_t(const sync_handler_t &) = delete;
+    sync_handler_t & operator = (const sync_handler_t &) = delete;
+
+    //! store a callable. previous one is destroyed.
+    template <typename Arg>
+    void assign(Arg && f)
+    {
+        typedef typename std::decay<Arg>::type Fn;
+        reset();
+        _assign<Fn>(std::forward<Arg>(f), std::integral_constant<bool,
+            sizeof(Fn) <= SYNC_HANDLER_INLINE_SIZE && alignof(Fn) <= 8>());
+    }
+
+    //! destroy stored callable
+    void reset()
+    {
+        if(destroy_fn) destroy_fn(storage);
+        invoke_fn = nullptr;
+        destroy_fn = nullptr;
+    }
+
+    int operator ()() { return invoke_fn ? invoke_fn(storage) : -1; }
+};
+
+
+/**
+ * Handle to a handler queued by run_in_main_thread_async().
+ * Dropping the handle without calling get() detaches the handler;
+ * it is still executed but its return value is discarded.
+ * */
+class main_thread_future_t
+{
+    int slot;
+
+public:
+    main_thread_future_t() : slot(-1) {}
+    explicit main_thread_future_t(int _slot) : slot(_slot) {}
+    main_thread_future_t(main_thread_future_t && r) : slot(r.slot) { r.slot = -1; }
+    main_thread_future_t & operator = (main_thread_future_t && r)
+    {
+        if(this != &r) { release(); slot = r.slot; r.slot = -1; }
+        return *this;
+    }
+    ~main_thread_future_t() { release(); }
+
+    main_thread_future_t(const main_thread_future_t &) = delete;
+    main_thread_future_t & operator = (const main_thread_future_t &) = delete;
+
+    //! returns whether the handle refers a queued handler
+    bool valid() const { return slot >= 0; }
+
+    //! returns whether the handler has been executed. never blocks.
+    bool ready() const;
+
+    //! wait for the handler execution done and returns its return value.
+    //! the handle becomes invalid after this call.
+    //! must be called from the task which queued the handler.
+    int get();
+
+    //! detach from the handler.
+    void release();
+};
+
+
+// internal interface used by the templates below
+int _main_thread_acquire_slot();
+sync_handler_t & _main_thread_slot_handler(int slot);
+void _main_thread_submit(int slot);
+bool _main_thread_is_current();
+
+/**
+ * run specified handler in main thread, without waiting for its completion.
+ * this blocks only while all queue slots are in use.
+ * */
+template <typename Fn>
+main_thread_future_t run_in_main_thread_async(Fn && handler)
+{
+    int slot = _main_thread_acquire_slot();
+    _main_thread_slot_handler(slot).assign(std::forward<Fn>(handler));
+    _main_thread_submit(slot);
+    return main_thread_future_t(slot);
+}
+
+/**
+ * run specified handler in main thread, and wait for its completion.
+ * returns the handler's return value.
+ * */
+template <typename Fn>
+int run_in_main_thread(Fn && handler)
+{
+    if(_main_thread_is_current())
+        return handler(); // already in main thread; queueing would dead-lock
+    return run_in_main_thread_async(std::forward<Fn>(handler)).get();
+}
 
-int run_in_main_thread(sync_handler_t handler);
 void poll_main_thread_queue();
 
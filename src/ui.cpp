@@ -15,6 +15,9 @@
 #include "calendar.h"
 #include "mz_bme.h"
 #include "ambient.h"
+#include "flow.h"
+#include "session_log.h"
+#include "ui_widget.h"
 
 #include "fonts/font_5x5.h"
 #include "fonts/font_4x5.h"
@@ -35,6 +38,7 @@ enum transition_t
 class screen_base_t
 {
 	bool erase_bg = true; //!< whether to erase background automatically before draw()
+	uint32_t flow_buttons = 0; //!< buttons pushed, not yet taken by flow_take_button()
 
 public:
 	//! The constructor
@@ -52,6 +56,14 @@ protected:
 	//! Called when a button is pushed
 	virtual void on_button(uint32_t button) { ; }
 
+	//! Called for each input event, in order of arrival.
+	//! The default implementation calls on_button() for pushes (including auto repeats).
+	virtual void on_input_event(const input_event_t &ev)
+	{
+		if (ev.is_push())
+			on_button(ev.button_bit());
+	}
+
 	//! Repeatedly called 10ms periodically when the screen is active
 	virtual void on_idle_10() { ; }
 
@@ -69,6 +81,24 @@ protected:
 	//! Called when the screen is deactivated (another screen starts accepting key events)
 	virtual void on_deactivate() { ; }
 
+	//! Cooperative flow of the screen, written with FLOW_* macros (see flow.h).
+	//! While the screen is on top, this is resumed every 10ms and right after
+	//! each button event. Return false when the flow is finished.
+	//! Note that if the flow pops the screen, 'this' is deleted;
+	//! return false immediately without touching any member.
+	virtual bool run_flow() { return false; }
+
+	flow_t flow; //!< resume point of run_flow()
+
+	//! Take buttons pushed since the last call, in the mask.
+	//! Use this in FLOW_WAIT_UNTIL() to wait for a button.
+	uint32_t flow_take_button(uint32_t mask)
+	{
+		uint32_t b = flow_buttons & mask;
+		flow_buttons &= ~mask;
+		return b;
+	}
+
 	//! Call this when the screen content is written and need to be showed
 	void show(transition_t transition = t_none);
 
@@ -212,8 +242,12 @@ protected:
 				// erase background
 				if (top->get_erase_bg())
 					get_bg_frame_buffer().fill(0, 0, LED_MAX_LOGICAL_COL, LED_MAX_LOGICAL_ROW, 0);
+				uint32_t draw_start = micros();
 				if (top->draw())
+				{
+					session_on_frame_drawn(micros() - draw_start);
 					show(t_none);
+				}
 			}
 		}
 		blink_intensity += 21;
@@ -248,11 +282,15 @@ protected:
 			stack_changed = false;
 			screen_base_t *top = stack[sz - 1];
 
-			// dispatch button event
-			uint32_t buttons = button_get();
-			for (uint32_t i = 1; i; i <<= 1)
-				if (buttons & i)
-					top->on_button(i);
+			// dispatch input events, in order of arrival
+			input_event_t ev;
+			while (!stack_changed && button_get_event(ev))
+			{
+				if (session_replaying())
+					continue; // live input is ignored while a session log is replayed
+				session_on_input_event(ev);
+				dispatch_input_event(ev);
+			}
 
 			// care must be taken again,
 			// the screen may be removed during button event
@@ -262,6 +300,12 @@ protected:
 				top->on_idle_10();
 			}
 
+			if (!stack_changed)
+			{
+				// resume the flow
+				top->run_flow();
+			}
+
 			// care must be taken,
 			// the screen may be pop'ed (removed) during previous event
 			if (!stack_changed && tick_interval_50 == 0)
@@ -280,6 +324,24 @@ protected:
 	friend void ui_process();
 
 public:
+	/**
+	 * Dispatch an input event to the top screen
+	 */
+	void dispatch_input_event(const input_event_t &ev)
+	{
+		size_t sz = stack.size();
+		if (!sz)
+			return;
+		stack_changed = false;
+		screen_base_t *top = stack[sz - 1];
+		top->on_input_event(ev);
+		if (stack_changed || !ev.is_push())
+			return;
+		// resume the flow at once, so it does not need to wait for the next tick
+		top->flow_buttons |= ev.button_bit();
+		top->run_flow();
+	}
+
 	/**
 	 * Get cursor blink intensity
 	 */
@@ -323,40 +385,61 @@ void screen_base_t::reset_blink_intensity()
 	screen_manager.reset_blink_intensity();
 }
 
-//! Simple message box
-class screen_message_box_t : public screen_base_t
+//! Screen composed of retained widgets; only damaged regions are repainted
+class screen_widget_t : public screen_base_t
 {
-	static constexpr int char_list_start_y = 7 + 6; // character list start position y in pixel
-
-	String title;
-	string_vector lines;
+protected:
+	widget_set_t widgets; //!< widgets to be painted, in painting order
 
 public:
-	screen_message_box_t(const String &_title, const string_vector &_lines) : title(_title), lines(_lines)
+	screen_widget_t()
 	{
+		set_erase_bg(false); // widgets paint on top of the previous frame
 	}
 
-	// TODO: scroll and text formatting
-
 protected:
 	bool draw() override
 	{
-		// draw title
-		fb().draw_text(0, 0, 255, title.c_str(), font_5x5);
+		return widgets.paint(get_blink_intensity());
+	}
 
-		// draw line
-		fb().fill(0, 7, LED_MAX_LOGICAL_COL, 1, 128);
+	void on_activate() override
+	{
+		widgets.invalidate_all(); // another screen may have been shown
+	}
 
-		// draw char_list
-		for (size_t i = 0; i < lines.size(); ++i)
-		{
-			fb().draw_text(0, i * 6 + char_list_start_y,
-						   255, lines[i].c_str(), font_5x5);
-		}
+	void on_idle_10() override
+	{
+		widgets.tick();
+	}
+};
 
-		return true;
+//! Simple message box
+class screen_message_box_t : public screen_widget_t
+{
+	static constexpr int char_list_start_y = 7 + 6; // character list start position y in pixel
+
+	string_vector lines;
+	string_vector_list_source_t lines_source{lines};
+
+	widget_label_t title_label{0, 0, LED_MAX_LOGICAL_COL, 6, font_5x5};
+	widget_rule_t title_rule{0, 7, LED_MAX_LOGICAL_COL, 1};
+	widget_list_t lines_list{0, char_list_start_y, LED_MAX_LOGICAL_COL,
+		LED_MAX_LOGICAL_ROW - char_list_start_y + 1, &lines_source, font_5x5, 0};
+
+public:
+	screen_message_box_t(const String &_title, const string_vector &_lines) : lines(_lines)
+	{
+		title_label.set_text(_title);
+		lines_list.set_selected(-1); // no cursor
+		widgets.add(&title_label);
+		widgets.add(&title_rule);
+		widgets.add(&lines_list);
 	}
 
+	// TODO: scroll and text formatting
+
+protected:
 	void on_button(uint32_t button) override
 	{
 		switch (button)
@@ -454,28 +537,32 @@ protected:
 };
 
 //! ASCII string editor UI
-class screen_ascii_editor_t : public screen_base_t
+class screen_ascii_editor_t : public screen_widget_t
 {
 protected:
 	static constexpr int num_char_list_display_lines = 6; //!< maximum display-able lines of char list
 	static constexpr int char_list_start_y = 7 + 6;		  // character list start position y in pixel
 
-	String title;  //!< the title
 	String line;   //!< a string to be edited
 	int max_chars; //!< maximum bytes arrowed
 
 	string_vector char_list;
+	string_vector_list_source_t char_list_source{char_list};
 
 	int line_start = 0;		 //!< line display start character index
-	int char_list_start = 0; //!< char_list display start line index
 	int cursor = 0;			 //!< cursor position in line
 	int y = 0;				 //!< logical position in char_list or line; 0=line, 1=BS/DEL, 2~ = char_list
 	int x = 0;				 //!< logical position in char_list
 	int px = 0;				 //!< physical x position (where cursor blinks)
 
+	widget_label_t title_label{0, 0, LED_MAX_LOGICAL_COL, 6, font_5x5};
+	widget_rule_t title_rule{0, 6, LED_MAX_LOGICAL_COL, 1};
+	widget_edit_line_t edit_line{0, 7, LED_MAX_LOGICAL_COL, 5, &line, font_5x5};
+	widget_list_t char_list_list{0, char_list_start_y, LED_MAX_LOGICAL_COL,
+		num_char_list_display_lines * 6, &char_list_source, font_5x5, 0};
+
 public:
-	screen_ascii_editor_t(const String &_title, const String &_line = "", int _max_chars = -1) : title(_title),
-																								 line(_line),
+	screen_ascii_editor_t(const String &_title, const String &_line = "", int _max_chars = -1) : line(_line),
 																								 max_chars(_max_chars),
 																								 char_list{
 																									 F("BS DEL"),
@@ -491,53 +578,45 @@ public:
 																									 F("@[\\]^_<=>?"),
 																									 F("`{|}~")}
 	{
+		title_label.set_text(_title);
+		widgets.add(&title_label);
+		widgets.add(&title_rule);
+		widgets.add(&edit_line);
+		widgets.add(&char_list_list);
+		sync_widgets();
 	}
 
 protected:
 	virtual bool validate(const String &line) { return true; }
 
-	bool draw() override
+	/**
+	 * Reflect the editor state to the widgets
+	 */
+	void sync_widgets()
 	{
-		// draw title
-		fb().draw_text(0, 0, 255, title.c_str(), font_5x5);
-
-		// draw line
-		fb().fill(0, 6, LED_MAX_LOGICAL_COL, 1, 128);
+		edit_line.set_cursor(cursor, line_start);
 
-		// draw line cursor
-		fb().fill((cursor - line_start) * 6, 7, 1, 5, get_blink_intensity());
+		if (y == 0)
+		{
+			// in edit line; no block cursor
+			char_list_list.set_selected(-1);
+			return;
+		}
 
-		// draw block cursor
+		char_list_list.set_selected(y - 1); // this also scrolls the char list
 		if (y == 1)
 		{
 			// BS or DEL
 			if (x <= 2)
-				fb().fill(0, char_list_start_y, 6 * 2, 6, get_blink_intensity()); // BS
+				char_list_list.set_cursor_span(0, 6 * 2, 6); // BS
 			else
-				fb().fill(6 * 3, char_list_start_y, 6 * 3, 6, get_blink_intensity()); // DEL
+				char_list_list.set_cursor_span(6 * 3, 6 * 3, 6); // DEL
 		}
-		else if (y >= 2)
+		else
 		{
 			// in char list
-			fb().fill(px * 6, (y - char_list_start - 1) * 6 + char_list_start_y, 5, 5,
-					  get_blink_intensity());
+			char_list_list.set_cursor_span(px * 6, 5, 5);
 		}
-
-		// draw edit line
-		fb().draw_text(1, 7, 255, line.c_str() + line_start, font_5x5);
-
-		// draw char_list
-		for (int i = 0; i < num_char_list_display_lines; ++i)
-		{
-			if (i + char_list_start < char_list.size())
-			{
-				fb().draw_text(0, i * 6 + char_list_start_y,
-							   255, char_list[i + char_list_start].c_str(), font_5x5);
-			}
-		}
-
-		// show the drawn content
-		return true;
 	}
 
 	/**
@@ -574,21 +653,6 @@ protected:
 		}
 	}
 
-	/**
-	 * Justify char list vertical range
-	 */
-	void adjust_char_list_range()
-	{
-		if (y == 0)
-			return;
-		int ny = y - 1;
-
-		if (ny < char_list_start)
-			char_list_start = ny;
-		else if (ny >= char_list_start + num_char_list_display_lines)
-			char_list_start = ny - num_char_list_display_lines + 1;
-	}
-
 	/**
 	 * Button handler
 	 */
@@ -645,14 +709,12 @@ protected:
 			if (y > 0)
 				--y;
 			adjust_px();
-			adjust_char_list_range();
 			break;
 
 		case BUTTON_DOWN:
 			if (y < char_list.size() + 1 - 1)
 				++y;
 			adjust_px();
-			adjust_char_list_range();
 			break;
 
 		case BUTTON_OK:
@@ -665,6 +727,7 @@ protected:
 				// which leads to delete this-self.
 				if (validate(_line))
 					on_ok(_line);
+				return; // 'this' may be deleted
 			}
 			else if (y == 1)
 			{
@@ -707,8 +770,9 @@ protected:
 
 		case BUTTON_CANCEL:
 			on_cancel();
-			break;
+			return; // 'this' may be deleted
 		}
+		sync_widgets();
 	}
 
 	virtual void on_ok(const String &line) { ; } //!< when the user pressed OK button
@@ -722,6 +786,7 @@ public:
 	screen_ip_editor_t(const String &_title, const String &_line = "") : screen_ascii_editor_t(_title, _line, 15) // XXX.XXX.XXX.XXX = 15 chars
 	{
 		char_list = {F("BS DEL"), F("56789."), F("01234")};
+		char_list_list.invalidate_items();
 	}
 
 protected:
@@ -733,70 +798,53 @@ protected:
 };
 
 //! Menu list UI
-class screen_menu_t : public screen_base_t
+class screen_menu_t : public screen_widget_t
 {
 protected:
-	String title;
 	string_vector items;
+	string_vector_list_source_t items_source{items};
 
 	int max_lines = 6;	   //!< maximum item lines per a screen
-	int x = 0;			   //!< left most column to be displayed
-	int y = 0;			   //!< selected item index
-	int y_top = 0;		   //!< display start index at top line of the items
 	bool h_scroll = false; //!< whether to allow horizontal scroll
 	int title_line_y = 7;  //!< title underline position in y axis
 	int list_start_y = 8;  //!< menu item start position in y axis
 
+	widget_label_t title_label{0, 0, LED_MAX_LOGICAL_COL, 6, font_5x5};
+	widget_rule_t title_rule{0, title_line_y, LED_MAX_LOGICAL_COL, 1};
+	widget_list_t list{0, list_start_y, LED_MAX_LOGICAL_COL, max_lines * 6, &items_source, font_5x5};
+
 public:
-	screen_menu_t(const String &_title, const string_vector &_items) : title(_title), items(_items)
+	screen_menu_t(const String &_title, const string_vector &_items) : items(_items)
 	{
+		title_label.set_text(_title);
+		widgets.add(&title_label);
+		widgets.add(&title_rule);
+		widgets.add(&list);
 	}
 
 	void set_h_scroll(bool b)
 	{
 		h_scroll = b;
 		if (!h_scroll)
-			x = 0;
+			list.set_scroll_x(0);
 	}
 
 protected:
-	string_vector &get_items() { return items; }
-
-	void set_selected(int i)
+	//! Returns the items; the list is refreshed as the caller may modify them
+	string_vector &get_items()
 	{
-		if (i < items.size())
-		{
-			y = i;
-			if (y_top > y)
-				y_top = y;
-			if (y_top < y - (max_lines - 1))
-				y_top = y - (max_lines - 1);
-		}
+		list.invalidate_items();
+		return items;
 	}
 
-	bool draw() override
-	{
-		// draw the title
-		fb().draw_text(0, 0, 255, title.c_str(), font_5x5);
-
-		// draw line
-		fb().fill(0, title_line_y, LED_MAX_LOGICAL_COL, 1, 128);
+	void set_selected(int i) { list.set_selected(i); }
 
-		// draw cursor
-		fb().fill(1, (y - y_top) * 6 + list_start_y, LED_MAX_LOGICAL_COL - 1, 5, get_blink_intensity());
-
-		// draw items
-		for (int i = 0; i < max_lines; ++i)
-		{
-			if (i + y_top < items.size())
-			{
-				if (x < items[i + y_top].length() - 1)
-					fb().draw_text(1, i * 6 + list_start_y, 255, items[i + y_top].c_str() + x, font_5x5);
-			}
-		}
-
-		// show the drawn content
-		return true;
+	//! Call this after changing title_line_y, list_start_y or max_lines
+	void apply_layout()
+	{
+		title_rule.set_rect(0, title_line_y, LED_MAX_LOGICAL_COL, 1);
+		list.set_rect(0, list_start_y, LED_MAX_LOGICAL_COL, max_lines * 6);
+		widgets.invalidate_all();
 	}
 
 	void on_button(uint32_t button) override
@@ -805,31 +853,26 @@ protected:
 		switch (button)
 		{
 		case BUTTON_UP:
-			if (y > 0)
-				--y;
-			if (y_top > y)
-				y_top = y;
+			if (list.get_selected() > 0)
+				list.set_selected(list.get_selected() - 1);
 			break;
 
 		case BUTTON_DOWN:
-			if (y < items.size() - 1)
-				++y;
-			if (y_top < y - (max_lines - 1))
-				y_top = y - (max_lines - 1);
+			list.set_selected(list.get_selected() + 1); // ignored at the last item
 			break;
 
 		case BUTTON_LEFT:
-			if (h_scroll && x > 0)
-				--x;
+			if (h_scroll)
+				list.set_scroll_x(list.get_scroll_x() - 1);
 			break;
 
 		case BUTTON_RIGHT:
 			if (h_scroll)
-				++x;
+				list.set_scroll_x(list.get_scroll_x() + 1);
 			break;
 
 		case BUTTON_OK:
-			on_ok(y);
+			on_ok(list.get_selected());
 			break;
 
 		case BUTTON_CANCEL:
@@ -844,10 +887,7 @@ protected:
 //! Menu list UI with scrolling marquee under title
 class screen_menu_with_marquee_t : public screen_menu_t
 {
-	String marquee;
-	int marquee_len; //!< length of marquee
-	int marquee_x;	 //!< marquee displaying x
-	int count = 0;	 //!< tick count
+	widget_marquee_t marquee{0, 6, LED_MAX_LOGICAL_COL, 6, font_5x5, 6 /* a space */, true};
 
 public:
 	screen_menu_with_marquee_t(
@@ -858,35 +898,14 @@ public:
 		title_line_y += 6;
 		list_start_y += 6;
 		--max_lines;
+		apply_layout();
+		widgets.add(&marquee);
 		set_marquee(_marquee);
 	}
 
 	void set_marquee(const String &m)
 	{
-		marquee = m + F(" ") + m + F(" ");
-		marquee_len = m.length() + 1;
-		if (marquee_len < num_w_chars)
-			marquee_x = 0;
-	}
-
-	bool draw() override
-	{
-		screen_menu_t::draw(); // call inherited class' draw()
-		fb().draw_text(-marquee_x, 6, 255, marquee.c_str(), font_5x5);
-		return true;
-	}
-
-	void on_idle_10() override
-	{
-		++count;
-		if (count >= 3)
-		{
-			count = 0;
-
-			++marquee_x;
-			if (marquee_x >= marquee_len * 6)
-				marquee_x = 0;
-		}
+		marquee.set_text(m);
 	}
 };
 
@@ -1126,18 +1145,10 @@ public:
 		get_items().push_back(F("-- Manual AP Name Input --"));
 
 		// Push station names order by its rssi.
-		// Here we use naive method to sort the list...
-		// Assumes the list is not so big.
-		for (int rssi = 0; rssi >= -100; --rssi)
-		{
-			for (int i = 0; i < num_stations; ++i)
-			{
-				if (WiFi.RSSI(i) == rssi)
-					get_items().push_back(WiFi.SSID(i));
-			}
-		}
+		for (auto &&item : get_wifi_scan_list(num_stations))
+			get_items().push_back(item.SSID);
 		// Delete scanned list to release precious heap
-		WiFi.scanDelete();
+		wifi_scan_delete();
 	}
 
 protected:
@@ -1164,120 +1175,120 @@ protected:
 	}
 };
 
-class screen_wifi_scanning_t : public screen_base_t
+class screen_wifi_scanning_t : public screen_widget_t
 {
-	String line[2];
+	widget_label_t line[2]{
+		{0, 12, LED_MAX_LOGICAL_COL, 6, font_5x5},
+		{0, 18, LED_MAX_LOGICAL_COL, 6, font_5x5}};
+	int16_t state = WIFI_SCAN_RUNNING; //!< scan result
 
 public:
-	screen_wifi_scanning_t() : line{F("Scanning"), F("Networks")}
+	screen_wifi_scanning_t()
 	{
-		WiFi.scanNetworks(/*async=*/true, /*show_hidden=*/false);
+		line[0].set_text(F("Scanning"));
+		line[1].set_text(F("Networks"));
+		widgets.add(&line[0]);
+		widgets.add(&line[1]);
+		wifi_scan_start();
 	}
 
 	bool draw() override
 	{
-		// draw the text
-		fb().draw_text(0, 12, get_blink_intensity(), line[0].c_str(), font_5x5);
-		fb().draw_text(0, 18, get_blink_intensity(), line[1].c_str(), font_5x5);
-
-		// show the drawn content
-		return true;
+		// blink the text
+		line[0].set_level(get_blink_intensity());
+		line[1].set_level(get_blink_intensity());
+		return screen_widget_t::draw();
 	}
 
 protected:
-	void on_idle_50() override
+	bool run_flow() override
 	{
-		int state = WiFi.scanComplete();
-		if (state > 0)
-		{
-			// scan complete (or failed)
-			screen_manager.pop();
-			screen_manager.push(new screen_ap_list_t(state));
-		}
-		else if (state == 0)
+		FLOW_BEGIN(flow);
+		FLOW_WAIT_UNTIL(flow, (state = wifi_scan_complete()) != WIFI_SCAN_RUNNING);
 		{
-			// scan complete but no APs found
-			screen_manager.pop();
-			screen_manager.push(new screen_ap_list_t(0));
+			// scan complete, failed, or no APs found
+			int num_stations = state > 0 ? state : 0;
+			screen_manager.pop(); // note at this point 'this' is deleted
+			screen_manager.push(new screen_ap_list_t(num_stations));
+			return false; // not FLOW_END's return; 'flow' is gone with 'this'
 		}
+		FLOW_END(flow); // not reached; closes FLOW_BEGIN
 	}
 };
 
-class screen_wps_processing_t : public screen_base_t
+class screen_wps_processing_t : public screen_widget_t
 {
-	String line[2];
-	bool done = false;
+	widget_label_t line[2]{
+		{0, 12, LED_MAX_LOGICAL_COL, 6, font_5x5},
+		{0, 18, LED_MAX_LOGICAL_COL, 6, font_5x5}};
 	bool first = false;
-	bool wps_started = false;
+	bool cancelled = false;
 
 public:
-	screen_wps_processing_t() : line{F("Waiting"), F("WPS")}
+	screen_wps_processing_t()
 	{
+		line[0].set_text(F("Waiting"));
+		line[1].set_text(F("WPS"));
+		widgets.add(&line[0]);
+		widgets.add(&line[1]);
 	}
 
 	bool draw() override
 	{
-		// draw the text
-		fb().draw_text(0, 12, get_blink_intensity(), line[0].c_str(), font_5x5);
-		fb().draw_text(0, 18, get_blink_intensity(), line[1].c_str(), font_5x5);
+		// blink the text
+		line[0].set_level(get_blink_intensity());
+		line[1].set_level(get_blink_intensity());
+		bool drawn = screen_widget_t::draw();
 		first = true; // indicate first screen is drawn
-		return true;
+		return drawn;
 	}
 
 protected:
-	void on_button(uint32_t button) override
+	bool run_flow() override
 	{
-		if (button == BUTTON_CANCEL)
+		FLOW_BEGIN(flow);
+
+		// wait for the first screen to be drawn
+		FLOW_WAIT_UNTIL(flow, (cancelled = flow_take_button(BUTTON_CANCEL)) || first);
+		if (cancelled)
 		{
-			if (wps_started)
-			{
-				wifi_stop_wps();
-			}
-			done = true;
+			screen_manager.pop(); // note at this point 'this' is deleted
+			return false;
 		}
-	}
 
-	void on_idle_50() override
-	{
-		if (first && !wps_started)
+		printf("Starting WPS...\n");
+		wifi_wps(); // this function will return before WPS process ends
+
+		// wait for the result or cancel
+		FLOW_WAIT_UNTIL(flow, (cancelled = flow_take_button(BUTTON_CANCEL)) ||
+			wifi_get_wps_status() != SYSTEM_EVENT_WIFI_READY);
+		if (cancelled)
 		{
-			first = false;
-			printf("Starting WPS...\n");
-			wifi_wps(); // this function will return before WPS process ends
-			wps_started = true;
+			wifi_stop_wps();
 		}
 		else
 		{
 			// check the result
-			WiFiEvent_t result = wifi_get_wps_status();
-			switch (result)
+			switch (wifi_get_wps_status())
 			{
-			case SYSTEM_EVENT_WIFI_READY:
-				// do nothing; continue
-				;
-				break;
-
 			case SYSTEM_EVENT_STA_WPS_ER_SUCCESS:
 				printf("WPS succeeded.\n");
-				done = true;
 				break;
 			case SYSTEM_EVENT_STA_WPS_ER_FAILED:
-				done = true;
 				printf("WPS failed.\n");
 				break;
 			case SYSTEM_EVENT_STA_WPS_ER_TIMEOUT:
-				done = true;
 				printf("WPS timed out.\n");
 				break;
 			default:
-				done = true;
 				printf("WPS failed by unknown reason.\n");
 				break;
 			}
-
-			if (done)
-				screen_manager.pop();
 		}
+		screen_manager.pop(); // note at this point 'this' is deleted
+		return false; // not FLOW_END's return; 'flow' is gone with 'this'
+
+		FLOW_END(flow); // not reached; closes FLOW_BEGIN
 	}
 };
 
@@ -1285,6 +1296,8 @@ class screen_wifi_setting_t : public screen_menu_with_marquee_t
 {
 	typedef screen_menu_with_marquee_t inherited;
 
+	widget_label_t ip_label{0, 12, LED_MAX_LOGICAL_COL, 6, font_4x5};
+
 public:
 	screen_wifi_setting_t() : inherited(
 								  F("WiFi config"), String(), {
@@ -1298,38 +1311,27 @@ public:
 		title_line_y += 5;
 		list_start_y += 5;
 		--max_lines;
+		apply_layout();
+		widgets.add(&ip_label);
+		update_ip_label();
 	}
 
 protected:
-	bool draw() override
+	void update_ip_label()
 	{
-		inherited::draw();
 		ip_addr_settings_t settings = wifi_get_ip_addr_settings(true);
-		const char *str;
 
 		if(settings.ip_addr == null_ip_addr)
 		{
-			str = "No WiFi connected";
+			ip_label.set_text(F("No WiFi connected"));
 		}
 		else
 		{
 			/* convert dot to shrunk dot '\x01' */
-			char buf[16]; // maximum IPv4 address length = 15
-			const char * in = settings.ip_addr.c_str();
-			char * out = buf;
-			while(*in && out - buf < 15)
-			{
-				char c = *in;
-				*out = (c == '.' ? '\x01' : c);
-				++ out;
-				++ in;
-			}
-			*out = 0; // terminate
-			str = buf;
+			String str = settings.ip_addr;
+			str.replace('.', '\x01');
+			ip_label.set_text(str);
 		}
-
-		fb().draw_text(0, 12, 255, str, font_4x5);
-		return true;
 	}
 
 	void on_ok(int idx) override
@@ -1370,10 +1372,13 @@ protected:
 			m = wifi_get_connection_info_string();
 
 		set_marquee(m);
+		update_ip_label();
 	}
 };
 
 //! main clock ui
+static const setting_string_t marquee_setting("ui_screen_clock_marquee", "");
+
 class screen_clock_t : public screen_base_t
 {
 	String marquee;		 //!< marquee string
@@ -1383,26 +1388,27 @@ class screen_clock_t : public screen_base_t
 	uint32_t off_indication_start = 0; // !< start tick for "OFF" indication
 	static constexpr uint32_t OFF_INDICATION_TIME = 2000; // time span to display "OFF" message
 	static constexpr uint32_t OFF_FADE_TIME = 1000; // time span to fade out "OFF" message
+	settings_subscription_id_t marquee_subscription;
 
 public:
 	screen_clock_t()
 	{
-		String r;
-		settings_write(F("ui_screen_clock_marquee"), F(""), SETTINGS_NO_OVERWRITE);
-		settings_read(F("ui_screen_clock_marquee"), r);
+		_set_marquee(marquee_setting.get());
+		marquee_subscription = settings_subscribe(marquee_setting.get_key(), [this]() { _set_marquee(marquee_setting.get()); });
+	}
 
-		_set_marquee(r);
+	~screen_clock_t()
+	{
+		settings_unsubscribe(marquee_subscription);
 	}
 
 public:
+	//! the marquee is updated through the settings subscription
 	void set_marquee(const String &s)
 	{
-		settings_write(F("ui_screen_clock_marquee"), s);
-		_set_marquee(s);
+		marquee_setting.set(s);
 	}
 
-	String get_marquee() const { return marquee; }
-
 private:
 	void _set_marquee(const String &s)
 	{
@@ -1595,5 +1601,10 @@ void ui_process()
 	screen_manager.process_idle();
 }
 
-String ui_get_marquee() { return screen_clock->get_marquee(); }
+void ui_dispatch_input_event(const input_event_t &ev)
+{
+	screen_manager.dispatch_input_event(ev);
+}
+
+String ui_get_marquee() { return marquee_setting.get(); } // may be newer than the shown one
 void ui_set_marquee(const String &s) { screen_clock->set_marquee(s); }
@@ -1,8 +1,11 @@
 #ifndef UI_H__
 #define UI_H__
 
+#include "buttons.h"
+
 void ui_setup();
 void ui_process();
+void ui_dispatch_input_event(const input_event_t &ev);
 
 String ui_get_marquee();
 void ui_set_marquee(const String &s);
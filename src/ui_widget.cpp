@@ -0,0 +1,317 @@
+#include <Arduino.h>
+#include <algorithm>
+#include "ui_widget.h"
+#include "fonts/font.h"
+
+void ui_rect_t::unite(const ui_rect_t &r)
+{
+	if (r.empty())
+		return;
+	if (empty())
+	{
+		*this = r;
+		return;
+	}
+	int x0 = std::min(x, r.x);
+	int y0 = std::min(y, r.y);
+	int x1 = std::max(x + w, r.x + r.w);
+	int y1 = std::max(y + h, r.y + r.h);
+	x = x0, y = y0, w = x1 - x0, h = y1 - y0;
+}
+
+void ui_rect_t::intersect(const ui_rect_t &r)
+{
+	int x0 = std::max(x, r.x);
+	int y0 = std::max(y, r.y);
+	int x1 = std::min(x + w, r.x + r.w);
+	int y1 = std::min(y + h, r.y + r.h);
+	if (x1 <= x0 || y1 <= y0)
+	{
+		*this = ui_rect_t();
+		return;
+	}
+	x = x0, y = y0, w = x1 - x0, h = y1 - y0;
+}
+
+
+void widget_t::set_rect(int x, int y, int w, int h)
+{
+	rect = ui_rect_t(x, y, w, h);
+	dirty = rect;
+}
+
+void widget_t::invalidate(const ui_rect_t &r)
+{
+	ui_rect_t d = r;
+	d.intersect(rect);
+	dirty.unite(d);
+}
+
+void widget_t::fill_clipped(frame_buffer_t &fb, ui_rect_t r, int level, const ui_rect_t &clip)
+{
+	r.intersect(clip);
+	r.intersect(ui_rect_t(0, 0, LED_MAX_LOGICAL_COL, LED_MAX_LOGICAL_ROW));
+	if (!r.empty())
+		fb.fill(r.x, r.y, r.w, r.h, level);
+}
+
+
+void widget_label_t::set_text(const String &s)
+{
+	if (text == s)
+		return;
+	text = s;
+	invalidate();
+}
+
+void widget_label_t::set_level(int l)
+{
+	if (level == l)
+		return;
+	level = l;
+	invalidate();
+}
+
+void widget_label_t::paint(frame_buffer_t &fb, const ui_rect_t &clip)
+{
+	fb.draw_text(rect.x, rect.y, level, text, font);
+}
+
+
+void widget_rule_t::paint(frame_buffer_t &fb, const ui_rect_t &clip)
+{
+	fill_clipped(fb, rect, level, clip);
+}
+
+
+void widget_marquee_t::set_text(const String &s)
+{
+	if (text == s)
+		return;
+	text = s;
+	text_w = get_bg_frame_buffer().get_text_width(text, font) + gap;
+	if (offset >= text_w)
+		offset = 0;
+	invalidate();
+}
+
+void widget_marquee_t::tick()
+{
+	++count;
+	if (count < 3)
+		return;
+	count = 0;
+
+	if (text.length() == 0 || (!always_scroll && text_w - gap <= rect.w))
+	{
+		if (offset != 0)
+			offset = 0, invalidate();
+		return;
+	}
+
+	++offset;
+	if (offset >= text_w)
+		offset = 0;
+	invalidate();
+}
+
+void widget_marquee_t::paint(frame_buffer_t &fb, const ui_rect_t &clip)
+{
+	if (text_w <= 0)
+		return;
+	for (int x = rect.x - offset; x < rect.x + rect.w; x += text_w)
+		fb.draw_text(x, rect.y, 255, text, font);
+}
+
+
+void widget_progress_t::set_value(int v, int max)
+{
+	if (max <= 0)
+		max = 1;
+	if (v < 0)
+		v = 0;
+	if (v > max)
+		v = max;
+	if (v == value && max == max_value)
+		return;
+	value = v;
+	max_value = max;
+	invalidate();
+}
+
+void widget_progress_t::paint(frame_buffer_t &fb, const ui_rect_t &clip)
+{
+	int filled = rect.w * value / max_value;
+	fill_clipped(fb, ui_rect_t(rect.x, rect.y, filled, rect.h), 255, clip);
+	fill_clipped(fb, ui_rect_t(rect.x + filled, rect.y, rect.w - filled, rect.h), 32, clip);
+}
+
+
+ui_rect_t widget_list_t::row_rect(int idx) const
+{
+	return ui_rect_t(rect.x, rect.y + (idx - top) * row_h, rect.w, row_h);
+}
+
+void widget_list_t::set_selected(int i)
+{
+	if (i >= source->get_count() || i == selected)
+		return;
+
+	if (selected >= 0)
+		invalidate(row_rect(selected));
+	selected = i;
+	if (i < 0)
+		return;
+
+	int old_top = top;
+	int num_rows = get_num_rows();
+	if (top > i)
+		top = i;
+	if (top < i - (num_rows - 1))
+		top = i - (num_rows - 1);
+	if (top != old_top)
+		invalidate(); // scrolled
+	else
+		invalidate(row_rect(i));
+}
+
+void widget_list_t::set_cursor_span(int x, int w, int h)
+{
+	if (x == cursor_x && w == cursor_w && h == cursor_h)
+		return;
+	if (selected >= 0)
+		invalidate(row_rect(selected)); // erase old cursor
+	cursor_x = x;
+	cursor_w = w;
+	cursor_h = h;
+}
+
+void widget_list_t::set_scroll_x(int x)
+{
+	if (x < 0)
+		x = 0;
+	if (x == scroll_x)
+		return;
+	scroll_x = x;
+	invalidate();
+}
+
+void widget_list_t::invalidate_items()
+{
+	rows_top = -1;
+	invalidate();
+}
+
+void widget_list_t::update(uint8_t blink_intensity)
+{
+	if (selected < 0 || cursor_level == blink_intensity)
+		return;
+	cursor_level = blink_intensity;
+	ui_rect_t r = row_rect(selected);
+	invalidate(ui_rect_t(rect.x + cursor_x, r.y, cursor_w, cursor_h));
+}
+
+void widget_list_t::fill_rows()
+{
+	if (rows_top == top)
+		return;
+	int count = source->get_count();
+	int num_rows = std::min(get_num_rows(), (int)max_rows);
+	for (int i = 0; i < num_rows; ++i)
+		rows[i] = (top + i < count) ? source->get_item(top + i) : String();
+	rows_top = top;
+}
+
+void widget_list_t::paint(frame_buffer_t &fb, const ui_rect_t &clip)
+{
+	fill_rows();
+
+	int num_rows = std::min(get_num_rows(), (int)max_rows);
+	for (int i = 0; i < num_rows; ++i)
+	{
+		int idx = top + i;
+		ui_rect_t r = row_rect(idx);
+		if (!r.intersects(clip))
+			continue;
+
+		// draw cursor
+		if (idx == selected)
+			fill_clipped(fb, ui_rect_t(rect.x + cursor_x, r.y, cursor_w, cursor_h), cursor_level, clip);
+
+		// draw item
+		const String &s = rows[i];
+		if (scroll_x < (int)s.length())
+			fb.draw_text(rect.x + text_x, r.y, 255, s.c_str() + scroll_x, font);
+	}
+}
+
+
+void widget_edit_line_t::set_cursor(int _cursor, int _start)
+{
+	cursor = _cursor;
+	start = _start;
+	invalidate();
+}
+
+void widget_edit_line_t::update(uint8_t blink_intensity)
+{
+	if (cursor_level == blink_intensity)
+		return;
+	cursor_level = blink_intensity;
+	invalidate(ui_rect_t(rect.x + (cursor - start) * char_w, rect.y, 1, rect.h));
+}
+
+void widget_edit_line_t::paint(frame_buffer_t &fb, const ui_rect_t &clip)
+{
+	// draw cursor
+	fill_clipped(fb, ui_rect_t(rect.x + (cursor - start) * char_w, rect.y, 1, rect.h), cursor_level, clip);
+
+	// draw text
+	if (start <= (int)text->length())
+		fb.draw_text(rect.x + 1, rect.y, 255, text->c_str() + start, font);
+}
+
+
+void widget_set_t::tick()
+{
+	for (auto w : widgets)
+		w->tick();
+}
+
+bool widget_set_t::paint(uint8_t blink_intensity)
+{
+	for (auto w : widgets)
+		w->update(blink_intensity);
+
+	// collect damaged region
+	ui_rect_t damage;
+	if (full)
+		damage = ui_rect_t(0, 0, LED_MAX_LOGICAL_COL, LED_MAX_LOGICAL_ROW);
+	else
+		for (auto w : widgets)
+			damage.unite(w->get_dirty());
+	damage.intersect(ui_rect_t(0, 0, LED_MAX_LOGICAL_COL, LED_MAX_LOGICAL_ROW));
+	if (damage.empty())
+		return false; // nothing to do; keep showing the current frame
+
+	// start from the currently shown frame, then repaint the damaged region
+	frame_buffer_t &fb = get_bg_frame_buffer();
+	if (!full)
+		fb.copy_from(get_current_frame_buffer());
+	fb.fill(damage.x, damage.y, damage.w, damage.h, 0);
+
+	for (auto w : widgets)
+	{
+		ui_rect_t r = w->get_rect();
+		r.intersect(damage);
+		if (!r.empty())
+		{
+			fb.set_clip(r.x, r.y, r.w, r.h);
+			w->paint(fb, r);
+		}
+		w->validate();
+	}
+	fb.reset_clip();
+	full = false;
+	return true;
+}
@@ -0,0 +1,263 @@
+#ifndef UI_WIDGET_H__
+#define UI_WIDGET_H__
+
+#include <Arduino.h>
+#include <vector>
+#include "frame_buffer.h"
+#include "settings.h"
+
+class font_base_t;
+
+// Retained-mode widgets for the UI screens.
+//
+// Each widget owns its position and its content, and remembers which part
+// of itself needs repainting. A screen built from widgets repaints only the
+// damaged region on top of the previously shown frame, instead of drawing
+// everything from scratch every frame.
+
+//! A rectangle
+struct ui_rect_t
+{
+	int16_t x = 0, y = 0, w = 0, h = 0;
+
+	ui_rect_t() {}
+	ui_rect_t(int _x, int _y, int _w, int _h) : x(_x), y(_y), w(_w), h(_h) {}
+
+	bool empty() const { return w <= 0 || h <= 0; }
+
+	//! make this the bounding box of this and r
+	void unite(const ui_rect_t &r);
+
+	//! make this the intersection of this and r
+	void intersect(const ui_rect_t &r);
+
+	bool intersects(const ui_rect_t &r) const
+	{
+		return !empty() && !r.empty() &&
+			x < r.x + r.w && r.x < x + w && y < r.y + r.h && r.y < y + h;
+	}
+};
+
+//! Widget base
+class widget_t
+{
+protected:
+	ui_rect_t rect;  //!< position in the screen
+	ui_rect_t dirty; //!< region to be repainted, in screen coordinates
+
+public:
+	widget_t(int x, int y, int w, int h) : rect(x, y, w, h), dirty(rect) {}
+	virtual ~widget_t() {}
+
+	const ui_rect_t &get_rect() const { return rect; }
+	const ui_rect_t &get_dirty() const { return dirty; }
+
+	//! move / resize the widget
+	void set_rect(int x, int y, int w, int h);
+
+	//! mark whole widget to be repainted
+	void invalidate() { dirty = rect; }
+
+	//! mark a part of the widget to be repainted
+	void invalidate(const ui_rect_t &r);
+
+	//! Called before each frame, to update time dependent content
+	//! such as blinking cursor or scrolling text.
+	virtual void update(uint8_t blink_intensity) {}
+
+	//! Called every 10ms while the screen is active
+	virtual void tick() {}
+
+	//! Paint the widget. The frame buffer is already cleared in 'clip' and
+	//! text drawing is clipped to it; fills must be clipped by fill_clipped().
+	virtual void paint(frame_buffer_t &fb, const ui_rect_t &clip) = 0;
+
+	//! Called by the owner screen after painting
+	void validate() { dirty = ui_rect_t(); }
+
+protected:
+	//! fill r intersected with clip
+	static void fill_clipped(frame_buffer_t &fb, ui_rect_t r, int level, const ui_rect_t &clip);
+};
+
+//! Static text
+class widget_label_t : public widget_t
+{
+	String text;
+	const font_base_t &font;
+	int level;
+
+public:
+	widget_label_t(int x, int y, int w, int h, const font_base_t &_font, int _level = 255) :
+		widget_t(x, y, w, h), font(_font), level(_level) {}
+
+	void set_text(const String &s);
+	const String &get_text() const { return text; }
+
+	void set_level(int l);
+
+	void paint(frame_buffer_t &fb, const ui_rect_t &clip) override;
+};
+
+//! Horizontal or vertical rule, or any filled rectangle
+class widget_rule_t : public widget_t
+{
+	int level;
+
+public:
+	widget_rule_t(int x, int y, int w, int h, int _level = 128) :
+		widget_t(x, y, w, h), level(_level) {}
+
+	void paint(frame_buffer_t &fb, const ui_rect_t &clip) override;
+};
+
+//! Text which scrolls to the left continuously when it does not fit the width
+class widget_marquee_t : public widget_t
+{
+	String text;
+	const font_base_t &font;
+	int text_w = 0;  //!< cached text width, including the gap
+	int offset = 0;  //!< scroll position in pixel
+	int count = 0;   //!< tick count
+	int gap;         //!< gap between repeating text in pixel
+	bool always_scroll; //!< scroll even if the text fits
+
+public:
+	widget_marquee_t(int x, int y, int w, int h, const font_base_t &_font,
+		int _gap, bool _always_scroll = false) :
+		widget_t(x, y, w, h), font(_font), gap(_gap), always_scroll(_always_scroll) {}
+
+	void set_text(const String &s);
+	const String &get_text() const { return text; }
+
+	void tick() override;
+	void paint(frame_buffer_t &fb, const ui_rect_t &clip) override;
+};
+
+//! Progress bar
+class widget_progress_t : public widget_t
+{
+	int value = 0;
+	int max_value = 100;
+
+public:
+	widget_progress_t(int x, int y, int w, int h) : widget_t(x, y, w, h) {}
+
+	void set_value(int v, int max);
+
+	void paint(frame_buffer_t &fb, const ui_rect_t &clip) override;
+};
+
+//! Item source of widget_list_t; only the displayed rows are queried
+class list_source_t
+{
+public:
+	virtual ~list_source_t() {}
+	virtual int get_count() const = 0;
+	virtual String get_item(int idx) const = 0;
+};
+
+//! list_source_t over a string vector
+class string_vector_list_source_t : public list_source_t
+{
+	const string_vector &items;
+
+public:
+	string_vector_list_source_t(const string_vector &_items) : items(_items) {}
+	int get_count() const override { return items.size(); }
+	String get_item(int idx) const override { return items[idx]; }
+};
+
+//! Virtualized list with a blinking cursor; one row is 6 pixels high.
+//! Rows are formatted only when they scroll into view.
+class widget_list_t : public widget_t
+{
+	static constexpr int row_h = 6;
+	static constexpr int max_rows = LED_MAX_LOGICAL_ROW / row_h;
+
+	const list_source_t *source;
+	const font_base_t &font;
+	int text_x;         //!< text x offset from the left of the widget
+	int selected = 0;   //!< selected index, -1 for no cursor
+	int top = 0;        //!< index at the top row
+	int scroll_x = 0;   //!< horizontal scroll in characters
+	int cursor_x, cursor_w, cursor_h; //!< cursor span in the row
+	uint8_t cursor_level = 0;
+
+	String rows[max_rows]; //!< cached text of displayed rows
+	int rows_top = -1;     //!< index of rows[0]; -1 if the cache is invalid
+
+public:
+	widget_list_t(int x, int y, int w, int h, const list_source_t *_source,
+		const font_base_t &_font, int _text_x = 1) :
+		widget_t(x, y, w, h), source(_source), font(_font), text_x(_text_x),
+		cursor_x(1), cursor_w(w - 1), cursor_h(5) {}
+
+	int get_num_rows() const { return rect.h / row_h; }
+
+	//! set selected item; the list scrolls to show it
+	void set_selected(int i);
+	int get_selected() const { return selected; }
+
+	//! set cursor span in the selected row, in pixels relative to the widget
+	void set_cursor_span(int x, int w, int h);
+
+	//! set horizontal scroll in characters
+	void set_scroll_x(int x);
+	int get_scroll_x() const { return scroll_x; }
+
+	//! call this when items of the source have been changed
+	void invalidate_items();
+
+	void update(uint8_t blink_intensity) override;
+	void paint(frame_buffer_t &fb, const ui_rect_t &clip) override;
+
+private:
+	ui_rect_t row_rect(int idx) const;
+	void fill_rows();
+};
+
+//! Single line text editor field with a blinking bar cursor
+class widget_edit_line_t : public widget_t
+{
+	static constexpr int char_w = 6;
+
+	const String *text; //!< owned by the owner screen
+	const font_base_t &font;
+	int start = 0;      //!< display start character index
+	int cursor = 0;     //!< cursor position in the text
+	uint8_t cursor_level = 0;
+
+public:
+	widget_edit_line_t(int x, int y, int w, int h, const String *_text, const font_base_t &_font) :
+		widget_t(x, y, w, h), text(_text), font(_font) {}
+
+	//! set cursor and display start; call this also when the text is changed
+	void set_cursor(int _cursor, int _start);
+
+	void update(uint8_t blink_intensity) override;
+	void paint(frame_buffer_t &fb, const ui_rect_t &clip) override;
+};
+
+//! A set of widgets composing a screen.
+//! Widgets are owned by the caller; they must outlive the set.
+class widget_set_t
+{
+	std::vector<widget_t *> widgets;
+	bool full = true; //!< whether the next paint needs whole screen
+
+public:
+	void add(widget_t *w) { widgets.push_back(w); }
+
+	//! request whole screen repaint; call this when the screen is activated
+	void invalidate_all() { full = true; }
+
+	//! dispatch 10ms tick to widgets
+	void tick();
+
+	//! Repaint damaged region into the background frame buffer, on top of
+	//! the currently shown frame. Returns false if nothing was damaged.
+	bool paint(uint8_t blink_intensity);
+};
+
+#endif
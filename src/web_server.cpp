@@ -1,5 +1,6 @@
 #include <WebServer.h>
 #include <StreamString.h>
+#include <map>
 #include "flash_fs.h"
 #include "mz_update.h"
 #include "settings.h"
@@ -7,17 +8,25 @@
 #include "ui.h"
 #include "mz_version.h"
 #include "buttons.h"
+#include "flash_stats.h"
+#include "fs_delta.h"
+#include "sector_delta.h"
+#include "threadsync.h"
 
 
-// The web server
+// The web server.
+// Requests are handled on a task of its own, so that sending a file or
+// receiving an upload does not stall the UI loop. Handlers which change
+// settings or the UI state do that through run_in_main_thread().
 static WebServer server(80);
+static constexpr uint32_t WEB_SERVER_STACK_SIZE = 8192; // see the stack shown by "OTA: Heap" messages
 
 static const String user_name = "admin";
-static String password = "admin"; // password for the UI
+static const setting_string_t web_password_setting("web_password", "admin");
 static bool in_recovery = false; // whether the system is in recovery mode
 
-static bool scheduled_reboot = false;
-static uint32_t scheduled_reboot_tick;
+static volatile bool scheduled_reboot = false;
+static volatile uint32_t scheduled_reboot_tick;
 
 void set_system_recovery_mode() {
 	in_recovery = true;
@@ -64,6 +73,7 @@ static bool send_common_header()
 {
 	if(!in_recovery)
 	{
+		String password = web_password_setting.get(); // settings are safe to read from any task
 		if(!server.authenticate(user_name.c_str(), password.c_str()))
 		{
 			server.requestAuthentication();
@@ -73,6 +83,41 @@ static bool send_common_header()
 	return true;
 }
 
+// Static files of the web UI, as listed in /w/.assets by web_assets.py.
+// Loaded once at startup; the file system is not looked up for a request
+// until the file is actually sent, and files not listed are not served.
+struct web_asset_t
+{
+	String etag; // quoted
+	bool gzipped; // stored as <path>.gz
+};
+static std::map<String, web_asset_t> web_assets; // by URL path
+static const char web_asset_manifest[] = "/w/.assets";
+
+static void load_web_assets()
+{
+	File f = FS.open(web_asset_manifest, "r");
+	if(!f)
+	{
+		printf("Web asset manifest '%s' not found; serving files as they are.\n", web_asset_manifest);
+		return;
+	}
+	while(f.available())
+	{
+		// <etag> <stored length> <gzipped> <URL path>
+		String line = f.readStringUntil('\n');
+		int p1 = line.indexOf(' ');
+		int p2 = line.indexOf(' ', p1 + 1);
+		int p3 = line.indexOf(' ', p2 + 1);
+		if(p1 <= 0 || p2 < 0 || p3 < 0) continue;
+		web_asset_t &a = web_assets[line.substring(p3 + 1)];
+		a.etag = String('"') + line.substring(0, p1) + '"';
+		a.gzipped = line.substring(p2 + 1, p3) == F("1");
+	}
+	f.close();
+	printf("%u web assets listed.\n", (unsigned)web_assets.size());
+}
+
 static bool loadFromFS(String path){
 	String dataType = F("text/plain");
 	if(path.endsWith("/")) path += F("index.html");
@@ -89,16 +134,42 @@ static bool loadFromFS(String path){
 	else if(path.endsWith(".zip")) dataType = F("application/zip");
 	else if(path.endsWith(".txt")) dataType = F("text/plain");
 
-	path = String(F("/w")) + path; // all contents must be under "w" directory
-		// TODO: path reverse-traversal check
+	auto it = web_assets.find(path);
+	if(it != web_assets.end())
+	{
+		const web_asset_t &a = it->second;
+		server.sendHeader(F("ETag"), a.etag);
+		// a URL versioned with ?v=<etag> by web_assets.py never changes
+		if(server.arg(F("v")).length() && String('"') + server.arg(F("v")) + '"' == a.etag)
+			server.sendHeader(F("Cache-Control"), F("private, max-age=31536000, immutable"));
+		else
+			server.sendHeader(F("Cache-Control"), F("no-cache")); // revalidate by the ETag
+		if(server.header(F("If-None-Match")) == a.etag)
+		{
+			server.send(304);
+			return true;
+		}
+		path = String(F("/w")) + path;
+		if(a.gzipped) path += F(".gz");
+	}
+	else if(!web_assets.empty())
+	{
+		return false; // not a part of the web UI
+	}
+	else
+	{
+		// no manifest; the file system may have been made without web_assets.py
+		path = String(F("/w")) + path; // all contents must be under "w" directory
+			// TODO: path reverse-traversal check
 
-	if(FS.exists(path + F(".gz")))
-      path += String(F(".gz")); // handle gz
+		if(FS.exists(path + F(".gz")))
+			path += String(F(".gz")); // handle gz
 
-	if (!FS.exists(path))
-	{
-		printf("Requested load form '%s' but file does not exist.\n", path.c_str());
-		return false;
+		if (!FS.exists(path))
+		{
+			printf("Requested load form '%s' but file does not exist.\n", path.c_str());
+			return false;
+		}
 	}
 
 	File dataFile = FS.open(path.c_str(), "r");
@@ -147,6 +218,27 @@ static void send_json_ok()
 	server.send(200, F("application/json"), F("{\"result\":\"ok\"}"));
 }
 
+// Print which sends its output as chunks of a response of unknown length
+class chunked_print_t : public Print
+{
+	char buf[1024];
+	size_t fill = 0;
+
+public:
+	size_t write(uint8_t c) override
+	{
+		buf[fill++] = (char)c;
+		if(fill == sizeof(buf)) flush();
+		return 1;
+	}
+
+	void flush()
+	{
+		if(fill) server.sendContent(buf, fill);
+		fill = 0;
+	}
+};
+
 static void string_json(const String &s, Stream & st)
 {
 	st.print((char)'"'); // starting "
@@ -190,7 +282,7 @@ static void web_server_export_json_for_ui(bool js)
 
 	st.print(F(",\n"));
 	st.print(F("\"admin_pass\":"));
-	string_json(password, st);
+	string_json(web_password_setting.get(), st);
 
 	st.print(F(",\n"));
 	st.print(F("\"ui_marquee\":"));
@@ -214,8 +306,8 @@ static void web_server_export_json_for_ui(bool js)
 static void web_server_handle_admin_pass()
 {
 	if(!send_common_header()) return;
-	password = server.arg(F("admin_pass"));
-	settings_write(F("web_password"), password);
+	String pass = server.arg(F("admin_pass"));
+	run_in_main_thread([&]() -> int { web_password_setting.set(pass); return 0; });
 
 	send_json_ok();
 }
@@ -225,30 +317,51 @@ static void web_server_handle_calendar()
 	if(!send_common_header()) return;
 	string_vector vec {server.arg(F("ntp1")), server.arg(F("ntp2")), server.arg(F("ntp3"))};
 	String tz = server.arg(F("tz"));
-	set_tz(vec, tz);
+	run_in_main_thread([&]() -> int { set_tz(vec, tz); return 0; });
 }
 
 static void web_server_handle_ui_marquee()
 {
 	if(!send_common_header()) return;
 	String m = server.arg(F("ui_marquee"));
-	ui_set_marquee(m);
+	run_in_main_thread([&]() -> int { ui_set_marquee(m); return 0; });
 
 	send_json_ok();
 }
 
+// whether the upload being received is refused, because the pull updater
+// has the Updater; only used on the web server task
+static bool push_rejected = false;
+
+// take the Updater for an upload; sets push_rejected if it cannot
+static bool begin_push()
+{
+	push_rejected = !Updater.acquire(compressed_updater_t::owPush);
+	if(push_rejected) printf("Update: Refused; a pulled update is running.\n");
+	return !push_rejected;
+}
+
 // schedule reboot
 void schedule_reboot()
 {
-	scheduled_reboot = true;
 	scheduled_reboot_tick = millis() + 2000; // after 2 sec, reboot.
+	scheduled_reboot = true;
+}
+
+static void web_server_task(void *arg)
+{
+	for(;;)
+	{
+		server.handleClient();
+		delay(1); // handleClient() returns at once while no client is connected
+	}
 }
 
 void web_server_setup()
 {
-	// load web user interface settings
-	settings_write(F("web_password"), password, SETTINGS_NO_OVERWRITE);
-	settings_read(F("web_password"), password);
+	load_web_assets();
+	static const char *collected_headers[] = { "If-None-Match" };
+	server.collectHeaders(collected_headers, sizeof(collected_headers) / sizeof(collected_headers[0]));
 
 	// setup handlers
 
@@ -258,6 +371,12 @@ void web_server_setup()
 			if(!send_common_header()) return;
 			web_server_export_json_for_ui(false);
 		});
+	server.on(F("/status/flash.json"), HTTP_GET, []() {
+			if(!send_common_header()) return;
+			StreamString st;
+			flash_stats_json(st);
+			server.send(200, F("application/json"), st);
+		});
 	server.on(F("/settings/settings.js"), HTTP_GET, []() {
 			if(!send_common_header()) return;
 			web_server_export_json_for_ui(true);
@@ -277,16 +396,44 @@ void web_server_setup()
 		server.send(200, "text/html", updateIndex);
 	});
 
+	server.on(F("/update/fs_manifest"), HTTP_GET, []() {
+			if(!send_common_header()) return;
+			StreamString st;
+			fs_delta_write_manifest(st);
+			server.send(200, F("text/plain"), st);
+		});
+
+	server.on(F("/update/sector_manifest"), HTTP_GET, []() {
+			// too large for a string; sent in chunks
+			if(!send_common_header()) return;
+			server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+			server.send(200, F("text/plain"), String());
+			chunked_print_t out;
+			sector_delta_write_manifest(out);
+			out.flush();
+			server.sendContent(String()); // terminating chunk
+		});
+
 	server.on("/update", HTTP_POST, []() {
 		server.sendHeader("Connection", "close");
-		server.send(200, "text/plain",  Updater.get_last_status() == updater_t::stNoError ? "OK" : "FAIL");
+		if(push_rejected)
+			server.send(409, "text/plain", "BUSY"); // the pull updater has the Updater
+		else
+			server.send(200, "text/plain",  Updater.get_last_status() == updater_t::stNoError ? "OK" : "FAIL");
+		Updater.release(compressed_updater_t::owPush);
+		push_rejected = false;
 	  }, []() {
 		HTTPUpload& upload = server.upload();
 		if (upload.status == UPLOAD_FILE_START) {
 			printf("Update: %s\n", upload.filename.c_str());
 
+			if(!begin_push()) return;
 			Updater.begin();
 
+		} else if (push_rejected) {
+
+			// discard
+
 		} else if (upload.status == UPLOAD_FILE_WRITE) {
 
 			Updater.write_data(upload.buf, upload.currentSize);
@@ -299,31 +446,96 @@ void web_server_setup()
 				schedule_reboot();
 			}
 
+		} else if (upload.status == UPLOAD_FILE_ABORTED) {
+
+			Updater.end();
+			Updater.release(compressed_updater_t::owPush);
+
+		}
+	  });
+	// resumable upload: the client asks where to continue from, then sends
+	// the archive from that offset as a raw body
+	server.on(F("/update/resume"), HTTP_GET, []() {
+			if(!send_common_header()) return;
+			if(Updater.get_owner() != compressed_updater_t::owNone)
+			{
+				server.send(409, F("application/json"), F("{\"result\":\"busy\"}"));
+				return;
+			}
+			uint32_t offset = Updater.get_resume_offset(server.arg(F("id")));
+			server.send(200, F("application/json"), String(F("{\"offset\":")) + String(offset) + F("}"));
+		});
+
+	server.on(F("/update/resume"), HTTP_POST, []() {
+		server.sendHeader("Connection", "close");
+		if(push_rejected)
+			server.send(409, "text/plain", "BUSY"); // the pull updater has the Updater
+		else
+			server.send(200, "text/plain",  Updater.get_last_status() == updater_t::stNoError ? "OK" :
+				Updater.is_resumable_error() ? "RETRY" : "FAIL"); // RETRY: resume from the checkpoint
+		Updater.release(compressed_updater_t::owPush);
+		push_rejected = false;
+	  }, []() {
+		HTTPRaw& raw = server.raw();
+		if (raw.status == RAW_START) {
+			String id = server.arg(F("id"));
+			uint32_t offset = strtoul(server.arg(F("offset")).c_str(), nullptr, 10);
+			printf("Update: %s from %u\n", id.c_str(), (unsigned)offset);
+
+			if(!begin_push()) return;
+			if(offset == 0)
+				Updater.begin(id);
+			else
+				Updater.resume(id, offset);
+
+		} else if (push_rejected) {
+
+			// discard
+
+		} else if (raw.status == RAW_WRITE) {
+
+			Updater.write_data(raw.buf, raw.currentSize);
+
+		} else if (raw.status == RAW_END) {
+
+			if(Updater.finish())
+			{
+				// schedule a reboot
+				schedule_reboot();
+			}
+
+		} else if (raw.status == RAW_ABORTED) {
+
+			Updater.end(); // the last checkpoint is kept
+			Updater.release(compressed_updater_t::owPush);
+
 		}
 	  });
 	server.on(F("/keys/U"), HTTP_GET, []() {
-		if(!send_common_header()) return; button_push(BUTTON_UP);     send_json_ok(); });
+		if(!send_common_header()) return; button_push(BUTTON_UP, is_web);     send_json_ok(); });
 	server.on(F("/keys/D"), HTTP_GET, []() {
-		if(!send_common_header()) return; button_push(BUTTON_DOWN);   send_json_ok(); });
+		if(!send_common_header()) return; button_push(BUTTON_DOWN, is_web);   send_json_ok(); });
 	server.on(F("/keys/L"), HTTP_GET, []() {
-		if(!send_common_header()) return; button_push(BUTTON_LEFT);   send_json_ok(); });
+		if(!send_common_header()) return; button_push(BUTTON_LEFT, is_web);   send_json_ok(); });
 	server.on(F("/keys/R"), HTTP_GET, []() {
-		if(!send_common_header()) return; button_push(BUTTON_RIGHT);  send_json_ok(); });
+		if(!send_common_header()) return; button_push(BUTTON_RIGHT, is_web);  send_json_ok(); });
 	server.on(F("/keys/O"), HTTP_GET, []() {
-		if(!send_common_header()) return; button_push(BUTTON_OK);     send_json_ok(); });
+		if(!send_common_header()) return; button_push(BUTTON_OK, is_web);     send_json_ok(); });
 	server.on(F("/keys/C"), HTTP_GET, []() {
-		if(!send_common_header()) return; button_push(BUTTON_CANCEL); send_json_ok(); });
+		if(!send_common_header()) return; button_push(BUTTON_CANCEL, is_web); send_json_ok(); });
 
 	server.on(F("/settings/export"), HTTP_GET, [](){
-			String filename(F("export.tar"));
 			if(!send_common_header()) return;
 			server.sendHeader(F("Content-Disposition"),
 				F("attachment; filename=\"mx5_settings.tar\""));
-			if(!settings_export(filename, String())) return;
-			File dataFile = FS.open(filename.c_str(), "r");
-			if (!dataFile) return;
-			server.streamFile(dataFile, F("application/tar"));
-			dataFile.close();
+			// stream the archive as chunked response, as it is built
+			server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+			server.send(200, F("application/tar"), String());
+			settings_export([](const uint8_t *buf, size_t size) {
+					server.sendContent(reinterpret_cast<const char *>(buf), size);
+					return (bool)server.client().connected();
+				}, String());
+			server.sendContent(String()); // terminating chunk
 		});
 
 	static int last_import_error = 0;
@@ -339,29 +551,27 @@ void web_server_setup()
 			server.close();
 			schedule_reboot();
 		}, []() {
-			String filename(F("import.tar"));
+			// parse the archive as it arrives
 			HTTPUpload& upload = server.upload();
 			if(upload.status == UPLOAD_FILE_START){
-				FS.remove(filename.c_str());
+				settings_import_begin();
 				last_import_error = 0;
 			} else if(upload.status == UPLOAD_FILE_WRITE){
-				// upload file in progress
-				const uint8_t *p = upload.buf;
-				size_t size = upload.currentSize;
-				File dataFile = FS.open(filename.c_str(), "a");
-				if(dataFile.size() > MAX_SETTINGS_TAR_SIZE)
+				if(!settings_import_feed(upload.buf, upload.currentSize) && last_import_error == 0)
 				{
-					last_import_error = 1;
-					return; // max size exceeded
+					last_import_error =
+						upload.totalSize + upload.currentSize > MAX_SETTINGS_TAR_SIZE ?
+							1 : // max size exceeded
+							2;  // broken archive
 				}
-				dataFile.write(p, size);
-				dataFile.close();
 			} else if(upload.status == UPLOAD_FILE_END){
-				if(!settings_import(filename))
+				if(!run_in_main_thread([]() -> int { return settings_import_end(); }) && last_import_error == 0)
 				{
 					last_import_error = 2;
 					return; // import error
 				}
+			} else if(upload.status == UPLOAD_FILE_ABORTED){
+				run_in_main_thread([]() -> int { settings_import_end(); return 0; }); // discard
 			}
 		});
 
@@ -370,13 +580,17 @@ void web_server_setup()
 	server.onNotFound(handleNotFound);
 
 	server.begin();
+	if(xTaskCreate(web_server_task, "web server", WEB_SERVER_STACK_SIZE, nullptr, 1, nullptr) != pdPASS)
+	{
+		puts("Could not start the HTTP server task");
+		return;
+	}
 	puts("HTTP server started");
 
 }
 
-void web_server_handle_client()
+void poll_web_server()
 {
-	server.handleClient();
 	if(scheduled_reboot && (int32_t)(millis() - scheduled_reboot_tick) > 0)
 	{
 		reboot(); // do scheduled reboot
@@ -1,5 +1,6 @@
 #pragma once
 
 void web_server_setup();
-void web_server_handle_client();
+void poll_web_server(); //!< requests are served on a task of their own; this only does the scheduled reboot
 void set_system_recovery_mode();
+void schedule_reboot(); //!< reboot after a short delay; safe to call from any task
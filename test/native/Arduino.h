@@ -0,0 +1,115 @@
+#pragma once
+
+// Host stand-in of the Arduino core, as far as the OTA updater and the
+// settings store need it.
+// See fake_esp.h for the fakes behind it.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <functional>
+#include <string>
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+#define F(s) (s)
+
+class String
+{
+    std::string s;
+
+public:
+    String() {}
+    String(const char *str) : s(str ? str : "") {}
+    String(const std::string &str) : s(str) {}
+
+    const char *c_str() const { return s.c_str(); }
+    unsigned int length() const { return (unsigned int)s.length(); }
+    void reserve(unsigned int size) { s.reserve(size); }
+
+    char operator[](unsigned int index) const { return index < s.length() ? s[index] : 0; }
+    String &operator+=(char c) { s += c; return *this; }
+    String &operator+=(const String &str) { s += str.s; return *this; }
+    String &operator+=(const char *str) { s += str; return *this; }
+    friend String operator+(const String &a, const String &b) { return String(a.s + b.s); }
+
+    bool operator==(const String &str) const { return s == str.s; }
+    bool operator==(const char *str) const { return s == str; }
+    bool operator!=(const String &str) const { return s != str.s; }
+    bool operator!=(const char *str) const { return s != str; }
+    bool operator<(const String &str) const { return s < str.s; }
+
+    int indexOf(char c, unsigned int from = 0) const { return find(s.find(c, from)); }
+    int indexOf(const char *str, unsigned int from = 0) const { return find(s.find(str, from)); }
+    int lastIndexOf(char c) const { return find(s.rfind(c)); }
+    bool startsWith(const char *str) const { return s.compare(0, strlen(str), str) == 0; }
+    bool startsWith(const String &str) const { return startsWith(str.c_str()); }
+    bool endsWith(const char *str) const
+    {
+        size_t n = strlen(str);
+        return s.length() >= n && s.compare(s.length() - n, n, str) == 0;
+    }
+    String substring(unsigned int from) const { return from < s.length() ? String(s.substr(from)) : String(); }
+    String substring(unsigned int from, unsigned int to) const
+    {
+        return from < to && from < s.length() ? String(s.substr(from, to - from)) : String();
+    }
+
+private:
+    static int find(size_t pos) { return pos == std::string::npos ? -1 : (int)pos; }
+};
+
+class Print
+{
+public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t c) = 0;
+    virtual size_t write(const uint8_t *buf, size_t size)
+    {
+        size_t n = 0;
+        while (size--)
+            n += write(*buf++);
+        return n;
+    }
+    size_t print(const char *str) { return write((const uint8_t *)str, strlen(str)); }
+    size_t print(const String &str) { return print(str.c_str()); }
+    size_t print(char c) { return write((uint8_t)c); }
+    size_t printf(const char *format, ...) __attribute__((format(printf, 2, 3)))
+    {
+        char buf[256];
+        va_list ap;
+        va_start(ap, format);
+        int n = vsnprintf(buf, sizeof(buf), format, ap);
+        va_end(ap);
+        if (n < 0)
+            return 0;
+        if ((size_t)n < sizeof(buf))
+            return write((const uint8_t *)buf, n);
+        std::string big(n + 1, '\0');
+        va_start(ap, format);
+        vsnprintf(&big[0], big.size(), format, ap);
+        va_end(ap);
+        return write((const uint8_t *)big.data(), n);
+    }
+};
+
+uint32_t millis();
+uint32_t micros();
+void delay(uint32_t ms);
+
+class EspClass
+{
+public:
+    uint32_t getFreeHeap() { return 0; }
+    uint32_t getMinFreeHeap() { return 0; }
+    uint32_t getMaxAllocHeap() { return 0; }
+    bool flashRead(uint32_t offset, uint32_t *data, size_t size); //!< from the fake flash
+    void restart() { abort(); }
+};
+
+extern EspClass ESP;
@@ -0,0 +1,64 @@
+#pragma once
+
+// Arduino FS on a host directory, as far as fs_delta, the settings store
+// and microtar need it. A mounted filesystem is a directory; see fake_fs.cpp.
+
+#include <Arduino.h>
+#include <memory>
+#include <string>
+
+#define FILE_READ "r"
+#define FILE_WRITE "w"
+#define FILE_APPEND "a"
+
+namespace fs
+{
+
+struct fake_file_t;
+
+class File : public Print
+{
+    std::shared_ptr<fake_file_t> impl;
+
+public:
+    File() {}
+    explicit File(const std::shared_ptr<fake_file_t> &_impl) : impl(_impl) {}
+
+    size_t write(uint8_t c) override { return write(&c, 1); }
+    size_t write(const uint8_t *buf, size_t size) override;
+    size_t read(uint8_t *buf, size_t size);
+    bool seek(uint32_t pos);
+    size_t size() const;
+    void close() { impl.reset(); }
+    operator bool() const { return !!impl; }
+    const char *path() const;
+    const char *name() const;
+    bool isDirectory() const;
+    File openNextFile(const char *mode = FILE_READ);
+};
+
+class FS
+{
+protected:
+    std::string root; //!< host directory of the mounted filesystem; empty if not mounted
+
+public:
+    File open(const char *path, const char *mode = FILE_READ, const bool create = false);
+    File open(const String &path, const char *mode = FILE_READ, const bool create = false)
+    {
+        return open(path.c_str(), mode, create);
+    }
+    bool exists(const char *path);
+    bool exists(const String &path) { return exists(path.c_str()); }
+    bool mkdir(const char *path);
+    bool mkdir(const String &path) { return mkdir(path.c_str()); }
+    bool remove(const char *path);
+    bool remove(const String &path) { return remove(path.c_str()); }
+    bool rename(const char *from, const char *to);
+    bool rename(const String &from, const String &to) { return rename(from.c_str(), to.c_str()); }
+};
+
+}
+
+using fs::FS;
+using fs::File;
@@ -0,0 +1,23 @@
+#pragma once
+
+// MD5 by the host OpenSSL
+
+#include <Arduino.h>
+
+class MD5Builder
+{
+    void *ctx = nullptr;
+    uint8_t digest[16] = {0};
+
+public:
+    MD5Builder() {}
+    MD5Builder(const MD5Builder &) = delete;
+    MD5Builder &operator=(const MD5Builder &) = delete;
+    ~MD5Builder();
+
+    void begin();
+    void add(uint8_t *data, uint16_t len);
+    void calculate();
+    void getBytes(uint8_t *output) { memcpy(output, digest, sizeof(digest)); }
+    String toString();
+};
@@ -0,0 +1,14 @@
+#pragma once
+
+#include "esp_partition.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+const esp_partition_t *esp_ota_get_running_partition();
+esp_err_t esp_ota_set_boot_partition(const esp_partition_t *partition);
+
+#ifdef __cplusplus
+}
+#endif
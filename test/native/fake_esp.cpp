@@ -0,0 +1,226 @@
+// Fake flash, partitions, OTA, NVS and Arduino core of the host tests;
+// see fake_esp.h
+
+#include <Arduino.h>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "esp_ota_ops.h"
+#include "esp_timer.h"
+#include "esp_spi_flash.h"
+#include "nvs.h"
+#include "panic.h"
+#include "fake_esp.h"
+
+static constexpr size_t FLASH_SIZE = 16 * 1024 * 1024;
+
+// as src/custom.csv
+static const esp_partition_t partitions[] = {
+    { ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_NVS, 0x9000, 0x5000, "nvs", false },
+    { ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_OTA, 0xe000, 0x2000, "otadata", false },
+    { ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_0, 0x10000, 0x300000, "app0", false },
+    { ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_1, 0x310000, 0x300000, "app1", false },
+    { ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_SPIFFS, 0x610000, 0x70000, "conf", false },
+    { ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_COREDUMP, 0x680000, 0x10000, "coredump", false },
+    { ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_SPIFFS, 0x690000, 0x100000, "fs1", false },
+    { ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_SPIFFS, 0x790000, 0x100000, "fs0", false },
+    { (esp_partition_type_t)0x40, (esp_partition_subtype_t)0, 0x890000, 0x380000, "font0", false },
+    { (esp_partition_type_t)0x40, (esp_partition_subtype_t)1, 0xc10000, 0x380000, "font1", false },
+};
+
+static std::vector<uint8_t> flash(FLASH_SIZE, 0xff);
+static const esp_partition_t *running_partition = &partitions[2];
+static const esp_partition_t *boot_partition = nullptr;
+
+
+void fake_flash_reset()
+{
+    std::fill(flash.begin(), flash.end(), 0xff);
+    running_partition = fake_partition("app0");
+    boot_partition = nullptr;
+}
+
+uint8_t *fake_flash_data(const esp_partition_t *partition)
+{
+    return flash.data() + partition->address;
+}
+
+const esp_partition_t *fake_partition(const char *label)
+{
+    for (auto &&p : partitions)
+        if (!strcmp(p.label, label))
+            return &p;
+    printf("fake_partition: no partition '%s'\n", label);
+    abort();
+}
+
+void fake_set_running_partition(const char *label)
+{
+    running_partition = fake_partition(label);
+}
+
+const esp_partition_t *fake_get_boot_partition()
+{
+    return boot_partition;
+}
+
+
+const esp_partition_t *esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype, const char *label)
+{
+    for (auto &&p : partitions)
+        if (p.type == type && (subtype == ESP_PARTITION_SUBTYPE_ANY || p.subtype == subtype) &&
+            (!label || !strcmp(p.label, label)))
+            return &p;
+    return nullptr;
+}
+
+esp_err_t esp_partition_read(const esp_partition_t *partition, size_t src_offset, void *dst, size_t size)
+{
+    if (src_offset > partition->size || size > partition->size - src_offset)
+        return ESP_ERR_INVALID_SIZE;
+    memcpy(dst, fake_flash_data(partition) + src_offset, size);
+    return ESP_OK;
+}
+
+// wrapped by flash_stats.cpp, as on the device
+esp_err_t esp_partition_write(const esp_partition_t *partition, size_t dst_offset, const void *src, size_t size)
+{
+    if (dst_offset > partition->size || size > partition->size - dst_offset)
+        return ESP_ERR_INVALID_SIZE;
+    uint8_t *dst = fake_flash_data(partition) + dst_offset;
+    for (size_t i = 0; i < size; ++i)
+        dst[i] &= ((const uint8_t *)src)[i]; // bits are only cleared
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t *partition, size_t offset, size_t size)
+{
+    if (offset > partition->size || size > partition->size - offset)
+        return ESP_ERR_INVALID_SIZE;
+    if ((offset | size) & (SPI_FLASH_SEC_SIZE - 1))
+        return ESP_ERR_INVALID_ARG;
+    memset(fake_flash_data(partition) + offset, 0xff, size);
+    return ESP_OK;
+}
+
+const esp_partition_t *esp_ota_get_running_partition()
+{
+    return running_partition;
+}
+
+esp_err_t esp_ota_set_boot_partition(const esp_partition_t *partition)
+{
+    if (partition->type != ESP_PARTITION_TYPE_APP)
+        return ESP_ERR_INVALID_ARG;
+    boot_partition = partition;
+    return ESP_OK;
+}
+
+
+// NVS: namespace and key to value; a handle is the namespace name
+static std::mutex nvs_mutex;
+static std::map<std::string, std::map<std::string, std::vector<uint8_t>>> nvs;
+static std::vector<std::string> nvs_handles;
+
+void fake_nvs_reset()
+{
+    std::lock_guard<std::mutex> lock(nvs_mutex);
+    nvs.clear();
+}
+
+esp_err_t nvs_open(const char *name, nvs_open_mode open_mode, nvs_handle *out_handle)
+{
+    std::lock_guard<std::mutex> lock(nvs_mutex);
+    if (open_mode == NVS_READONLY && !nvs.count(name))
+        return ESP_ERR_NVS_NOT_FOUND;
+    nvs[name];
+    auto it = std::find(nvs_handles.begin(), nvs_handles.end(), name);
+    if (it == nvs_handles.end())
+        it = nvs_handles.insert(it, name);
+    *out_handle = (nvs_handle)(it - nvs_handles.begin());
+    return ESP_OK;
+}
+
+esp_err_t nvs_set_blob(nvs_handle handle, const char *key, const void *value, size_t length)
+{
+    std::lock_guard<std::mutex> lock(nvs_mutex);
+    nvs[nvs_handles[handle]][key].assign((const uint8_t *)value, (const uint8_t *)value + length);
+    return ESP_OK;
+}
+
+esp_err_t nvs_get_blob(nvs_handle handle, const char *key, void *out_value, size_t *length)
+{
+    std::lock_guard<std::mutex> lock(nvs_mutex);
+    auto &&ns = nvs[nvs_handles[handle]];
+    auto it = ns.find(key);
+    if (it == ns.end())
+        return ESP_ERR_NVS_NOT_FOUND;
+    if (out_value)
+    {
+        if (*length < it->second.size())
+            return ESP_ERR_NVS_INVALID_LENGTH;
+        memcpy(out_value, it->second.data(), it->second.size());
+    }
+    *length = it->second.size();
+    return ESP_OK;
+}
+
+esp_err_t nvs_erase_key(nvs_handle handle, const char *key)
+{
+    std::lock_guard<std::mutex> lock(nvs_mutex);
+    return nvs[nvs_handles[handle]].erase(key) ? ESP_OK : ESP_ERR_NVS_NOT_FOUND;
+}
+
+esp_err_t nvs_commit(nvs_handle handle)
+{
+    return ESP_OK;
+}
+
+void nvs_close(nvs_handle handle)
+{
+}
+
+
+// Arduino core
+EspClass ESP;
+
+bool EspClass::flashRead(uint32_t offset, uint32_t *data, size_t size)
+{
+    if (offset > FLASH_SIZE || size > FLASH_SIZE - offset)
+        return false;
+    memcpy(data, flash.data() + offset, size);
+    return true;
+}
+
+static const std::chrono::steady_clock::time_point boot_time = std::chrono::steady_clock::now();
+
+int64_t esp_timer_get_time()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - boot_time).count();
+}
+
+uint32_t millis()
+{
+    return (uint32_t)(esp_timer_get_time() / 1000);
+}
+
+uint32_t micros()
+{
+    return (uint32_t)esp_timer_get_time();
+}
+
+void delay(uint32_t ms)
+{
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+
+// panic.cpp; the settings store calls this when it cannot mount
+void immediate_reset()
+{
+    printf("immediate_reset() called\n");
+    abort();
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+// Control of the host fakes behind the stub headers in this directory,
+// for the tests.
+//
+// The flash is a 16 MiB RAM array laid out as src/custom.csv. As on NOR
+// flash, a write can only clear bits, so a write without an erase shows
+// up as corrupted data. NVS is an in-memory map. A mounted LittleFS is a
+// directory under the filesystem root given by the test.
+
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_partition.h"
+
+//! erase the whole flash and forget the boot partition
+void fake_flash_reset();
+//! the flash content of the partition
+uint8_t *fake_flash_data(const esp_partition_t *partition);
+//! the partition of the label; aborts if there is none
+const esp_partition_t *fake_partition(const char *label);
+
+//! the partition the firmware runs from; "app0" after fake_flash_reset()
+void fake_set_running_partition(const char *label);
+//! the partition set by esp_ota_set_boot_partition(); nullptr if none
+const esp_partition_t *fake_get_boot_partition();
+
+//! forget all NVS content
+void fake_nvs_reset();
+
+//! host directory holding a directory per filesystem partition label
+void fake_fs_set_root(const char *dir);
+
+//! calls to the files of the fake filesystems; the test may reset them
+struct fake_fs_counters_t
+{
+    unsigned opens;  //!< files opened, directories not counted
+    unsigned reads;  //!< File::read() calls
+    unsigned writes; //!< File::write() calls
+};
+extern fake_fs_counters_t fake_fs_counters;
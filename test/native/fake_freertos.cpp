@@ -0,0 +1,225 @@
+// FreeRTOS tasks, queues, recursive mutexes and stream buffers on host
+// threads; see freertos/FreeRTOS.h
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/stream_buffer.h"
+
+static constexpr auto TICK = std::chrono::microseconds(10);
+
+// wait on cv until ready() or the ticks pass; lock is held
+template <typename Pred>
+static bool wait_for(std::condition_variable &cv, std::unique_lock<std::mutex> &lock, TickType_t ticks, Pred ready)
+{
+    if (ticks == portMAX_DELAY)
+    {
+        cv.wait(lock, ready);
+        return true;
+    }
+    return cv.wait_for(lock, ticks * TICK, ready);
+}
+
+
+struct fake_task_t
+{
+    std::string name;
+};
+
+static thread_local fake_task_t *current_task = nullptr;
+static fake_task_t main_task = { "main" };
+
+BaseType_t xTaskCreate(TaskFunction_t code, const char *name, configSTACK_DEPTH_TYPE stack_depth,
+                       void *parameters, UBaseType_t priority, TaskHandle_t *created_task)
+{
+    fake_task_t *task = new fake_task_t{ name };
+    if (created_task)
+        *created_task = task;
+    std::thread([=]() {
+        current_task = task;
+        code(parameters);
+        delete task;
+    }).detach();
+    return pdPASS;
+}
+
+void vTaskDelete(TaskHandle_t task)
+{
+    // the task function returns right after; the thread ends there
+}
+
+char *pcTaskGetName(TaskHandle_t task)
+{
+    if (!task)
+        task = current_task ? current_task : &main_task;
+    return &task->name[0];
+}
+
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task)
+{
+    return 0;
+}
+
+
+// Items are handed over under the lock and waiters are notified before it
+// is released, so that a queue may be deleted as soon as a waiter returns,
+// as the updater does with its semaphores.
+struct fake_queue_t
+{
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::deque<std::vector<uint8_t>> items;
+    size_t length;
+    size_t item_size;
+    std::thread::id owner; //!< recursive mutex: the holding thread
+    unsigned depth = 0;    //!< recursive mutex: takes not yet given back
+};
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size)
+{
+    fake_queue_t *queue = new fake_queue_t;
+    queue->length = length;
+    queue->item_size = item_size;
+    return queue;
+}
+
+void vQueueDelete(QueueHandle_t queue)
+{
+    delete queue;
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t ticks_to_wait)
+{
+    std::unique_lock<std::mutex> lock(queue->mutex);
+    if (!wait_for(queue->changed, lock, ticks_to_wait, [=]() { return queue->items.size() < queue->length; }))
+        return pdFALSE;
+    queue->items.emplace_back((const uint8_t *)item, (const uint8_t *)item + queue->item_size);
+    queue->changed.notify_all();
+    return pdTRUE;
+}
+
+static BaseType_t receive(QueueHandle_t queue, void *buffer, TickType_t ticks_to_wait, bool remove)
+{
+    std::unique_lock<std::mutex> lock(queue->mutex);
+    if (!wait_for(queue->changed, lock, ticks_to_wait, [=]() { return !queue->items.empty(); }))
+        return pdFALSE;
+    if (buffer)
+        memcpy(buffer, queue->items.front().data(), queue->item_size);
+    if (remove)
+    {
+        queue->items.pop_front();
+        queue->changed.notify_all();
+    }
+    return pdTRUE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *buffer, TickType_t ticks_to_wait)
+{
+    return receive(queue, buffer, ticks_to_wait, true);
+}
+
+BaseType_t xQueuePeek(QueueHandle_t queue, void *buffer, TickType_t ticks_to_wait)
+{
+    return receive(queue, buffer, ticks_to_wait, false);
+}
+
+SemaphoreHandle_t xSemaphoreCreateRecursiveMutex()
+{
+    return xQueueCreate(1, 0);
+}
+
+BaseType_t xSemaphoreTakeRecursive(SemaphoreHandle_t mutex, TickType_t ticks_to_wait)
+{
+    std::unique_lock<std::mutex> lock(mutex->mutex);
+    std::thread::id self = std::this_thread::get_id();
+    if (!wait_for(mutex->changed, lock, ticks_to_wait, [=]() { return !mutex->depth || mutex->owner == self; }))
+        return pdFALSE;
+    mutex->owner = self;
+    ++mutex->depth;
+    return pdTRUE;
+}
+
+BaseType_t xSemaphoreGiveRecursive(SemaphoreHandle_t mutex)
+{
+    std::unique_lock<std::mutex> lock(mutex->mutex);
+    if (!mutex->depth || mutex->owner != std::this_thread::get_id())
+        return pdFALSE;
+    if (!--mutex->depth)
+        mutex->changed.notify_all();
+    return pdTRUE;
+}
+
+
+struct fake_stream_buffer_t
+{
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::vector<uint8_t> ring;
+    size_t head = 0; // index of the first byte
+    size_t count = 0; // bytes in the ring
+    size_t trigger_level;
+};
+
+StreamBufferHandle_t xStreamBufferCreate(size_t buffer_size, size_t trigger_level)
+{
+    fake_stream_buffer_t *sb = new fake_stream_buffer_t;
+    sb->ring.resize(buffer_size);
+    sb->trigger_level = trigger_level ? trigger_level : 1;
+    return sb;
+}
+
+void vStreamBufferDelete(StreamBufferHandle_t stream_buffer)
+{
+    delete stream_buffer;
+}
+
+size_t xStreamBufferSend(StreamBufferHandle_t sb, const void *data, size_t length, TickType_t ticks_to_wait)
+{
+    // as FreeRTOS: wait for space for all (at most the buffer size), then
+    // write as much as fits
+    std::unique_lock<std::mutex> lock(sb->mutex);
+    size_t size = sb->ring.size();
+    size_t required = std::min(length, size);
+    wait_for(sb->changed, lock, ticks_to_wait, [=]() { return size - sb->count >= required; });
+    size_t n = std::min(length, size - sb->count);
+    for (size_t done = 0; done < n;)
+    {
+        size_t tail = (sb->head + sb->count) % size;
+        size_t len = std::min(n - done, size - tail);
+        memcpy(&sb->ring[tail], (const uint8_t *)data + done, len);
+        done += len;
+        sb->count += len;
+    }
+    if (n)
+        sb->changed.notify_all();
+    return n;
+}
+
+size_t xStreamBufferReceive(StreamBufferHandle_t sb, void *buffer, size_t length, TickType_t ticks_to_wait)
+{
+    std::unique_lock<std::mutex> lock(sb->mutex);
+    size_t size = sb->ring.size();
+    wait_for(sb->changed, lock, ticks_to_wait, [=]() { return sb->count >= sb->trigger_level; });
+    size_t n = std::min(length, sb->count);
+    for (size_t done = 0; done < n;)
+    {
+        size_t len = std::min(n - done, size - sb->head);
+        memcpy((uint8_t *)buffer + done, &sb->ring[sb->head], len);
+        done += len;
+        sb->head = (sb->head + len) % size;
+        sb->count -= len;
+    }
+    if (n)
+        sb->changed.notify_all();
+    return n;
+}
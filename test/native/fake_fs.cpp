@@ -0,0 +1,207 @@
+// Arduino FS and the LittleFS partitions of flash_fs.h on host directories;
+// see FS.h. A partition is formatted if its directory exists.
+
+#include <Arduino.h>
+#include <algorithm>
+#include <filesystem>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "flash_fs.h"
+#include "fake_esp.h"
+
+fake_fs_counters_t fake_fs_counters;
+
+namespace fs
+{
+
+struct fake_file_t
+{
+    FILE *f = nullptr;
+    std::string root;
+    std::string path; //!< path on the filesystem
+    bool dir = false;
+    std::vector<std::string> children; //!< paths of the directory entries
+    size_t next_child = 0;
+
+    ~fake_file_t()
+    {
+        if (f)
+            fclose(f);
+    }
+};
+
+static File open_file(const std::string &root, const std::string &path, const char *mode)
+{
+    std::string full = root + path;
+    struct stat st;
+    bool exists = !stat(full.c_str(), &st);
+    auto impl = std::make_shared<fake_file_t>();
+    impl->root = root;
+    impl->path = path;
+    if (!strcmp(mode, FILE_READ))
+    {
+        if (!exists)
+            return File();
+        if (S_ISDIR(st.st_mode))
+        {
+            impl->dir = true;
+            for (auto &&entry : std::filesystem::directory_iterator(full))
+                impl->children.push_back((path == "/" ? "" : path) + "/" + entry.path().filename().string());
+            std::sort(impl->children.begin(), impl->children.end());
+            return File(impl);
+        }
+        impl->f = fopen(full.c_str(), "rb");
+    }
+    else if (!strcmp(mode, FILE_WRITE) || !strcmp(mode, FILE_APPEND))
+    {
+        if (exists && S_ISDIR(st.st_mode))
+            return File();
+        impl->f = fopen(full.c_str(), !strcmp(mode, FILE_WRITE) ? "wb" : "ab");
+    }
+    if (impl->f)
+        ++fake_fs_counters.opens;
+    return impl->f ? File(impl) : File();
+}
+
+size_t File::write(const uint8_t *buf, size_t size)
+{
+    if (!impl || !impl->f)
+        return 0;
+    ++fake_fs_counters.writes;
+    return fwrite(buf, 1, size, impl->f);
+}
+
+size_t File::read(uint8_t *buf, size_t size)
+{
+    if (!impl || !impl->f)
+        return 0;
+    ++fake_fs_counters.reads;
+    return fread(buf, 1, size, impl->f);
+}
+
+bool File::seek(uint32_t pos)
+{
+    return impl && impl->f && !fseek(impl->f, pos, SEEK_SET);
+}
+
+size_t File::size() const
+{
+    struct stat st;
+    if (!impl || !impl->f || fstat(fileno(impl->f), &st))
+        return 0;
+    return st.st_size;
+}
+
+const char *File::path() const
+{
+    return impl ? impl->path.c_str() : nullptr;
+}
+
+const char *File::name() const
+{
+    if (!impl)
+        return nullptr;
+    const char *slash = strrchr(impl->path.c_str(), '/');
+    return slash ? slash + 1 : impl->path.c_str();
+}
+
+bool File::isDirectory() const
+{
+    return impl && impl->dir;
+}
+
+File File::openNextFile(const char *mode)
+{
+    if (!impl || !impl->dir || impl->next_child == impl->children.size())
+        return File();
+    return open_file(impl->root, impl->children[impl->next_child++], mode);
+}
+
+File FS::open(const char *path, const char *mode, const bool create)
+{
+    if (root.empty() || path[0] != '/')
+        return File();
+    return open_file(root, path, mode);
+}
+
+bool FS::exists(const char *path)
+{
+    struct stat st;
+    return !root.empty() && !stat((root + path).c_str(), &st);
+}
+
+bool FS::mkdir(const char *path)
+{
+    return !root.empty() && !::mkdir((root + path).c_str(), 0755);
+}
+
+bool FS::remove(const char *path)
+{
+    return !root.empty() && !::unlink((root + path).c_str());
+}
+
+// replaces an existing file, as LittleFS does
+bool FS::rename(const char *from, const char *to)
+{
+    return !root.empty() && !::rename((root + from).c_str(), (root + to).c_str());
+}
+
+
+static std::string fs_root;
+
+static std::string partition_dir(const char *label)
+{
+    return fs_root + "/" + (label ? label : "spiffs");
+}
+
+ANY_LittleFSFS::ANY_LittleFSFS()
+{
+}
+
+bool ANY_LittleFSFS::begin(const flash_fs_config_t &config)
+{
+    std::string dir = partition_dir(config.label);
+    if (!std::filesystem::is_directory(dir) && !(config.format_on_fail && format(config.label)))
+        return false;
+    root = dir;
+    return true;
+}
+
+bool ANY_LittleFSFS::begin(bool formatOnFail, const char *label, const char *basePath, uint8_t maxOpenFiles)
+{
+    flash_fs_config_t config;
+    config.label = label;
+    config.base_path = basePath;
+    config.format_on_fail = formatOnFail;
+    return begin(config);
+}
+
+bool ANY_LittleFSFS::format(const char *label)
+{
+    std::error_code ec;
+    std::filesystem::remove_all(partition_dir(label), ec);
+    return std::filesystem::create_directories(partition_dir(label), ec);
+}
+
+void ANY_LittleFSFS::end(const char *label)
+{
+    root.clear();
+}
+
+}
+
+fs::ANY_LittleFSFS FS;
+
+void fake_fs_set_root(const char *dir)
+{
+    fs::fs_root = dir;
+}
+
+const char *get_main_flash_fs_partition_name(int generation)
+{
+    const esp_partition_t *par = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY,
+                                                          (generation == 0) ? "fs0" : "fs1");
+    return par ? par->label : nullptr;
+}
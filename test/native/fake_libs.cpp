@@ -0,0 +1,110 @@
+// SHA-256, MD5, CRC32 and tinfl of the device on the host OpenSSL and zlib
+
+#include <Arduino.h>
+#include <openssl/evp.h>
+#include "MD5Builder.h"
+#include "mbedtls/sha256.h"
+#include "rom/crc.h"
+#include "rom/miniz.h"
+
+int mbedtls_sha256_ret(const unsigned char *input, size_t ilen, unsigned char output[32], int is224)
+{
+    if (is224)
+        return -1;
+    return EVP_Digest(input, ilen, output, nullptr, EVP_sha256(), nullptr) ? 0 : -1;
+}
+
+
+uint32_t crc32_le(uint32_t crc, uint8_t const *buf, uint32_t len)
+{
+    // zlib returns 0 for a null buffer; the ROM just returns crc for no data
+    return len ? crc32(crc, buf, len) : crc;
+}
+
+
+MD5Builder::~MD5Builder()
+{
+    EVP_MD_CTX_free((EVP_MD_CTX *)ctx);
+}
+
+void MD5Builder::begin()
+{
+    if (!ctx)
+        ctx = EVP_MD_CTX_new();
+    EVP_DigestInit_ex((EVP_MD_CTX *)ctx, EVP_md5(), nullptr);
+    memset(digest, 0, sizeof(digest));
+}
+
+void MD5Builder::add(uint8_t *data, uint16_t len)
+{
+    EVP_DigestUpdate((EVP_MD_CTX *)ctx, data, len);
+}
+
+void MD5Builder::calculate()
+{
+    EVP_DigestFinal_ex((EVP_MD_CTX *)ctx, digest, nullptr);
+}
+
+String MD5Builder::toString()
+{
+    char hex[sizeof(digest) * 2 + 1];
+    for (size_t i = 0; i < sizeof(digest); ++i)
+        sprintf(hex + i * 2, "%02x", digest[i]);
+    return String(hex);
+}
+
+
+tinfl_decompressor::~tinfl_decompressor()
+{
+    if (started)
+        inflateEnd(&z);
+}
+
+void tinfl_init(tinfl_decompressor *r)
+{
+    if (r->started)
+        inflateEnd(&r->z);
+    r->started = r->done = false;
+}
+
+tinfl_status tinfl_decompress(tinfl_decompressor *r, const mz_uint8 *pIn_buf_next, size_t *pIn_buf_size,
+                              mz_uint8 *pOut_buf_start, mz_uint8 *pOut_buf_next, size_t *pOut_buf_size,
+                              const mz_uint32 decomp_flags)
+{
+    // zlib keeps its own window, so the output dictionary is just the output
+    if (!r->started)
+    {
+        memset(&r->z, 0, sizeof(r->z));
+        if (inflateInit2(&r->z, (decomp_flags & TINFL_FLAG_PARSE_ZLIB_HEADER) ? MAX_WBITS : -MAX_WBITS) != Z_OK)
+        {
+            *pIn_buf_size = *pOut_buf_size = 0;
+            return TINFL_STATUS_FAILED;
+        }
+        r->started = true;
+    }
+    if (r->done)
+    {
+        *pIn_buf_size = *pOut_buf_size = 0;
+        return TINFL_STATUS_DONE;
+    }
+
+    r->z.next_in = const_cast<mz_uint8 *>(pIn_buf_next);
+    r->z.avail_in = (uInt)*pIn_buf_size;
+    r->z.next_out = pOut_buf_next;
+    r->z.avail_out = (uInt)*pOut_buf_size;
+    int ret = inflate(&r->z, Z_NO_FLUSH);
+    *pIn_buf_size -= r->z.avail_in;
+    *pOut_buf_size -= r->z.avail_out;
+
+    if (ret == Z_STREAM_END)
+    {
+        r->done = true;
+        return TINFL_STATUS_DONE;
+    }
+    if (ret != Z_OK && ret != Z_BUF_ERROR)
+        return TINFL_STATUS_FAILED;
+    if (r->z.avail_out == 0)
+        return TINFL_STATUS_HAS_MORE_OUTPUT;
+    // all input taken and the stream not ended
+    return (decomp_flags & TINFL_FLAG_HAS_MORE_INPUT) ? TINFL_STATUS_NEEDS_MORE_INPUT : TINFL_STATUS_FAILED;
+}
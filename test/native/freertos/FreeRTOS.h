@@ -0,0 +1,29 @@
+#pragma once
+
+// FreeRTOS on host threads; see fake_freertos.cpp.
+// A tick is 10 us instead of 1 ms: the updater waits with timeouts only
+// to poll, and the test should not spend its time in those waits.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <mutex>
+
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+
+#define pdFALSE 0
+#define pdTRUE 1
+#define pdFAIL pdFALSE
+#define pdPASS pdTRUE
+#define portMAX_DELAY ((TickType_t)0xffffffff)
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
+#define configSTACK_DEPTH_TYPE uint32_t
+
+struct portMUX_TYPE
+{
+    std::mutex mutex;
+};
+#define portMUX_INITIALIZER_UNLOCKED {}
+#define portENTER_CRITICAL(mux) ((mux)->mutex.lock())
+#define portEXIT_CRITICAL(mux) ((mux)->mutex.unlock())
@@ -0,0 +1,16 @@
+#pragma once
+
+#include "queue.h"
+
+// a binary semaphore is a queue of one empty item, as in FreeRTOS
+typedef QueueHandle_t SemaphoreHandle_t;
+
+#define xSemaphoreCreateBinary() xQueueCreate(1, 0)
+#define vSemaphoreDelete(semaphore) vQueueDelete(semaphore)
+#define xSemaphoreGive(semaphore) xQueueSend((semaphore), nullptr, 0)
+#define xSemaphoreTake(semaphore, ticks_to_wait) xQueueReceive((semaphore), nullptr, (ticks_to_wait))
+
+// a recursive mutex is a queue which remembers its owner thread
+SemaphoreHandle_t xSemaphoreCreateRecursiveMutex();
+BaseType_t xSemaphoreTakeRecursive(SemaphoreHandle_t mutex, TickType_t ticks_to_wait);
+BaseType_t xSemaphoreGiveRecursive(SemaphoreHandle_t mutex);
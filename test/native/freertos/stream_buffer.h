@@ -0,0 +1,10 @@
+#pragma once
+
+#include "FreeRTOS.h"
+
+typedef struct fake_stream_buffer_t *StreamBufferHandle_t;
+
+StreamBufferHandle_t xStreamBufferCreate(size_t buffer_size, size_t trigger_level);
+void vStreamBufferDelete(StreamBufferHandle_t stream_buffer);
+size_t xStreamBufferSend(StreamBufferHandle_t stream_buffer, const void *data, size_t length, TickType_t ticks_to_wait);
+size_t xStreamBufferReceive(StreamBufferHandle_t stream_buffer, void *buffer, size_t length, TickType_t ticks_to_wait);
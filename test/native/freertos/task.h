@@ -0,0 +1,15 @@
+#pragma once
+
+#include "FreeRTOS.h"
+
+typedef struct fake_task_t *TaskHandle_t;
+typedef void (*TaskFunction_t)(void *);
+
+//! runs the task on a detached thread; stack depth and priority are ignored
+BaseType_t xTaskCreate(TaskFunction_t code, const char *name, configSTACK_DEPTH_TYPE stack_depth,
+                       void *parameters, UBaseType_t priority, TaskHandle_t *created_task);
+//! only vTaskDelete(nullptr) at the end of the task function
+void vTaskDelete(TaskHandle_t task);
+char *pcTaskGetName(TaskHandle_t task);
+//! 0; the host has no stack limit to report
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task);
@@ -0,0 +1,144 @@
+#!/usr/bin/env python3
+
+# Make the OTA archives for the host test of the updater (test/test_ota_archive);
+# used as a PlatformIO pre script of [env:native], which passes the output
+# directory to the test as OTA_TEST_DATA_DIR.
+#
+# The archives are made by make_archive.py from generated content:
+# - full_zlib.bin:  font, fs and app images, zlib compressed
+# - full_lz4.bin:   the same, LZ4 compressed with per sector hashes
+#                   (only if the lz4 module is installed)
+# - delta.bin:      font image, "fsfiles" and an app "sdelta" against the
+#                   running device state below, zlib compressed
+# - delta_lz4.bin:  delta.bin LZ4 compressed (only if the lz4 module is installed)
+# - delta.bin.uncompressed: delta.bin before compression
+# The running device state: app_running.bin in app0, app_inactive.bin in
+# app1, and the files under fs_running/ on fs0. The images to be written:
+# font.bin, fs.bin and app.bin, and the files under fs_new/.
+
+import hashlib
+import os
+import random
+import shutil
+import sys
+
+PROJECT_DIR = os.path.dirname(os.path.dirname(os.path.dirname(os.path.abspath(__file__))))
+sys.path.insert(0, PROJECT_DIR)
+import make_archive
+
+SECTOR_SIZE = 4096
+ARCHIVE_HEADER = b"MZ5 firmware archive 1.0\r\n\n\x1a    "
+
+
+def write_if_changed(filename, content):
+    """keep the timestamp of unchanged files"""
+    if os.path.isfile(filename) and open(filename, "rb").read() == content:
+        return
+    os.makedirs(os.path.dirname(filename), exist_ok=True)
+    open(filename, "wb").write(content)
+
+def make_image(rnd, size):
+    """compressible content, somewhat like code and fonts"""
+    words = [bytes(rnd.randrange(256) for _ in range(rnd.randrange(2, 12))) for _ in range(256)]
+    out = bytearray()
+    while len(out) < size:
+        out += rnd.choice(words) if rnd.random() < 0.9 else bytes([rnd.randrange(256)])
+    return bytes(out[:size])
+
+def change_sectors(rnd, image, sectors):
+    """a copy of the image with the given sectors overwritten"""
+    out = bytearray(image)
+    for i in sectors:
+        out[i * SECTOR_SIZE:(i + 1) * SECTOR_SIZE] = make_image(rnd, SECTOR_SIZE)
+    return bytes(out)
+
+def write_tree(out_dir, files):
+    shutil.rmtree(out_dir, ignore_errors = True)
+    for path, content in files.items():
+        filename = os.path.join(out_dir, path.lstrip("/"))
+        os.makedirs(os.path.dirname(filename), exist_ok=True)
+        open(filename, "wb").write(content)
+
+def sector_manifest(label, running, inactive):
+    """as /update/sector_manifest of the device writes it, for one target"""
+    out = []
+    for side, image in (("running", running), ("inactive", inactive)):
+        out.append(f"{label} {side} {len(image) // SECTOR_SIZE}\n")
+        out += [hashlib.sha256(image[i:i + SECTOR_SIZE]).hexdigest() + "\n"
+            for i in range(0, len(image), SECTOR_SIZE)]
+    return "".join(out)
+
+def make_test_archives(out_dir):
+    """make the archives and the device state into out_dir; returns out_dir"""
+    rnd = random.Random(5)
+    font = make_image(rnd, 256 * 1024)
+    fs = make_image(rnd, 128 * 1024)
+    app = make_image(rnd, 512 * 1024 + 1000) # not sector aligned, as firmware.bin
+    app_padded = make_archive.bin_padding(app, SECTOR_SIZE)
+    app_count = len(app_padded) // SECTOR_SIZE
+    # most sectors on the running partition, some still on the inactive one
+    app_running = change_sectors(rnd, app_padded, range(0, app_count, 7))
+    app_inactive = change_sectors(rnd, app_padded, range(1, app_count, 3))
+
+    fs_running = {
+        "/index.html": b"<html>old</html>\n" * 50,
+        "/w/app.js": make_image(rnd, 20000),
+        "/w/style.css": make_image(rnd, 3000),
+        "/w/img/logo.bin": make_image(rnd, 9000),
+        "/removed.txt": b"only in the running filesystem\n",
+    }
+    fs_new = dict(fs_running)
+    del fs_new["/removed.txt"]
+    fs_new["/index.html"] = b"<html>new</html>\n" * 60
+    fs_new["/w/img/new.bin"] = make_image(rnd, 5000)
+    fs_new["/empty"] = b""
+
+    for name, content in (("font.bin", font), ("fs.bin", fs), ("app.bin", app_padded),
+                          ("app_running.bin", app_running), ("app_inactive.bin", app_inactive)):
+        write_if_changed(os.path.join(out_dir, name), content)
+    write_tree(os.path.join(out_dir, "fs_running"), fs_running)
+    write_tree(os.path.join(out_dir, "fs_new"), fs_new)
+
+    header = make_archive.bin_padding(ARCHIVE_HEADER, SECTOR_SIZE)
+    def full(sector_hashes):
+        return header + b"".join(
+            make_archive.make_section(label, make_archive.bin_padding(content, SECTOR_SIZE),
+                len(content), SECTOR_SIZE, sector_hashes)
+            for content, label in ((font, "font"), (fs, "fs"), (app, "app")))
+
+    fs_delta = make_archive.make_fs_delta(os.path.join(out_dir, "fs_new"),
+        {p: (len(c), hashlib.md5(c).hexdigest()) for p, c in fs_running.items()})
+    manifest = os.path.join(out_dir, "sector_manifest.txt")
+    write_if_changed(manifest, sector_manifest("app", app_running, app_inactive).encode("utf-8"))
+    sdelta = make_archive.make_sector_delta("app", app_padded,
+        make_archive.read_sector_manifest(manifest), SECTOR_SIZE)
+    delta = (header +
+        make_archive.make_section("font", make_archive.bin_padding(font, SECTOR_SIZE), len(font), SECTOR_SIZE) +
+        make_archive.make_section("fsfiles", fs_delta, len(fs_delta), SECTOR_SIZE) +
+        make_archive.make_section("sdelta", sdelta, len(sdelta), SECTOR_SIZE, True))
+    write_if_changed(os.path.join(out_dir, "delta.bin.uncompressed"), delta)
+    write_if_changed(os.path.join(out_dir, "delta.bin"), make_archive.compress_archive(delta, False))
+
+    write_if_changed(os.path.join(out_dir, "full_zlib.bin"), make_archive.compress_archive(full(False), False))
+    try:
+        import lz4.block
+        write_if_changed(os.path.join(out_dir, "full_lz4.bin"), make_archive.compress_archive(full(True), True))
+        write_if_changed(os.path.join(out_dir, "delta_lz4.bin"), make_archive.compress_archive(delta, True))
+    except ImportError:
+        print("The lz4 module is not installed; LZ4 archives are not tested.\n")
+    return out_dir
+
+try:
+    Import("env")
+except NameError:
+    env = None
+
+if env is not None:
+    out_dir = make_test_archives(env.subst("$BUILD_DIR/ota_test_data"))
+    env.Append(CPPDEFINES = [("OTA_TEST_DATA_DIR", env.StringifyMacro(os.path.abspath(out_dir)))])
+elif __name__ == '__main__':
+    import argparse
+    parser = argparse.ArgumentParser(description="make the OTA archives for the host test of the updater")
+    parser.add_argument("out_dir", nargs="?", default=".pio/build/native/ota_test_data")
+    args = parser.parse_args()
+    make_test_archives(args.out_dir)
@@ -0,0 +1,15 @@
+#pragma once
+
+// SHA-256 by the host OpenSSL
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int mbedtls_sha256_ret(const unsigned char *input, size_t ilen, unsigned char output[32], int is224);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,15 @@
+#pragma once
+
+// crc32_le() of the ESP32 ROM; the same CRC as zlib crc32(), see fake_libs.cpp
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+uint32_t crc32_le(uint32_t crc, uint8_t const *buf, uint32_t len);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,48 @@
+#pragma once
+
+// The tinfl interface of the ESP32 ROM miniz, on the host zlib.
+// Only what mz_inflator_t uses: the wrapping 32 KiB output dictionary and
+// the status codes.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <zlib.h>
+
+typedef unsigned char mz_uint8;
+typedef uint32_t mz_uint32;
+
+#define TINFL_LZ_DICT_SIZE 32768
+
+enum
+{
+    TINFL_FLAG_PARSE_ZLIB_HEADER = 1,
+    TINFL_FLAG_HAS_MORE_INPUT = 2,
+    TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF = 4,
+    TINFL_FLAG_COMPUTE_ADLER32 = 8,
+};
+
+typedef enum
+{
+    TINFL_STATUS_BAD_PARAM = -3,
+    TINFL_STATUS_ADLER32_MISMATCH = -2,
+    TINFL_STATUS_FAILED = -1,
+    TINFL_STATUS_DONE = 0,
+    TINFL_STATUS_NEEDS_MORE_INPUT = 1,
+    TINFL_STATUS_HAS_MORE_OUTPUT = 2,
+} tinfl_status;
+
+struct tinfl_decompressor
+{
+    z_stream z;
+    bool started = false;
+    bool done = false;
+
+    tinfl_decompressor() {}
+    tinfl_decompressor(const tinfl_decompressor &) = delete;
+    ~tinfl_decompressor();
+};
+
+void tinfl_init(tinfl_decompressor *r);
+tinfl_status tinfl_decompress(tinfl_decompressor *r, const mz_uint8 *pIn_buf_next, size_t *pIn_buf_size,
+                              mz_uint8 *pOut_buf_start, mz_uint8 *pOut_buf_next, size_t *pOut_buf_size,
+                              const mz_uint32 decomp_flags);
@@ -0,0 +1,462 @@
+// Host test of the OTA updater: archives made by make_archive.py (see
+// test/native/make_test_archives.py) go through compressed_updater_t, its
+// inflate and flash tasks, the decoders, the archive parser, fs_delta and
+// sector_delta, onto the fakes of test/native/fake_esp.h. Also fuzzes the
+// decoders and the parser with mutated archives, and measures the
+// throughput of the pipeline by upload chunk size.
+
+#include <Arduino.h>
+#include <unity.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <vector>
+#include "mz_update.h"
+#include "flash_fs.h"
+#include "settings.h"
+#include "fake_esp.h"
+#include "nvs.h"
+
+#ifndef OTA_TEST_DATA_DIR
+#error "OTA_TEST_DATA_DIR is given by test/native/make_test_archives.py"
+#endif
+#ifndef OTA_TEST_FUZZ_ITERATIONS
+#define OTA_TEST_FUZZ_ITERATIONS 1000 //!< per fuzzed archive
+#endif
+
+static constexpr size_t WEB_SERVER_CHUNK = 1436; //!< what WebServer passes per upload callback
+static const std::string data_dir = OTA_TEST_DATA_DIR;
+static const std::string fs_root = data_dir + "/fs_work";
+
+typedef std::vector<uint8_t> bytes_t;
+
+static bytes_t load(const char *name)
+{
+    std::ifstream f(data_dir + "/" + name, std::ios::binary);
+    return bytes_t(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+}
+
+// the updater reports every sector; keep the output of long runs short
+class quiet_stdout_t
+{
+    int saved;
+
+public:
+    quiet_stdout_t()
+    {
+        fflush(stdout);
+        saved = dup(1);
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, 1);
+        close(null);
+    }
+    ~quiet_stdout_t()
+    {
+        fflush(stdout);
+        dup2(saved, 1);
+        close(saved);
+    }
+};
+
+// the running device: app_running.bin on app0, app_inactive.bin on app1,
+// the files of fs_running/ on fs0, an empty settings store, nothing else
+static void reset_device()
+{
+    fake_flash_reset();
+    fake_nvs_reset();
+    bytes_t running = load("app_running.bin"), inactive = load("app_inactive.bin");
+    memcpy(fake_flash_data(fake_partition("app0")), running.data(), running.size());
+    memcpy(fake_flash_data(fake_partition("app1")), inactive.data(), inactive.size());
+
+    std::filesystem::remove_all(fs_root);
+    std::filesystem::create_directories(fs_root);
+    std::filesystem::copy(data_dir + "/fs_running", fs_root + "/fs0", std::filesystem::copy_options::recursive);
+    fake_fs_set_root(fs_root.c_str());
+    TEST_ASSERT_TRUE(FS.begin(false, "fs0"));
+    quiet_stdout_t quiet;
+    init_settings();
+}
+
+static bool update(const bytes_t &archive, size_t chunk)
+{
+    Updater.begin();
+    for (size_t pos = 0; pos < archive.size(); pos += chunk)
+        Updater.write_data(archive.data() + pos, std::min(chunk, archive.size() - pos));
+    return Updater.finish();
+}
+
+static bool partition_is(const char *label, const bytes_t &image)
+{
+    return !memcmp(fake_flash_data(fake_partition(label)), image.data(), image.size());
+}
+
+static bool partition_is_erased(const char *label)
+{
+    const esp_partition_t *p = fake_partition(label);
+    const uint8_t *data = fake_flash_data(p);
+    return std::all_of(data, data + p->size, [](uint8_t b) { return b == 0xff; });
+}
+
+// whether the image hash of the partition is recorded as the one of the image
+static bool image_hash_is(partition_updater_t::update_type_t type, const bytes_t &image)
+{
+    uint8_t expected[IMAGE_HASH_SIZE] = {0}, recorded[IMAGE_HASH_SIZE];
+    for (size_t pos = 0; pos < image.size(); pos += SPI_FLASH_SEC_SIZE)
+    {
+        uint8_t digest[IMAGE_HASH_SIZE];
+        sector_sha256(image.data() + pos, digest);
+        image_hash_add(expected, digest);
+    }
+    return get_image_hash(type, get_next_partition_number(), recorded) &&
+           !memcmp(expected, recorded, sizeof(expected));
+}
+
+// whether the directory trees have the same files of the same content
+static bool same_tree(const std::string &a, const std::string &b)
+{
+    namespace stdfs = std::filesystem;
+    if (!stdfs::is_directory(a) || !stdfs::is_directory(b))
+        return false;
+    size_t count = 0;
+    for (auto &&entry : stdfs::recursive_directory_iterator(a))
+    {
+        if (entry.is_directory())
+            continue;
+        ++count;
+        stdfs::path other = b / stdfs::relative(entry.path(), a);
+        std::ifstream fa(entry.path(), std::ios::binary), fb(other, std::ios::binary);
+        if (!fb || !std::equal(std::istreambuf_iterator<char>(fa), std::istreambuf_iterator<char>(),
+                               std::istreambuf_iterator<char>(fb), std::istreambuf_iterator<char>()))
+            return false;
+    }
+    for (auto &&entry : stdfs::recursive_directory_iterator(b))
+        if (!entry.is_directory())
+            --count;
+    return count == 0;
+}
+
+static void check_full_update()
+{
+    TEST_ASSERT_TRUE_MESSAGE(partition_is("font1", load("font.bin")), "font1");
+    TEST_ASSERT_TRUE_MESSAGE(partition_is("fs1", load("fs.bin")), "fs1");
+    TEST_ASSERT_TRUE_MESSAGE(partition_is("app1", load("app.bin")), "app1");
+    TEST_ASSERT_TRUE(fake_get_boot_partition() == fake_partition("app1"));
+    TEST_ASSERT_TRUE(image_hash_is(partition_updater_t::utFont, load("font.bin")));
+    TEST_ASSERT_TRUE(image_hash_is(partition_updater_t::utFS, load("fs.bin")));
+    TEST_ASSERT_TRUE(image_hash_is(partition_updater_t::utCode, load("app.bin")));
+}
+
+static void check_delta_update()
+{
+    TEST_ASSERT_TRUE_MESSAGE(partition_is("font1", load("font.bin")), "font1");
+    TEST_ASSERT_TRUE_MESSAGE(partition_is("app1", load("app.bin")), "app1");
+    TEST_ASSERT_TRUE_MESSAGE(same_tree(data_dir + "/fs_new", fs_root + "/fs1"), "fs1");
+    TEST_ASSERT_TRUE(fake_get_boot_partition() == fake_partition("app1"));
+    TEST_ASSERT_TRUE(image_hash_is(partition_updater_t::utCode, load("app.bin")));
+}
+
+void setUp()
+{
+    reset_device();
+}
+
+void tearDown()
+{
+}
+
+void test_full_zlib()
+{
+    TEST_ASSERT_TRUE(update(load("full_zlib.bin"), WEB_SERVER_CHUNK));
+    check_full_update();
+}
+
+void test_full_lz4()
+{
+    bytes_t archive = load("full_lz4.bin");
+    if (archive.empty())
+        TEST_IGNORE_MESSAGE("no LZ4 archive; install the lz4 Python module");
+    TEST_ASSERT_TRUE(update(archive, WEB_SERVER_CHUNK));
+    check_full_update();
+}
+
+void test_delta()
+{
+    TEST_ASSERT_TRUE(update(load("delta.bin"), WEB_SERVER_CHUNK));
+    check_delta_update();
+}
+
+void test_already_written_sectors_are_skipped()
+{
+    bytes_t archive = load("full_zlib.bin");
+    TEST_ASSERT_TRUE(update(archive, WEB_SERVER_CHUNK));
+    TEST_ASSERT_TRUE(update(archive, WEB_SERVER_CHUNK));
+    check_full_update();
+}
+
+// the upload breaks off after a checkpoint; returns where it broke off
+static size_t break_upload(const bytes_t &archive)
+{
+    Updater.begin("resume-test");
+    size_t broken = archive.size() * 3 / 4;
+    for (size_t pos = 0; pos < broken; pos += WEB_SERVER_CHUNK)
+        Updater.write_data(archive.data() + pos, std::min(WEB_SERVER_CHUNK, broken - pos));
+    Updater.end();
+    return broken;
+}
+
+void test_resume()
+{
+    bytes_t archive = load("full_lz4.bin");
+    if (archive.empty())
+        TEST_IGNORE_MESSAGE("no LZ4 archive; install the lz4 Python module");
+
+    size_t broken = break_upload(archive);
+    uint32_t offset = Updater.get_resume_offset("resume-test");
+    TEST_ASSERT_TRUE(offset > 0 && offset < broken);
+    TEST_ASSERT_EQUAL_UINT32(0, Updater.get_resume_offset("other-archive"));
+    TEST_ASSERT_TRUE(Updater.resume("resume-test", offset));
+    for (size_t pos = offset; pos < archive.size(); pos += WEB_SERVER_CHUNK)
+        Updater.write_data(archive.data() + pos, std::min(WEB_SERVER_CHUNK, archive.size() - pos));
+    TEST_ASSERT_TRUE(Updater.finish());
+    check_full_update();
+    TEST_ASSERT_EQUAL_UINT32(0, Updater.get_resume_offset("resume-test"));
+}
+
+// gives access to the checkpoint layout
+struct checkpoint_access_t : compressed_updater_t
+{
+    using compressed_updater_t::checkpoint_t;
+};
+
+// a checkpoint which loads but cannot be restored is dropped, so that the
+// client starts over instead of retrying the same offset for good
+void test_resume_from_corrupted_checkpoint()
+{
+    bytes_t archive = load("full_lz4.bin");
+    if (archive.empty())
+        TEST_IGNORE_MESSAGE("no LZ4 archive; install the lz4 Python module");
+
+    break_upload(archive);
+    checkpoint_access_t::checkpoint_t cp;
+    size_t size = sizeof(cp);
+    nvs_handle h;
+    TEST_ASSERT_EQUAL_INT(ESP_OK, nvs_open("mz5_ota", NVS_READWRITE, &h));
+    TEST_ASSERT_EQUAL_INT(ESP_OK, nvs_get_blob(h, "checkpoint", &cp, &size));
+    cp.phase = 0; // phBegin; never saved, so it is not restorable
+    TEST_ASSERT_EQUAL_INT(ESP_OK, nvs_set_blob(h, "checkpoint", &cp, sizeof(cp)));
+    nvs_commit(h);
+    nvs_close(h);
+
+    uint32_t offset = Updater.get_resume_offset("resume-test");
+    TEST_ASSERT_TRUE(offset > 0);
+    TEST_ASSERT_FALSE(Updater.resume("resume-test", offset));
+    Updater.end(); // as the pull updater gives up; without finish()
+    TEST_ASSERT_EQUAL_UINT32(0, Updater.get_resume_offset("resume-test"));
+
+    TEST_ASSERT_TRUE(update(archive, WEB_SERVER_CHUNK));
+    check_full_update();
+}
+
+void test_bad_magic()
+{
+    bytes_t archive = load("full_zlib.bin");
+    archive[3] ^= 1;
+    TEST_ASSERT_FALSE(update(archive, WEB_SERVER_CHUNK));
+    TEST_ASSERT_TRUE(partition_is_erased("font1"));
+}
+
+
+// Fuzzing: mutations of an archive must never crash or hang the updater,
+// and an update which succeeds must leave every partition either as it was
+// or holding its new image. (An archive cut at a section boundary is
+// valid; it just has fewer sections.)
+
+static void mutate(bytes_t &a, std::mt19937 &rnd, bool sector_aligned)
+{
+    auto pick = [&](size_t n) { return (size_t)(rnd() % (n ? n : 1)); };
+    // headers and manifests start at sectors; hit them more often
+    auto where = [&](size_t len) {
+        size_t n = a.size() - len + 1;
+        return std::min(n - 1, rnd() & 1 ? pick(n) : pick(n / SPI_FLASH_SEC_SIZE + 1) * SPI_FLASH_SEC_SIZE + pick(128));
+    };
+    static const uint32_t values[] = { 0, 1, 0x7fffffff, 0x80000000, 0xffffffff, 0x1000, 0xfff, 0x10000000 };
+    switch (pick(sector_aligned ? 7 : 5))
+    {
+    case 0: // flip some bits
+        for (int n = 1 + pick(8); n-- && !a.empty();)
+            a[where(1)] ^= 1 << pick(8);
+        break;
+    case 1: // overwrite a range with random bytes
+      {
+        if (a.empty())
+            break;
+        size_t pos = where(1), len = std::min(a.size() - pos, 1 + pick(64));
+        for (size_t i = 0; i < len; ++i)
+            a[pos + i] = (uint8_t)rnd();
+        break;
+      }
+    case 2: // put a boundary value into a 32-bit field
+        if (a.size() >= 4)
+        {
+            uint32_t v = values[pick(sizeof(values) / sizeof(values[0]))];
+            memcpy(a.data() + where(4), &v, 4);
+        }
+        break;
+    case 3: // cut
+        a.resize(pick(a.size()));
+        break;
+    case 4: // drop or repeat a range
+      {
+        size_t pos = pick(a.size()), len = std::min(a.size() - pos, 1 + pick(4096));
+        if (rnd() & 1)
+            a.erase(a.begin() + pos, a.begin() + pos + len);
+        else
+            a.insert(a.begin() + pos, a.begin() + pos, a.begin() + pos + len);
+        break;
+      }
+    case 5: // drop or repeat sectors; the structure of the archive changes
+    case 6:
+      {
+        size_t sectors = a.size() / SPI_FLASH_SEC_SIZE;
+        size_t pos = pick(sectors) * SPI_FLASH_SEC_SIZE, len = (1 + pick(3)) * SPI_FLASH_SEC_SIZE;
+        len = std::min(a.size() - pos, len);
+        if (rnd() & 1)
+            a.erase(a.begin() + pos, a.begin() + pos + len);
+        else
+            a.insert(a.begin() + pos, a.begin() + pos, a.begin() + pos + len);
+        break;
+      }
+    }
+}
+
+// "MZ5 lz4 blocks archive" of stored blocks, to reach the parser with any content
+static bytes_t wrap_stored_lz4(const bytes_t &plain)
+{
+    static const char mark[] = "MZ5 lz4 blocks archive\r\n\n\x1a";
+    static constexpr size_t BLOCK_SIZE = 32768;
+    bytes_t out(mark, mark + sizeof(mark) - 1);
+    auto put_u32 = [&](uint32_t v) { for (int i = 0; i < 4; ++i) out.push_back((uint8_t)(v >> (8 * i))); };
+    put_u32(plain.size());
+    for (size_t pos = 0; pos < plain.size(); pos += BLOCK_SIZE)
+    {
+        size_t len = std::min(BLOCK_SIZE, plain.size() - pos);
+        put_u32(0x80000000 | len);
+        out.insert(out.end(), plain.begin() + pos, plain.begin() + pos + len);
+    }
+    return out;
+}
+
+static void fuzz(const char *name, bool parser)
+{
+    bytes_t original = load(parser ? "delta.bin.uncompressed" : name);
+    if (original.empty())
+        TEST_IGNORE_MESSAGE("no archive to fuzz; install the lz4 Python module");
+    bytes_t app_before = load("app_inactive.bin");
+    bytes_t font = load("font.bin"), app = load("app.bin");
+    static const size_t chunks[] = { 1, 100, WEB_SERVER_CHUNK, 4096, 65536 };
+    std::mt19937 rnd(48);
+    unsigned succeeded = 0;
+
+    for (int i = 0; i < OTA_TEST_FUZZ_ITERATIONS; ++i)
+    {
+        bytes_t archive = original;
+        for (int n = 1 + rnd() % 3; n--;)
+            mutate(archive, rnd, parser);
+        if (parser)
+            archive = wrap_stored_lz4(archive);
+        size_t chunk = chunks[rnd() % (sizeof(chunks) / sizeof(chunks[0]))];
+        if (chunk == 1)
+            chunk = 1 + rnd() % 64; // byte by byte is too slow over the whole archive
+
+        reset_device();
+        bool ok;
+        {
+            quiet_stdout_t quiet;
+            ok = update(archive, chunk);
+        }
+        if (!ok)
+            continue;
+        ++succeeded;
+        char msg[80];
+        snprintf(msg, sizeof(msg), "%s: iteration %d succeeded with a wrong result", name, i);
+        TEST_ASSERT_TRUE_MESSAGE(partition_is_erased("font1") || partition_is("font1", font), msg);
+        bool app_updated = partition_is("app1", app);
+        TEST_ASSERT_TRUE_MESSAGE(app_updated || partition_is("app1", app_before), msg);
+        TEST_ASSERT_TRUE_MESSAGE(app_updated == (fake_get_boot_partition() == fake_partition("app1")), msg);
+        TEST_ASSERT_TRUE_MESSAGE(!std::filesystem::exists(fs_root + "/fs1") ||
+                                 same_tree(data_dir + "/fs_new", fs_root + "/fs1"), msg);
+    }
+    char msg[80];
+    snprintf(msg, sizeof(msg), "%s: %d mutated archives, %u accepted", name, OTA_TEST_FUZZ_ITERATIONS, succeeded);
+    TEST_MESSAGE(msg);
+}
+
+void test_fuzz_zlib()
+{
+    fuzz("delta.bin", false);
+}
+
+void test_fuzz_lz4()
+{
+    fuzz("delta_lz4.bin", false);
+}
+
+void test_fuzz_parser()
+{
+    fuzz("delta.bin.uncompressed", true);
+}
+
+
+// Throughput of receive, decode, hash and write by upload chunk size. The
+// fake flash takes no time, so this is the CPU side of the pipeline on the
+// host; compare chunk sizes and decoders, not absolute numbers.
+void test_throughput()
+{
+    static const char *const archives[] = { "full_zlib.bin", "full_lz4.bin" };
+    static const size_t chunks[] = { WEB_SERVER_CHUNK, 4096, 16384, 65536 };
+    size_t image_bytes = load("font.bin").size() + load("fs.bin").size() + load("app.bin").size();
+
+    for (auto &&name : archives)
+    {
+        bytes_t archive = load(name);
+        if (archive.empty())
+            continue;
+        for (auto &&chunk : chunks)
+        {
+            reset_device();
+            bool ok;
+            uint32_t start = micros(), us;
+            {
+                quiet_stdout_t quiet;
+                ok = update(archive, chunk);
+                us = micros() - start;
+            }
+            TEST_ASSERT_TRUE(ok);
+            char msg[120];
+            snprintf(msg, sizeof(msg), "%-14s chunk %6u: %7.1f MB/s in, %7.1f MB/s written",
+                     name, (unsigned)chunk, archive.size() / (double)us, image_bytes / (double)us);
+            TEST_MESSAGE(msg);
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_full_zlib);
+    RUN_TEST(test_full_lz4);
+    RUN_TEST(test_delta);
+    RUN_TEST(test_already_written_sectors_are_skipped);
+    RUN_TEST(test_resume);
+    RUN_TEST(test_resume_from_corrupted_checkpoint);
+    RUN_TEST(test_bad_magic);
+    RUN_TEST(test_fuzz_zlib);
+    RUN_TEST(test_fuzz_lz4);
+    RUN_TEST(test_fuzz_parser);
+    RUN_TEST(test_throughput);
+    std::filesystem::remove_all(fs_root);
+    return UNITY_END();
+}
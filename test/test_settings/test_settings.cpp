@@ -0,0 +1,273 @@
+// Host test of the settings store (src/settings.cpp) on the fake LittleFS
+// of test/native: the log survives a reboot with removals, and the latency
+// of boot, settings_read() and settings_write() and of the export and import
+// of the archive through microtar is measured.
+
+#include <Arduino.h>
+#include <unity.h>
+#include <filesystem>
+#include "settings.h"
+#include "flash_fs.h"
+#include "fake_esp.h"
+
+static const std::string fs_root = (std::filesystem::temp_directory_path() / "mz5_test_settings").string();
+static const std::string store_file = fs_root + "/conf/.store";
+static const std::string saved_store_file = fs_root + "/store.saved";
+
+static constexpr size_t RECORD_HEADER_SIZE = 8; //!< store_record_header_t
+
+// power cycle: only what is in the store file survives
+static void reboot()
+{
+    namespace stdfs = std::filesystem;
+    stdfs::copy_file(store_file, saved_store_file, stdfs::copy_options::overwrite_existing);
+    _clear_settings();
+    stdfs::copy_file(saved_store_file, store_file, stdfs::copy_options::overwrite_existing);
+    init_settings();
+}
+
+static size_t store_size()
+{
+    return std::filesystem::file_size(store_file);
+}
+
+static String read_string(const char *key)
+{
+    String value;
+    if (!settings_read(key, value))
+        return "(none)";
+    return value;
+}
+
+void setUp()
+{
+    std::filesystem::remove_all(fs_root);
+    std::filesystem::create_directories(fs_root);
+    fake_fs_set_root(fs_root.c_str());
+    _clear_settings();
+    init_settings();
+}
+
+void tearDown()
+{
+}
+
+void test_remove_appends_a_tombstone()
+{
+    settings_write("a", String("apple"));
+    settings_write("b", String("banana"));
+    settings_flush();
+    size_t before = store_size();
+
+    settings_remove("a");
+    settings_flush();
+    // a remove record of the key and a commit record; not a rewrite of the store
+    TEST_ASSERT_EQUAL_UINT32(before + RECORD_HEADER_SIZE + 1 + RECORD_HEADER_SIZE, store_size());
+    TEST_ASSERT_EQUAL_STRING("(none)", read_string("a").c_str());
+
+    reboot();
+    TEST_ASSERT_EQUAL_STRING("(none)", read_string("a").c_str());
+    TEST_ASSERT_EQUAL_STRING("banana", read_string("b").c_str());
+}
+
+void test_write_after_remove()
+{
+    settings_write("a", String("apple"));
+    settings_flush();
+    settings_remove("a");
+    settings_write("a", String("apricot"));
+    settings_flush();
+
+    reboot();
+    TEST_ASSERT_EQUAL_STRING("apricot", read_string("a").c_str());
+}
+
+void test_remove_after_write()
+{
+    settings_write("a", String("apple"));
+    settings_flush();
+    settings_write("a", String("apricot"));
+    settings_remove("a");
+    settings_flush();
+
+    reboot();
+    TEST_ASSERT_EQUAL_STRING("(none)", read_string("a").c_str());
+}
+
+void test_unflushed_remove_is_lost_by_reboot()
+{
+    settings_write("a", String("apple"));
+    settings_flush();
+    settings_remove("a");
+
+    reboot();
+    TEST_ASSERT_EQUAL_STRING("apple", read_string("a").c_str());
+}
+
+// changes reach a listener once the settings have been quiet, and never
+// after it has unsubscribed
+void test_unsubscribe()
+{
+    int calls = 0;
+    settings_subscription_id_t id = settings_subscribe("sub_", [&calls]() { ++calls; });
+    settings_write("sub_a", String("1"));
+    delay(150);
+    poll_settings();
+    TEST_ASSERT_EQUAL_INT(1, calls);
+
+    settings_unsubscribe(id);
+    settings_write("sub_a", String("2"));
+    delay(150);
+    poll_settings();
+    TEST_ASSERT_EQUAL_INT(1, calls);
+}
+
+
+// Latency with BENCH_KEYS keys of BENCH_VALUE_SIZE bytes. The fake LittleFS
+// is a host directory, so file operations cost far less than on the
+// device; the counts of file operations carry over, the times do not.
+static constexpr int BENCH_KEYS = 100;
+static constexpr size_t BENCH_VALUE_SIZE = 16;
+static constexpr int BENCH_ROUNDS = 20;
+
+static String bench_key(int i)
+{
+    char key[16];
+    snprintf(key, sizeof(key), "bench_%02d", i);
+    return key;
+}
+
+static void report(const char *what, uint32_t us, unsigned calls, const fake_fs_counters_t &fs)
+{
+    char msg[160];
+    snprintf(msg, sizeof(msg), "%-24s %8.2f us/call, %5.2f opens, %5.2f reads, %5.2f writes per call",
+             what, us / (double)calls, fs.opens / (double)calls, fs.reads / (double)calls, fs.writes / (double)calls);
+    TEST_MESSAGE(msg);
+}
+
+void test_latency()
+{
+    uint8_t value[BENCH_VALUE_SIZE] = {0};
+    for (int i = 0; i < BENCH_KEYS; ++i)
+    {
+        value[0] = i;
+        TEST_ASSERT_TRUE(settings_write(bench_key(i), value, sizeof(value)));
+    }
+    settings_flush();
+
+    // boot: mount, load, then every key read once as the modules do
+    std::filesystem::copy_file(store_file, saved_store_file, std::filesystem::copy_options::overwrite_existing);
+    _clear_settings();
+    std::filesystem::copy_file(saved_store_file, store_file, std::filesystem::copy_options::overwrite_existing);
+    fake_fs_counters = fake_fs_counters_t();
+    uint32_t start = micros();
+    init_settings();
+    for (int i = 0; i < BENCH_KEYS; ++i)
+        TEST_ASSERT_TRUE(settings_read(bench_key(i), value, sizeof(value)));
+    report("boot, all keys read once", micros() - start, 1, fake_fs_counters);
+
+    fake_fs_counters = fake_fs_counters_t();
+    start = micros();
+    for (int round = 0; round < BENCH_ROUNDS; ++round)
+        for (int i = 0; i < BENCH_KEYS; ++i)
+            settings_read(bench_key(i), value, sizeof(value));
+    report("settings_read()", micros() - start, BENCH_ROUNDS * BENCH_KEYS, fake_fs_counters);
+
+    // every write changes the value; the flush follows once per round, as
+    // poll_settings() does after a burst of writes
+    fake_fs_counters = fake_fs_counters_t();
+    uint32_t flush_us = 0;
+    start = micros();
+    for (int round = 0; round < BENCH_ROUNDS; ++round)
+    {
+        for (int i = 0; i < BENCH_KEYS; ++i)
+        {
+            value[1] = round + 1;
+            settings_write(bench_key(i), value, sizeof(value));
+        }
+        uint32_t flush_start = micros();
+        settings_flush();
+        flush_us += micros() - flush_start;
+    }
+    uint32_t total_us = micros() - start;
+    report("settings_write()", total_us - flush_us, BENCH_ROUNDS * BENCH_KEYS, fake_fs_counters_t());
+    report("  and its flush", flush_us, BENCH_ROUNDS * BENCH_KEYS, fake_fs_counters);
+}
+
+// Export of an archive of BENCH_KEYS keys of EXPORT_VALUE_SIZE bytes, as the
+// web UI and the console do. Every key takes a header and a data block, so the
+// import is measured with IMPORT_KEYS keys, the most that fit the
+// MAX_SETTINGS_TAR_SIZE limit of the importer.
+static constexpr size_t EXPORT_VALUE_SIZE = 20;
+static constexpr int IMPORT_KEYS = 30;
+
+void test_export_import()
+{
+    uint8_t value[EXPORT_VALUE_SIZE] = {0};
+    for (int i = 0; i < BENCH_KEYS; ++i)
+    {
+        value[0] = i;
+        TEST_ASSERT_TRUE(settings_write(bench_key(i), value, sizeof(value)));
+    }
+    settings_flush();
+
+    // to a sink, as GET /settings/export streams it
+    unsigned sink_calls = 0;
+    size_t archive_size = 0;
+    uint32_t start = micros();
+    for (int round = 0; round < BENCH_ROUNDS; ++round)
+    {
+        TEST_ASSERT_TRUE(settings_export([&](const uint8_t *buf, size_t size) {
+            ++sink_calls;
+            archive_size += size;
+            return true;
+        }, String()));
+    }
+    uint32_t us = micros() - start;
+    char msg[160];
+    snprintf(msg, sizeof(msg), "%-24s %8.2f us/archive, %6.1f sink calls of %u bytes per archive",
+             "settings_export(sink)", us / (double)BENCH_ROUNDS, sink_calls / (double)BENCH_ROUNDS,
+             (unsigned)(archive_size / BENCH_ROUNDS));
+    TEST_MESSAGE(msg);
+
+    // to a file on the main filesystem, as the console does
+    TEST_ASSERT_TRUE(FS.begin(true, "fs0"));
+    fake_fs_counters = fake_fs_counters_t();
+    start = micros();
+    for (int round = 0; round < BENCH_ROUNDS; ++round)
+        TEST_ASSERT_TRUE(settings_export(String("/export.tar"), String()));
+    report("settings_export(file)", micros() - start, BENCH_ROUNDS, fake_fs_counters);
+
+    // and back
+    for (int i = IMPORT_KEYS; i < BENCH_KEYS; ++i)
+        settings_remove(bench_key(i));
+    TEST_ASSERT_TRUE(settings_export(String("/export.tar"), String()));
+    for (int i = 0; i < IMPORT_KEYS; ++i)
+        settings_remove(bench_key(i));
+    fake_fs_counters = fake_fs_counters_t();
+    start = micros();
+    for (int round = 0; round < BENCH_ROUNDS; ++round)
+        TEST_ASSERT_TRUE(settings_import(String("/export.tar")));
+    report("settings_import(file)", micros() - start, BENCH_ROUNDS, fake_fs_counters);
+    FS.end();
+
+    for (int i = 0; i < IMPORT_KEYS; ++i)
+    {
+        TEST_ASSERT_TRUE(settings_read(bench_key(i), value, sizeof(value)));
+        TEST_ASSERT_EQUAL_UINT32(i, value[0]);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_remove_appends_a_tombstone);
+    RUN_TEST(test_write_after_remove);
+    RUN_TEST(test_remove_after_write);
+    RUN_TEST(test_unflushed_remove_is_lost_by_reboot);
+    RUN_TEST(test_unsubscribe);
+    RUN_TEST(test_latency);
+    RUN_TEST(test_export_import);
+    std::filesystem::remove_all(fs_root);
+    return UNITY_END();
+}
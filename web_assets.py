@@ -0,0 +1,107 @@
+#!/usr/bin/env python3
+
+# Prepare the web UI for the filesystem image; used as a PlatformIO pre
+# script, which points the filesystem image at the prepared directory.
+#
+# data/ is copied to .pio/build/<env>/data/ with files under w/ processed:
+# - text files are stored gzipped (as <name>.gz) when that is smaller;
+# - local src="..." and href="..." references in HTML files get "?v=<etag>"
+#   appended, so the browser may cache the referenced files for good;
+# - w/.assets lists each file for the web server (src/web_server.cpp):
+#     <etag> <stored length> <gzipped: 0 or 1> <URL path>
+#   The ETag is the first 16 hex digits of the SHA-256 of the stored file.
+
+import gzip
+import hashlib
+import os
+import posixpath
+import re
+
+GZIP_EXTENSIONS = (".html", ".htm", ".js", ".css", ".txt", ".xml", ".svg", ".json")
+HTML_EXTENSIONS = (".html", ".htm")
+ASSET_MANIFEST = ".assets"
+
+
+def write_if_changed(filename, content):
+    """keep the timestamp of unchanged files so that the image is not rebuilt"""
+    if os.path.isfile(filename) and open(filename, "rb").read() == content:
+        return
+    os.makedirs(os.path.dirname(filename), exist_ok=True)
+    open(filename, "wb").write(content)
+
+def version_references(html, url, assets):
+    """append ?v=<etag> to references of the HTML at url to files in assets"""
+    def replace(m):
+        ref = m.group(3)
+        if "://" in ref or ref.startswith("//") or "?" in ref or "#" in ref:
+            return m.group(0)
+        target = posixpath.normpath(posixpath.join(posixpath.dirname(url), ref))
+        if target not in assets:
+            return m.group(0)
+        return f"{m.group(1)}{m.group(2)}{ref}?v={assets[target][0]}{m.group(2)}"
+    text = html.decode("utf-8")
+    return re.sub(r'(\b(?:src|href)=)(["\'])([^"\'<>]+)\2', replace, text).encode("utf-8")
+
+def build_web_assets(data_dir = "data", out_dir = ".pio/build/esp32dev/data"):
+    """make the filesystem content from data_dir into out_dir; returns out_dir"""
+    web_dir = os.path.join(data_dir, "w")
+    produced = set()
+    assets = {} # URL path: (etag, length, gzipped)
+
+    def store(rel, content):
+        write_if_changed(os.path.join(out_dir, rel), content)
+        produced.add(os.path.normpath(os.path.join(out_dir, rel)))
+
+    # collect the files; HTML last, as it refers to the others
+    web_files = []
+    for root, dirs, names in os.walk(data_dir):
+        dirs.sort()
+        for name in sorted(names):
+            full = os.path.join(root, name)
+            rel = os.path.relpath(full, data_dir)
+            if os.path.commonpath([full, web_dir]) != web_dir or name.startswith("."):
+                store(rel, open(full, "rb").read()) # as is
+                continue
+            url = "/" + os.path.relpath(full, web_dir).replace(os.sep, "/")
+            web_files.append((url.lower().endswith(HTML_EXTENSIONS), url, rel, full))
+
+    for is_html, url, rel, full in sorted(web_files):
+        content = open(full, "rb").read()
+        if is_html:
+            content = version_references(content, url, assets)
+        gzipped = False
+        if url.lower().endswith(GZIP_EXTENSIONS):
+            compressed = gzip.compress(content, 9, mtime = 0)
+            if len(compressed) < len(content):
+                content, gzipped = compressed, True
+                rel += ".gz"
+        store(rel, content)
+        assets[url] = (hashlib.sha256(content).hexdigest()[:16], len(content), gzipped)
+
+    store(os.path.join("w", ASSET_MANIFEST), "".join(
+        f"{etag} {length} {int(gzipped)} {url}\n"
+        for url, (etag, length, gzipped) in sorted(assets.items())).encode("utf-8"))
+
+    # remove what is no longer produced
+    for root, dirs, names in os.walk(out_dir):
+        for name in names:
+            full = os.path.normpath(os.path.join(root, name))
+            if full not in produced:
+                os.remove(full)
+    return out_dir
+
+try:
+    Import("env")
+except NameError:
+    env = None
+
+if env is not None:
+    out_dir = build_web_assets(env.subst("$PROJECT_DATA_DIR"), env.subst("$BUILD_DIR/data"))
+    env.Replace(PROJECT_DATA_DIR = os.path.abspath(out_dir))
+elif __name__ == '__main__':
+    import argparse
+    parser = argparse.ArgumentParser(description="prepare the filesystem content with gzipped, versioned web assets")
+    parser.add_argument("data_dir", nargs="?", default="data")
+    parser.add_argument("out_dir", nargs="?", default=".pio/build/esp32dev/data")
+    args = parser.parse_args()
+    build_web_assets(args.data_dir, args.out_dir)